@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <algorithm>
+
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "generator.hpp"
+#include "engine.hpp"
+
+using namespace std;
+
+namespace bench {
+    struct PhaseResult {
+        char name[24];
+        double ms;
+        size_t rss;     // resident set after the phase, in bytes
+        size_t peak;    // peak resident set so far, in bytes
+        size_t bytes;   // source bytes processed
+    };
+
+    static size_t CurrentRss() {
+        FILE* statm = fopen("/proc/self/statm", "r");
+        if (statm == nullptr) {
+            return 0;
+        }
+
+        size_t pages = 0, resident = 0;
+        if (fscanf(statm, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+
+        fclose(statm);
+        return resident * sysconf(_SC_PAGESIZE);
+    }
+
+    static size_t PeakRss() {
+        rusage usage;
+        getrusage(RUSAGE_SELF, &usage);
+        return (size_t)usage.ru_maxrss * 1024;
+    }
+
+    // Runs every compiler phase on a generated program, streaming one PhaseResult per phase to 'fd'.
+    static void RunPipeline(int fd, const GeneratorConfig& config) {
+        size_t bytes = 0;
+
+        auto phase = [&](const char* name, const function<void()>& work) {
+            auto start = chrono::steady_clock::now();
+            work();
+            auto end = chrono::steady_clock::now();
+
+            PhaseResult result = {};
+            strncpy(result.name, name, sizeof(result.name) - 1);
+            result.ms = chrono::duration<double, milli>(end - start).count();
+            result.rss = CurrentRss();
+            result.peak = max(PeakRss(), result.rss);
+            result.bytes = bytes;
+
+            if (write(fd, &result, sizeof(result)) != sizeof(result)) {
+                _exit(EXIT_FAILURE);
+            }
+        };
+
+        string code;
+        phase("generate", [&]() {
+            Generator generator(config);
+            code = generator.generate();
+            bytes = code.size();
+        });
+
+        engine::Tokenizer tokenizer(move(code));
+        phase("cleanup", [&]() { tokenizer.cleanup(); });
+        phase("tokenize", [&]() { tokenizer.tokenize(); });
+
+        engine::IL il(tokenizer.takeTokens());
+        phase("il.analyze", [&]() { il.analyze(); });
+        phase("il.optimize", [&]() { il.optimize(); });
+
+        engine::Assembler assembler(il);
+        phase("asm.translate", [&]() { assembler.translate(il.takeILs()); });
+        phase("asm.optimize", [&]() { assembler.optimize(); });
+        phase("asm.assemble", [&]() { assembler.assemble(); });
+    }
+
+    // Forks a child per input size so a crash, a runaway phase or the memory of one size cannot skew the next.
+    static bool Measure(const GeneratorConfig& config, int timeout, vector<PhaseResult>& results, string& status) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            status = "pipe failed";
+            return false;
+        }
+
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+
+            // the engine reports progress on stdout, keep the table readable
+            freopen("/dev/null", "w", stdout);
+
+            RunPipeline(fds[1], config);
+            close(fds[1]);
+            _exit(EXIT_SUCCESS);
+        }
+
+        close(fds[1]);
+
+        auto deadline = chrono::steady_clock::now() + chrono::seconds(timeout);
+        bool timed_out = false;
+
+        while (true) {
+            int remaining = (int)chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+            if (remaining <= 0) {
+                timed_out = true;
+                break;
+            }
+
+            pollfd pfd = { fds[0], POLLIN, 0 };
+            if (poll(&pfd, 1, remaining) <= 0) {
+                continue;
+            }
+
+            PhaseResult result;
+            ssize_t read_size = read(fds[0], &result, sizeof(result));
+            if (read_size != sizeof(result)) {
+                break;
+            }
+
+            results.push_back(result);
+        }
+
+        if (timed_out) {
+            kill(pid, SIGKILL);
+        }
+
+        close(fds[0]);
+
+        int wstatus = 0;
+        waitpid(pid, &wstatus, 0);
+
+        if (timed_out) {
+            status = "timeout after " + to_string(timeout) + "s";
+            return false;
+        }
+
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != EXIT_SUCCESS) {
+            status = "compiler failed";
+            return false;
+        }
+
+        status = "ok";
+        return true;
+    }
+
+    static size_t ParseSize(const string& value) {
+        char* end = nullptr;
+        size_t size = strtoull(value.data(), &end, 0);
+
+        switch (*end) {
+            case 'k': case 'K': size *= 1024; break;
+            case 'm': case 'M': size *= 1024 * 1024; break;
+            case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+            default: break;
+        }
+
+        return size;
+    }
+
+    static string FormatSize(size_t size) {
+        char buffer[32];
+        if (size >= 1024 * 1024) snprintf(buffer, sizeof(buffer), "%.1fM", size / (1024.0 * 1024.0));
+        else if (size >= 1024) snprintf(buffer, sizeof(buffer), "%.1fK", size / 1024.0);
+        else snprintf(buffer, sizeof(buffer), "%zu", size);
+        return buffer;
+    }
+}
+
+static void Usage() {
+    printf("usage: bench [options]\n");
+    printf("\t--sizes A,B,...  input sizes (default 1K,10K,100K,1M,10M,100M)\n");
+    printf("\t--timeout SEC    per size time limit, larger sizes are skipped once hit (default 60)\n");
+    printf("\t--csv FILE       also write the results as csv\n");
+    printf("\t--locals N, --statements N, --fanout N, --asm N, --args N, --keeps N, --seed N\n");
+    printf("\t                 generator knobs, see lxgen --help\n");
+}
+
+int main(int argc, char** argv) {
+    using namespace bench;
+
+    vector<size_t> sizes = { 1024, 10 * 1024, 100 * 1024, 1024 * 1024, 10 * 1024 * 1024, 100 * 1024 * 1024 };
+    GeneratorConfig config;
+    int timeout = 60;
+    string csv_path;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            Usage();
+            return EXIT_SUCCESS;
+        }
+
+        if (i + 1 >= argc) {
+            Usage();
+            return EXIT_FAILURE;
+        }
+
+        string value = argv[++i];
+        if (arg == "--sizes") {
+            sizes.clear();
+
+            size_t start = 0;
+            while (start <= value.size()) {
+                size_t end = value.find(',', start);
+                if (end == string::npos) {
+                    end = value.size();
+                }
+
+                sizes.push_back(ParseSize(value.substr(start, end - start)));
+                start = end + 1;
+            }
+        }
+        else if (arg == "--timeout") timeout = stoi(value);
+        else if (arg == "--csv") csv_path = value;
+        else if (arg == "--locals") config.locals = ParseSize(value);
+        else if (arg == "--statements") config.statements = ParseSize(value);
+        else if (arg == "--fanout") config.fanout = ParseSize(value);
+        else if (arg == "--asm") config.asm_blocks = ParseSize(value);
+        else if (arg == "--args") config.args = ParseSize(value);
+        else if (arg == "--keeps") config.keeps = ParseSize(value);
+        else if (arg == "--seed") config.seed = ParseSize(value);
+        else {
+            Usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    ofstream csv;
+    if (csv_path.empty() == false) {
+        csv.open(csv_path, ios::out | ios::trunc);
+        csv << "target,bytes,phase,ms,mb_per_s,rss_bytes,peak_bytes\n";
+    }
+
+    printf("%-8s %-9s %-14s %12s %10s %10s %10s\n", "target", "bytes", "phase", "ms", "MB/s", "rss", "peak");
+
+    bool skip = false;
+    for (size_t size : sizes) {
+        if (skip) {
+            printf("%-8s skipped, a smaller input already hit the time limit\n", FormatSize(size).data());
+            continue;
+        }
+
+        config.target_size = size;
+
+        vector<PhaseResult> results;
+        string status;
+        bool ok = Measure(config, timeout, results, status);
+
+        for (const PhaseResult& result : results) {
+            double throughput = result.ms > 0 ? (result.bytes / (1024.0 * 1024.0)) / (result.ms / 1000.0) : 0;
+
+            printf("%-8s %-9zu %-14s %12.3f %10.2f %10s %10s\n", FormatSize(size).data(), result.bytes, result.name,
+                result.ms, throughput, FormatSize(result.rss).data(), FormatSize(result.peak).data());
+
+            if (csv.is_open()) {
+                csv << size << "," << result.bytes << "," << result.name << "," << result.ms << "," << throughput << ","
+                    << result.rss << "," << result.peak << "\n";
+            }
+        }
+
+        if (!ok) {
+            printf("%-8s %s\n", FormatSize(size).data(), status.data());
+            skip = status.rfind("timeout", 0) == 0;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,169 @@
+#include "generator.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+bench::Generator::Generator(const GeneratorConfig& config)
+                            : m_config(config), m_rng(config.seed), m_emitted(0) {
+    m_output.clear();
+}
+
+bench::Generator::~Generator() {
+
+}
+
+size_t bench::Generator::Random(size_t bound) {
+    if (bound == 0) {
+        return 0;
+    }
+
+    return uniform_int_distribution<size_t>(0, bound - 1)(m_rng);
+}
+
+const string& bench::Generator::Pick(const vector<string>& names) {
+    return names.at(Random(names.size()));
+}
+
+string bench::Generator::generate() {
+    m_output.clear();
+    m_emitted = 0;
+
+    if (m_config.target_size > 0) {
+        m_output.reserve(m_config.target_size + 4096);
+    }
+
+    while (true) {
+        if (m_config.target_size > 0) {
+            if (m_output.size() >= m_config.target_size) {
+                break;
+            }
+        }
+        else if (m_emitted >= m_config.functions) {
+            break;
+        }
+
+        EmitFunction(m_emitted++);
+    }
+
+    EmitEntry();
+    return move(m_output);
+}
+
+void bench::Generator::EmitFunction(size_t index) {
+    vector<string> names;
+
+    m_output += "fn u64 fn_" + to_string(index) + "(";
+    for (size_t i = 0; i < m_config.args; ++i) {
+        string arg = "a" + to_string(i);
+        m_output += (i > 0 ? ", u64 " : "u64 ") + arg;
+        names.push_back(arg);
+    }
+    m_output += ") {\n";
+
+    for (size_t i = 0; i < m_config.locals; ++i) {
+        string local = "v" + to_string(i);
+        m_output += "    u64 " + local + " = " + to_string(Random(256)) + ";\n";
+        names.push_back(local);
+    }
+
+    // 0 = plain statement, 1 = call, 2 = inline assembly, 3 = keep
+    vector<uint8_t> kinds;
+    kinds.insert(kinds.end(), m_config.statements, 0);
+    kinds.insert(kinds.end(), index > 0 ? m_config.fanout : 0, 1);
+    kinds.insert(kinds.end(), names.empty() ? 0 : m_config.asm_blocks, 2);
+    kinds.insert(kinds.end(), index > 0 ? m_config.keeps : 0, 3);
+    shuffle(kinds.begin(), kinds.end(), m_rng);
+
+    for (uint8_t kind : kinds) {
+        switch (kind) {
+            case 0: EmitStatement(index, names); break;
+            case 1: EmitCall(index, names, Random(2) == 0); break;
+            case 2: EmitAsm(names); break;
+            case 3: m_output += "    keep fn_" + to_string(Random(index)) + ";\n"; break;
+            default: break;
+        }
+    }
+
+    m_output += "    ret " + (names.empty() ? string("0") : Pick(names)) + ";\n";
+    m_output += "}\n\n";
+}
+
+void bench::Generator::EmitEntry() {
+    m_output += "fn u64 efi_main(u64 image_handle, u64 st) {\n";
+    m_output += "    u64 status = 0;\n";
+
+    size_t calls = min<size_t>(m_emitted, max<size_t>(1, m_config.fanout));
+    for (size_t i = 0; i < calls; ++i) {
+        m_output += "    status = fn_" + to_string(m_emitted - 1 - i) + "(image_handle";
+        for (size_t j = 1; j < m_config.args; ++j) {
+            m_output += ", st";
+        }
+        m_output += ");\n";
+    }
+
+    m_output += "    ret status;\n";
+    m_output += "}\n";
+}
+
+void bench::Generator::EmitStatement(size_t index, const vector<string>& names) {
+    static const vector<string> OPERATORS = { "=", "+=", "-=", "*=", "^=", "&=", "|=" };
+
+    if (names.empty()) {
+        return;
+    }
+
+    const string& left = Pick(names);
+
+    switch (Random(8)) {
+        case 0: {
+            m_output += "    " + left + " ~= " + left + ";\n";
+        } break;
+        case 1: {
+            m_output += "    " + left + (Random(2) == 0 ? " <<= " : " >>= ") + to_string(1 + Random(7)) + ";\n";
+        } break;
+        case 2: {
+            char hex[32];
+            snprintf(hex, sizeof(hex), "0x%zX", Random(0x10000));
+            m_output += "    " + left + " " + Pick(OPERATORS) + " " + hex + ";\n";
+        } break;
+        case 3: {
+            m_output += "    # " + to_string(index) + ": " + left + " is updated below\n";
+            m_output += "    " + left + " " + Pick(OPERATORS) + " " + to_string(Random(1000)) + ";\n";
+        } break;
+        default: {
+            m_output += "    " + left + " " + Pick(OPERATORS) + " " + Pick(names) + ";\n";
+        } break;
+    }
+}
+
+void bench::Generator::EmitCall(size_t index, const vector<string>& names, bool assign) {
+    // prefer recent helpers so call chains form instead of everything hitting fn_0
+    size_t window = min<size_t>(index, 8);
+    size_t callee = index - 1 - Random(window);
+
+    m_output += "    ";
+    if (assign && names.empty() == false) {
+        m_output += Pick(names) + " = ";
+    }
+
+    m_output += "fn_" + to_string(callee) + "(";
+    for (size_t i = 0; i < m_config.args; ++i) {
+        if (i > 0) {
+            m_output += ", ";
+        }
+
+        m_output += (names.empty() || Random(4) == 0) ? to_string(Random(100)) : Pick(names);
+    }
+    m_output += ");\n";
+}
+
+void bench::Generator::EmitAsm(const vector<string>& names) {
+    const string& var = Pick(names);
+
+    m_output += "    $asm(\"\n";
+    m_output += "        mov rax, qword [@" + var + "]\n";
+    m_output += "        add rax, " + to_string(Random(64)) + "\n";
+    m_output += "        mov qword [@" + var + "], rax\n";
+    m_output += "    \")\n";
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#ifndef HPP_GENERATOR
+#define HPP_GENERATOR
+
+#include <string>
+#include <vector>
+#include <random>
+#include <cstdint>
+
+using namespace std;
+
+namespace bench {
+    struct GeneratorConfig {
+        size_t functions = 16;      // helper functions (efi_main excluded), 0 = grow until target_size
+        size_t target_size = 0;     // stop emitting helpers once the source reaches this many bytes
+        size_t args = 2;            // parameters per helper
+        size_t locals = 4;          // locals per function
+        size_t statements = 12;     // statements per function body
+        size_t fanout = 2;          // calls per function body
+        size_t asm_blocks = 1;      // $asm blocks per function body
+        size_t keeps = 0;           // 'keep' statements per function body
+        uint64_t seed = 1337;
+    };
+
+    class Generator {
+        public:
+            Generator(const GeneratorConfig& config);
+            ~Generator();
+
+            [[nodiscard]] string generate();
+
+        private:
+            void EmitFunction(size_t index);
+            void EmitEntry();
+            void EmitStatement(size_t index, const vector<string>& names);
+            void EmitCall(size_t index, const vector<string>& names, bool assign);
+            void EmitAsm(const vector<string>& names);
+
+            [[nodiscard]] size_t Random(size_t bound);
+            [[nodiscard]] const string& Pick(const vector<string>& names);
+
+            GeneratorConfig m_config;
+            mt19937_64 m_rng;
+            string m_output;
+            size_t m_emitted;
+    };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <iostream>
+#include <string>
+#include <cstring>
+#include <fstream>
+
+#include "generator.hpp"
+
+using namespace std;
+
+static size_t ParseSize(const char* value) {
+    char* end = nullptr;
+    size_t size = strtoull(value, &end, 0);
+
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; break;
+        case 'm': case 'M': size *= 1024 * 1024; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; break;
+        default: break;
+    }
+
+    return size;
+}
+
+static void Usage() {
+    printf("usage: lxgen [options]\n");
+    printf("\t--functions N   number of helper functions (default 16)\n");
+    printf("\t--size N[K|M|G] keep adding helpers until the source reaches N bytes\n");
+    printf("\t--args N        parameters per helper (default 2)\n");
+    printf("\t--locals N      locals per function (default 4)\n");
+    printf("\t--statements N  statements per function (default 12)\n");
+    printf("\t--fanout N      calls per function (default 2)\n");
+    printf("\t--asm N         $asm blocks per function (default 1)\n");
+    printf("\t--keeps N       keep statements per function (default 0)\n");
+    printf("\t--seed N        random seed (default 1337)\n");
+    printf("\t-o FILE         output file (default stdout)\n");
+}
+
+int main(int argc, char** argv) {
+    bench::GeneratorConfig config;
+    string output;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-h" || arg == "--help") {
+            Usage();
+            return EXIT_SUCCESS;
+        }
+
+        if (i + 1 >= argc) {
+            Usage();
+            return EXIT_FAILURE;
+        }
+
+        const char* value = argv[++i];
+        if (arg == "--functions") config.functions = ParseSize(value);
+        else if (arg == "--size") config.target_size = ParseSize(value);
+        else if (arg == "--args") config.args = ParseSize(value);
+        else if (arg == "--locals") config.locals = ParseSize(value);
+        else if (arg == "--statements") config.statements = ParseSize(value);
+        else if (arg == "--fanout") config.fanout = ParseSize(value);
+        else if (arg == "--asm") config.asm_blocks = ParseSize(value);
+        else if (arg == "--keeps") config.keeps = ParseSize(value);
+        else if (arg == "--seed") config.seed = ParseSize(value);
+        else if (arg == "-o") output = value;
+        else {
+            Usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    bench::Generator generator(config);
+    string code = generator.generate();
+
+    if (output.empty()) {
+        fwrite(code.data(), 1, code.size(), stdout);
+        return EXIT_SUCCESS;
+    }
+
+    ofstream stream(output, ios::out | ios::binary | ios::trunc);
+    if (!stream) {
+        printf("Failed to open '%s'\n", output.data());
+        return EXIT_FAILURE;
+    }
+
+    stream.write(code.data(), code.size());
+    return EXIT_SUCCESS;
+}
\ No newline at end of file
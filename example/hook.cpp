@@ -0,0 +1,48 @@
+// Example compiler hook, a lint that reports inline assembly and the size of every function. Build it
+// with 'make hook' and load it with 'bin/compiler example/main.lx --hook bin/hook.so'.
+#include "hooks.hpp"
+
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+    class AsmLint : public engine::CompilerHook {
+        public:
+            const char* getName() const override {
+                return "asm-lint";
+            }
+
+            void onIL(engine::HookPoint point, engine::IL& il) override {
+                if (point != engine::HOOK_POINT_ANALYZED) {
+                    return;
+                }
+
+                il.forEachFunction([&](const engine::DeclareFunction& function, span<engine::IL_Instruction> body) {
+                    for (const engine::IL_Instruction& insn : body) {
+                        if (insn.type == engine::IL_TYPE_INLINE_ASM) {
+                            printf("\t- asm-lint: '%s' uses inline assembly on line %u\n", il.getString(function.name).data(), insn.line);
+                        }
+                    }
+                });
+            }
+
+            void onRoutines(engine::HookPoint point, span<engine::AsmRoutine> routines, const engine::IL& il) override {
+                if (point != engine::HOOK_POINT_LAID_OUT) {
+                    return;
+                }
+
+                for (const engine::AsmRoutine& routine : routines) {
+                    printf("\t- asm-lint: '%s' has %zu instructions\n", routine.name.data(), routine.insns.size());
+                }
+            }
+    };
+}
+
+extern "C" engine::CompilerHook* lefix_hook_create(uint32_t api_version) {
+    return api_version == engine::HOOK_API_VERSION ? new AsmLint() : nullptr;
+}
+
+extern "C" void lefix_hook_destroy(engine::CompilerHook* hook) {
+    delete hook;
+}
\ No newline at end of file
@@ -4,26 +4,118 @@
 #include <unordered_map>
 #include <algorithm>
 #include <sstream>
+#include <unordered_set>
+#include <deque>
+#include <queue>
+#include <bit>
 #include "assert.hpp"
 
 using namespace std;
 
-engine::Assembler::Assembler() {
+namespace {
+    struct Register {
+        const char* r64;
+        const char* r32;
+        const char* r16;
+        const char* r8;
+    };
+
+    // expressions are evaluated in these, rax and rdx are left to div and rcx to shift counts and spills
+    constexpr Register EXPR_REGISTERS[] = {
+        { "rsi", "esi", "si", "sil" },
+        { "rdi", "edi", "di", "dil" },
+        { "r8", "r8d", "r8w", "r8b" },
+        { "r9", "r9d", "r9w", "r9b" },
+        { "r10", "r10d", "r10w", "r10b" },
+        { "r11", "r11d", "r11w", "r11b" }
+    };
+
+    constexpr size_t EXPR_REGISTER_COUNT = sizeof(EXPR_REGISTERS) / sizeof(EXPR_REGISTERS[0]);
+    constexpr Register SCRATCH_REGISTER = { "rcx", "ecx", "cx", "cl" };
+    constexpr Register FILL_REGISTER = { "rax", "eax", "ax", "al" };
+
+    // constant $copy/$fill sizes up to this many bytes are unrolled into movdqu, larger ones use rep
+    constexpr uint64_t INLINE_MEMORY_LIMIT = 256;
+
+    string GetRegister(const Register& reg, size_t size) {
+        switch (size) {
+            case 8: return reg.r8;
+            case 16: return reg.r16;
+            case 32: return reg.r32;
+            case 64: return reg.r64;
+            default: CRASH("Unknown type size"); return reg.r64;
+        }
+    }
+
+    // condition codes of EXPR_OP_EQ..EXPR_OP_GE, unsigned then signed
+    const char* GetConditionCode(engine::ExprOp op, bool is_signed) {
+        switch (op) {
+            case engine::EXPR_OP_EQ: return "e";
+            case engine::EXPR_OP_NE: return "ne";
+            case engine::EXPR_OP_LT: return is_signed ? "l" : "b";
+            case engine::EXPR_OP_LE: return is_signed ? "le" : "be";
+            case engine::EXPR_OP_GT: return is_signed ? "g" : "a";
+            case engine::EXPR_OP_GE: return is_signed ? "ge" : "ae";
+            default: CRASH("Not a comparison"); return "e";
+        }
+    }
+
+    // sse2 mnemonic of a packed operator on lanes of 'size' bits
+    string GetPackedOp(engine::ExprOp op, uint8_t size) {
+        const string suffix = size == 8 ? "b" : size == 16 ? "w" : size == 32 ? "d" : "q";
+
+        switch (op) {
+            case engine::EXPR_OP_ADD: return "padd" + suffix;
+            case engine::EXPR_OP_SUB: return "psub" + suffix;
+            case engine::EXPR_OP_AND: return "pand";
+            case engine::EXPR_OP_OR: return "por";
+            case engine::EXPR_OP_XOR: return "pxor";
+            case engine::EXPR_OP_MUL: return "pmullw";
+            default: CRASH("No packed form of operator %u", op); return "";
+        }
+    }
+
+    string GetXmm(size_t index) {
+        return "xmm" + to_string(index);
+    }
+
+    // the comparison that holds exactly when 'op' does not
+    engine::ExprOp GetInverse(engine::ExprOp op) {
+        switch (op) {
+            case engine::EXPR_OP_EQ: return engine::EXPR_OP_NE;
+            case engine::EXPR_OP_NE: return engine::EXPR_OP_EQ;
+            case engine::EXPR_OP_LT: return engine::EXPR_OP_GE;
+            case engine::EXPR_OP_LE: return engine::EXPR_OP_GT;
+            case engine::EXPR_OP_GT: return engine::EXPR_OP_LE;
+            case engine::EXPR_OP_GE: return engine::EXPR_OP_LT;
+            default: CRASH("Not a comparison"); return op;
+        }
+    }
 }
 
-engine::Assembler::Assembler(const vector<const IL_Instruction*>& ils) 
-    : m_ils(move(ils)){
+engine::Assembler::Assembler(const IL& il) 
+    : m_il(il), m_pushed(0), m_labels(0), m_line(0), m_instrument(false), m_profile(nullptr), m_alignment(16) {
     m_routines.clear();
 }
 
+void engine::Assembler::enableDebugInfo(const string& source) {
+    m_source = source;
+}
+
+void engine::Assembler::enableInstrumentation() {
+    m_instrument = true;
+}
+
+void engine::Assembler::useProfile(const Profile& profile) {
+    m_profile = &profile;
+}
+
+void engine::Assembler::setFunctionAlignment(size_t alignment) {
+    ASSERT(has_single_bit(alignment), "Function alignment %zu is not a power of two", alignment);
+    m_alignment = alignment;
+}
+
 engine::Assembler::~Assembler() {
-    for (const AsmRoutine* routine : m_routines) {
-        for (const auto [var, local] : routine->stack) {
-            delete local;
-        }
-     
-        delete routine;
-    }
 }
 
 void engine::Assembler::global(const string& name, const string& comment) {
@@ -36,6 +128,20 @@ void engine::Assembler::global(const string& name, const string& comment) {
     m_output += "\n";
 }
 
+void engine::Assembler::line(uint32_t number) {
+    // NASM takes every following line as 'number' of the source until the next marker
+    if (m_source.empty() || number == 0 || number == m_line) {
+        return;
+    }
+
+    m_output += "%line " + to_string(number) + "+0 " + m_source + "\n";
+    m_line = number;
+}
+
+void engine::Assembler::section(const string& name) {
+    m_output += "section " + name + "\n";
+}
+
 void engine::Assembler::label(const string& name, const string& comment) {
     m_output += name + ":";
 
@@ -211,6 +317,211 @@ void engine::Assembler::_shl(const string& dst, const string& src, const string&
     m_output += "\n";
 }
 
+void engine::Assembler::_imul(const string& dst, const string& src, const string& comment) {
+    m_output += "\timul " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_idiv(const string& src, const string& comment) {
+    m_output += "\tidiv " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_neg(const string& src, const string& comment) {
+    m_output += "\tneg " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_sar(const string& dst, const string& src, const string& comment) {
+    m_output += "\tsar " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_movzx(const string& dst, const string& src, const string& comment) {
+    m_output += "\tmovzx " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_movsx(const string& dst, const string& src, const string& comment) {
+    m_output += "\tmovsx " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_movsxd(const string& dst, const string& src, const string& comment) {
+    m_output += "\tmovsxd " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_cqo(const string& comment) {
+    m_output += "\tcqo";
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_cmp(const string& dst, const string& src, const string& comment) {
+    m_output += "\tcmp " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_test(const string& dst, const string& src, const string& comment) {
+    m_output += "\ttest " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_set(const string& cc, const string& dst, const string& comment) {
+    m_output += "\tset" + cc + " " + dst;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_cmov(const string& cc, const string& dst, const string& src, const string& comment) {
+    m_output += "\tcmov" + cc + " " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_lea(const string& dst, const string& src, const string& comment) {
+    m_output += "\tlea " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+// sse2 instructions with two operands share one emitter, 'op' is the full mnemonic
+void engine::Assembler::_packed(const string& op, const string& dst, const string& src, const string& comment) {
+    m_output += "\t" + op + " " + dst + ", " + src;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_pshufd(const string& dst, const string& src, const string& order, const string& comment) {
+    m_output += "\tpshufd " + dst + ", " + src + ", " + order;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_pshuflw(const string& dst, const string& src, const string& order, const string& comment) {
+    m_output += "\tpshuflw " + dst + ", " + src + ", " + order;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_rep(const string& op, const string& comment) {
+    m_output += "\trep " + op;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_data(const string& directive, const string& values, const string& comment) {
+    m_output += "\t" + directive + " " + values;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_align(size_t alignment) {
+    m_output += "\talign " + to_string(alignment) + "\n";
+}
+
+void engine::Assembler::_resb(size_t size, const string& comment) {
+    m_output += "\tresb " + to_string(size);
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
+void engine::Assembler::_j(const string& cc, const string& dst, const string& comment) {
+    m_output += "\tj" + cc + " " + dst;
+
+    if (comment.empty() == false) {
+        m_output += " ; " + comment;
+    }
+
+    m_output += "\n";
+}
+
 void engine::Assembler::_ret(const string& comment) {
     m_output += "\tret";
 
@@ -262,359 +573,968 @@ size_t engine::Assembler::AlignStack(size_t offset, size_t size) {
     return offset + (size - (offset % size));
 }
 
-void engine::Assembler::translate() {
-    for (const IL_Instruction* il : m_ils) {
-        switch (il->type) {
-            case IL_TYPE_DECLARE_FUNCTION: {
-                const DeclareFunction* func = (const DeclareFunction*)&il->data;
-
-                AsmRoutine* routine = new AsmRoutine;
-                routine->name = func->name;
-                routine->stack_size = 0;
-                routine->stack.clear();
-                routine->insns.clear();
-                
-                vector<const DeclareVariable*> vars;
-                for (const DeclareVariable& arg : func->args) {
-                    vars.push_back(&arg);
-                }
-                
-                for (const IL_Instruction* il : m_ils) {
-                    if (il->type == IL_TYPE_DECLARE_VARIABLE) {
-                        const DeclareVariable* var = &get<DeclareVariable>(il->data);
-                        if (var->function == func) {
-                            vars.push_back(var);
-                        }
-                    }
-                }
+int64_t engine::Assembler::GetOffset(const AsmRoutine& routine, uint32_t var) const {
+    int64_t offset = routine.stack.at(var).offset;
+    if (m_il.getVariable(var).flags & VAR_FLAGS_ARG) {
+        offset += routine.stack_size + 8;
+    }
 
-                for (const DeclareVariable* var : vars) {
-                    AsmLocal* local = new AsmLocal;
-                    local->size = var->size / 8;
-                    local->type = var->value.empty() == false ? ASM_LOCAL_TYPE_IMMEDIATE : ASM_LOCAL_TYPE_NONE; 
-                    local->offset = AlignStack(routine->stack_size, local->size);
-
-                    switch (local->type) {
-                        case ASM_LOCAL_TYPE_IMMEDIATE: {
-                            switch (var->size)  {
-                                case 8: local->imm.b8 = IL::getImm(var->value); break;
-                                case 16: local->imm.b16 = IL::getImm(var->value); break;
-                                case 32: local->imm.b32 = IL::getImm(var->value); break;
-                                case 64: local->imm.b64 = IL::getImm(var->value); break;
-                                default: CRASH("Unknown type size"); break;
-                            }
-                            
-                        } break;
-                        default: break;
-                    }
+    return offset;
+}
 
-                    routine->stack.emplace(var, local);
+string engine::Assembler::GetName(uint32_t var) const {
+    return string(m_il.getString(m_il.getVariable(var).name));
+}
 
-                    size_t diff = local->offset - routine->stack_size;
-                    routine->stack_size += diff + local->size;
-                }
+string engine::Assembler::GetSlot(const AsmRoutine& routine, uint32_t var) const {
+    return getMemSize(m_il.getVariable(var).size) + " [" + GetAddress(routine, var) + "]";
+}
 
-                for (const IL_Instruction* il : m_ils) {
-                    if (il->type != IL_TYPE_DECLARE_VARIABLE) {
-                        if (*(DeclareFunction**)&il->data == func) {
-                            routine->insns.push_back(il);
-                        }
-                    }
-                }
-                
-                m_routines.push_back(routine);
-                break;
-            } break;
-            default: break;
-        };
+string engine::Assembler::GetAddress(const AsmRoutine& routine, uint32_t var) const {
+    const DeclareVariable& data = m_il.getVariable(var);
+    if (data.flags & VAR_FLAGS_GLOBAL) {
+        return "rel " + GetName(var);
     }
+
+    return "rsp+" + to_string(GetOffset(routine, var) + m_pushed);
 }
 
-void engine::Assembler::optimize() {
-    // Remove stack if no locals are used
-    for (AsmRoutine* routine : m_routines) {
-        if (routine->stack.empty()) {
-            continue;
-        }
+string engine::Assembler::GetElement(const AsmRoutine& routine, uint32_t array, const string& index, const string& temp) {
+    // rip relative addresses take no index register, the base of a global goes through 'temp'
+    const DeclareVariable& data = m_il.getVariable(array);
 
-        vector<const AsmLocal*> used_locals;
-        for (const IL_Instruction* insn : routine->insns) {
-            switch (insn->type) {
-                case IL_TYPE_RETURN: {
-                    const FunctionReturn* data = &get<FunctionReturn>(insn->data);
-                    if (data->var != nullptr) {
-                        used_locals.push_back(routine->stack.at(data->var));
-                    }
-                } break;
-                case IL_TYPE_EQ_SET: {
-                    const EQSet* data = &get<EQSet>(insn->data);
-                    const DeclareVariable* left = data->left;
-                    const DeclareVariable* right = data->right;
-                    
-                    if (!(left->flags & VAR_FLAGS_IMMEDIATE)) {
-                        used_locals.push_back(routine->stack.at(left));
-                    }
+    string base = GetAddress(routine, array);
+    if (data.flags & VAR_FLAGS_GLOBAL) {
+        _lea(temp, "[" + base + "]", GetName(array));
+        base = temp;
+    }
 
-                    if (!(right->flags & VAR_FLAGS_IMMEDIATE)) {
-                        used_locals.push_back(routine->stack.at(right));
-                    }
-                } break;
-                case IL_TYPE_FUNC_CALL: {
-                    const FunctionCall* data = &get<FunctionCall>(insn->data);
-                    if (data->ret != nullptr) {
-                        used_locals.push_back(routine->stack.at(data->ret));
-                    }
-                    
-                    for (const DeclareVariable* arg : data->args) {
-                        used_locals.push_back(routine->stack.at(arg));
-                    }
-                } break;
-                default: break;
-            }
-        }
+    return "[" + base + "+" + index + "*" + to_string(data.size / 8) + "]";
+}
 
-        if (used_locals.empty() == true) {
-            routine->stack_size = false;
-            routine->stack.clear();
-        }
+void engine::Assembler::LoadVariable(const AsmRoutine& routine, size_t reg, uint32_t var) {
+    // widen to 64 bits so every operator works on full registers
+    const Register& dst = reg < EXPR_REGISTER_COUNT ? EXPR_REGISTERS[reg] : SCRATCH_REGISTER;
+    const DeclareVariable& data = m_il.getVariable(var);
+    const string name = GetName(var);
+
+    if (data.flags & VAR_FLAGS_IMMEDIATE) {
+        LoadImmediate(dst.r64, var);
+        return;
     }
+
+    LoadMemory(reg, GetSlot(routine, var), data, name);
 }
 
+void engine::Assembler::LoadWidened(const AsmRoutine& routine, uint32_t var, size_t size) {
+    // into the gp0 register of 'size', narrower values are widened so the bits above them are never stale
+    const DeclareVariable& data = m_il.getVariable(var);
+    const string name = GetName(var);
 
+    if (data.flags & VAR_FLAGS_IMMEDIATE) {
+        LoadImmediate(getGP0(size), var);
+        return;
+    }
 
-void engine::Assembler::assemble() {
-    for (const AsmRoutine* routine : m_routines) {
-        // create a label for the function
-        label(routine->name);
+    const string ref = GetSlot(routine, var);
+    if (data.size >= size) {
+        _mov(getGP0(data.size), ref, name);
+    }
+    else if (data.size == 32) {
+        IL::isSigned(data.type) ? _movsxd("rax", ref, name) : _mov("eax", ref, name);
+    }
+    else {
+        IL::isSigned(data.type) ? _movsx("rax", ref, name) : _movzx("eax", ref, name);
+    }
+}
 
-        // reserve stack for variables
-        if (routine->stack_size > 0) {
-            _sub("rsp", to_string(routine->stack_size), "reserve locals");
-        }
+void engine::Assembler::LoadImmediate(const string& dst, uint32_t var) {
+    // strings are addresses into the literal pool
+    const DeclareVariable& data = m_il.getVariable(var);
 
-        // assemble instructions
-        for (const IL_Instruction* insn : routine->insns) {
-            switch (insn->type)
-            {
-            case IL_TYPE_INLINE_ASM: {
-                InlineAsm* data = (InlineAsm*)&get<InlineAsm>(insn->data);
-
-
-                for (size_t i = 0; i < data->code.size(); ++i) {
-                    if (data->code.substr(i, 11) == "@stack_size") {
-                        data->code.erase(i, 11);
-
-                        string stub = to_string(routine->stack_size) + " ; @stack_size";
-                        data->code.insert(i, stub);
-                        i += stub.size();
-                    } else if (data->code[i] == '@') {
-                        size_t start = i + 1;
-                        size_t end = start;
-                        while (end < data->code.size() && (isalnum(data->code[end]) || data->code[end] == '_')) {
-                            ++end;
-                        }
+    if (data.type == DATA_TYPE_STR) {
+        _lea(dst, "[rel " + GetLiteral(data.value) + "]", GetName(var));
+        return;
+    }
 
-                        for (const auto [var, local] : routine->stack) {
-                            if (var->name == data->code.substr(start, end - start)) {
-                                int64_t right_offset = local->offset;
-                                if (var->flags & VAR_FLAGS_ARG) {
-                                    right_offset += routine->stack_size + 8;
-                                }
-
-                                data->code.erase(i, end - start + 1);
-                                data->code.insert(i, + "rsp+" + to_string(right_offset));
-                                break;
-                            }
-                        }
-                    }
-                }
+    _mov(dst, to_string(data.imm), GetName(var));
+}
 
-                insert(data->code, "Inlined assembly");
-            } break;
-            case IL_TYPE_EQ_SET: {
-                const EQSet* data = &get<EQSet>(insn->data);
-                
-                const DeclareVariable* left = data->left;
-                const DeclareVariable* right = data->right;
-  
-                const string& left_mem = getMemSize(left->size);
-                const string& right_mem = getMemSize(right->size);
-                const string& left_gp0 = getGP0(left->size);
-                const string& right_gp0 = getGP0(right->size);
-
-                if (data->type != SET_TYPE_SHIFTL && data->type != SET_TYPE_SHIFTR) {
-                    if (!(right->flags & VAR_FLAGS_IMMEDIATE)) {
-                        const AsmLocal* right_stack = routine->stack.at(right);
-
-                        int64_t right_offset = right_stack->offset;
-                        if (right->flags & VAR_FLAGS_ARG) {
-                            right_offset += routine->stack_size + 8;
-                        }
+string engine::Assembler::GetLiteral(uint32_t value) {
+    // identical literals share one label, named after a hash of their content so it is the same in every build
+    string_view text = m_il.getString(value);
+    if (auto it = m_literals.find(text); it != m_literals.end()) {
+        return it->second;
+    }
 
-                        // read from var within the stack
-                        _mov(right_gp0, right_mem + " [rsp+" + to_string(right_offset) + "]", right->name);
-                    }
-                    else {
-                        // write to gp0 reg imm value
-                        _mov(right_gp0, to_string(IL::getImm(right->value)), right->name);
-                    }
-                }
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : text) {
+        hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+    }
 
-                // write to var within the stack
-                const AsmLocal* left_stack = routine->stack.at(left);
-            
-                int64_t left_offset = left_stack->offset;
-                 if (left->flags & VAR_FLAGS_ARG) {
-                    left_offset += routine->stack_size + 8;
-                }
-                
-                switch (data->type) {
-                    case SET_TYPE_DIRECT: {
-                        _mov(left_mem + " [rsp+" + to_string(left_offset) + "]", left_gp0, left->name);
-                    } break;
-                    case SET_TYPE_ADD: {
-                        _add(left_mem + " [rsp+" + to_string(left_offset) + "]", left_gp0, left->name);
-                    } break;
-                    case SET_TYPE_SUB: {
-                        _sub(left_mem + " [rsp+" + to_string(left_offset) + "]", left_gp0, left->name);
-                    } break;
-                    case SET_TYPE_XOR: {
-                        _xor(left_mem + " [rsp+" + to_string(left_offset) + "]", left_gp0, left->name);
-                    } break;
-                    case SET_TYPE_OR: {
-                        _or(left_mem + " [rsp+" + to_string(left_offset) + "]", left_gp0, left->name);
-                    } break;
-                    case SET_TYPE_NOT: {
-                        _not(left_mem + " [rsp+" + to_string(left_offset) + "]", left->name);
-                    } break;
-                    case SET_TYPE_AND: {
-                        _and(left_mem + " [rsp+" + to_string(left_offset) + "]", left_gp0, left->name);
-                    } break;
-                    case SET_TYPE_SHIFTL: {
-                        _shl(left_mem + " [rsp+" + to_string(left_offset) + "]", to_string(IL::getImm(right->value)), left->name);
-                    } break;
-                    case SET_TYPE_SHIFTR: {
-                        _shr(left_mem + " [rsp+" + to_string(left_offset) + "]", to_string(IL::getImm(right->value)), left->name);
-                    } break;
-                    case SET_TYPE_MUL: {   
-                        _mov("rbx", "rax");
-                        _mov(left_gp0, left_mem + " [rsp+" + to_string(left_offset) + "]", left->name);
-                        _mul("rbx", right->name);   
-                        _mov(left_mem + " [rsp+" + to_string(left_offset) + "]", "rax", left->name); 
-                    } break;
-                    case SET_TYPE_DIV: {
-                        _mov("rbx", "rax");
-                        _xor("rdx", "rdx");
-                        _mov(left_gp0, left_mem + " [rsp+" + to_string(left_offset) + "]", left->name);
-                        _div("rbx", right->name);   
-                        _mov(left_mem + " [rsp+" + to_string(left_offset) + "]", "rax", left->name);
-                    } break;
-                    case SET_TYPE_REM: {
-                        _mov("rbx", "rax");
-                        _xor("rdx", "rdx");
-                        _mov(left_gp0, left_mem + " [rsp+" + to_string(left_offset) + "]", left->name);
-                        _div("rbx", right->name);   
-                        _mov(left_mem + " [rsp+" + to_string(left_offset) + "]", "rdx", left->name);
-                    } break;
-                    default: break;
-                }
-            } break;
-            case IL_TYPE_FUNC_CALL: {
-                const FunctionCall* data = &get<FunctionCall>(insn->data);
-                
-                size_t stack_size = 0;
-                for (const DeclareVariable* arg : data->args) {
-                    const string& mem = getMemSize(arg->size);
-                    const string& gp0 = getGP0(arg->size);
-
-                    // reserve space for the var
-                    _sub("rsp", to_string(arg->size / 8), "reserve " + arg->name);
-
-                    if (!(arg->flags & VAR_FLAGS_IMMEDIATE)) {
-                        const AsmLocal* arg_stack = routine->stack.at(arg);
-
-                        int64_t arg_offset = arg_stack->offset;
-                        if (arg->flags & VAR_FLAGS_ARG) {
-                            arg_offset += routine->stack_size + 8;
-                        }
-                        arg_offset += arg->size / 8; // skip the reserved space
+    char name[32];
+    snprintf(name, sizeof(name), "str_%016llx", (unsigned long long)hash);
 
-                        _mov(gp0, mem + " [rsp+" + to_string(arg_offset) + "]", arg->name);
-                        _mov(mem + " [rsp+0]", gp0);
-                    }
-                    else {
-                        _mov(gp0, to_string(IL::getImm(arg->value)), arg->name);
-                        _mov(mem + " [rsp+0]", gp0);
-                    }
+    string label = name;
+    for (size_t i = 1; m_pool.contains(label); ++i) {
+        label = string(name) + "_" + to_string(i);
+    }
 
-                    stack_size += arg->size / 8;
-                }
+    m_literals.emplace(text, label);
+    m_pool.emplace(label, text);
+    return label;
+}
+
+void engine::Assembler::LoadMemory(size_t reg, const string& mem, const DeclareVariable& data, const string& name) {
+    const Register& dst = reg < EXPR_REGISTER_COUNT ? EXPR_REGISTERS[reg] : SCRATCH_REGISTER;
+
+    switch (data.size) {
+        case 64: _mov(dst.r64, mem, name); break;
+        case 32: IL::isSigned(data.type) ? _movsxd(dst.r64, mem, name) : _mov(dst.r32, mem, name); break;
+        default: IL::isSigned(data.type) ? _movsx(dst.r64, mem, name) : _movzx(dst.r32, mem, name); break;
+    }
+}
+
+string engine::Assembler::GetOperand(const AsmRoutine& routine, uint32_t var, bool allow_imm) {
+    // right hand leaves are used in place when x86 allows it, otherwise through the scratch register
+    const DeclareVariable& data = m_il.getVariable(var);
+
+    if (data.flags & VAR_FLAGS_IMMEDIATE) {
+        if (allow_imm && data.type != DATA_TYPE_STR && data.imm <= INT32_MAX) {
+            return to_string(data.imm);
+        }
+    }
+    else if (data.size == 64) {
+        return GetSlot(routine, var);
+    }
 
-                _call(data->callee->name);
+    LoadVariable(routine, EXPR_REGISTER_COUNT, var);
+    return SCRATCH_REGISTER.r64;
+}
 
-                if (stack_size > 0) {
-                    _add("rsp", to_string(stack_size), "free args");
+void engine::Assembler::ApplyOperator(ExprOp op, size_t dst, const string& src, bool is_signed) {
+    const Register& reg = EXPR_REGISTERS[dst];
+
+    switch (op) {
+        case EXPR_OP_ADD: _add(reg.r64, src); break;
+        case EXPR_OP_SUB: _sub(reg.r64, src); break;
+        case EXPR_OP_AND: _and(reg.r64, src); break;
+        case EXPR_OP_OR: _or(reg.r64, src); break;
+        case EXPR_OP_XOR: _xor(reg.r64, src); break;
+        case EXPR_OP_MUL: _imul(reg.r64, src); break;
+        case EXPR_OP_SHL:
+        case EXPR_OP_SHR: {
+            // counts are either immediates or in cl, the cpu masks both to 6 bits but imm8 can't hold more
+            string count = src;
+            if (isdigit(src[0])) {
+                count = to_string(stoull(src) & 63);
+            }
+            else {
+                if (src != SCRATCH_REGISTER.r64) {
+                    _mov(SCRATCH_REGISTER.r64, src);
                 }
-                
-                if (data->ret != nullptr) {
-                    size_t ret_size = DATA_TYPE_SIZES.at(data->ret->type);
-                    const string& mem = getMemSize(ret_size);
-                    const string& gp0 = getGP0(ret_size);
 
-                    const AsmLocal* ret_stack = routine->stack.at(data->ret);
+                count = SCRATCH_REGISTER.r8;
+            }
+
+            if (op == EXPR_OP_SHL) _shl(reg.r64, count);
+            else if (is_signed) _sar(reg.r64, count);
+            else _shr(reg.r64, count);
+        } break;
+        case EXPR_OP_DIV:
+        case EXPR_OP_REM: {
+            string divisor = src;
+            if (isdigit(src[0])) {
+                _mov(SCRATCH_REGISTER.r64, src);
+                divisor = SCRATCH_REGISTER.r64;
+            }
+
+            _mov("rax", reg.r64);
+            if (is_signed) {
+                _cqo();
+                _idiv(divisor);
+            }
+            else {
+                _xor("edx", "edx");
+                _div(divisor);
+            }
+
+            _mov(reg.r64, op == EXPR_OP_DIV ? "rax" : "rdx");
+        } break;
+        case EXPR_OP_EQ:
+        case EXPR_OP_NE:
+        case EXPR_OP_LT:
+        case EXPR_OP_LE:
+        case EXPR_OP_GT:
+        case EXPR_OP_GE: {
+            // branchless, the flag becomes 0 or 1
+            _cmp(reg.r64, src);
+            _set(GetConditionCode(op, is_signed), reg.r8);
+            _movzx(reg.r32, reg.r8);
+        } break;
+        default: CRASH("Unknown expression operator %u", op); break;
+    }
+}
+
+void engine::Assembler::LowerSelect(const AsmRoutine& routine, const ExprNode& expr, size_t reg) {
+    // arms that can't fault are both evaluated and picked with cmov, there is no branch to mispredict.
+    // An arm that may fault, a division or an array load, only runs when it is taken.
+    const Register& dst = EXPR_REGISTERS[reg];
+
+    if (MayFault(expr.right) || MayFault(expr.other)) {
+        const string other = MakeLabel("select_other");
+        const string done = MakeLabel("select_done");
+
+        LowerNode(routine, expr.left, reg);
+        _test(dst.r64, dst.r64);
+        _j("z", other);
+
+        LowerNode(routine, expr.right, reg);
+        _j("mp", done);
+
+        label(other);
+        LowerNode(routine, expr.other, reg);
+        label(done);
+        return;
+    }
+
+    if (reg + 2 < EXPR_REGISTER_COUNT) {
+        const Register& yes = EXPR_REGISTERS[reg + 1];
+        const Register& no = EXPR_REGISTERS[reg + 2];
+
+        LowerNode(routine, expr.left, reg);
+        LowerNode(routine, expr.right, reg + 1);
+        LowerNode(routine, expr.other, reg + 2);
+
+        _test(dst.r64, dst.r64);
+        _mov(dst.r64, no.r64);
+        _cmov("nz", dst.r64, yes.r64);
+        return;
+    }
+
+    LowerNode(routine, expr.other, reg);
+    _push(dst.r64, "spill");
+    m_pushed += 8;
+
+    LowerNode(routine, expr.right, reg);
+    _push(dst.r64, "spill");
+    m_pushed += 8;
+
+    LowerNode(routine, expr.left, reg);
+    _pop(SCRATCH_REGISTER.r64, "reload");
+    _pop("rdx", "reload");
+    m_pushed -= 16;
+
+    _test(dst.r64, dst.r64);
+    _cmov("z", SCRATCH_REGISTER.r64, "rdx");
+    _mov(dst.r64, SCRATCH_REGISTER.r64);
+}
+
+bool engine::Assembler::MayFault(uint32_t node) const {
+    const ExprNode& expr = m_il.getExprNodes()[node];
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: return false;
+        case EXPR_OP_INDEX:
+        case EXPR_OP_DIV:
+        case EXPR_OP_REM: return true;
+        default: break;
+    }
+
+    return MayFault(expr.left) || (expr.right != IL_NONE && MayFault(expr.right)) || (expr.other != IL_NONE && MayFault(expr.other));
+}
+
+void engine::Assembler::LowerNode(const AsmRoutine& routine, uint32_t node, size_t reg) {
+    // Sethi-Ullman: the subtree that needs more registers is evaluated first, so the other one never
+    // needs more than what is left. Once the pool runs out the right side goes through the stack.
+    const vector<ExprNode>& nodes = m_il.getExprNodes();
+    const ExprNode& expr = nodes[node];
+    const string dst = EXPR_REGISTERS[reg].r64;
+
+    // a comparison's flag is its operands' signedness, which is what picks the condition code
+    bool is_signed = expr.is_signed;
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: {
+            LoadVariable(routine, reg, expr.left);
+        } return;
+        case EXPR_OP_NOT: {
+            LowerNode(routine, expr.left, reg);
+            _not(dst);
+        } return;
+        case EXPR_OP_NEG: {
+            LowerNode(routine, expr.left, reg);
+            _neg(dst);
+        } return;
+        case EXPR_OP_SELECT: {
+            LowerSelect(routine, expr, reg);
+        } return;
+        case EXPR_OP_INDEX: {
+            // the element replaces its index in the same register
+            const DeclareVariable& array = m_il.getVariable(expr.left);
+
+            LowerNode(routine, expr.right, reg);
+            LoadMemory(reg, getMemSize(array.size) + " " + GetElement(routine, expr.left, dst, SCRATCH_REGISTER.r64), array, GetName(expr.left));
+        } return;
+        default: break;
+    }
+
+    const ExprNode& left = nodes[expr.left];
+    const ExprNode& right = nodes[expr.right];
+
+    if (right.op == EXPR_OP_LEAF) {
+        LowerNode(routine, expr.left, reg);
+        bool allow_imm = expr.op != EXPR_OP_DIV && expr.op != EXPR_OP_REM;
+        ApplyOperator(expr.op, reg, GetOperand(routine, right.left, allow_imm), is_signed);
+    }
+    else if (reg + 1 < EXPR_REGISTER_COUNT) {
+        const string next = EXPR_REGISTERS[reg + 1].r64;
+
+        if (left.need >= right.need) {
+            LowerNode(routine, expr.left, reg);
+            LowerNode(routine, expr.right, reg + 1);
+            ApplyOperator(expr.op, reg, next, is_signed);
+        }
+        else {
+            LowerNode(routine, expr.right, reg);
+            LowerNode(routine, expr.left, reg + 1);
+
+            bool commutative = expr.op == EXPR_OP_ADD || expr.op == EXPR_OP_MUL || expr.op == EXPR_OP_AND || expr.op == EXPR_OP_OR || expr.op == EXPR_OP_XOR || expr.op == EXPR_OP_EQ || expr.op == EXPR_OP_NE;
+            if (commutative) {
+                ApplyOperator(expr.op, reg, next, is_signed);
+            }
+            else {
+                ApplyOperator(expr.op, reg + 1, dst, is_signed);
+                _mov(dst, next);
+            }
+        }
+    }
+    else {
+        LowerNode(routine, expr.right, reg);
+        _push(dst, "spill");
+        m_pushed += 8;
+
+        LowerNode(routine, expr.left, reg);
+        _pop(SCRATCH_REGISTER.r64, "reload");
+        m_pushed -= 8;
 
-                    int64_t ret_offset = ret_stack->offset;
-                    if (data->ret->flags & VAR_FLAGS_ARG) {
-                        ret_offset += routine->stack_size + 8;
+        ApplyOperator(expr.op, reg, SCRATCH_REGISTER.r64, is_signed);
+    }
+}
+
+void engine::Assembler::LowerExpression(const AsmRoutine& routine, const Expression& expr) {
+    const DeclareVariable& target = m_il.getVariable(expr.target);
+
+    LowerNode(routine, expr.root, 0);
+
+    if (expr.index == IL_NONE) {
+        _mov(GetSlot(routine, expr.target), GetRegister(EXPR_REGISTERS[0], target.size), GetName(expr.target));
+        return;
+    }
+
+    // the value is held while the index is evaluated next to it
+    LowerNode(routine, expr.index, 1);
+
+    const string element = getMemSize(target.size) + " " + GetElement(routine, expr.target, EXPR_REGISTERS[1].r64, SCRATCH_REGISTER.r64);
+    _mov(element, GetRegister(EXPR_REGISTERS[0], target.size), GetName(expr.target));
+}
+
+void engine::Assembler::LowerMemory(const AsmRoutine& routine, const MemoryOp& op) {
+    // rdi is the destination and rsi the source, fills keep their value broadcast in xmm0 and rax
+    const DeclareVariable& dst = m_il.getVariable(op.dst);
+    const DeclareVariable& src = m_il.getVariable(op.src);
+    const DeclareVariable& count = m_il.getVariable(op.count);
+    const bool copy = op.type == MEMORY_OP_COPY;
+    const size_t scale = dst.size / 8;
+
+    _lea("rdi", "[" + GetAddress(routine, op.dst) + "]", GetName(op.dst));
+    if (copy) {
+        _lea("rsi", "[" + GetAddress(routine, op.src) + "]", GetName(op.src));
+    }
+    else if ((src.flags & VAR_FLAGS_IMMEDIATE) && src.imm == 0) {
+        _packed("pxor", GetXmm(0), GetXmm(0));
+        _xor("eax", "eax");
+    }
+    else {
+        LoadVariable(routine, EXPR_REGISTER_COUNT, op.src);
+        Broadcast(GetXmm(0), dst.size);
+        _packed("movq", "rax", GetXmm(0));
+    }
+
+    if (!(count.flags & VAR_FLAGS_IMMEDIATE)) {
+        LowerMemoryLoop(routine, op, scale);
+        return;
+    }
+
+    const uint64_t bytes = count.imm * scale;
+    if (bytes > INLINE_MEMORY_LIMIT) {
+        // fast strings move whole cache lines at a time once the size pays for their startup
+        if (copy) {
+            _mov(SCRATCH_REGISTER.r64, to_string(bytes));
+            _rep("movsb", GetName(op.dst));
+            return;
+        }
+
+        // stosb needs every byte of the value to be the same, wider elements are stored one at a time
+        const uint64_t pattern = (src.imm & 0xFF) * 0x0101010101010101 >> (64 - dst.size);
+        const bool bytewise = scale == 1 || ((src.flags & VAR_FLAGS_IMMEDIATE) && pattern == src.imm);
+        _mov(SCRATCH_REGISTER.r64, to_string(bytewise ? bytes : count.imm));
+        _rep(bytewise ? "stosb" : scale == 2 ? "stosw" : scale == 4 ? "stosd" : "stosq", GetName(op.dst));
+        return;
+    }
+
+    // whole vectors, then one vector that overlaps the last of them, or a few scalar moves below 16 bytes
+    auto move = [&](uint64_t offset, size_t width) {
+        const string at = "+" + to_string(offset) + "]";
+
+        if (width == 16) {
+            if (copy) {
+                _packed("movdqu", GetXmm(0), "[rsi" + at);
+            }
+
+            _packed("movdqu", "[rdi" + at, GetXmm(0));
+            return;
+        }
+
+        const string reg = GetRegister(copy ? EXPR_REGISTERS[2] : FILL_REGISTER, width * 8);
+        if (copy) {
+            _mov(reg, getMemSize(width * 8) + " [rsi" + at);
+        }
+
+        _mov(getMemSize(width * 8) + " [rdi" + at, reg);
+    };
+
+    if (bytes >= 16) {
+        for (uint64_t offset = 0; offset + 16 <= bytes; offset += 16) {
+            move(offset, 16);
+        }
+
+        if (bytes % 16 != 0) {
+            move(bytes - 16, 16);
+        }
+
+        return;
+    }
+
+    uint64_t offset = 0;
+    for (size_t width = 8; width > 0; width /= 2) {
+        if (bytes & width) {
+            move(offset, width);
+            offset += width;
+        }
+    }
+}
+
+void engine::Assembler::LowerMemoryLoop(const AsmRoutine& routine, const MemoryOp& op, size_t scale) {
+    // Runtime counts: 16 bytes per iteration and one overlapping vector for the rest. Fewer than 16
+    // bytes are moved an element at a time. rax is the offset and rcx the size in bytes.
+    const bool copy = op.type == MEMORY_OP_COPY;
+    const string top = MakeLabel("memory");
+    const string small = MakeLabel("memory_small");
+    const string done = MakeLabel("memory_done");
+    const string mem = getMemSize(scale * 8);
+
+    // the fill pattern moves to r8, rax becomes the offset
+    if (copy == false) {
+        _mov(EXPR_REGISTERS[2].r64, "rax");
+    }
+
+    LoadVariable(routine, EXPR_REGISTER_COUNT, op.count);
+    if (scale > 1) {
+        _shl(SCRATCH_REGISTER.r64, to_string(countr_zero(scale)));
+    }
+
+    _xor("eax", "eax");
+    _cmp(SCRATCH_REGISTER.r64, "16");
+    _j("b", small);
+
+    _sub(SCRATCH_REGISTER.r64, "16", "offset of the last vector");
+    label(top);
+    if (copy) {
+        _packed("movdqu", GetXmm(0), "[rsi+rax]");
+    }
+
+    _packed("movdqu", "[rdi+rax]", GetXmm(0));
+    _add("rax", "16");
+    _cmp("rax", SCRATCH_REGISTER.r64);
+    _j("b", top);
+
+    if (copy) {
+        _packed("movdqu", GetXmm(0), "[rsi+rcx]");
+    }
+
+    _packed("movdqu", "[rdi+rcx]", GetXmm(0));
+    _j("mp", done);
+
+    label(small);
+    _test(SCRATCH_REGISTER.r64, SCRATCH_REGISTER.r64);
+    _j("z", done);
+
+    const string reg = GetRegister(EXPR_REGISTERS[2], scale * 8);
+    const string loop = MakeLabel("memory_element");
+    label(loop);
+    if (copy) {
+        _mov(reg, mem + " [rsi+rax]");
+    }
+
+    _mov(mem + " [rdi+rax]", reg);
+    _add("rax", to_string(scale));
+    _cmp("rax", SCRATCH_REGISTER.r64);
+    _j("b", loop);
+    label(done);
+}
+
+void engine::Assembler::translate(vector<IL_Instruction>&& ils) {
+    // one pass to create routines, one pass to bucket declarations and instructions into them
+    vector<size_t> routine_ids(m_il.getFunctions().size(), SIZE_MAX);
+    for (const IL_Instruction& il : ils) {
+        if (il.type == IL_TYPE_DECLARE_FUNCTION) {
+            AsmRoutine routine;
+            routine.name = m_il.getString(m_il.getFunction(il.operand).name);
+            routine.function = il.operand;
+            routine.stack_size = 0;
+            routine.line = il.line;
+            routine.cold = false;
+            routine.alignment = 1;
+
+            routine_ids[il.operand] = m_routines.size();
+            m_routines.push_back(move(routine));
+        }
+    }
+
+    vector<vector<uint32_t>> vars(m_routines.size());
+    for (size_t i = 0; i < m_routines.size(); ++i) {
+        const DeclareFunction& func = m_il.getFunction(m_routines[i].function);
+        for (uint32_t arg = 0; arg < func.arg_count; ++arg) {
+            vars[i].push_back(func.first_arg + arg);
+        }
+    }
+
+    // exact sizes, the routines keep the only copy of the instructions
+    vector<size_t> sizes(m_routines.size(), 0);
+    for (const IL_Instruction& il : ils) {
+        size_t id = routine_ids[il.function];
+        if (id != SIZE_MAX && il.type != IL_TYPE_DECLARE_VARIABLE && il.type != IL_TYPE_DECLARE_FUNCTION) {
+            ++sizes[id];
+        }
+    }
+
+    for (size_t i = 0; i < m_routines.size(); ++i) {
+        m_routines[i].insns.reserve(sizes[i]);
+    }
+
+    for (const IL_Instruction& il : ils) {
+        size_t id = routine_ids[il.function];
+        if (id == SIZE_MAX) {
+            continue;
+        }
+
+        if (il.type == IL_TYPE_DECLARE_VARIABLE) {
+            vars[id].push_back(il.operand);
+        }
+        else if (il.type != IL_TYPE_DECLARE_FUNCTION) {
+            m_routines[id].insns.push_back(il);
+        }
+    }
+
+    ils = vector<IL_Instruction>();
+
+    for (size_t i = 0; i < m_routines.size(); ++i) {
+        AsmRoutine& routine = m_routines[i];
+
+        for (uint32_t index : vars[i]) {
+            const DeclareVariable& var = m_il.getVariable(index);
+
+            AsmLocal local;
+            local.size = var.size / 8 * var.count;
+            local.type = (var.flags & VAR_FLAGS_IMMEDIATE) ? ASM_LOCAL_TYPE_IMMEDIATE : ASM_LOCAL_TYPE_NONE;
+            local.offset = AlignStack(routine.stack_size, local.size);
+            local.imm.b64 = 0;
+
+            switch (local.type) {
+                case ASM_LOCAL_TYPE_IMMEDIATE: {
+                    switch (var.size)  {
+                        case 8: local.imm.b8 = var.imm; break;
+                        case 16: local.imm.b16 = var.imm; break;
+                        case 32: local.imm.b32 = var.imm; break;
+                        case 64: local.imm.b64 = var.imm; break;
+                        default: CRASH("Unknown type size"); break;
                     }
 
-                    // write to var within the stack from gp0 (result)
-                    _mov(mem + " [rsp+" + to_string(ret_offset) + "]", gp0, data->ret->name);
-                }
+                } break;
+                default: break;
+            }
 
-            } break;
-            case IL_TYPE_RETURN: {
-                const FunctionReturn* data = &get<FunctionReturn>(insn->data);
+            routine.stack.emplace(index, local);
 
-                if (data->var != nullptr) {
-                    const DeclareVariable* var = data->var;
+            size_t diff = local.offset - routine.stack_size;
+            routine.stack_size += diff + local.size;
+        }
+    }
+}
 
-                    const string& gp0 = getGP0(var->size);
-                    const string& mem = getMemSize(var->size);
+void engine::Assembler::optimize() {
+    PassManager passes;
+    registerPasses(passes);
+    passes.run(PASS_STAGE_MACHINE);
+}
 
-                    if (!(var->flags & VAR_FLAGS_IMMEDIATE)) {
-                        const AsmLocal* var_stack = routine->stack.at(var);
+void engine::Assembler::registerPasses(PassManager& passes) {
+    passes.add("strip-stack", [this]() { return stripStack(); });
+    passes.add("layout", [this]() { return layout(); });
+    passes.add("align", [this]() { return alignEntries(); });
+}
 
-                        // calculate stack offset
-                        int64_t offset = var_stack->offset;
-                        if (var->flags & VAR_FLAGS_ARG) {
-                            offset += routine->stack_size + 8;
-                        }
+size_t engine::Assembler::stripStack() {
+    const vector<FunctionReturn>& returns = m_il.getReturns();
+    const vector<EQSet>& sets = m_il.getSets();
+    const vector<FunctionCall>& calls = m_il.getCalls();
+    const vector<uint32_t>& call_args = m_il.getCallArgs();
+    const vector<InlineAsm>& asms = m_il.getAsms();
+    const vector<AsmPart>& asm_parts = m_il.getAsmParts();
+
+    // Remove stack if no locals are used
+    size_t stripped = 0;
+    for (AsmRoutine& routine : m_routines) {
+        if (routine.stack.empty()) {
+            continue;
+        }
+
+        vector<const AsmLocal*> used_locals;
+        auto use = [&](uint32_t var) {
+            if (!(m_il.getVariable(var).flags & (VAR_FLAGS_IMMEDIATE | VAR_FLAGS_GLOBAL))) {
+                used_locals.push_back(&routine.stack.at(var));
+            }
+        };
 
-                        // read from var within the stack
-                        _mov(gp0, mem + " [rsp+" + to_string(offset) + "]", var->name);
+        for (const IL_Instruction& insn : routine.insns) {
+            switch (insn.type) {
+                case IL_TYPE_RETURN: {
+                    uint32_t var = returns[insn.operand].var;
+                    if (var != IL_NONE) {
+                        use(var);
+                    }
+                } break;
+                case IL_TYPE_EQ_SET: {
+                    const EQSet& data = sets[insn.operand];
+                    use(data.left);
+                    use(data.right);
+                } break;
+                case IL_TYPE_FUNC_CALL: {
+                    const FunctionCall& data = calls[insn.operand];
+                    if (data.ret != IL_NONE) {
+                        use(data.ret);
                     }
-                    else {
-                        // write to gp0 reg imm value
-                        _mov(gp0, to_string(IL::getImm(var->value)), var->name);
+
+                    for (uint32_t i = 0; i < data.arg_count; ++i) {
+                        use(call_args[data.first_arg + i]);
                     }
-                }
+                } break;
+                case IL_TYPE_EXPRESSION: {
+                    const Expression& expr = m_il.getExpressions()[insn.operand];
 
-                if (routine->stack_size > 0) {
-                    _add("rsp", to_string(routine->stack_size), "free locals");
-                } 
+                    vector<uint32_t> vars = { expr.target };
+                    m_il.getLeaves(expr.root, vars);
+                    if (expr.index != IL_NONE) {
+                        m_il.getLeaves(expr.index, vars);
+                    }
 
-                _ret();
-            } break;
-            default: break;
+                    for_each(vars.begin(), vars.end(), use);
+                } break;
+                case IL_TYPE_LOOP_BEGIN: {
+                    const Loop& loop = m_il.getLoops()[insn.operand];
+                    if (loop.type == LOOP_TYPE_COUNTED) {
+                        use(loop.counter);
+                        break;
+                    }
+
+                    vector<uint32_t> leaves;
+                    m_il.getLeaves(loop.cond, leaves);
+                    for_each(leaves.begin(), leaves.end(), use);
+                } break;
+                case IL_TYPE_INLINE_ASM: {
+                    const InlineAsm& data = asms[insn.operand];
+                    for (uint32_t i = 0; i < data.part_count; ++i) {
+                        const AsmPart& part = asm_parts[data.first_part + i];
+                        if (part.type == ASM_PART_VARIABLE) {
+                            use(part.value);
+                        }
+                    }
+                } break;
+                case IL_TYPE_MEMORY: {
+                    const MemoryOp& op = m_il.getMemoryOps()[insn.operand];
+                    use(op.dst);
+                    use(op.src);
+                    use(op.count);
+                } break;
+                default: break;
+            }
+        }
+
+        if (used_locals.empty() == true) {
+            routine.stack_size = 0;
+            routine.stack.clear();
+            ++stripped;
+        }
+    }
+
+    return stripped;
+}
+
+
+
+size_t engine::Assembler::layout() {
+    // Pettis-Hansen: every routine starts as a chain of its own and the two chains with the most calls
+    // between them are joined until no calls are left, oriented so the routines of the heaviest call
+    // end up next to each other. Calls are weighed by the profile, or without one each call site
+    // counts 8 times per loop around it.
+    struct ChainEdge {
+        uint64_t weight;
+        uint64_t heaviest;      // of the calls between two routines of the chains
+        uint32_t from;
+        uint32_t to;
+    };
+
+    const uint32_t count = m_routines.size();
+    unordered_map<string_view, uint32_t> ids;
+    vector<uint64_t> heat(count, 0);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        AsmRoutine& routine = m_routines[i];
+        ids.emplace(routine.name, i);
+
+        if (m_profile != nullptr) {
+            routine.cold = m_profile->getCount(Profile::getEntryName(routine.name), heat[i]) && heat[i] == 0;
+        }
+    }
+
+    map<pair<uint32_t, uint32_t>, uint64_t> calls;
+    for (uint32_t i = 0; i < count; ++i) {
+        const AsmRoutine& routine = m_routines[i];
+        if (routine.cold) {
+            continue;
+        }
+
+        uint32_t depth = 0;
+        for (const IL_Instruction& insn : routine.insns) {
+            depth += insn.type == IL_TYPE_LOOP_BEGIN;
+            depth -= insn.type == IL_TYPE_LOOP_END;
+
+            if (insn.type != IL_TYPE_FUNC_CALL) {
+                continue;
+            }
+
+            string_view callee = m_il.getString(m_il.getFunction(m_il.getCalls()[insn.operand].callee).name);
+            auto it = ids.find(callee);
+            if (it == ids.end() || it->second == i || m_routines[it->second].cold) {
+                continue;
+            }
+
+            uint64_t weight = 1ull << (3 * min(depth, 6u));
+            if (m_profile != nullptr && m_profile->getCount(Profile::getCallName(routine.name, callee, insn.line), weight) == false) {
+                weight = 0;
+            }
+
+            if (weight > 0) {
+                calls[{ min(i, it->second), max(i, it->second) }] += weight;
+            }
+        }
+    }
+
+    vector<deque<uint32_t>> chains(count);
+    vector<uint32_t> owner(count);
+    vector<int64_t> position(count, 0);     // in the chain, only the order matters
+    vector<unordered_map<uint32_t, ChainEdge>> edges(count);
+    priority_queue<tuple<uint64_t, uint32_t, uint32_t>> queue;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        chains[i].push_back(i);
+        owner[i] = i;
+    }
+
+    for (const auto& [routines, weight] : calls) {
+        const auto [a, b] = routines;
+        edges[a][b] = { weight, weight, a, b };
+        edges[b][a] = { weight, weight, a, b };
+        queue.emplace(weight, a, b);
+    }
+
+    while (queue.empty() == false) {
+        const auto [weight, a, b] = queue.top();
+        queue.pop();
+
+        // entries of chains that were joined since are stale
+        auto edge = edges[a].find(b);
+        if (chains[a].empty() || chains[b].empty() || edge == edges[a].end() || edge->second.weight != weight) {
+            continue;
+        }
+
+        // the shorter chain goes to the end of the longer one its routine of the heaviest call is nearer to
+        const ChainEdge joined = edge->second;
+        const uint32_t big = chains[a].size() >= chains[b].size() ? a : b;
+        const uint32_t small = big == a ? b : a;
+        const uint32_t inner = owner[joined.from] == big ? joined.from : joined.to;
+        const uint32_t outer = inner == joined.from ? joined.to : joined.from;
+
+        deque<uint32_t>& into = chains[big];
+        deque<uint32_t>& from = chains[small];
+        const bool back = position[into.back()] - position[inner] <= position[inner] - position[into.front()];
+        const bool outer_first = position[outer] - position[from.front()] <= position[from.back()] - position[outer];
+
+        // appended, 'outer' comes first; prepended, it comes last
+        vector<uint32_t> moved(from.begin(), from.end());
+        if (outer_first != back) {
+            reverse(moved.begin(), moved.end());
+        }
+
+        if (back) {
+            for (uint32_t routine : moved) {
+                position[routine] = position[into.back()] + 1;
+                into.push_back(routine);
+            }
+        }
+        else {
+            for (auto it = moved.rbegin(); it != moved.rend(); ++it) {
+                position[*it] = position[into.front()] - 1;
+                into.push_front(*it);
+            }
+        }
+
+        for (uint32_t routine : moved) {
+            owner[routine] = big;
+        }
+
+        from.clear();
+        heat[big] += heat[small] + (m_profile == nullptr ? weight : 0);
+
+        // the calls of both chains to a third one add up
+        edges[big].erase(small);
+        for (const auto& [other, other_edge] : edges[small]) {
+            if (other == big) {
+                continue;
             }
+
+            ChainEdge& sum = edges[big].try_emplace(other, ChainEdge{ 0, 0, 0, 0 }).first->second;
+            sum.weight += other_edge.weight;
+            if (other_edge.heaviest > sum.heaviest) {
+                sum.heaviest = other_edge.heaviest;
+                sum.from = other_edge.from;
+                sum.to = other_edge.to;
+            }
+
+            edges[other].erase(small);
+            edges[other][big] = sum;
+            queue.emplace(sum.weight, min(big, other), max(big, other));
         }
+
+        edges[small].clear();
     }
 
+    // hottest chains first, by entry counts with a profile and by the calls inside them without,
+    // ties keep the source order of their first routine. Cold routines follow in source order.
+    vector<uint32_t> order;
+    for (uint32_t i = 0; i < count; ++i) {
+        if (chains[i].empty() == false && m_routines[i].cold == false) {
+            order.push_back(i);
+        }
+    }
+
+    stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return heat[a] > heat[b];
+    });
+
+    vector<AsmRoutine> routines;
+    size_t moved = 0;
+    routines.reserve(count);
+
+    for (uint32_t chain : order) {
+        for (uint32_t routine : chains[chain]) {
+            moved += routine != routines.size();
+            routines.push_back(move(m_routines[routine]));
+        }
+    }
+
+    for (uint32_t i = 0; i < count; ++i) {
+        if (m_routines[i].cold) {
+            moved += i != routines.size();
+            routines.push_back(move(m_routines[i]));
+        }
+    }
+
+    m_routines = move(routines);
+    return moved;
+}
+
+size_t engine::Assembler::alignEntries() {
+    // cold code stays unaligned, it is out of the way and padding would only cost space
+    size_t aligned = 0;
+    for (AsmRoutine& routine : m_routines) {
+        if (routine.cold == false && m_alignment > 1) {
+            routine.alignment = m_alignment;
+            ++aligned;
+        }
+    }
+
+    return aligned;
+}
+
+void engine::Assembler::assemble() {
+    bool cold = false;
+    for (const AsmRoutine& routine : m_routines) {
+        if (routine.cold && cold == false) {
+            section(COLD_SECTION);
+            cold = true;
+        }
+
+        if (routine.alignment > 1) {
+            _align(routine.alignment);
+        }
+
+        // typed and sized symbols let profilers attribute samples to the routine, '.end' closes it
+        if (m_source.empty() == false) {
+            global(routine.name + ":function " + routine.name + ".end-" + routine.name);
+        }
+
+        line(routine.line);
+
+        // create a label for the function
+        label(routine.name);
+
+        if (m_instrument) {
+            Count(Profile::getEntryName(routine.name));
+        }
+
+        // reserve stack for variables
+        if (routine.stack_size > 0) {
+            _sub("rsp", to_string(routine.stack_size), "reserve locals");
+        }
+
+        // match every loop's begin with its end once, so nested ranges are found without rescanning
+        vector<size_t> ends(routine.insns.size(), SIZE_MAX);
+        vector<size_t> open;
+        for (size_t i = 0; i < routine.insns.size(); ++i) {
+            if (routine.insns[i].type == IL_TYPE_LOOP_BEGIN) {
+                open.push_back(i);
+            }
+            else if (routine.insns[i].type == IL_TYPE_LOOP_END) {
+                ends[open.back()] = i;
+                open.pop_back();
+            }
+        }
+
+        // assemble instructions
+        AssembleRange(routine, 0, routine.insns.size(), ends);
+
+        if (m_source.empty() == false) {
+            label(".end");
+        }
+    }
+
+    // _start and the profile dump run once, after a cold routine they stay in its section
     global("_start", "for testing");
     label("_start");
-    _mov("rcx", "69"); 
-    _mov("rdx", "96"); 
+    _mov("rcx", to_string(TEST_IMAGE_HANDLE));
+    _mov("rdx", to_string(TEST_SYSTEM_TABLE));
     _push("rdx", "SystemTable");
     _push("rcx", "ImageHandle");
     _call("efi_main");
@@ -622,8 +1542,724 @@ void engine::Assembler::assemble() {
     _mov("rbx", "rax", "exit code");
     _mov("rax", "1", "sys_exit");
     _int("0x80");
+
+    if (m_instrument) {
+        AssembleProfile();
+    }
+
+    AssembleData();
+    m_routines = vector<AsmRoutine>();
+}
+
+void engine::Assembler::Count(const string& name) {
+    // every copy of a call site, e.g. in an unrolled loop, shares its counter
+    auto [it, inserted] = m_counter_ids.emplace(name, m_counters.size());
+    if (inserted) {
+        m_counters.push_back(name);
+    }
+
+    const size_t offset = sizeof(ProfileHeader) + it->second * sizeof(uint64_t);
+    _add("qword [rel " + string(PROFILE_SYMBOL) + "+" + to_string(offset) + "]", "1", name);
+}
+
+void engine::Assembler::AssembleProfile() {
+    size_t size = sizeof(ProfileHeader) + m_counters.size() * sizeof(uint64_t);
+    for (const string& name : m_counters) {
+        size += name.size() + 1;
+    }
+
+    // called like any routine, the buffer is the first argument
+    const string done = MakeLabel("done");
+    global(PROFILE_DUMP);
+    label(PROFILE_DUMP);
+    _mov("rax", to_string(size), "bytes");
+    _mov("rdi", "qword [rsp+8]", "buffer");
+    _test("rdi", "rdi");
+    _j("z", done);
+    _lea("rsi", "[rel " + string(PROFILE_SYMBOL) + "]");
+    _mov("rcx", "rax");
+    _rep("movsb");
+    label(done);
+    _ret();
+
+    section(".data");
+    _align(8);
+    global(PROFILE_SYMBOL);
+    label(PROFILE_SYMBOL);
+    _data("dd", to_string(PROFILE_MAGIC) + ", " + to_string(PROFILE_VERSION), "magic, version");
+    _data("dq", to_string(size) + ", " + to_string(m_counters.size()), "size, counters");
+
+    if (m_counters.empty() == false) {
+        _data("times " + to_string(m_counters.size()) + " dq", "0", "counters");
+    }
+
+    for (const string& name : m_counters) {
+        string bytes;
+        for (char c : name) {
+            bytes += to_string((uint8_t)c) + ", ";
+        }
+
+        _data("db", bytes + "0", name);
+    }
+}
+
+void engine::Assembler::AssembleData() {
+    // Initialized globals that no instruction writes are constant tables and go to .rodata next to the
+    // string literals, the other initialized ones to .data. The rest start zeroed in .bss and take no
+    // space in the file.
+    const vector<DeclareVariable>& variables = m_il.getVariables();
+    unordered_set<uint32_t> written;
+
+    for (const AsmRoutine& routine : m_routines) {
+        for (const IL_Instruction& insn : routine.insns) {
+            switch (insn.type) {
+                case IL_TYPE_EXPRESSION: written.insert(m_il.getExpressions()[insn.operand].target); break;
+                case IL_TYPE_EQ_SET: written.insert(m_il.getSets()[insn.operand].left); break;
+                case IL_TYPE_MEMORY: written.insert(m_il.getMemoryOps()[insn.operand].dst); break;
+                case IL_TYPE_FUNC_CALL: written.insert(m_il.getCalls()[insn.operand].ret); break;
+                case IL_TYPE_LOOP_BEGIN: written.insert(m_il.getLoops()[insn.operand].counter); break;
+                case IL_TYPE_INLINE_ASM: {
+                    const InlineAsm& data = m_il.getAsms()[insn.operand];
+                    for (uint32_t i = 0; i < data.part_count; ++i) {
+                        const AsmPart& part = m_il.getAsmParts()[data.first_part + i];
+                        if (part.type == ASM_PART_VARIABLE) {
+                            written.insert(part.value);
+                        }
+                    }
+                } break;
+                default: break;
+            }
+        }
+    }
+
+    vector<uint32_t> rodata;
+    vector<uint32_t> data;
+    vector<uint32_t> bss;
+
+    for (uint32_t i = 0; i < variables.size(); ++i) {
+        if (!(variables[i].flags & VAR_FLAGS_GLOBAL)) {
+            continue;
+        }
+
+        if (variables[i].value == IL_NONE) {
+            bss.push_back(i);
+        }
+        else {
+            (written.contains(i) ? data : rodata).push_back(i);
+        }
+    }
+
+    // string globals point into the pool, which has to be complete before it is written
+    for (uint32_t var : rodata) {
+        if (variables[var].type == DATA_TYPE_STR) {
+            (void)GetLiteral(variables[var].value);
+        }
+    }
+
+    for (uint32_t var : data) {
+        if (variables[var].type == DATA_TYPE_STR) {
+            (void)GetLiteral(variables[var].value);
+        }
+    }
+
+    if (m_pool.empty() == false || rodata.empty() == false) {
+        section(".rodata");
+    }
+
+    for (const auto& [name, text] : m_pool) {
+        string bytes;
+        for (char c : text) {
+            bytes += to_string((uint8_t)c) + ", ";
+        }
+
+        label(name);
+        _data("db", bytes + "0");
+    }
+
+    for (uint32_t var : rodata) {
+        AssembleGlobal(var);
+    }
+
+    if (data.empty() == false) {
+        section(".data");
+    }
+
+    for (uint32_t var : data) {
+        AssembleGlobal(var);
+    }
+
+    if (bss.empty() == false) {
+        section(".bss");
+    }
+
+    for (uint32_t var : bss) {
+        const DeclareVariable& global = variables[var];
+
+        _align(global.flags & VAR_FLAGS_ARRAY ? 16 : global.size / 8);
+        label(GetName(var));
+        _resb(global.size / 8 * global.count);
+    }
+}
+
+void engine::Assembler::AssembleGlobal(uint32_t var) {
+    // arrays are 16 byte aligned for the packed loops, elements past the initializer are zero
+    const DeclareVariable& global = m_il.getVariable(var);
+    const size_t width = global.size / 8;
+    const string directive = width == 1 ? "db" : width == 2 ? "dw" : width == 4 ? "dd" : "dq";
+
+    _align(global.flags & VAR_FLAGS_ARRAY ? 16 : width);
+    label(GetName(var));
+
+    if (global.type == DATA_TYPE_STR) {
+        _data("dq", GetLiteral(global.value));
+        return;
+    }
+
+    string_view bytes = m_il.getString(global.value);
+    const size_t count = bytes.size() / width;
+
+    for (size_t first = 0; first < count; first += 16) {
+        string values;
+        for (size_t i = first; i < min<size_t>(count, first + 16); ++i) {
+            uint64_t value = 0;
+            for (size_t b = 0; b < width; ++b) {
+                value |= (uint64_t)(uint8_t)bytes[i * width + b] << (b * 8);
+            }
+
+            values += (values.empty() ? "" : ", ") + to_string(value);
+        }
+
+        _data(directive, values);
+    }
+
+    if (count < global.count) {
+        _data("times " + to_string((global.count - count) * width), "db 0");
+    }
+}
+
+
+void engine::Assembler::AssembleRange(const AsmRoutine& routine, size_t begin, size_t end, const vector<size_t>& ends) {
+    for (size_t i = begin; i < end; ++i) {
+        line(routine.insns[i].line);
+
+        if (routine.insns[i].type == IL_TYPE_LOOP_BEGIN) {
+            AssembleLoop(routine, i, ends[i], ends);
+            i = ends[i];
+        }
+        else {
+            AssembleInstruction(routine, routine.insns[i]);
+        }
+    }
+}
+
+void engine::Assembler::AssembleInstruction(const AsmRoutine& routine, const IL_Instruction& insn) {
+    const vector<FunctionReturn>& returns = m_il.getReturns();
+    const vector<EQSet>& sets = m_il.getSets();
+    const vector<FunctionCall>& calls = m_il.getCalls();
+    const vector<uint32_t>& call_args = m_il.getCallArgs();
+    const vector<InlineAsm>& asms = m_il.getAsms();
+    const vector<AsmPart>& asm_parts = m_il.getAsmParts();
+    const vector<Expression>& exprs = m_il.getExpressions();
+
+    switch (insn.type)
+    {
+    case IL_TYPE_INLINE_ASM: {
+        const InlineAsm& data = asms[insn.operand];
+
+        string code;
+        for (uint32_t i = 0; i < data.part_count; ++i) {
+            const AsmPart& part = asm_parts[data.first_part + i];
+
+            switch (part.type) {
+                case ASM_PART_TEXT: code += m_il.getString(part.value); break;
+                case ASM_PART_STACK_SIZE: code += to_string(routine.stack_size) + " ; @stack_size"; break;
+                case ASM_PART_VARIABLE: code += GetAddress(routine, part.value); break;
+                default: break;
+            }
+        }
+
+        insert(code, "Inlined assembly");
+    } break;
+    case IL_TYPE_EXPRESSION: {
+        LowerExpression(routine, exprs[insn.operand]);
+    } break;
+    case IL_TYPE_MEMORY: {
+        LowerMemory(routine, m_il.getMemoryOps()[insn.operand]);
+    } break;
+    case IL_TYPE_EQ_SET: {
+        const EQSet& data = sets[insn.operand];
+
+        const DeclareVariable& left = m_il.getVariable(data.left);
+        const DeclareVariable& right = m_il.getVariable(data.right);
+        const string left_name = GetName(data.left);
+        const string right_name = GetName(data.right);
+
+        const string& left_mem = getMemSize(left.size);
+        const string& right_mem = getMemSize(right.size);
+        const string& left_gp0 = getGP0(left.size);
+
+        if (data.type != SET_TYPE_SHIFTL && data.type != SET_TYPE_SHIFTR) {
+            LoadWidened(routine, data.right, left.size);
+        }
+
+        const string left_ref = GetSlot(routine, data.left);
+
+        switch (data.type) {
+            case SET_TYPE_DIRECT: {
+                _mov(left_ref, left_gp0, left_name);
+            } break;
+            case SET_TYPE_ADD: {
+                _add(left_ref, left_gp0, left_name);
+            } break;
+            case SET_TYPE_SUB: {
+                _sub(left_ref, left_gp0, left_name);
+            } break;
+            case SET_TYPE_XOR: {
+                _xor(left_ref, left_gp0, left_name);
+            } break;
+            case SET_TYPE_OR: {
+                _or(left_ref, left_gp0, left_name);
+            } break;
+            case SET_TYPE_NOT: {
+                _not(left_ref, left_name);
+            } break;
+            case SET_TYPE_AND: {
+                _and(left_ref, left_gp0, left_name);
+            } break;
+            case SET_TYPE_SHIFTL: {
+                _shl(left_ref, to_string(right.imm), left_name);
+            } break;
+            case SET_TYPE_SHIFTR: {
+                _shr(left_ref, to_string(right.imm), left_name);
+            } break;
+            case SET_TYPE_MUL: {
+                _mov("rbx", "rax");
+                _mov(left_gp0, left_ref, left_name);
+                _mul("rbx", right_name);
+                _mov(left_ref, "rax", left_name);
+            } break;
+            case SET_TYPE_DIV: {
+                _mov("rbx", "rax");
+                _xor("rdx", "rdx");
+                _mov(left_gp0, left_ref, left_name);
+                _div("rbx", right_name);
+                _mov(left_ref, "rax", left_name);
+            } break;
+            case SET_TYPE_REM: {
+                _mov("rbx", "rax");
+                _xor("rdx", "rdx");
+                _mov(left_gp0, left_ref, left_name);
+                _div("rbx", right_name);
+                _mov(left_ref, "rdx", left_name);
+            } break;
+            default: break;
+        }
+    } break;
+    case IL_TYPE_FUNC_CALL: {
+        const FunctionCall& data = calls[insn.operand];
+        const DeclareFunction& callee = m_il.getFunction(data.callee);
+
+        // args go where the callee's own layout expects its parameters, the first one lowest and each
+        // widened to its parameter's size
+        vector<size_t> offsets;
+        size_t stack_size = 0;
+        for (uint32_t i = 0; i < data.arg_count; ++i) {
+            const DeclareVariable& param = m_il.getVariable(callee.first_arg + i);
+
+            offsets.push_back(AlignStack(stack_size, param.size / 8));
+            stack_size = offsets.back() + param.size / 8;
+        }
+
+        if (stack_size > 0) {
+            _sub("rsp", to_string(stack_size), "reserve args");
+        }
+
+        m_pushed += stack_size;
+        for (uint32_t i = 0; i < data.arg_count; ++i) {
+            const DeclareVariable& param = m_il.getVariable(callee.first_arg + i);
+
+            LoadWidened(routine, call_args[data.first_arg + i], param.size);
+            _mov(getMemSize(param.size) + " [rsp+" + to_string(offsets[i]) + "]", getGP0(param.size), GetName(callee.first_arg + i));
+        }
+
+        m_pushed -= stack_size;
+
+        if (m_instrument) {
+            Count(Profile::getCallName(routine.name, m_il.getString(callee.name), insn.line));
+        }
+
+        _call(string(m_il.getString(callee.name)));
+
+        if (stack_size > 0) {
+            _add("rsp", to_string(stack_size), "free args");
+        }
+
+        if (data.ret != IL_NONE) {
+            const DeclareVariable& ret = m_il.getVariable(data.ret);
+
+            size_t ret_size = DATA_TYPE_SIZES.at(ret.type);
+            const string& mem = getMemSize(ret_size);
+            const string& gp0 = getGP0(ret_size);
+
+            // write to var from gp0 (result)
+            _mov(mem + " [" + GetAddress(routine, data.ret) + "]", gp0, GetName(data.ret));
+        }
+
+    } break;
+    case IL_TYPE_RETURN: {
+        const FunctionReturn& data = returns[insn.operand];
+
+        // the whole of rax is the result, callers keep as many bits of it as their variable has
+        if (data.var != IL_NONE) {
+            LoadWidened(routine, data.var, 64);
+        }
+
+        if (routine.stack_size > 0) {
+            _add("rsp", to_string(routine.stack_size), "free locals");
+        }
+
+        _ret();
+    } break;
+    default: break;
+    }
+}
+
+void engine::Assembler::AssembleLoop(const AsmRoutine& routine, size_t begin, size_t end, const vector<size_t>& ends) {
+    // Loops are rotated: the condition is checked once on entry and then at the bottom, so each iteration
+    // runs one conditional jump. Hoisted instructions sit between the entry check and the loop label.
+    const Loop& loop = m_il.getLoops()[routine.insns[begin].operand];
+    const size_t body = begin + 1 + loop.hoisted;
+    const string top = MakeLabel("loop");
+    const string done = MakeLabel("done");
+
+    if (loop.type == LOOP_TYPE_WHILE) {
+        LowerBranch(routine, loop.cond, false, done);
+        AssembleRange(routine, begin + 1, body, ends);
+
+        label(top);
+        AssembleRange(routine, body, end, ends);
+        line(routine.insns[begin].line);
+        LowerBranch(routine, loop.cond, true, top);
+        label(done);
+        return;
+    }
+
+    const DeclareVariable& counter = m_il.getVariable(loop.counter);
+    const DeclareVariable& start = m_il.getVariable(loop.start);
+    const DeclareVariable& last = m_il.getVariable(loop.end);
+    const bool is_signed = IL::isSigned(counter.type);
+    const string below = is_signed ? "l" : "b";
+
+    LoadVariable(routine, 0, loop.start);
+    _mov(GetSlot(routine, loop.counter), GetRegister(EXPR_REGISTERS[0], counter.size), GetName(loop.counter));
+
+    // with constant bounds the trip count is known and the entry check is resolved here
+    const bool constant = (start.flags & VAR_FLAGS_IMMEDIATE) && (last.flags & VAR_FLAGS_IMMEDIATE);
+    const uint64_t trips = constant && last.imm > start.imm ? last.imm - start.imm : 0;
+    if (constant && trips == 0) {
+        return;
+    }
+
+    if (constant == false) {
+        _cmp(EXPR_REGISTERS[0].r64, GetOperand(routine, loop.end, true));
+        _j(is_signed ? "ge" : "ae", done);
+    }
+
+    AssembleRange(routine, begin + 1, body, ends);
+
+    // whole vectors first, the scalar loop below finishes the elements that are left
+    if (loop.lanes > 1) {
+        line(routine.insns[begin].line);
+        AssemblePacked(routine, loop, body, end);
+
+        if (constant) {
+            for (uint64_t i = 0; i < trips % loop.lanes; ++i) {
+                AssembleRange(routine, body, end, ends);
+                StepCounter(routine, routine.insns[begin]);
+            }
+
+            label(done);
+            return;
+        }
+
+        line(routine.insns[begin].line);
+        LoadVariable(routine, 0, loop.counter);
+        _cmp(EXPR_REGISTERS[0].r64, GetOperand(routine, loop.end, true));
+        _j(is_signed ? "ge" : "ae", done);
+    }
+
+    // an unrolled loop runs the remainder first, then whole groups of 'unroll' copies
+    size_t copies = 1;
+    if (loop.unroll > 1) {
+        copies = loop.unroll;
+
+        for (uint64_t i = 0; i < trips % copies; ++i) {
+            AssembleRange(routine, body, end, ends);
+            StepCounter(routine, routine.insns[begin]);
+        }
+
+        if (trips < copies) {
+            label(done);
+            return;
+        }
+    }
+
+    // a single group is straight line code
+    const bool once = constant && trips / copies == 1;
+    if (once == false) {
+        label(top);
+    }
+
+    for (size_t i = 0; i < copies; ++i) {
+        AssembleRange(routine, body, end, ends);
+        StepCounter(routine, routine.insns[begin]);
+    }
+
+    if (once == false) {
+        line(routine.insns[begin].line);
+        LoadVariable(routine, 0, loop.counter);
+        _cmp(EXPR_REGISTERS[0].r64, GetOperand(routine, loop.end, true));
+        _j(below, top);
+    }
+
+    label(done);
+}
+
+void engine::Assembler::AssemblePacked(const AsmRoutine& routine, const Loop& loop, size_t begin, size_t end) {
+    // The counter lives in rcx and the end in rdx. Values that are the same in every lane are broadcast
+    // into xmm8 and up before the loop, accumulators take the registers after them and statements are
+    // evaluated in xmm0-xmm7. See IL::VectorizeLoop for what qualifies.
+    const vector<Expression>& exprs = m_il.getExpressions();
+    const vector<ExprNode>& nodes = m_il.getExprNodes();
+    const DeclareVariable& counter = m_il.getVariable(loop.counter);
+    const bool is_signed = IL::isSigned(counter.type);
+    const uint8_t size = 128 / loop.lanes;
+    const string lanes = to_string(loop.lanes);
+    const string next = "[rcx+" + lanes + "]";
+
+    vector<uint32_t> leaves;
+    vector<pair<uint32_t, ExprOp>> accumulators;
+
+    for (size_t i = begin; i < end; ++i) {
+        const Expression& expr = exprs[routine.insns[i].operand];
+
+        if (m_il.getVariable(expr.target).flags & VAR_FLAGS_ARRAY) {
+            m_il.getLeaves(expr.root, leaves);
+        }
+        else {
+            accumulators.push_back({ expr.target, nodes[expr.root].op });
+            m_il.getLeaves(nodes[expr.root].right, leaves);
+        }
+    }
+
+    m_broadcasts.clear();
+    size_t xmm = 8;
+
+    for (uint32_t var : leaves) {
+        if (var == loop.counter || (m_il.getVariable(var).flags & VAR_FLAGS_ARRAY) || m_broadcasts.contains(var)) {
+            continue;
+        }
+
+        m_broadcasts.emplace(var, GetXmm(xmm++));
+        LoadVariable(routine, EXPR_REGISTER_COUNT, var);
+        Broadcast(m_broadcasts.at(var), size);
+    }
+
+    vector<string> sums;
+    for (const auto& [var, op] : accumulators) {
+        sums.push_back(GetXmm(xmm++));
+        _packed(op == EXPR_OP_AND ? "pcmpeqd" : "pxor", sums.back(), sums.back(), GetName(var));
+    }
+
+    LoadVariable(routine, EXPR_REGISTER_COUNT, loop.end);
+    _mov("rdx", SCRATCH_REGISTER.r64);
+    LoadVariable(routine, EXPR_REGISTER_COUNT, loop.counter);
+
+    const string top = MakeLabel("packed");
+    const string done = MakeLabel("packed_done");
+
+    _lea("rax", next);
+    _cmp("rax", "rdx");
+    _j(is_signed ? "g" : "a", done);
+
+    label(top);
+    size_t sum = 0;
+
+    for (size_t i = begin; i < end; ++i) {
+        const Expression& expr = exprs[routine.insns[i].operand];
+
+        if (m_il.getVariable(expr.target).flags & VAR_FLAGS_ARRAY) {
+            LowerPacked(routine, expr.root, 0, size);
+            _packed("movdqu", GetElement(routine, expr.target, SCRATCH_REGISTER.r64, "rax"), GetXmm(0), GetName(expr.target));
+        }
+        else {
+            LowerPacked(routine, nodes[expr.root].right, 0, size);
+            _packed(GetPackedOp(nodes[expr.root].op, size), sums[sum++], GetXmm(0), GetName(expr.target));
+        }
+    }
+
+    _add(SCRATCH_REGISTER.r64, lanes);
+    _lea("rax", next);
+    _cmp("rax", "rdx");
+    _j(is_signed ? "le" : "be", top);
+    label(done);
+
+    _mov(GetSlot(routine, loop.counter), GetRegister(SCRATCH_REGISTER, counter.size), GetName(loop.counter));
+
+    // fold each accumulator's lanes and merge them into the scalar
+    for (size_t i = 0; i < accumulators.size(); ++i) {
+        const auto& [var, op] = accumulators[i];
+        const string slot = GetSlot(routine, var);
+        const string src = GetRegister(SCRATCH_REGISTER, m_il.getVariable(var).size);
+
+        ReduceLanes(sums[i], op, size);
+        switch (op) {
+            case EXPR_OP_ADD: _add(slot, src, GetName(var)); break;
+            case EXPR_OP_XOR: _xor(slot, src, GetName(var)); break;
+            case EXPR_OP_OR: _or(slot, src, GetName(var)); break;
+            default: _and(slot, src, GetName(var)); break;
+        }
+    }
+}
+
+void engine::Assembler::LowerPacked(const AsmRoutine& routine, uint32_t node, size_t reg, uint8_t size) {
+    const ExprNode& expr = m_il.getExprNodes()[node];
+    const string dst = GetXmm(reg);
+    const string next = GetXmm(reg + 1);
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: {
+            _packed("movdqa", dst, m_broadcasts.at(expr.left), GetName(expr.left));
+        } break;
+        case EXPR_OP_INDEX: {
+            // legacy sse memory operands must be aligned, elements are loaded with movdqu instead
+            _packed("movdqu", dst, GetElement(routine, expr.left, SCRATCH_REGISTER.r64, "rax"), GetName(expr.left));
+        } break;
+        case EXPR_OP_NOT: {
+            LowerPacked(routine, expr.left, reg, size);
+            _packed("pcmpeqd", next, next);
+            _packed("pxor", dst, next);
+        } break;
+        case EXPR_OP_NEG: {
+            LowerPacked(routine, expr.left, reg, size);
+            _packed("pxor", next, next);
+            _packed(GetPackedOp(EXPR_OP_SUB, size), next, dst);
+            _packed("movdqa", dst, next);
+        } break;
+        default: {
+            // broadcasts are used in place
+            const ExprNode& right = m_il.getExprNodes()[expr.right];
+
+            LowerPacked(routine, expr.left, reg, size);
+            if (right.op == EXPR_OP_LEAF) {
+                _packed(GetPackedOp(expr.op, size), dst, m_broadcasts.at(right.left), GetName(right.left));
+                break;
+            }
+
+            LowerPacked(routine, expr.right, reg + 1, size);
+            _packed(GetPackedOp(expr.op, size), dst, next);
+        } break;
+    }
+}
+
+void engine::Assembler::Broadcast(const string& dst, uint8_t size) {
+    // copies the low 'size' bits of rcx into every lane of 'dst'
+    if (size == 64) {
+        _packed("movq", dst, SCRATCH_REGISTER.r64);
+        _packed("punpcklqdq", dst, dst);
+        return;
+    }
+
+    _packed("movd", dst, SCRATCH_REGISTER.r32);
+    if (size == 8) {
+        _packed("punpcklbw", dst, dst);
+    }
+
+    if (size <= 16) {
+        _pshuflw(dst, dst, "0");
+    }
+
+    _pshufd(dst, dst, "0");
+}
+
+void engine::Assembler::ReduceLanes(const string& src, ExprOp op, uint8_t size) {
+    // halves are folded onto each other until the first lane holds the result, which ends up in rcx
+    const string temp = GetXmm(7);
+    const string packed = GetPackedOp(op, size);
+
+    _pshufd(temp, src, "0x4E");
+    _packed(packed, src, temp);
+
+    if (size <= 32) {
+        _pshufd(temp, src, "0xB1");
+        _packed(packed, src, temp);
+    }
+
+    if (size <= 16) {
+        _packed("movdqa", temp, src);
+        _packed("psrld", temp, "16");
+        _packed(packed, src, temp);
+    }
+
+    if (size <= 8) {
+        _packed("movdqa", temp, src);
+        _packed("psrlw", temp, "8");
+        _packed(packed, src, temp);
+    }
+
+    _packed("movq", SCRATCH_REGISTER.r64, src);
 }
 
+void engine::Assembler::StepCounter(const AsmRoutine& routine, const IL_Instruction& insn) {
+    const Loop& loop = m_il.getLoops()[insn.operand];
+
+    line(insn.line);
+    _add(GetSlot(routine, loop.counter), "1", GetName(loop.counter));
+}
+
+void engine::Assembler::LowerBranch(const AsmRoutine& routine, uint32_t cond, bool when, const string& target) {
+    // jumps to 'target' when the condition is 'when', a comparison at the root feeds the jump directly
+    const vector<ExprNode>& nodes = m_il.getExprNodes();
+    const ExprNode& expr = nodes[cond];
+
+    if (IL::isComparison(expr.op) == false) {
+        LowerNode(routine, cond, 0);
+        _test(EXPR_REGISTERS[0].r64, EXPR_REGISTERS[0].r64);
+        _j(when ? "nz" : "z", target);
+        return;
+    }
+
+    const ExprNode& right = nodes[expr.right];
+    string src = EXPR_REGISTERS[1].r64;
+
+    LowerNode(routine, expr.left, 0);
+    if (right.op == EXPR_OP_LEAF) {
+        src = GetOperand(routine, right.left, true);
+    }
+    else {
+        LowerNode(routine, expr.right, 1);
+    }
+
+    ExprOp op = when ? expr.op : GetInverse(expr.op);
+    _cmp(EXPR_REGISTERS[0].r64, src);
+    _j(GetConditionCode(op, expr.is_signed), target);
+}
+
+string engine::Assembler::MakeLabel(const string& name) {
+    return "." + name + "_" + to_string(m_labels++);
+}
+
+const string& engine::Assembler::getOutput() const {
+    return m_output;
+}
+
+string engine::Assembler::takeOutput() {
+    return move(m_output);
+}
+
+span<engine::AsmRoutine> engine::Assembler::getRoutines() {
+    return m_routines;
+}
 
 void engine::Assembler::create(const string& filename) const {
     io::File file(filename);
@@ -3,15 +3,25 @@
 
 #include "engine.hpp"
 #include "il.hpp"
+#include "profile.hpp"
+#include "passes.hpp"
 
 #include <unordered_map>
 #include <string>
 #include <vector>
 #include <map>
+#include <span>
 
 using namespace std;
 
 namespace engine {
+    // what _start passes efi_main when the output is linked for testing
+    constexpr uint64_t TEST_IMAGE_HANDLE = 69;
+    constexpr uint64_t TEST_SYSTEM_TABLE = 96;
+
+    // routines the profile saw entered zero times, and what follows them, go here
+    constexpr const char* COLD_SECTION = ".text.cold progbits alloc exec nowrite align=16";
+
     enum AsmLocalType {
         ASM_LOCAL_TYPE_NONE = 0,
         ASM_LOCAL_TYPE_IMMEDIATE
@@ -20,7 +30,7 @@ namespace engine {
     struct AsmLocal {
         AsmLocalType type;
         int64_t offset;
-        uint8_t size;
+        uint32_t size;          // bytes
         
         union {
             uint8_t b8;
@@ -32,25 +42,58 @@ namespace engine {
 
     struct AsmRoutine {
         string name;
+        uint32_t function;
         size_t stack_size;
-        unordered_map<const DeclareVariable*, const AsmLocal*> stack; 
-        vector<const IL_Instruction*> insns; 
+        uint32_t line;                              // of the function's declaration
+        bool cold;                                  // never ran according to the profile
+        size_t alignment;                           // of its entry
+        unordered_map<uint32_t, AsmLocal> stack;    // variable -> slot
+        vector<IL_Instruction> insns; 
     };
     
     class Assembler {
         public:
 
-            Assembler();
-            Assembler(const vector<const IL_Instruction*>& ils);
+            Assembler(const IL& il);
             ~Assembler();
 
-            void translate();
+            // symbol types and sizes and %line markers back to 'source', call before assemble()
+            void enableDebugInfo(const string& source);
+
+            // entry and call site counters with a routine to dump them, see profile.hpp
+            void enableInstrumentation();
+
+            // call counts weigh the layout and unused routines move to COLD_SECTION, 'profile' has to
+            // outlive the Assembler
+            void useProfile(const Profile& profile);
+
+            // bytes the align pass aligns hot routines' entries to, 1 disables
+            void setFunctionAlignment(size_t alignment);
+
+            // 'ils' are the IL's instructions, see IL::takeILs(). The routines own them from here.
+            void translate(vector<IL_Instruction>&& ils);
+
+            // every machine pass at -O2, see passes.hpp
             void optimize();
+            void registerPasses(PassManager& passes);
+
+            // the passes, each returns how many routines it changed
+            size_t stripStack();
+            size_t layout();
+            size_t alignEntries();
+
+            // consumes the routines, only the output is left
             void assemble();
             void create(const string& filename) const;
+
+            [[nodiscard]] const string& getOutput() const;
+            [[nodiscard]] string takeOutput();
+            [[nodiscard]] span<AsmRoutine> getRoutines();
             
         private:
             void global(const string& name, const string& comment = "");
+            void section(const string& name);
+            void line(uint32_t number);
             void label(const string& name, const string& comment = "");
             void _add(const string& dst, const string& src, const string& comment = "");
             void _sub(const string& dst, const string& src, const string& comment = "");
@@ -62,22 +105,90 @@ namespace engine {
             void _shl(const string& dst, const string& src, const string& comment = "");
             void _div(const string& src, const string& comment = "");
             void _mul(const string& src, const string& comment = "");
+            void _imul(const string& dst, const string& src, const string& comment = "");
+            void _idiv(const string& src, const string& comment = "");
+            void _neg(const string& src, const string& comment = "");
+            void _sar(const string& dst, const string& src, const string& comment = "");
+            void _movzx(const string& dst, const string& src, const string& comment = "");
+            void _movsx(const string& dst, const string& src, const string& comment = "");
+            void _movsxd(const string& dst, const string& src, const string& comment = "");
+            void _cqo(const string& comment = "");
+            void _cmp(const string& dst, const string& src, const string& comment = "");
+            void _test(const string& dst, const string& src, const string& comment = "");
+            void _set(const string& cc, const string& dst, const string& comment = "");
+            void _cmov(const string& cc, const string& dst, const string& src, const string& comment = "");
+            void _lea(const string& dst, const string& src, const string& comment = "");
+            void _packed(const string& op, const string& dst, const string& src, const string& comment = "");
+            void _pshufd(const string& dst, const string& src, const string& order, const string& comment = "");
+            void _pshuflw(const string& dst, const string& src, const string& order, const string& comment = "");
+            void _rep(const string& op, const string& comment = "");
+            void _data(const string& directive, const string& values, const string& comment = "");
+            void _align(size_t alignment);
+            void _resb(size_t size, const string& comment = "");
             void insert(const string& code, const string& comment = "");
             void _mov(const string& dst, const string& src, const string& comment = "");
             void _push(const string& src, const string& comment = "");
             void _pop(const string& dst, const string& comment = "");
             void _call(const string& dst, const string& comment = "");
+            void _j(const string& cc, const string& dst, const string& comment = "");
             void _ret(const string& comment = "");
             void _int(const string& value, const string& comment = "");
 
             [[nodiscard]] static string getMemSize(size_t size);
             [[nodiscard]] static string getGP0(size_t size);
             [[nodiscard]] static size_t AlignStack(size_t offset, size_t size);
+            [[nodiscard]] int64_t GetOffset(const AsmRoutine& routine, uint32_t var) const;
+            [[nodiscard]] string GetName(uint32_t var) const;
+
+            void AssembleRange(const AsmRoutine& routine, size_t begin, size_t end, const vector<size_t>& ends);
+            void AssembleInstruction(const AsmRoutine& routine, const IL_Instruction& insn);
+            void AssembleLoop(const AsmRoutine& routine, size_t begin, size_t end, const vector<size_t>& ends);
+            void StepCounter(const AsmRoutine& routine, const IL_Instruction& insn);
+            void AssemblePacked(const AsmRoutine& routine, const Loop& loop, size_t begin, size_t end);
+            void LowerPacked(const AsmRoutine& routine, uint32_t node, size_t reg, uint8_t size);
+            void Broadcast(const string& dst, uint8_t size);
+            void ReduceLanes(const string& src, ExprOp op, uint8_t size);
+            void LowerBranch(const AsmRoutine& routine, uint32_t cond, bool when, const string& target);
+            [[nodiscard]] string MakeLabel(const string& name);
+            [[nodiscard]] string GetLiteral(uint32_t value);
+
+            void AssembleData();
+            void AssembleProfile();
+            void Count(const string& name);
+            void AssembleGlobal(uint32_t var);
+
+            void LowerMemory(const AsmRoutine& routine, const MemoryOp& op);
+            void LowerMemoryLoop(const AsmRoutine& routine, const MemoryOp& op, size_t scale);
+            void LowerExpression(const AsmRoutine& routine, const Expression& expr);
+            void LowerNode(const AsmRoutine& routine, uint32_t node, size_t reg);
+            void LowerSelect(const AsmRoutine& routine, const ExprNode& expr, size_t reg);
+            [[nodiscard]] bool MayFault(uint32_t node) const;
+            void LoadVariable(const AsmRoutine& routine, size_t reg, uint32_t var);
+            void LoadImmediate(const string& dst, uint32_t var);
+            void LoadWidened(const AsmRoutine& routine, uint32_t var, size_t size);
+            void LoadMemory(size_t reg, const string& mem, const DeclareVariable& data, const string& name);
+            void ApplyOperator(ExprOp op, size_t dst, const string& src, bool is_signed);
+            [[nodiscard]] string GetOperand(const AsmRoutine& routine, uint32_t var, bool allow_imm);
+            [[nodiscard]] string GetSlot(const AsmRoutine& routine, uint32_t var) const;
+            [[nodiscard]] string GetAddress(const AsmRoutine& routine, uint32_t var) const;
+            [[nodiscard]] string GetElement(const AsmRoutine& routine, uint32_t array, const string& index, const string& temp);
 
         private:
             string m_output;
-            vector<const IL_Instruction*> m_ils;
-            vector<AsmRoutine*> m_routines;
+            const IL& m_il;
+            vector<AsmRoutine> m_routines;
+            int64_t m_pushed;       // bytes pushed while lowering an expression, rsp relative slots move by it
+            size_t m_labels;        // local labels emitted so far, keeps loop labels unique
+            string m_source;        // file named by %line markers, none are emitted when empty
+            uint32_t m_line;        // of the last %line marker
+            bool m_instrument;
+            vector<string> m_counters;                      // names in the order of their counters
+            unordered_map<string, size_t> m_counter_ids;    // name -> index in m_counters
+            const Profile* m_profile;
+            size_t m_alignment;
+            unordered_map<uint32_t, string> m_broadcasts;   // variable -> xmm register, in the packed loop being lowered
+            unordered_map<string_view, string> m_literals;  // string literal -> label
+            map<string, string_view> m_pool;                // label -> contents of the .rodata strings
     };
 }
 
@@ -2,8 +2,38 @@
 #define HPP_ASSERT
 
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <cstdarg>
+#include <cstdio>
 
-#define CRASH(reason, ...) { printf("[%s:%d] " reason "\n", __FILE__, __LINE__, ##__VA_ARGS__); exit(EXIT_FAILURE); }
+using namespace std;
+
+namespace engine {
+    // What CRASH throws, the message starts with where it was raised. A failed compile only loses its own
+    // IL, assembler and JIT, so an embedder can report it and go on with the next one.
+    class Error : public runtime_error {
+        public:
+            using runtime_error::runtime_error;
+    };
+
+    [[noreturn]] __attribute__((format(printf, 1, 2))) inline void Fail(const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        va_list copy;
+        va_copy(copy, args);
+
+        string message(vsnprintf(nullptr, 0, format, copy), '\0');
+        va_end(copy);
+
+        vsnprintf(message.data(), message.size() + 1, format, args);
+        va_end(args);
+
+        throw Error(message);
+    }
+}
+
+#define CRASH(reason, ...) { engine::Fail("[%s:%d] " reason, __FILE__, __LINE__, ##__VA_ARGS__); }
 #define ASSERT(condition, reason, ...) if (!(condition)) CRASH(reason, ##__VA_ARGS__)
 
 #endif
\ No newline at end of file
@@ -3,6 +3,12 @@
 
 #include "tokenizer.hpp"
 #include "il.hpp"
+#include "interpreter.hpp"
 #include "assembler.hpp"
+#include "image.hpp"
+#include "profile.hpp"
+#include "passes.hpp"
+#include "jit.hpp"
+#include "session.hpp"
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+#include "hooks.hpp"
+#include "assert.hpp"
+
+#include <dlfcn.h>
+
+using namespace std;
+
+engine::Hooks::Hooks() {
+}
+
+engine::Hooks::~Hooks() {
+    // the hook's code goes away with its library
+    for (auto it = m_plugins.rbegin(); it != m_plugins.rend(); ++it) {
+        it->destroy(it->hook);
+        dlclose(it->handle);
+    }
+}
+
+const char* engine::Hooks::load(const string& path) {
+    // symbols are resolved now so a plugin missing part of the compiler fails here and not mid-compile
+    void* handle = dlopen(path.data(), RTLD_NOW | RTLD_LOCAL);
+    ASSERT(handle != nullptr, "Failed to load hook '%s': %s", path.data(), dlerror());
+
+    using Create = CompilerHook* (*)(uint32_t api_version);
+    using Destroy = void (*)(CompilerHook* hook);
+
+    Create create = (Create)dlsym(handle, HOOK_CREATE);
+    Destroy destroy = (Destroy)dlsym(handle, HOOK_DESTROY);
+    ASSERT(create != nullptr && destroy != nullptr, "'%s' doesn't export %s and %s", path.data(), HOOK_CREATE, HOOK_DESTROY);
+
+    CompilerHook* hook = create(HOOK_API_VERSION);
+    ASSERT(hook != nullptr, "'%s' doesn't support hook API version %u", path.data(), HOOK_API_VERSION);
+
+    m_plugins.push_back({ handle, hook, destroy });
+    return hook->getName();
+}
+
+bool engine::Hooks::empty() const {
+    return m_plugins.empty();
+}
+
+void engine::Hooks::run(HookPoint point, IL& il) const {
+    for (const Plugin& plugin : m_plugins) {
+        plugin.hook->onIL(point, il);
+    }
+}
+
+void engine::Hooks::run(HookPoint point, Assembler& assembler, const IL& il) const {
+    for (const Plugin& plugin : m_plugins) {
+        plugin.hook->onRoutines(point, assembler.getRoutines(), il);
+    }
+}
\ No newline at end of file
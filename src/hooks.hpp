@@ -0,0 +1,72 @@
+#ifndef HPP_HOOKS
+#define HPP_HOOKS
+
+#include "il.hpp"
+#include "assembler.hpp"
+
+#include <span>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    // Bumped whenever CompilerHook, the IL and AsmRoutine layouts or the points change, plugins built
+    // against another version are refused.
+    constexpr uint32_t HOOK_API_VERSION = 2;
+
+    // what a plugin exports with C linkage
+    constexpr const char* HOOK_CREATE = "lefix_hook_create";     // CompilerHook* (uint32_t api_version)
+    constexpr const char* HOOK_DESTROY = "lefix_hook_destroy";   // void (CompilerHook*)
+
+    enum HookPoint {
+        HOOK_POINT_ANALYZED = 0,    // IL from the front end or an image, before its passes
+        HOOK_POINT_OPTIMIZED,       // IL after its passes
+        HOOK_POINT_TRANSLATED,      // routines before the machine passes, they own the instructions from here
+        HOOK_POINT_LAID_OUT,        // routines in their final order, right before assembly
+        HOOK_POINT_COUNT
+    };
+
+    // A plugin's hook, called at every point of the pipeline. Instructions are edited in place, setting
+    // one to IL_TYPE_UNKNOWN drops it. Routines own their instructions and may be reordered and
+    // edited freely. Problems are reported with CRASH or ASSERT, which fail the compile.
+    class CompilerHook {
+        public:
+            virtual ~CompilerHook() = default;
+
+            [[nodiscard]] virtual const char* getName() const = 0;
+
+            virtual void onIL(HookPoint point, IL& il) { (void)point; (void)il; }
+            virtual void onRoutines(HookPoint point, span<AsmRoutine> routines, const IL& il) { (void)point; (void)routines; (void)il; }
+    };
+
+    // Loaded plugins, in the order they run. Nothing is called and nothing is copied when none are.
+    class Hooks {
+        public:
+            Hooks();
+            ~Hooks();
+
+            Hooks(const Hooks&) = delete;
+            Hooks& operator=(const Hooks&) = delete;
+
+            // dlopen()s 'path' and creates its hook, returns the hook's name
+            const char* load(const string& path);
+
+            [[nodiscard]] bool empty() const;
+
+            void run(HookPoint point, IL& il) const;
+            void run(HookPoint point, Assembler& assembler, const IL& il) const;
+
+        private:
+            struct Plugin {
+                void* handle;
+                CompilerHook* hook;
+                void (*destroy)(CompilerHook* hook);
+            };
+
+            vector<Plugin> m_plugins;
+    };
+}
+
+#endif
\ No newline at end of file
@@ -1,46 +1,268 @@
 #include "il.hpp"
+#include "image.hpp"
+#include "interpreter.hpp"
+#include "profile.hpp"
+#include "passes.hpp"
 #include <iostream>
-#include <random>
 #include "assert.hpp"
 #include <stdexcept>
 #include <charconv>
 #include <limits>
 #include <regex>
+#include <unordered_set>
+#include <map>
+#include <algorithm>
 
 using namespace std;
 
-engine::IL::IL(const vector<Token>& tokens) {
-    m_tokens = move(tokens);
+engine::IL::IL(vector<Token>&& tokens) : m_tokens(move(tokens)), m_next_id(0), m_line(0) {
 }
 
-engine::IL::~IL() {
-    for (const IL_Instruction* insn : m_ils) {
-        delete insn;
+engine::IL::IL(const ILImage& image) : m_next_id(0), m_line(0) {
+    // records are stored exactly as the image lays them out, loading is a copy per array
+    auto load = [](auto& dst, auto src) {
+        dst.assign(src.begin(), src.end());
+    };
+
+    load(m_ils, image.getInstructions());
+    load(m_functions, image.getFunctions());
+    load(m_variables, image.getVariables());
+    load(m_returns, image.getReturns());
+    load(m_sets, image.getSets());
+    load(m_calls, image.getCalls());
+    load(m_call_args, image.getCallArgs());
+    load(m_asms, image.getAsms());
+    load(m_asm_parts, image.getAsmParts());
+    load(m_exprs, image.getExpressions());
+    load(m_expr_nodes, image.getExprNodes());
+    load(m_loops, image.getLoops());
+    load(m_strings, image.getStrings());
+    load(m_kept, image.getKept());
+    load(m_memory_ops, image.getMemoryOps());
+    m_chars = image.getChars();
+
+    for (const ILString& str : m_strings) {
+        ASSERT((uint64_t)str.offset + str.size < m_chars.size() + 1, "IL image string out of bounds");
+    }
+
+    for (uint32_t i = 0; i < m_variables.size(); ++i) {
+        const DeclareVariable& var = m_variables[i];
+        ASSERT(var.name < m_strings.size() && (var.value == IL_NONE || var.value < m_strings.size()), "IL image variable out of bounds");
+
+        if (var.flags & VAR_FLAGS_GLOBAL) {
+            m_globals.emplace(getString(var.name), i);
+        }
+    }
+
+    for (const IL_Instruction& il : m_ils) {
+        ASSERT(il.function < m_functions.size(), "IL image references unknown function %u", il.function);
+
+        size_t count = 0;
+        switch (il.type) {
+            case IL_TYPE_DECLARE_FUNCTION: count = m_functions.size(); break;
+            case IL_TYPE_DECLARE_VARIABLE: count = m_variables.size(); break;
+            case IL_TYPE_RETURN: count = m_returns.size(); break;
+            case IL_TYPE_EQ_SET: count = m_sets.size(); break;
+            case IL_TYPE_FUNC_CALL: count = m_calls.size(); break;
+            case IL_TYPE_INLINE_ASM: count = m_asms.size(); break;
+            case IL_TYPE_EXPRESSION: count = m_exprs.size(); break;
+            case IL_TYPE_LOOP_BEGIN:
+            case IL_TYPE_LOOP_END: count = m_loops.size(); break;
+            case IL_TYPE_MEMORY: count = m_memory_ops.size(); break;
+            default: CRASH("Unknown IL type %u in IL image", il.type); break;
+        }
+
+        ASSERT(il.operand < count, "IL image operand out of bounds");
+        m_next_id = max(m_next_id, il.id + 1);
+    }
+
+    for (const InlineAsm& inline_asm : m_asms) {
+        ASSERT((uint64_t)inline_asm.first_part + inline_asm.part_count <= m_asm_parts.size(), "IL image asm parts out of bounds");
+    }
+
+    for (const AsmPart& part : m_asm_parts) {
+        switch (part.type) {
+            case ASM_PART_TEXT: ASSERT(part.value < m_strings.size(), "IL image asm text out of bounds"); break;
+            case ASM_PART_VARIABLE: ASSERT(part.value < m_variables.size(), "IL image asm variable out of bounds"); break;
+            case ASM_PART_STACK_SIZE: break;
+            default: CRASH("Unknown asm part type %u in IL image", part.type); break;
+        }
+    }
+
+    for (const Expression& expr : m_exprs) {
+        ASSERT(expr.target < m_variables.size() && expr.root < m_expr_nodes.size(), "IL image expression out of bounds");
+        ASSERT(expr.index == IL_NONE || expr.index < m_expr_nodes.size(), "IL image expression index out of bounds");
+    }
+
+    // children are always created before their parent, which also rules out cycles
+    for (size_t i = 0; i < m_expr_nodes.size(); ++i) {
+        const ExprNode& node = m_expr_nodes[i];
+        if (node.op == EXPR_OP_LEAF) {
+            ASSERT(node.left < m_variables.size(), "IL image expression variable out of bounds");
+        }
+        else if (node.op == EXPR_OP_INDEX) {
+            ASSERT(node.left < m_variables.size() && node.right < i, "IL image expression node %zu is invalid", i);
+        }
+        else {
+            ASSERT(node.op <= EXPR_OP_SELECT && node.left < i && (node.right == IL_NONE || node.right < i) && (node.other == IL_NONE || node.other < i), "IL image expression node %zu is invalid", i);
+        }
+    }
+
+    for (const Loop& loop : m_loops) {
+        if (loop.type == LOOP_TYPE_WHILE) {
+            ASSERT(loop.cond < m_expr_nodes.size(), "IL image loop condition out of bounds");
+        }
+        else {
+            ASSERT(loop.type == LOOP_TYPE_COUNTED, "Unknown loop type %u in IL image", loop.type);
+            ASSERT(loop.counter < m_variables.size() && loop.start < m_variables.size() && loop.end < m_variables.size(), "IL image loop out of bounds");
+        }
+    }
+
+    // the interpreter and the assembler pair every LOOP_BEGIN with its LOOP_END, so loops have to nest
+    // within one function and each end has to close the loop that is open
+    vector<size_t> open;
+    for (size_t i = 0; i < m_ils.size(); ++i) {
+        const IL_Instruction& il = m_ils[i];
+        ASSERT(open.empty() || m_ils[open.back()].function == il.function, "IL image loop %u isn't closed in its function", m_ils[open.back()].operand);
+
+        if (il.type == IL_TYPE_LOOP_BEGIN) {
+            open.push_back(i);
+        }
+        else if (il.type == IL_TYPE_LOOP_END) {
+            ASSERT(open.empty() == false && m_ils[open.back()].operand == il.operand, "IL image loop end %u doesn't match an open loop", il.operand);
+            ASSERT(m_loops[il.operand].hoisted < i - open.back(), "IL image loop %u hoists more than its body", il.operand);
+            open.pop_back();
+        }
+    }
+
+    ASSERT(open.empty(), "IL image loop %u isn't closed", open.empty() ? 0 : m_ils[open.back()].operand);
+
+    for (const MemoryOp& op : m_memory_ops) {
+        ASSERT(op.type <= MEMORY_OP_FILL, "Unknown memory op type %u in IL image", op.type);
+        ASSERT(op.dst < m_variables.size() && op.src < m_variables.size() && op.count < m_variables.size(), "IL image memory op out of bounds");
+    }
+
+    for (const FunctionCall& call : m_calls) {
+        ASSERT(call.callee < m_functions.size(), "IL image references unknown function %u", call.callee);
+        ASSERT((uint64_t)call.first_arg + call.arg_count <= m_call_args.size(), "IL image call args out of bounds");
     }
 }
 
+engine::IL::~IL() {
+}
+
 void engine::IL::analyze() {
-    DeclareFunction* function = nullptr;
-    
+    // declare every signature up front and remember where each body is, bodies are only analyzed once
+    // they are reachable from efi_main or a keep in a reachable body
+    size_t depth = 0;
+
+    // a body runs up to the next top level declaration
+    auto close = [&](size_t at) {
+        if (m_bodies.empty() == false && m_bodies.back().second == m_tokens.size()) {
+            m_bodies.back().second = at;
+        }
+    };
+
     for (size_t i = 0; i < m_tokens.size(); ++i) {
+        const Token& token = m_tokens[i];
+        if (token.type == TOKEN_TYPE_SCOPE_START) {
+            ++depth;
+        }
+        else if (token.type == TOKEN_TYPE_SCOPE_END && depth > 0) {
+            --depth;
+        }
+
+        if (token.type != TOKEN_TYPE_KEYWORD) {
+            continue;
+        }
+
+        if (token.value == "fn") {
+            m_line = token.line;
+            auto [il, size] = AnalyzeDeclareFunction(token);
+            close(i);
+            m_declarations.push_back(il);
+            m_bodies.push_back({ i + size, m_tokens.size() });
+
+            i += size - 1;
+        }
+        else if (depth == 0 && isDataType(token) == true) {
+            close(i);
+
+            auto [il, size] = AnalyzeDeclareVariable(IL_NONE, token);
+            i += size - 1;
+        }
+    }
+
+    vector<bool> queued(m_functions.size(), false);
+    vector<uint32_t> pending;
+
+    auto enqueue = [&](uint32_t function) {
+        if (function != IL_NONE && queued[function] == false) {
+            queued[function] = true;
+            pending.push_back(function);
+        }
+    };
+
+    // keeps name functions by the id of their declaration
+    unordered_map<uint64_t, uint32_t> declared;
+    for (uint32_t function = 0; function < m_declarations.size(); ++function) {
+        declared.emplace(m_declarations[function].id, function);
+    }
+
+    enqueue(FindFunction("efi_main"));
+
+    while (pending.empty() == false) {
+        uint32_t function = pending.back();
+        pending.pop_back();
+
+        size_t first_call = m_calls.size();
+        size_t first_kept = m_kept.size();
+        m_ils.push_back(m_declarations[function]);
+        AnalyzeBody(function, m_bodies[function].first, m_bodies[function].second);
+
+        for (size_t i = first_call; i < m_calls.size(); ++i) {
+            enqueue(m_calls[i].callee);
+        }
+
+        // the same roots removeDeadFunctions starts from
+        for (size_t i = first_kept; i < m_kept.size(); ++i) {
+            if (auto it = declared.find(m_kept[i]); it != declared.end()) {
+                enqueue(it->second);
+            }
+        }
+    }
+
+    // bodies were analyzed in discovery order, keep the output in source order
+    stable_sort(m_ils.begin(), m_ils.end(), [](const IL_Instruction& a, const IL_Instruction& b) {
+        return a.function < b.function;
+    });
+
+    // the tokens and lookups are only read by the analysis, the IL stands on its own from here
+    m_tokens = vector<Token>();
+    m_function_names = unordered_map<string, uint32_t>();
+    m_scopes = vector<unordered_map<string, uint32_t>>();
+    m_declarations = vector<IL_Instruction>();
+    m_bodies = vector<pair<size_t, size_t>>();
+    m_selects = unordered_map<uint32_t, uint32_t>();
+}
+
+void engine::IL::AnalyzeBody(uint32_t function, size_t begin, size_t end) {
+    vector<uint32_t> loops;     // open loops, each is closed by the next '}'
+
+    for (size_t i = begin; i < end; ++i) {
         const Token& token = m_tokens.at(i);
-       
+        m_line = token.line;
+
         switch (token.type) {
             case TOKEN_TYPE_KEYWORD: {
-                if (token.value == "fn") {
-                    auto [il, size] = AnalyzeDeclareFunction(token);
-                    function = (DeclareFunction*)&il->data;
-                    m_ils.push_back(il);
-                    i += size - 1;
-                }
-                else if (isDataType(token) == true) {
+                if (isDataType(token) == true) {
                     auto [il, size] = AnalyzeDeclareVariable(function, token);
                     m_ils.push_back(il);
                     i += size - 1;
                 }
                 else if (token.value == "ret") {
                     auto [ils, size] = AnalyzeReturn(function, token);
-                    for (const IL_Instruction* il : ils) {
+                    for (const IL_Instruction& il : ils) {
                         m_ils.push_back(il);
                     }
 
@@ -54,19 +276,42 @@ void engine::IL::analyze() {
 
                     i += size - 1;
                 }
+                else if (token.value == "while" || token.value == "for") {
+                    auto [il, size] = AnalyzeLoop(function, token);
+                    loops.push_back(il.operand);
+                    m_ils.push_back(il);
+                    i += size - 1;
+                }
+            } break;
+            case TOKEN_TYPE_SCOPE_END: {
+                if (loops.empty() == false) {
+                    m_ils.push_back(CreateIL(IL_TYPE_LOOP_END, function, loops.back()));
+                    loops.pop_back();
+                }
             } break;
             case TOKEN_TYPE_IDENTIFIER: {
                 if (Move(token, 1).type == TOKEN_TYPE_ARG_START) {
-                    ASSERT(FindFunction(token.value) != NULL, "Function '%s' not found", token.value.data());
-                    
+                    ASSERT(FindFunction(token.value) != IL_NONE, "Function '%s' not found", token.value.data());
+
                     auto [il, size] = AnalyzeCall(function, token);
                     m_ils.push_back(il);
                     i += size - 1;
                 }
+                else if (Move(token, 1).type == TOKEN_TYPE_INDEX_START) {
+                    auto [ils, size] = AnalyzeElementSet(function, token);
+                    for (const IL_Instruction& il : ils) {
+                        m_ils.push_back(il);
+                    }
+
+                    i += size - 1;
+                }
             } break;
             case TOKEN_TYPE_OPERATOR: {
-                auto [il, size] = AnalyzeOperator(function, token);
-                m_ils.push_back(il);
+                auto [ils, size] = AnalyzeOperator(function, token);
+                for (const IL_Instruction& il : ils) {
+                    m_ils.push_back(il);
+                }
+
                 i += size - 1;
             } break;
             case TOKEN_TYPE_MACRO: {
@@ -76,94 +321,1182 @@ void engine::IL::analyze() {
             } break;
             default: break;
         }
+    }
+
+    ASSERT(loops.empty(), "Expected '}' to close the loop within '%s'", getString(m_functions[function].name).data());
+}
+
+void engine::IL::optimize(uint32_t unroll, uint32_t budget, const Profile* profile) {
+    PassManager passes;
+    registerPasses(passes, unroll, budget, profile);
+    passes.run(PASS_STAGE_IL);
+}
+
+void engine::IL::registerPasses(PassManager& passes, uint32_t unroll, uint32_t budget, const Profile* profile) {
+    passes.add("specialize", [this, budget, profile]() { return specializeCalls(budget, profile); });
+    passes.add("fold-calls", [this]() { return foldCalls(); });
+    passes.add("dead-functions", [this]() { return removeDeadFunctions(); });
+    passes.add("hoist", [this]() { return hoistInvariants(); });
+    passes.add("vectorize", [this, profile]() { return vectorizeLoops(profile); });
+    passes.add("unroll", [this, unroll, profile]() { return unrollLoops(unroll, profile); });
+}
+
+size_t engine::IL::removeDeadFunctions() {
+    // remove every function that can't be reached from efi_main or a kept function
+    vector<vector<uint32_t>> callees(m_functions.size());
+    vector<uint32_t> pending;
+    vector<bool> used(m_functions.size(), false);
+    unordered_set<uint64_t> kept(m_kept.begin(), m_kept.end());
+
+    for (const IL_Instruction& il : m_ils) {
+        if (il.type == IL_TYPE_FUNC_CALL) {
+            callees[il.function].push_back(m_calls[il.operand].callee);
+        }
+        else if (il.type == IL_TYPE_DECLARE_FUNCTION) {
+            if (kept.contains(il.id) || getString(m_functions[il.operand].name) == "efi_main") {
+                used[il.operand] = true;
+                pending.push_back(il.operand);
+            }
+        }
+    }
+
+    while (pending.empty() == false) {
+        uint32_t function = pending.back();
+        pending.pop_back();
+
+        for (uint32_t callee : callees[function]) {
+            if (used[callee] == false) {
+                used[callee] = true;
+                pending.push_back(callee);
+            }
+        }
+    }
+
+    // variables, calls and the declaration itself all belong to their function
+    return erase_if(m_ils, [&](const IL_Instruction& il) {
+        return used[il.function] == false;
+    });
+}
+
+void engine::IL::ForEachLoop(const function<void(size_t, size_t)>& visit) const {
+    // a loop ends before the loop around it does, so inner loops are visited first. Instructions that
+    // only move inside their own loop leave the indices of the open loops valid.
+    vector<size_t> open;
+    for (size_t i = 0; i < m_ils.size(); ++i) {
+        if (m_ils[i].type == IL_TYPE_LOOP_BEGIN) {
+            open.push_back(i);
+        }
+        else if (m_ils[i].type == IL_TYPE_LOOP_END) {
+            ASSERT(open.empty() == false, "Unbalanced loop");
+
+            visit(open.back(), i);
+            open.pop_back();
+        }
+    }
+}
+
+vector<bool> engine::IL::GetCold(const Profile* profile) const {
+    // code that never ran isn't worth growing
+    vector<bool> cold(m_functions.size(), false);
+    if (profile != nullptr) {
+        for (uint32_t i = 0; i < m_functions.size(); ++i) {
+            uint64_t count = 0;
+            cold[i] = profile->getCount(Profile::getEntryName(getString(m_functions[i].name)), count) && count == 0;
+        }
+    }
+
+    return cold;
+}
+
+size_t engine::IL::hoistInvariants() {
+    size_t hoisted = 0;
+    ForEachLoop([&](size_t begin, size_t end) {
+        hoisted += HoistInvariants(begin, end);
+    });
+
+    return hoisted;
+}
+
+size_t engine::IL::vectorizeLoops(const Profile* profile) {
+    const vector<bool> cold = GetCold(profile);
+
+    size_t vectorized = 0;
+    ForEachLoop([&](size_t begin, size_t end) {
+        if (cold[m_ils[begin].function] == false) {
+            VectorizeLoop(begin, end);
+            vectorized += m_loops[m_ils[begin].operand].lanes > 1 ? end - begin - 1 : 0;
+        }
+    });
+
+    return vectorized;
+}
+
+size_t engine::IL::unrollLoops(uint32_t factor, const Profile* profile) {
+    const vector<bool> cold = GetCold(profile);
+
+    size_t unrolled = 0;
+    ForEachLoop([&](size_t begin, size_t end) {
+        if (cold[m_ils[begin].function] == false) {
+            UnrollLoop(begin, end, factor);
+            unrolled += m_loops[m_ils[begin].operand].unroll > 1 ? end - begin - 1 : 0;
+        }
+    });
+
+    return unrolled;
+}
+
+size_t engine::IL::specializeCalls(uint32_t budget, const Profile* profile) {
+    // A call that passes immediates to parameters its callee only reads gets a clone of the callee with
+    // those parameters replaced by the values, and whatever that makes constant in the clone is folded.
+    // Calls with the same constants share a clone and the calls a clone makes are specialized in turn,
+    // until the IL has grown by 'budget' percent. Callees left without calls are removed after this.
+    Interpreter interpreter(*this);
+    const vector<bool> cold = GetCold(profile);
+    const uint32_t known = m_functions.size();      // the interpreter knows nothing of clones
+
+    // clones are appended, which keeps every function's instructions together
+    vector<pair<size_t, size_t>> ranges(m_functions.size(), { 0, 0 });
+    for (size_t i = 0; i < m_ils.size(); ++i) {
+        if (m_ils[i].type == IL_TYPE_DECLARE_FUNCTION) {
+            ranges[m_ils[i].function].first = i;
+        }
+
+        ranges[m_ils[i].function].second = i + 1;
+    }
+
+    // reads of every parameter, IL_NONE if it can't be replaced: it is written, it isn't a number, or
+    // the function has $asm, which may address parameters by their slot
+    auto get_uses = [&](uint32_t function) {
+        const DeclareFunction& fn = m_functions[function];
+        vector<uint32_t> uses(fn.arg_count, 0);
+
+        for (uint32_t arg = 0; arg < fn.arg_count; ++arg) {
+            const DeclareVariable& param = m_variables[fn.first_arg + arg];
+            if ((param.flags & (VAR_FLAGS_PTR | VAR_FLAGS_ARRAY)) || param.type == DATA_TYPE_STR) {
+                uses[arg] = IL_NONE;
+            }
+        }
+
+        vector<uint32_t> reads;
+        vector<uint32_t> writes;
+        for (size_t i = ranges[function].first; i < ranges[function].second; ++i) {
+            if (m_ils[i].type == IL_TYPE_INLINE_ASM) {
+                return vector<uint32_t>(fn.arg_count, IL_NONE);
+            }
+
+            reads.clear();
+            writes.clear();
+            GetAccess(m_ils[i], reads, writes);
+
+            for (uint32_t var : reads) {
+                if (var - fn.first_arg < fn.arg_count && uses[var - fn.first_arg] != IL_NONE) {
+                    ++uses[var - fn.first_arg];
+                }
+            }
+
+            for (uint32_t var : writes) {
+                if (var - fn.first_arg < fn.arg_count) {
+                    uses[var - fn.first_arg] = IL_NONE;
+                }
+            }
+        }
+
+        return uses;
+    };
+
+    vector<vector<uint32_t>> uses;
+    for (uint32_t function = 0; function < m_functions.size(); ++function) {
+        uses.push_back(get_uses(function));
+    }
+
+    // callee and the replaced parameters with their values
+    using Signature = pair<uint32_t, vector<pair<uint32_t, uint64_t>>>;
+    map<Signature, uint32_t> clones;
+
+    unordered_set<string> names;
+    for (const DeclareFunction& fn : m_functions) {
+        names.emplace(getString(fn.name));
+    }
+
+    size_t allowance = budget == 0 ? 0 : max(m_ils.size() * budget / 100, SPECIALIZE_MIN_BUDGET);
+    size_t specialized = 0;
+
+    for (bool changed = true; changed;) {
+        changed = false;
+
+        map<Signature, vector<size_t>> sites;
+        for (size_t i = 0; i < m_ils.size(); ++i) {
+            const IL_Instruction& il = m_ils[i];
+            if (il.type != IL_TYPE_FUNC_CALL || (il.function < known && cold[il.function])) {
+                continue;
+            }
+
+            const FunctionCall& call = m_calls[il.operand];
+            const DeclareFunction& callee = m_functions[call.callee];
+
+            Signature signature = { call.callee, {} };
+            bool literal = true;
+            for (uint32_t arg = 0; arg < call.arg_count; ++arg) {
+                const DeclareVariable& var = m_variables[m_call_args[call.first_arg + arg]];
+                const DeclareVariable& param = m_variables[callee.first_arg + arg];
+                const uint32_t reads = uses[call.callee][arg];
+
+                if (!(var.flags & VAR_FLAGS_IMMEDIATE) || var.type == DATA_TYPE_STR) {
+                    literal = false;
+                    continue;
+                }
+
+                // the immediate is loaded whole, it must be what the parameter's slot would read back
+                const uint8_t bits = param.size - (isSigned(param.type) ? 1 : 0);
+                if (reads != IL_NONE && reads > 0 && (bits >= 64 || var.imm < (1ull << bits))) {
+                    signature.second.emplace_back(arg, var.imm);
+                }
+            }
+
+            // fold-calls runs those whole
+            if (literal && call.callee < known && interpreter.isPure(call.callee)) {
+                continue;
+            }
+
+            if (signature.second.empty() == false) {
+                sites[signature].push_back(i);
+            }
+        }
+
+        // existing clones are free, new ones go by replaced reads per instruction copied
+        auto cost = [&](const Signature& signature) -> size_t {
+            return clones.contains(signature) ? 0 : ranges[signature.first].second - ranges[signature.first].first;
+        };
+
+        auto benefit = [&](const pair<Signature, vector<size_t>>& entry) {
+            size_t reads = 0;
+            for (const auto& [arg, value] : entry.first.second) {
+                reads += uses[entry.first.first][arg];
+            }
+
+            return (double)reads * entry.second.size();
+        };
+
+        vector<pair<Signature, vector<size_t>>> order(sites.begin(), sites.end());
+        stable_sort(order.begin(), order.end(), [&](const auto& a, const auto& b) {
+            return benefit(a) * cost(b.first) > benefit(b) * cost(a.first);
+        });
+
+        for (const auto& [signature, calls] : order) {
+            auto it = clones.find(signature);
+            if (it == clones.end()) {
+                const size_t size = cost(signature);
+                if (size > allowance) {
+                    continue;
+                }
+
+                allowance -= size;
+
+                // names are the routines' labels
+                string name;
+                for (size_t i = 1; name.empty() || names.contains(name); ++i) {
+                    name = string(getString(m_functions[signature.first].name)) + "_spec" + to_string(i);
+                }
+
+                names.insert(name);
+
+                const size_t begin = m_ils.size();
+                const uint32_t clone = CloneFunction(signature.first, name, signature.second, ranges[signature.first].first, ranges[signature.first].second);
+                FoldConstants(begin, m_ils.size(), interpreter);
+
+                ranges.emplace_back(begin, m_ils.size());
+                uses.push_back(get_uses(clone));
+                it = clones.emplace(signature, clone).first;
+            }
+
+            for (size_t site : calls) {
+                FunctionCall call = m_calls[m_ils[site].operand];
+                const uint32_t first = m_call_args.size();
+
+                size_t replaced = 0;
+                for (uint32_t arg = 0; arg < call.arg_count; ++arg) {
+                    if (replaced < signature.second.size() && signature.second[replaced].first == arg) {
+                        ++replaced;
+                        continue;
+                    }
+
+                    const uint32_t var = m_call_args[call.first_arg + arg];
+                    m_call_args.push_back(var);
+                }
+
+                call.callee = it->second;
+                call.first_arg = first;
+                call.arg_count = m_call_args.size() - first;
+
+                m_calls.push_back(call);
+                m_ils[site].operand = m_calls.size() - 1;
+                ++specialized;
+            }
+
+            changed = true;
+        }
+    }
+
+    // loops that folded away
+    erase_if(m_ils, [](const IL_Instruction& il) {
+        return il.type == IL_TYPE_UNKNOWN;
+    });
+
+    return specialized;
+}
+
+uint32_t engine::IL::CloneFunction(uint32_t function, string_view name, const vector<pair<uint32_t, uint64_t>>& constants, size_t begin, size_t end) {
+    // the kept parameters come first so they stay back to back, the replaced ones become immediates of
+    // their parameter's type and keep its name
+    const uint32_t clone = m_functions.size();
+    const DeclareFunction callee = m_functions[function];
+
+    DeclareFunction fn = callee;
+    fn.first_arg = m_variables.size();
+    fn.arg_count = 0;
+
+    unordered_map<uint32_t, uint32_t> vars;
+    for (bool replaced : { false, true }) {
+        for (uint32_t arg = 0; arg < callee.arg_count; ++arg) {
+            auto constant = find_if(constants.begin(), constants.end(), [&](const pair<uint32_t, uint64_t>& entry) {
+                return entry.first == arg;
+            });
+
+            if ((constant != constants.end()) != replaced) {
+                continue;
+            }
+
+            DeclareVariable var = m_variables[callee.first_arg + arg];
+            var.function = clone;
+
+            if (replaced) {
+                var.flags = VAR_FLAGS_IMMEDIATE;
+                var.imm = constant->second;
+            }
+            else {
+                fn.arg_count += 1;
+            }
+
+            vars.emplace(callee.first_arg + arg, AddVariable(var));
+        }
+    }
+
+    fn.name = Intern(name);
+    m_functions.push_back(fn);
+
+    // every record is copied, the clone owns its variables, loops and expression trees
+    unordered_map<uint32_t, uint32_t> loops;
+    for (size_t i = begin; i < end; ++i) {
+        const IL_Instruction il = m_ils[i];
+        uint32_t operand = IL_NONE;
+
+        switch (il.type) {
+            case IL_TYPE_DECLARE_FUNCTION: operand = clone; break;
+            case IL_TYPE_DECLARE_VARIABLE: operand = CloneVariable(il.operand, function, clone, vars); break;
+            case IL_TYPE_RETURN: {
+                m_returns.push_back({ CloneVariable(m_returns[il.operand].var, function, clone, vars) });
+                operand = m_returns.size() - 1;
+            } break;
+            case IL_TYPE_EQ_SET: {
+                EQSet set = m_sets[il.operand];
+                set.left = CloneVariable(set.left, function, clone, vars);
+                set.right = CloneVariable(set.right, function, clone, vars);
+
+                m_sets.push_back(set);
+                operand = m_sets.size() - 1;
+            } break;
+            case IL_TYPE_FUNC_CALL: {
+                FunctionCall call = m_calls[il.operand];
+                const uint32_t first = m_call_args.size();
+
+                for (uint32_t arg = 0; arg < call.arg_count; ++arg) {
+                    const uint32_t var = CloneVariable(m_call_args[call.first_arg + arg], function, clone, vars);
+                    m_call_args.push_back(var);
+                }
+
+                call.first_arg = first;
+                call.ret = CloneVariable(call.ret, function, clone, vars);
+
+                m_calls.push_back(call);
+                operand = m_calls.size() - 1;
+            } break;
+            case IL_TYPE_EXPRESSION: {
+                Expression expr = m_exprs[il.operand];
+                expr.target = CloneVariable(expr.target, function, clone, vars);
+                expr.root = CloneNode(expr.root, function, clone, vars);
+
+                if (expr.index != IL_NONE) {
+                    expr.index = CloneNode(expr.index, function, clone, vars);
+                }
+
+                m_exprs.push_back(expr);
+                operand = m_exprs.size() - 1;
+            } break;
+            case IL_TYPE_LOOP_BEGIN: {
+                Loop loop = m_loops[il.operand];
+                if (loop.type == LOOP_TYPE_WHILE) {
+                    loop.cond = CloneNode(loop.cond, function, clone, vars);
+                }
+                else {
+                    loop.counter = CloneVariable(loop.counter, function, clone, vars);
+                    loop.start = CloneVariable(loop.start, function, clone, vars);
+                    loop.end = CloneVariable(loop.end, function, clone, vars);
+                }
+
+                m_loops.push_back(loop);
+                operand = m_loops.size() - 1;
+                loops.emplace(il.operand, operand);
+            } break;
+            case IL_TYPE_LOOP_END: operand = loops.at(il.operand); break;
+            case IL_TYPE_MEMORY: {
+                MemoryOp op = m_memory_ops[il.operand];
+                op.dst = CloneVariable(op.dst, function, clone, vars);
+                op.src = CloneVariable(op.src, function, clone, vars);
+                op.count = CloneVariable(op.count, function, clone, vars);
+
+                m_memory_ops.push_back(op);
+                operand = m_memory_ops.size() - 1;
+            } break;
+            case IL_TYPE_UNKNOWN: continue;
+            default: CRASH("Can't clone IL type %u of '%s'", il.type, getString(callee.name).data()); break;
+        }
+
+        IL_Instruction copy = CreateIL(il.type, clone, operand);
+        copy.line = il.line;
+        m_ils.push_back(copy);
+    }
+
+    return clone;
+}
+
+uint32_t engine::IL::CloneVariable(uint32_t var, uint32_t function, uint32_t clone, unordered_map<uint32_t, uint32_t>& vars) {
+    // globals, and variables of other functions, are shared
+    if (var == IL_NONE || m_variables[var].function != function) {
+        return var;
+    }
+
+    if (auto it = vars.find(var); it != vars.end()) {
+        return it->second;
+    }
+
+    DeclareVariable copy = m_variables[var];
+    copy.function = clone;
+
+    const uint32_t index = AddVariable(copy);
+    vars.emplace(var, index);
+    return index;
+}
+
+uint32_t engine::IL::CloneNode(uint32_t node, uint32_t function, uint32_t clone, unordered_map<uint32_t, uint32_t>& vars) {
+    const ExprNode expr = m_expr_nodes[node];
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: return MakeNode(EXPR_OP_LEAF, CloneVariable(expr.left, function, clone, vars), IL_NONE);
+        case EXPR_OP_INDEX: {
+            const uint32_t array = CloneVariable(expr.left, function, clone, vars);
+            return MakeNode(EXPR_OP_INDEX, array, CloneNode(expr.right, function, clone, vars));
+        }
+        default: break;
+    }
+
+    const uint32_t left = CloneNode(expr.left, function, clone, vars);
+    const uint32_t right = expr.right == IL_NONE ? IL_NONE : CloneNode(expr.right, function, clone, vars);
+    const uint32_t other = expr.other == IL_NONE ? IL_NONE : CloneNode(expr.other, function, clone, vars);
+    return MakeNode(expr.op, left, right, other);
+}
+
+void engine::IL::FoldConstants(size_t begin, size_t end, const Interpreter& interpreter) {
+    // while loops whose condition folds to 0 are dropped, their declarations stay since a variable is
+    // visible in the whole function
+    for (size_t i = begin; i < end; ++i) {
+        const IL_Instruction& il = m_ils[i];
+
+        if (il.type == IL_TYPE_EXPRESSION) {
+            Expression& expr = m_exprs[il.operand];
+            expr.root = FoldNode(expr.root, il.function, interpreter);
+
+            if (expr.index != IL_NONE) {
+                expr.index = FoldNode(expr.index, il.function, interpreter);
+            }
+        }
+        else if (il.type == IL_TYPE_LOOP_BEGIN && m_loops[il.operand].type == LOOP_TYPE_WHILE) {
+            Loop& loop = m_loops[il.operand];
+            loop.cond = FoldNode(loop.cond, il.function, interpreter);
+
+            uint64_t value = 0;
+            if (interpreter.evaluate(loop.cond, value) == false || value != 0) {
+                continue;
+            }
+
+            for (size_t depth = 0; i < end; ++i) {
+                const InstructionType type = m_ils[i].type;
+                depth += type == IL_TYPE_LOOP_BEGIN;
+                depth -= type == IL_TYPE_LOOP_END;
+
+                if (type != IL_TYPE_DECLARE_VARIABLE) {
+                    m_ils[i].type = IL_TYPE_UNKNOWN;
+                }
+
+                if (depth == 0) {
+                    break;
+                }
+            }
+        }
+    }
+}
+
+uint32_t engine::IL::FoldNode(uint32_t node, uint32_t function, const Interpreter& interpreter) {
+    // nodes may be shared, what changes is rebuilt. Rebuilt nodes keep their signedness since it picked
+    // their operator's instructions and those of their parents.
+    const ExprNode expr = m_expr_nodes[node];
+    if (expr.op == EXPR_OP_LEAF) {
+        return node;
+    }
+
+    uint32_t left = expr.left;
+    if (expr.op != EXPR_OP_INDEX) {
+        left = FoldNode(expr.left, function, interpreter);
+
+        uint64_t cond = 0;
+        if (expr.op == EXPR_OP_SELECT && interpreter.evaluate(left, cond)) {
+            return FoldNode(cond != 0 ? expr.right : expr.other, function, interpreter);
+        }
+    }
+
+    const uint32_t right = expr.right == IL_NONE ? IL_NONE : FoldNode(expr.right, function, interpreter);
+    const uint32_t other = expr.other == IL_NONE ? IL_NONE : FoldNode(expr.other, function, interpreter);
+
+    uint32_t folded = node;
+    if (left != expr.left || right != expr.right || other != expr.other) {
+        folded = MakeNode(expr.op, left, right, other);
+        m_expr_nodes[folded].is_signed = expr.is_signed;
+    }
+
+    const bool constant = IsConstant(left) && (right == IL_NONE || IsConstant(right)) && (other == IL_NONE || IsConstant(other));
+
+    uint64_t value = 0;
+    if (expr.op != EXPR_OP_INDEX && constant && interpreter.evaluate(folded, value)) {
+        return MakeConstant(function, value, expr.is_signed);
+    }
+
+    // a constant operand may decide the node alone or leave it the other one
+    auto is = [&](uint32_t child, uint64_t imm) {
+        return child != IL_NONE && IsConstant(child) && m_variables[m_expr_nodes[child].left].imm == imm;
+    };
+
+    switch (expr.op) {
+        case EXPR_OP_AND: {
+            if (is(left, 0) || is(right, 0)) return MakeConstant(function, 0, expr.is_signed);
+        } break;
+        case EXPR_OP_MUL: {
+            if (is(left, 0) || is(right, 0)) return MakeConstant(function, 0, expr.is_signed);
+            if (is(left, 1)) return right;
+            if (is(right, 1)) return left;
+        } break;
+        case EXPR_OP_ADD:
+        case EXPR_OP_OR:
+        case EXPR_OP_XOR: {
+            if (is(left, 0)) return right;
+            if (is(right, 0)) return left;
+        } break;
+        case EXPR_OP_SUB:
+        case EXPR_OP_SHL:
+        case EXPR_OP_SHR: {
+            if (is(right, 0)) return left;
+        } break;
+        case EXPR_OP_DIV: {
+            if (is(right, 1)) return left;
+        } break;
+        default: break;
+    }
+
+    return folded;
+}
+
+uint32_t engine::IL::MakeConstant(uint32_t function, uint64_t value, bool is_signed) {
+    // the whole register a node leaves, see Interpreter::Evaluate
+    DeclareVariable var = {};
+    var.function = function;
+    var.flags = VAR_FLAGS_IMMEDIATE;
+    var.name = GenerateName("var_");
+    var.value = IL_NONE;
+    var.count = 1;
+    var.reserved = 0;
+    var.imm = value;
+    var.type = is_signed ? DATA_TYPE_I64 : DATA_TYPE_U64;
+    var.size = 64;
+
+    return MakeNode(EXPR_OP_LEAF, AddVariable(var), IL_NONE);
+}
+
+bool engine::IL::IsConstant(uint32_t node) const {
+    const ExprNode& expr = m_expr_nodes[node];
+    if (expr.op != EXPR_OP_LEAF) {
+        return false;
+    }
+
+    const DeclareVariable& var = m_variables[expr.left];
+    return (var.flags & VAR_FLAGS_IMMEDIATE) && var.type != DATA_TYPE_STR;
+}
+
+size_t engine::IL::foldCalls() {
+    // Calls of pure functions with immediate arguments are run here and become a set of their result,
+    // or disappear when the result is dropped. Callees left without calls are removed after this.
+    Interpreter interpreter(*this);
+    size_t folded = 0;
+
+    for (IL_Instruction& il : m_ils) {
+        if (il.type != IL_TYPE_FUNC_CALL) {
+            continue;
+        }
+
+        const FunctionCall call = m_calls[il.operand];
+        if (interpreter.isPure(call.callee) == false || (call.ret != IL_NONE && m_functions[call.callee].ret_type == DATA_TYPE_NONE)) {
+            continue;
+        }
+
+        vector<uint64_t> args;
+        for (uint32_t i = 0; i < call.arg_count; ++i) {
+            const DeclareVariable& arg = m_variables[m_call_args[call.first_arg + i]];
+            if (!(arg.flags & VAR_FLAGS_IMMEDIATE) || arg.type == DATA_TYPE_STR) {
+                break;
+            }
+
+            args.push_back(arg.imm);
+        }
+
+        uint64_t result = 0;
+        if (args.size() != call.arg_count || interpreter.call(call.callee, args, result) == false) {
+            continue;
+        }
+
+        if (call.ret == IL_NONE) {
+            il.type = IL_TYPE_UNKNOWN;
+            ++folded;
+            continue;
+        }
+
+        const uint8_t size = m_variables[call.ret].size;
+
+        DeclareVariable var = {};
+        var.function = il.function;
+        var.flags = VAR_FLAGS_IMMEDIATE;
+        var.name = GenerateName("var_");
+        var.value = IL_NONE;
+        var.count = 1;
+        var.reserved = 0;
+        var.imm = size >= 64 ? result : result & ((1ull << size) - 1);
+        var.type = getImmType(var.imm);
+        var.size = DATA_TYPE_SIZES.at(var.type);
+
+        EQSet set = {};
+        set.left = call.ret;
+        set.right = AddVariable(var);
+        set.type = SET_TYPE_DIRECT;
+        m_sets.push_back(set);
+        il.type = IL_TYPE_EQ_SET;
+        il.operand = m_sets.size() - 1;
+        ++folded;
+    }
+
+    erase_if(m_ils, [](const IL_Instruction& il) {
+        return il.type == IL_TYPE_UNKNOWN;
+    });
+
+    return folded;
+}
+
+void engine::IL::getLeaves(uint32_t node, vector<uint32_t>& leaves) const {
+    const ExprNode& expr = m_expr_nodes[node];
+    if (expr.op == EXPR_OP_LEAF || expr.op == EXPR_OP_INDEX) {
+        leaves.push_back(expr.left);
+
+        if (expr.op == EXPR_OP_INDEX) {
+            getLeaves(expr.right, leaves);
+        }
+
+        return;
+    }
+
+    getLeaves(expr.left, leaves);
+    if (expr.right != IL_NONE) {
+        getLeaves(expr.right, leaves);
+    }
+
+    if (expr.other != IL_NONE) {
+        getLeaves(expr.other, leaves);
+    }
+}
+
+void engine::IL::GetAccess(const IL_Instruction& il, vector<uint32_t>& reads, vector<uint32_t>& writes) const {
+    switch (il.type) {
+        case IL_TYPE_EQ_SET: {
+            const EQSet& set = m_sets[il.operand];
+            writes.push_back(set.left);
+            reads.push_back(set.right);
+
+            if (set.type != SET_TYPE_DIRECT) {
+                reads.push_back(set.left);
+            }
+        } break;
+        case IL_TYPE_EXPRESSION: {
+            const Expression& expr = m_exprs[il.operand];
+            writes.push_back(expr.target);
+            getLeaves(expr.root, reads);
+
+            if (expr.index != IL_NONE) {
+                getLeaves(expr.index, reads);
+            }
+        } break;
+        case IL_TYPE_FUNC_CALL: {
+            const FunctionCall& call = m_calls[il.operand];
+            for (uint32_t i = 0; i < call.arg_count; ++i) {
+                reads.push_back(m_call_args[call.first_arg + i]);
+            }
+
+            if (call.ret != IL_NONE) {
+                writes.push_back(call.ret);
+            }
+
+            // the callee may use any global
+            for (const auto& [name, var] : m_globals) {
+                reads.push_back(var);
+                writes.push_back(var);
+            }
+        } break;
+        case IL_TYPE_RETURN: {
+            if (m_returns[il.operand].var != IL_NONE) {
+                reads.push_back(m_returns[il.operand].var);
+            }
+        } break;
+        case IL_TYPE_INLINE_ASM: {
+            // assembly may do anything with what it references
+            const InlineAsm& inline_asm = m_asms[il.operand];
+            for (uint32_t i = 0; i < inline_asm.part_count; ++i) {
+                const AsmPart& part = m_asm_parts[inline_asm.first_part + i];
+                if (part.type == ASM_PART_VARIABLE) {
+                    reads.push_back(part.value);
+                    writes.push_back(part.value);
+                }
+            }
+        } break;
+        case IL_TYPE_LOOP_BEGIN:
+        case IL_TYPE_LOOP_END: {
+            const Loop& loop = m_loops[il.operand];
+            if (loop.type == LOOP_TYPE_WHILE) {
+                getLeaves(loop.cond, reads);
+            }
+            else {
+                reads.push_back(loop.counter);
+                reads.push_back(loop.start);
+                reads.push_back(loop.end);
+                writes.push_back(loop.counter);
+            }
+        } break;
+        case IL_TYPE_MEMORY: {
+            const MemoryOp& op = m_memory_ops[il.operand];
+            reads.push_back(op.src);
+            reads.push_back(op.count);
+            writes.push_back(op.dst);
+        } break;
+        default: break;
+    }
+}
+
+size_t engine::IL::HoistInvariants(size_t begin, size_t end) {
+    // An assignment moves in front of the loop when nothing it reads changes inside the loop, its target
+    // is written nowhere else in the loop and is not read before it. It is only taken from the top level
+    // of the body, so it would have run on the first iteration anyway. The assembler places hoisted code
+    // after the loop's entry check, so it still never runs for loops that don't.
+    Loop& loop = m_loops[m_ils[begin].operand];
+
+    vector<uint32_t> reads;
+    vector<uint32_t> writes;
+    unordered_map<uint32_t, uint32_t> write_count;
+
+    for (size_t i = begin; i <= end; ++i) {
+        reads.clear();
+        writes.clear();
+        GetAccess(m_ils[i], reads, writes);
+
+        for (uint32_t var : writes) {
+            ++write_count[var];
+        }
+    }
+
+    auto invariant = [&](uint32_t var) {
+        return write_count.contains(var) == false;
+    };
+
+    unordered_set<uint32_t> read_before;
+    vector<bool> hoist(end - begin, false);
+    size_t first = begin + 1 + loop.hoisted;
+    size_t depth = 0;
+    size_t count = 0;
+
+    for (size_t i = first; i < end; ++i) {
+        const IL_Instruction& il = m_ils[i];
+
+        // nothing moves above code that may leave the function
+        if (il.type == IL_TYPE_RETURN || il.type == IL_TYPE_INLINE_ASM) {
+            break;
+        }
+
+        reads.clear();
+        writes.clear();
+        GetAccess(il, reads, writes);
+
+        bool candidate = depth == 0 && (il.type == IL_TYPE_EXPRESSION || (il.type == IL_TYPE_EQ_SET && m_sets[il.operand].type == SET_TYPE_DIRECT));
+        if (candidate) {
+            uint32_t target = writes.front();
+            candidate = write_count[target] == 1 && read_before.contains(target) == false && all_of(reads.begin(), reads.end(), invariant);
+        }
+
+        if (candidate) {
+            hoist[i - begin] = true;
+            ++count;
+        }
+        else {
+            read_before.insert(reads.begin(), reads.end());
+        }
+
+        if (il.type == IL_TYPE_LOOP_BEGIN) ++depth;
+        else if (il.type == IL_TYPE_LOOP_END) --depth;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // hoisted instructions form the preheader in front of the rest of the body, both keep their order
+    vector<IL_Instruction> body;
+    body.reserve(end - first);
+
+    for (bool hoisted : { true, false }) {
+        for (size_t i = first; i < end; ++i) {
+            if (hoist[i - begin] == hoisted) {
+                body.push_back(m_ils[i]);
+            }
+        }
+    }
+
+    copy(body.begin(), body.end(), m_ils.begin() + first);
+
+    loop.hoisted += count;
+    return count;
+}
+
+void engine::IL::UnrollLoop(size_t begin, size_t end, uint32_t factor) {
+    // counted loops with a constant trip count get 'unroll' body copies per iteration, the assembler peels
+    // the remainder in front of the loop
+    Loop& loop = m_loops[m_ils[begin].operand];
+    if (loop.type != LOOP_TYPE_COUNTED || loop.lanes > 1 || factor < 2) {
+        return;
+    }
+
+    const DeclareVariable& start = m_variables[loop.start];
+    const DeclareVariable& last = m_variables[loop.end];
+    if (!(start.flags & VAR_FLAGS_IMMEDIATE) || !(last.flags & VAR_FLAGS_IMMEDIATE)) {
+        return;
+    }
+
+    // copies step the counter themselves, a body that writes it keeps its single copy
+    vector<uint32_t> reads;
+    vector<uint32_t> writes;
+    for (size_t i = begin + 1; i < end; ++i) {
+        GetAccess(m_ils[i], reads, writes);
+    }
+
+    if (find(writes.begin(), writes.end(), loop.counter) != writes.end()) {
+        return;
+    }
+
+    uint64_t trips = last.imm > start.imm ? last.imm - start.imm : 0;
+    loop.unroll = (uint8_t)min<uint64_t>({ factor, UINT8_MAX, max<uint64_t>(trips, 1) });
+}
+
+const vector<engine::IL_Instruction>& engine::IL::getILs() const {
+    return m_ils;
+}
+
+vector<engine::IL_Instruction> engine::IL::takeILs() {
+    return move(m_ils);
+}
+
+void engine::IL::forEachFunction(const function<void(const DeclareFunction&, span<IL_Instruction>)>& visit) {
+    // the front end emits a function's instructions together and no pass moves them across functions
+    for (size_t begin = 0; begin < m_ils.size();) {
+        size_t end = begin + 1;
+        while (end < m_ils.size() && m_ils[end].function == m_ils[begin].function) {
+            ++end;
+        }
+
+        ASSERT(m_ils[begin].type == IL_TYPE_DECLARE_FUNCTION, "Instructions of '%s' are not contiguous", getString(m_functions[m_ils[begin].function].name).data());
+        visit(m_functions[m_ils[begin].function], span<IL_Instruction>(m_ils.data() + begin, end - begin));
+        begin = end;
+    }
+}
+
+const vector<uint64_t>& engine::IL::getKept() const {
+    return m_kept;
+}
+
+const vector<engine::DeclareFunction>& engine::IL::getFunctions() const {
+    return m_functions;
+}
+
+const vector<engine::DeclareVariable>& engine::IL::getVariables() const {
+    return m_variables;
+}
+
+const vector<engine::FunctionReturn>& engine::IL::getReturns() const {
+    return m_returns;
+}
+
+const vector<engine::EQSet>& engine::IL::getSets() const {
+    return m_sets;
+}
+
+const vector<engine::FunctionCall>& engine::IL::getCalls() const {
+    return m_calls;
+}
+
+const vector<uint32_t>& engine::IL::getCallArgs() const {
+    return m_call_args;
+}
+
+const vector<engine::InlineAsm>& engine::IL::getAsms() const {
+    return m_asms;
+}
+
+const vector<engine::AsmPart>& engine::IL::getAsmParts() const {
+    return m_asm_parts;
+}
+
+const vector<engine::Expression>& engine::IL::getExpressions() const {
+    return m_exprs;
+}
+
+const vector<engine::ExprNode>& engine::IL::getExprNodes() const {
+    return m_expr_nodes;
+}
+
+void engine::IL::VectorizeLoop(size_t begin, size_t end) {
+    // Element-wise counted loops run 16 bytes per iteration in SSE2 registers. Every statement either
+    // stores 'a[i]' or accumulates into a scalar with + ^ | &, from elements '[i]' of the same width and
+    // from values that don't change in the loop. The assembler finishes the tail with the scalar body.
+    Loop& loop = m_loops[m_ils[begin].operand];
+    if (loop.type != LOOP_TYPE_COUNTED) {
+        return;
+    }
+
+    uint8_t size = 0;
+    vector<uint32_t> scalars;
+    vector<uint32_t> accumulators;
+
+    for (size_t i = begin + 1 + loop.hoisted; i < end; ++i) {
+        const IL_Instruction& il = m_ils[i];
+        if (il.type == IL_TYPE_DECLARE_VARIABLE) {
+            continue;
+        }
+
+        if (il.type != IL_TYPE_EXPRESSION) {
+            return;
+        }
+
+        const Expression& expr = m_exprs[il.operand];
+        const DeclareVariable& target = m_variables[expr.target];
+        uint32_t value = expr.root;
+
+        if (target.flags & VAR_FLAGS_ARRAY) {
+            if (IsElement(expr.index, loop.counter) == false) {
+                return;
+            }
+        }
+        else {
+            // 'sum = sum op value', each lane keeps a partial result
+            const ExprNode& root = m_expr_nodes[expr.root];
+            bool reduction = root.op == EXPR_OP_ADD || root.op == EXPR_OP_XOR || root.op == EXPR_OP_OR || root.op == EXPR_OP_AND;
+            if (reduction == false || m_expr_nodes[root.left].op != EXPR_OP_LEAF || m_expr_nodes[root.left].left != expr.target) {
+                return;
+            }
+
+            if (expr.target == loop.counter || find(accumulators.begin(), accumulators.end(), expr.target) != accumulators.end()) {
+                return;
+            }
+
+            accumulators.push_back(expr.target);
+            value = root.right;
+        }
+
+        if (size != 0 && target.size != size) {
+            return;
+        }
+
+        size = target.size;
+
+        uint8_t depth = GetPackedDepth(value, loop.counter, size, scalars);
+        if (depth == 0 || depth > 8) {
+            return;
+        }
+    }
+
+    if (size == 0) {
+        return;
+    }
+
+    // accumulators only change once per statement, broadcasts and accumulators share xmm8-xmm15
+    for (uint32_t var : accumulators) {
+        if (find(scalars.begin(), scalars.end(), var) != scalars.end()) {
+            return;
+        }
+    }
+
+    if (scalars.size() + accumulators.size() > 8) {
+        return;
+    }
+
+    loop.lanes = 128 / size;
+}
+
+uint8_t engine::IL::GetPackedDepth(uint32_t node, uint32_t counter, uint8_t size, vector<uint32_t>& scalars) const {
+    // xmm registers the packed form of 'node' needs, 0 when SSE2 has none
+    const ExprNode& expr = m_expr_nodes[node];
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: {
+            // the same value in every lane, broadcast once before the loop
+            if (expr.left == counter) {
+                return 0;
+            }
+
+            if (find(scalars.begin(), scalars.end(), expr.left) == scalars.end()) {
+                scalars.push_back(expr.left);
+            }
+
+            return 1;
+        }
+        case EXPR_OP_INDEX: {
+            return m_variables[expr.left].size == size && IsElement(expr.right, counter) ? 1 : 0;
+        }
+        case EXPR_OP_NOT:
+        case EXPR_OP_NEG: {
+            uint8_t depth = GetPackedDepth(expr.left, counter, size, scalars);
+            return depth == 0 ? 0 : max<uint8_t>(depth, 2);
+        }
+        case EXPR_OP_MUL: {
+            // pmullw is the only packed multiply sse2 has
+            if (size != 16) {
+                return 0;
+            }
+        } [[fallthrough]];
+        case EXPR_OP_ADD:
+        case EXPR_OP_SUB:
+        case EXPR_OP_AND:
+        case EXPR_OP_OR:
+        case EXPR_OP_XOR: {
+            uint8_t left = GetPackedDepth(expr.left, counter, size, scalars);
+            uint8_t right = GetPackedDepth(expr.right, counter, size, scalars);
+            return left == 0 || right == 0 ? 0 : max<uint8_t>(left, right + 1);
+        }
+        default: return 0;
+    }
+}
+
+bool engine::IL::IsElement(uint32_t node, uint32_t counter) const {
+    const ExprNode& expr = m_expr_nodes[node];
+    return expr.op == EXPR_OP_LEAF && expr.left == counter;
+}
+
+const vector<engine::Loop>& engine::IL::getLoops() const {
+    return m_loops;
+}
+
+const vector<engine::MemoryOp>& engine::IL::getMemoryOps() const {
+    return m_memory_ops;
+}
+
+const vector<engine::ILString>& engine::IL::getStrings() const {
+    return m_strings;
+}
+
+const string& engine::IL::getChars() const {
+    return m_chars;
+}
+
+const engine::DeclareFunction& engine::IL::getFunction(uint32_t index) const {
+    return m_functions.at(index);
+}
 
-        if (m_tokens[i].type == TOKEN_TYPE_EOF) {
-            ++i;
-        }
-    }
+const engine::DeclareVariable& engine::IL::getVariable(uint32_t index) const {
+    return m_variables.at(index);
 }
 
-void engine::IL::optimize() {
-    // remove unused routines (except efi_main)
-    vector<const DeclareFunction*> used_routines;
-    for (const IL_Instruction* il : m_ils) {
-        if (il->type == IL_TYPE_FUNC_CALL) {
-            const FunctionCall& fn = get<FunctionCall>(il->data);
-            used_routines.push_back(fn.callee);
-        }
-    }
-    
-    vector<const DeclareFunction*> unused_routines;
-    for (const IL_Instruction* il : m_ils) {
-        if (find(m_kept.begin(), m_kept.end(), il->id) != m_kept.end()) {
-            continue;
-        }
+string_view engine::IL::getString(uint32_t index) const {
+    const ILString& str = m_strings.at(index);
+    return { m_chars.data() + str.offset, str.size };
+}
 
-        if (il->type == IL_TYPE_DECLARE_FUNCTION) {
-            const DeclareFunction& fn = get<DeclareFunction>(il->data);
-            if (fn.name != "efi_main" && find(used_routines.begin(), used_routines.end(), &fn) == used_routines.end()) {
-                unused_routines.push_back(&fn);
-            }
-        }
-    }
+uint32_t engine::IL::Intern(string_view value) {
+    string key(value);
 
-    for (const DeclareFunction* fn : unused_routines) {
-        for (size_t i = 0; i < m_ils.size(); ++i) {
-            if (m_ils[i]->type == IL_TYPE_DECLARE_FUNCTION && &get<DeclareFunction>(m_ils[i]->data) == fn) {
-                m_ils.erase(m_ils.begin() + i);
-                break;
-            }
-        }
+    auto it = m_interned.find(key);
+    if (it != m_interned.end()) {
+        return it->second;
     }
-}
 
-const vector<const engine::IL_Instruction*>& engine::IL::getILs() const {
-    return move(m_ils);
+    ASSERT(m_chars.size() + value.size() < UINT32_MAX, "String table overflow");
+
+    // strings are nul terminated in the table so getString(...).data() can be printed directly
+    uint32_t index = m_strings.size();
+    m_strings.push_back({ (uint32_t)m_chars.size(), (uint32_t)value.size() });
+    m_chars.append(value);
+    m_chars.push_back('\0');
+
+    m_interned.emplace(move(key), index);
+    return index;
 }
 
 const engine::Token& engine::IL::Move(const Token& token, int64_t times) const {
-    int64_t index = -1;
+    // token ids are their index in the stream
+    int64_t index = (int64_t)token.id + times;
+    ASSERT(index >= 0 && index < (int64_t)m_tokens.size(), "Index out of bounds");
 
-    for (size_t i = 0; i < m_tokens.size(); ++i) {
-        if (m_tokens[i].id == token.id) {
-            index = i;
-            break;
-        }
-    }
+    return m_tokens[index];
+}
 
-    index += times;
-    ASSERT(index < (int64_t)m_tokens.size(), "Index out of bounds");
-    
-    return m_tokens.at(index);
+engine::IL_Instruction engine::IL::CreateIL(InstructionType type, uint32_t function, uint32_t operand) {
+    IL_Instruction il = {};
+    il.id = m_next_id++;
+    il.type = type;
+    il.function = function;
+    il.operand = operand;
+    il.line = m_line;
+    return il;
 }
 
-uint16_t engine::IL::getRandomId() {
-    random_device rd;
-    mt19937_64 gen(rd());
-    uniform_int_distribution<uint64_t> dis(10000, 99999);
-    return dis(gen);
+uint32_t engine::IL::AddVariable(const DeclareVariable& var) {
+    m_variables.push_back(var);
+    return m_variables.size() - 1;
 }
 
-engine::IL_Instruction* engine::IL::CreateIL(InstructionType type, const auto& data) const {
-    IL_Instruction* il = new IL_Instruction();
-    il->id = getRandomId();
-    il->type = type;
-    il->data = data;
-    return il;
+// named after the index the variable is about to get, unique and the same on every compile
+uint32_t engine::IL::GenerateName(string_view prefix) {
+    return Intern(string(prefix) + to_string(m_variables.size()));
 }
 
-pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeDeclareFunction(const Token& token) const {
-    DeclareFunction fn;
-    fn.args.clear();
+pair<engine::IL_Instruction, size_t> engine::IL::AnalyzeDeclareFunction(const Token& token) {
+    DeclareFunction fn = {};
 
+    string name;
     size_t size = 1;
     if (Move(token, 1).type == TOKEN_TYPE_IDENTIFIER) {
-        fn.name = Move(token, 1).value;
+        name = Move(token, 1).value;
         fn.ret_type = DATA_TYPE_NONE;
         size += 1;
     }
     else if (isDataType(Move(token, 1))) {
-        fn.name = Move(token, 2).value;
+        name = Move(token, 2).value;
         fn.ret_type = DATA_TYPES.at(Move(token, 1).value);
         size += 2;
     }
@@ -174,21 +1507,28 @@ pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeDeclareFunction(const T
     ASSERT(Move(token, size).type == TOKEN_TYPE_ARG_START, "Expected '(' after function declaration");
     size += 1;
 
-    IL_Instruction* il = CreateIL(IL_TYPE_DECLARE_FUNCTION, fn);
-    
+    fn.name = Intern(name);
+    fn.first_arg = m_variables.size();
+    fn.arg_count = 0;
+
+    uint32_t index = m_functions.size();
+    m_functions.push_back(fn);
+    m_scopes.emplace_back();
+    m_function_names.emplace(name, index);
+
+    IL_Instruction il = CreateIL(IL_TYPE_DECLARE_FUNCTION, index, index);
+
     if (Move(token, size).type != TOKEN_TYPE_ARG_END) {
         while (true) {
             const Token& arg = Move(token, size);
             ASSERT(isDataType(arg) == true, "Expected data type in argument");
             ASSERT(Move(token, size + 1).type == TOKEN_TYPE_IDENTIFIER, "Expected identifier after data type in argument");
 
-            auto [il_arg, il_size] = AnalyzeDeclareVariable((DeclareFunction*)&il->data, arg);
-
-            DeclareVariable* var = &get<DeclareVariable>(il_arg->data);
-            var->flags |= VAR_FLAGS_ARG;
-
-            get<DeclareFunction>(il->data).args.push_back(*var);
-            delete il_arg;
+            // args are the function's first variables and are stored back to back
+            auto [il_arg, il_size] = AnalyzeDeclareVariable(index, arg);
+            ASSERT(il_size == 2, "Arrays can't be passed as arguments of '%s'", name.data());
+            m_variables[il_arg.operand].flags |= VAR_FLAGS_ARG;
+            m_functions[index].arg_count += 1;
 
             size += 3;
             if (Move(token, size - 1).type != TOKEN_TYPE_NEW_ARG) {
@@ -200,88 +1540,204 @@ pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeDeclareFunction(const T
     return { il, size };
 }
 
-pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeDeclareVariable(const DeclareFunction* function, const Token& token) const {
-    ASSERT(function != nullptr, "Expected function declaration before variable declaration");
+pair<engine::IL_Instruction, size_t> engine::IL::AnalyzeDeclareVariable(uint32_t function, const Token& token) {
     ASSERT(Move(token, 1).type == TOKEN_TYPE_IDENTIFIER, "Expected identifier after data type");
 
-    DeclareVariable var;
+    const string& name = Move(token, 1).value;
+
+    DeclareVariable var = {};
     var.function = function;
     var.type = DATA_TYPES.at(token.value);
     var.size = DATA_TYPE_SIZES.at(var.type);
-    var.name = Move(token, 1).value;
+    var.name = Intern(name);
     var.flags = VAR_FLAGS_NONE;
-    var.value = "";
-    return { CreateIL(IL_TYPE_DECLARE_VARIABLE, var), 2 };    
+    var.value = IL_NONE;
+    var.count = 1;
+    var.reserved = 0;
+    var.imm = 0;
+
+    // 'type name[count]'
+    size_t size = 2;
+    if (token.id + 2 < m_tokens.size() && Move(token, 2).type == TOKEN_TYPE_INDEX_START) {
+        const Token& count = Move(token, 3);
+        ASSERT(count.type == TOKEN_TYPE_NUMBER, "Expected array length after '%s['", name.data());
+        ASSERT(Move(token, 4).type == TOKEN_TYPE_INDEX_END, "Expected ']' after array length of '%s'", name.data());
+        ASSERT(var.type != DATA_TYPE_STR, "Expected number type for array '%s'", name.data());
+
+        uint64_t length = getImm(count.value);
+        ASSERT(length > 0 && length <= UINT32_MAX / 8, "Invalid length %llu for array '%s'", (unsigned long long)length, name.data());
+
+        var.count = length;
+        var.flags |= VAR_FLAGS_ARRAY;
+        size = 5;
+    }
+
+    if (function == IL_NONE) {
+        ASSERT(m_globals.contains(name) == false, "Global '%s' is already declared", name.data());
+
+        var.flags |= VAR_FLAGS_GLOBAL;
+        if (token.id + size < m_tokens.size() && Move(token, size).type == TOKEN_TYPE_OPERATOR && Move(token, size).value == "=") {
+            size += 1 + ParseInitializer(var, Move(token, size + 1));
+        }
+
+        uint32_t index = AddVariable(var);
+        m_globals.emplace(name, index);
+        return { IL_Instruction(), size };
+    }
+
+    uint32_t index = AddVariable(var);
+    m_scopes[function][name] = index;
+
+    return { CreateIL(IL_TYPE_DECLARE_VARIABLE, function, index), size };
+}
+
+size_t engine::IL::ParseInitializer(DeclareVariable& var, const Token& token) {
+    // 'name = value' and 'name[n] = { values }', numbers are kept as the global's initial bytes and
+    // missing elements are zero
+    const string name(getString(var.name));
+
+    if (var.type == DATA_TYPE_STR) {
+        ASSERT(token.type == TOKEN_TYPE_STRING, "Expected string literal to initialize '%s'", name.data());
+        var.value = Intern(token.value.substr(1, token.value.size() - 2));
+        return 1;
+    }
+
+    string bytes;
+    auto append = [&](const Token& first) -> size_t {
+        bool negative = first.type == TOKEN_TYPE_OPERATOR && first.value == "-";
+        const Token& number = Move(first, negative ? 1 : 0);
+        ASSERT(number.type == TOKEN_TYPE_NUMBER, "Expected number to initialize '%s'", name.data());
+        ASSERT(negative == false || isSigned(var.type), "Negative value for unsigned '%s'", name.data());
+
+        uint64_t value = getImm(number.value);
+        ASSERT(DATA_TYPE_SIZES.at(getImmType(value)) <= var.size, "Integer overflow at '%s' < '%s'", name.data(), number.value.data());
+
+        value = negative ? 0 - value : value;
+        for (size_t i = 0; i < var.size / 8; ++i) {
+            bytes.push_back((char)(value >> (i * 8)));
+        }
+
+        return negative ? 2 : 1;
+    };
+
+    if (!(var.flags & VAR_FLAGS_ARRAY)) {
+        size_t size = append(token);
+        var.value = Intern(bytes);
+        return size;
+    }
+
+    ASSERT(token.type == TOKEN_TYPE_SCOPE_START, "Expected '{' to initialize array '%s'", name.data());
+
+    size_t size = 1;
+    while (Move(token, size).type != TOKEN_TYPE_SCOPE_END) {
+        size += append(Move(token, size));
+
+        const Token& next = Move(token, size);
+        ASSERT(next.type == TOKEN_TYPE_NEW_ARG || next.type == TOKEN_TYPE_SCOPE_END, "Expected ',' or '}' in initializer of '%s'", name.data());
+        if (next.type == TOKEN_TYPE_NEW_ARG) {
+            ++size;
+        }
+    }
+
+    ASSERT(bytes.size() / (var.size / 8) <= var.count, "Too many values to initialize array '%s'", name.data());
+
+    var.value = Intern(bytes);
+    return size + 1;
 }
 
-pair<vector<engine::IL_Instruction*>, size_t> engine::IL::AnalyzeReturn(const DeclareFunction* function, const Token& token) const {
-    ASSERT(function != nullptr, "Expected function declaration before return keyword");
+pair<vector<engine::IL_Instruction>, size_t> engine::IL::AnalyzeReturn(uint32_t function, const Token& token) {
+    ASSERT(function != IL_NONE, "Expected function declaration before return keyword");
 
     const Token& src = Move(token, 1);
+    const DeclareFunction fn = m_functions[function];
+    const string fn_name(getString(fn.name));
+
+    FunctionReturn ret = {};
+    ret.var = IL_NONE;
+
+    if (fn.ret_type == DATA_TYPE_NONE) {
+        m_returns.push_back(ret);
+        return { { CreateIL(IL_TYPE_RETURN, function, m_returns.size() - 1) }, 1 };
+    }
 
-    FunctionReturn ret;
-    ret.function = function;
-    ret.var = nullptr;
+    if (IsExpression(src.id) == true) {
+        vector<IL_Instruction> ils;
+        size_t index = src.id;
+        uint32_t root = ParseExpression(function, index, 0, ils);
 
-    if (ret.function->ret_type == DATA_TYPE_NONE) {
-        return { { CreateIL(IL_TYPE_RETURN, ret) }, 1 };
+        ret.var = MakeTemporary(function, fn.ret_type, ils);
+        CheckExpression(function, root, &m_variables[ret.var]);
+
+        m_exprs.push_back({ ret.var, root, IL_NONE });
+        ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+
+        m_returns.push_back(ret);
+        ils.push_back(CreateIL(IL_TYPE_RETURN, function, m_returns.size() - 1));
+        return { ils, index - token.id };
     }
 
     switch (src.type)
     {
     case TOKEN_TYPE_IDENTIFIER: {
-        if (FindFunction(src.value) != nullptr) {
-            vector<IL_Instruction*> ils;
+        if (FindFunction(src.value) != IL_NONE) {
+            vector<IL_Instruction> ils;
 
             auto [il_call, il_size] = AnalyzeCall(function, src);
 
-            DeclareVariable ret_var;
+            DeclareVariable ret_var = {};
             ret_var.flags = VAR_FLAGS_NONE;
             ret_var.function = function;
-            ret_var.name = "ret_" + to_string(getRandomId());
-            ret_var.type = get<FunctionCall>(il_call->data).callee->ret_type;
+            ret_var.name = GenerateName("ret_");
+            ret_var.type = m_functions[m_calls[il_call.operand].callee].ret_type;
             ret_var.size = DATA_TYPE_SIZES.at(ret_var.type);
-            ret_var.value = "";
-            
-            IL_Instruction* il_var = CreateIL(IL_TYPE_DECLARE_VARIABLE, ret_var);
-            get<FunctionCall>(il_call->data).ret = (const DeclareVariable*)&il_var->data;
+            ret_var.value = IL_NONE;
+            ret_var.count = 1;
+            ret_var.reserved = 0;
+            ret_var.imm = 0;
 
-            ret.var = (const DeclareVariable*)&il_var->data;
-            IL_Instruction* il_ret = CreateIL(IL_TYPE_RETURN, ret);
+            uint32_t ret_index = AddVariable(ret_var);
+            IL_Instruction il_var = CreateIL(IL_TYPE_DECLARE_VARIABLE, function, ret_index);
+            m_calls[il_call.operand].ret = ret_index;
+
+            ret.var = ret_index;
+            m_returns.push_back(ret);
+            IL_Instruction il_ret = CreateIL(IL_TYPE_RETURN, function, m_returns.size() - 1);
 
             ils.push_back(il_var);
             ils.push_back(il_call);
             ils.push_back(il_ret);
-            
+
             return { ils, il_size + 1 };
         }
 
-        ret.var = FindVariable(function, src.value);
-        
-        if (ret.function->ret_type == DATA_TYPE_STR) {
-            ASSERT(ret.var->type == DATA_TYPE_STR, "Expected string type at return statement of '%s'", function->name.data());
+        ret.var = FindScalar(function, src.value);
+
+        const DeclareVariable& var = m_variables[ret.var];
+        if (fn.ret_type == DATA_TYPE_STR) {
+            ASSERT(var.type == DATA_TYPE_STR, "Expected string type at return statement of '%s'", fn_name.data());
         } else {
-            ASSERT(ret.var->type != DATA_TYPE_STR, "Expected number type at return statement of '%s'", function->name.data());
+            ASSERT(var.type != DATA_TYPE_STR, "Expected number type at return statement of '%s'", fn_name.data());
         }
 
-        ASSERT(DATA_TYPE_SIZES.at(function->ret_type) >= ret.var->size, "Integer overflow at return statement of '%s'", function->name.data());
+        ASSERT(DATA_TYPE_SIZES.at(fn.ret_type) >= var.size, "Integer overflow at return statement of '%s'", fn_name.data());
     } break;
     case TOKEN_TYPE_STRING: {
-        ASSERT(function->ret_type == DATA_TYPE_STR, "Expected string type at return statement of '%s'", function->name.data());
+        ASSERT(fn.ret_type == DATA_TYPE_STR, "Expected string type at return statement of '%s'", fn_name.data());
 
         ret.var = MakeVariable(function, src);
-        ASSERT(DATA_TYPE_SIZES.at(function->ret_type) >= ret.var->size, "Integer overflow at return statement of '%s'", function->name.data());
+        ASSERT(DATA_TYPE_SIZES.at(fn.ret_type) >= m_variables[ret.var].size, "Integer overflow at return statement of '%s'", fn_name.data());
     } break;
     case TOKEN_TYPE_NUMBER: {
-        ASSERT(function->ret_type != DATA_TYPE_STR, "Expected number type at return statement of '%s'", function->name.data());
+        ASSERT(fn.ret_type != DATA_TYPE_STR, "Expected number type at return statement of '%s'", fn_name.data());
 
         ret.var = MakeVariable(function, src);
-        ASSERT(DATA_TYPE_SIZES.at(function->ret_type) >= ret.var->size, "Integer overflow at return statement of '%s'", function->name.data());
+        ASSERT(DATA_TYPE_SIZES.at(fn.ret_type) >= m_variables[ret.var].size, "Integer overflow at return statement of '%s'", fn_name.data());
     } break;
     default: CRASH("Expected identifier after return keyword"); break;
     }
 
-    return { { CreateIL(IL_TYPE_RETURN, ret) }, 2 };
+    m_returns.push_back(ret);
+    return { { CreateIL(IL_TYPE_RETURN, function, m_returns.size() - 1) }, 2 };
 }
 
 uint64_t engine::IL::getImm(const string& value) {
@@ -291,7 +1747,7 @@ uint64_t engine::IL::getImm(const string& value) {
     if (isHex) {
         auto [ptr, ec] = from_chars(value.data() + 2, value.data() + value.size(), num, 16);
         ASSERT(ec != errc::result_out_of_range, "Integer overflow");
-    } 
+    }
     else {
         int64_t numSigned = stoll(value);
         ASSERT(numSigned >= 0, "Negative number is not valid for u64");
@@ -302,9 +1758,7 @@ uint64_t engine::IL::getImm(const string& value) {
     return num;
 }
 
-engine::DataType engine::IL::getImmType(const string& value) {
-    uint64_t num = getImm(value);
-
+engine::DataType engine::IL::getImmType(uint64_t num) {
     if (num <= UINT8_MAX) return DATA_TYPE_U8;
     else if (num <= UINT16_MAX) return DATA_TYPE_U16;
     else if (num <= UINT32_MAX) return DATA_TYPE_U32;
@@ -313,84 +1767,440 @@ engine::DataType engine::IL::getImmType(const string& value) {
     CRASH("Unknown integer type");
 }
 
+bool engine::IL::isSigned(DataType type) {
+    return type == DATA_TYPE_I8 || type == DATA_TYPE_I16 || type == DATA_TYPE_I32 || type == DATA_TYPE_I64;
+}
+
+bool engine::IL::isComparison(ExprOp op) {
+    return op >= EXPR_OP_EQ && op <= EXPR_OP_GE;
+}
+
 bool engine::IL::isDataType(const Token& token) {
-    return token.type == TOKEN_TYPE_KEYWORD && DATA_TYPES.find(token.value) != DATA_TYPES.end();
+    return token.type == TOKEN_TYPE_KEYWORD && DATA_TYPES.contains(token.value);
 }
 
-pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeOperator(const DeclareFunction* function, const Token& token) const {
+pair<vector<engine::IL_Instruction>, size_t> engine::IL::AnalyzeOperator(uint32_t function, const Token& token) {
     ASSERT(Move(token, -1).type == TOKEN_TYPE_IDENTIFIER, "Expected identifier before '=' operator");
 
     const Token& left = Move(token, -1);
     const Token& right = Move(token, 1);
+    const string fn_name(getString(m_functions.at(function).name));
 
-    EQSet set;
-    set.function = function;
+    EQSet set = {};
     set.type = OPERATION_TYPES.at(token.value);
-    set.left = FindVariable(function, left.value);
+    set.left = FindScalar(function, left.value);
+
+    const DeclareVariable left_var = m_variables[set.left];
+
+    if (IsExpression(right.id) == true) {
+        ASSERT(set.type != SET_TYPE_NOT, "'~=' takes a single operand at '%s' within '%s'", left.value.data(), fn_name.data());
+
+        vector<IL_Instruction> ils;
+        size_t index = right.id;
+        uint32_t root = ParseExpression(function, index, 0, ils);
+
+        // 'a op= expr' is 'a = a op (expr)'
+        if (set.type != SET_TYPE_DIRECT) {
+            root = MakeNode(SET_TYPE_OPS[set.type], MakeNode(EXPR_OP_LEAF, set.left, IL_NONE), root);
+        }
+
+        CheckExpression(function, root, &left_var);
+
+        m_exprs.push_back({ set.left, root, IL_NONE });
+        ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+        return { ils, index - token.id };
+    }
 
     switch (right.type)
     {
         case TOKEN_TYPE_IDENTIFIER: {
-            if (const DeclareFunction* callee = FindFunction(right.value)) {
-                if (set.left->type == DATA_TYPE_STR) {
-                    ASSERT(callee->ret_type == DATA_TYPE_STR, "Expected string type");
+            if (uint32_t callee = FindFunction(right.value); callee != IL_NONE) {
+                DataType ret_type = m_functions[callee].ret_type;
+                if (left_var.type == DATA_TYPE_STR) {
+                    ASSERT(ret_type == DATA_TYPE_STR, "Expected string type");
                 } else {
-                    ASSERT(callee->ret_type != DATA_TYPE_STR, "Expected number type");
+                    ASSERT(ret_type != DATA_TYPE_STR, "Expected number type");
                 }
-                
-                ASSERT(set.left->size >= DATA_TYPE_SIZES.at(callee->ret_type), "Integer overflow at '%s' < '%s' within '%s'", left.value.data(), right.value.data(), function->name.data());
+
+                ASSERT(left_var.size >= DATA_TYPE_SIZES.at(ret_type), "Integer overflow at '%s' < '%s' within '%s'", left.value.data(), right.value.data(), fn_name.data());
                 auto [il_call, il_size] = AnalyzeCall(function, right);
-                get<FunctionCall>(il_call->data).ret = set.left;
-                
-                return { il_call, il_size };
+                m_calls[il_call.operand].ret = set.left;
+
+                return { { il_call }, il_size };
             }
             else {
-                set.right = FindVariable(function, right.value);
-            
-                if (set.left->type == DATA_TYPE_STR) {
-                    ASSERT(set.right->type == DATA_TYPE_STR, "Expected string type");
+                set.right = FindScalar(function, right.value);
+
+                const DeclareVariable& right_var = m_variables[set.right];
+                if (left_var.type == DATA_TYPE_STR) {
+                    ASSERT(right_var.type == DATA_TYPE_STR, "Expected string type");
                 } else {
-                    ASSERT(set.right->type != DATA_TYPE_STR, "Expected number type");
+                    ASSERT(right_var.type != DATA_TYPE_STR, "Expected number type");
                 }
-               
-                ASSERT(set.left->size >= set.right->size, "Integer overflow at '%s' < '%s' within '%s'", left.value.data(), right.value.data(), function->name.data());
+
+                ASSERT(left_var.size >= right_var.size, "Integer overflow at '%s' < '%s' within '%s'", left.value.data(), right.value.data(), fn_name.data());
             }
         } break;
         case TOKEN_TYPE_STRING: {
             set.right = MakeVariable(function, right);
-            ASSERT(set.left->type == DATA_TYPE_STR, "Expected number type");
+            ASSERT(left_var.type == DATA_TYPE_STR, "Expected number type");
         } break;
         case TOKEN_TYPE_NUMBER: {
             set.right = MakeVariable(function, right);
-            ASSERT(set.left->type != DATA_TYPE_STR, "Expected string type");
-            ASSERT(set.left->size >= set.right->size, "Integer overflow at '%s' < '%s' within '%s'", left.value.data(), right.value.data(), function->name.data());
+            ASSERT(left_var.type != DATA_TYPE_STR, "Expected string type");
+            ASSERT(left_var.size >= m_variables[set.right].size, "Integer overflow at '%s' < '%s' within '%s'", left.value.data(), right.value.data(), fn_name.data());
         } break;
         default:
             CRASH("Unexpected token type");
             break;
     }
- 
-    return { CreateIL(IL_TYPE_EQ_SET, set), 2 };
+
+    m_sets.push_back(set);
+    return { { CreateIL(IL_TYPE_EQ_SET, function, m_sets.size() - 1) }, 2 };
+}
+
+pair<vector<engine::IL_Instruction>, size_t> engine::IL::AnalyzeElementSet(uint32_t function, const Token& token) {
+    // 'array[index] op= expr', the stored value is always an expression
+    const string fn_name(getString(m_functions.at(function).name));
+
+    uint32_t array = FindVariable(function, token.value);
+    ASSERT(array != IL_NONE, "Variable '%s' not found within '%s'", token.value.data(), fn_name.data());
+
+    vector<IL_Instruction> ils;
+    size_t index = token.id + 2;
+    uint32_t element = ParseExpression(function, index, 0, ils);
+    ASSERT(index < m_tokens.size() && m_tokens[index].type == TOKEN_TYPE_INDEX_END, "Expected ']' after index of '%s' within '%s'", token.value.data(), fn_name.data());
+    CheckIndex(function, array, element);
+
+    const Token& op = Move(m_tokens[index], 1);
+    ASSERT(op.type == TOKEN_TYPE_OPERATOR && OPERATION_TYPES.contains(op.value), "Expected assignment after '%s[...]' within '%s'", token.value.data(), fn_name.data());
+
+    SetType type = OPERATION_TYPES.at(op.value);
+    ASSERT(type != SET_TYPE_NOT, "'~=' is not supported on elements of '%s' within '%s'", token.value.data(), fn_name.data());
+
+    index += 2;
+    uint32_t root = ParseExpression(function, index, 0, ils);
+    if (type != SET_TYPE_DIRECT) {
+        root = MakeNode(SET_TYPE_OPS[type], MakeNode(EXPR_OP_INDEX, array, element), root);
+    }
+
+    CheckExpression(function, root, &m_variables[array]);
+
+    m_exprs.push_back({ array, root, element });
+    ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+    return { ils, index - token.id };
+}
+
+bool engine::IL::IsExpression(size_t index) const {
+    // anything beyond a single operand (or a single call) is an expression
+    const Token& first = m_tokens.at(index);
+    if (first.type == TOKEN_TYPE_ARG_START || (first.type == TOKEN_TYPE_OPERATOR && (first.value == "~" || first.value == "-"))) {
+        return true;
+    }
+
+    size_t next = index + 1;
+    if (first.type == TOKEN_TYPE_IDENTIFIER && next < m_tokens.size() && m_tokens[next].type == TOKEN_TYPE_INDEX_START) {
+        return true;
+    }
+
+    if (first.type == TOKEN_TYPE_IDENTIFIER && next < m_tokens.size() && m_tokens[next].type == TOKEN_TYPE_ARG_START) {
+        while (next < m_tokens.size() && m_tokens[next].type != TOKEN_TYPE_ARG_END) {
+            ++next;
+        }
+
+        ++next;
+    }
+
+    return next < m_tokens.size() && m_tokens[next].type == TOKEN_TYPE_OPERATOR && (EXPR_OPERATORS.contains(m_tokens[next].value) || m_tokens[next].value == "?");
+}
+
+uint32_t engine::IL::ParseExpression(uint32_t function, size_t& index, uint8_t precedence, vector<IL_Instruction>& ils) {
+    // precedence climbing, binary operators are left associative
+    uint32_t left = ParsePrimary(function, index, ils);
+
+    while (index < m_tokens.size()) {
+        const Token& token = m_tokens[index];
+        const ExprOperator* op = token.type == TOKEN_TYPE_OPERATOR ? EXPR_OPERATORS.find(token.value) : nullptr;
+        if (op == nullptr || op->precedence < precedence) {
+            break;
+        }
+
+        ++index;
+        uint32_t right = ParseExpression(function, index, op->precedence + 1, ils);
+        left = MakeNode(op->op, left, right);
+    }
+
+    // 'cond ? a : b' binds loosest and nests to the right
+    if (precedence == 0 && index < m_tokens.size() && m_tokens[index].value == "?") {
+        const string fn_name(getString(m_functions[function].name));
+
+        // calls of an arm may only run when it is taken
+        vector<IL_Instruction> yes_ils;
+        vector<IL_Instruction> no_ils;
+
+        ++index;
+        uint32_t yes = ParseExpression(function, index, 0, yes_ils);
+        ASSERT(index < m_tokens.size() && m_tokens[index].value == ":", "Expected ':' in expression within '%s'", fn_name.data());
+
+        ++index;
+        uint32_t no = ParseExpression(function, index, 0, no_ils);
+        left = MakeNode(EXPR_OP_SELECT, left, yes, no);
+
+        if (yes_ils.empty() == false || no_ils.empty() == false) {
+            left = BranchSelect(function, left, yes_ils, no_ils, ils);
+        }
+    }
+
+    return left;
+}
+
+uint32_t engine::IL::BranchSelect(uint32_t function, uint32_t select, const vector<IL_Instruction>& yes_ils, const vector<IL_Instruction>& no_ils, vector<IL_Instruction>& ils) {
+    // 'cond ? a : b' with calls in an arm becomes two loops that run at most once, each setting the
+    // result from its arm, and the expression reads the result instead
+    const ExprNode expr = m_expr_nodes[select];
+    const uint32_t zero = MakeConstant(function, 0, false);
+
+    const uint32_t result = MakeTemporary(function, expr.is_signed ? DATA_TYPE_I64 : DATA_TYPE_U64, ils);
+    const uint32_t taken = MakeTemporary(function, DATA_TYPE_U64, ils);
+    const uint32_t other = MakeTemporary(function, DATA_TYPE_U64, ils);
+
+    m_exprs.push_back({ taken, expr.left, IL_NONE });
+    ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+    m_exprs.push_back({ other, MakeNode(EXPR_OP_EQ, MakeNode(EXPR_OP_LEAF, taken, IL_NONE), zero), IL_NONE });
+    ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+
+    auto arm = [&](uint32_t flag, uint32_t node, const vector<IL_Instruction>& arm_ils) {
+        Loop loop = {};
+        loop.type = LOOP_TYPE_WHILE;
+        loop.unroll = 1;
+        loop.lanes = 1;
+        loop.reserved = 0;
+        loop.hoisted = 0;
+        loop.cond = MakeNode(EXPR_OP_LEAF, flag, IL_NONE);
+        loop.counter = IL_NONE;
+        loop.start = IL_NONE;
+        loop.end = IL_NONE;
+
+        m_loops.push_back(loop);
+        ils.push_back(CreateIL(IL_TYPE_LOOP_BEGIN, function, m_loops.size() - 1));
+        ils.insert(ils.end(), arm_ils.begin(), arm_ils.end());
+
+        m_exprs.push_back({ result, node, IL_NONE });
+        ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+        m_exprs.push_back({ flag, zero, IL_NONE });
+        ils.push_back(CreateIL(IL_TYPE_EXPRESSION, function, m_exprs.size() - 1));
+        ils.push_back(CreateIL(IL_TYPE_LOOP_END, function, m_loops.size() - 1));
+    };
+
+    arm(taken, expr.right, yes_ils);
+    arm(other, expr.other, no_ils);
+
+    m_selects.emplace(result, select);
+    return MakeNode(EXPR_OP_LEAF, result, IL_NONE);
+}
+
+uint32_t engine::IL::ParsePrimary(uint32_t function, size_t& index, vector<IL_Instruction>& ils) {
+    const Token& token = m_tokens.at(index);
+    const string fn_name(getString(m_functions[function].name));
+
+    switch (token.type) {
+        case TOKEN_TYPE_ARG_START: {
+            ++index;
+            uint32_t node = ParseExpression(function, index, 0, ils);
+            ASSERT(index < m_tokens.size() && m_tokens[index].type == TOKEN_TYPE_ARG_END, "Expected ')' in expression within '%s'", fn_name.data());
+            ++index;
+            return node;
+        }
+        case TOKEN_TYPE_OPERATOR: {
+            ASSERT(token.value == "~" || token.value == "-", "Unexpected '%s' in expression within '%s'", token.value.data(), fn_name.data());
+            ++index;
+            return MakeNode(token.value == "~" ? EXPR_OP_NOT : EXPR_OP_NEG, ParsePrimary(function, index, ils), IL_NONE);
+        }
+        case TOKEN_TYPE_IDENTIFIER: {
+            if (Move(token, 1).type == TOKEN_TYPE_ARG_START) {
+                // calls are hoisted in front of the expression, their result is a temporary
+                auto [il_call, size] = AnalyzeCall(function, token);
+
+                DataType ret_type = m_functions[m_calls[il_call.operand].callee].ret_type;
+                ASSERT(ret_type != DATA_TYPE_NONE, "Function '%s' has no return value within '%s'", token.value.data(), fn_name.data());
+
+                uint32_t temp = MakeTemporary(function, ret_type, ils);
+                m_calls[il_call.operand].ret = temp;
+                ils.push_back(il_call);
+
+                index += size;
+                if (m_tokens.at(index - 1).type != TOKEN_TYPE_ARG_END) {
+                    ++index;
+                }
+
+                return MakeNode(EXPR_OP_LEAF, temp, IL_NONE);
+            }
+
+            if (Move(token, 1).type == TOKEN_TYPE_INDEX_START) {
+                uint32_t array = FindVariable(function, token.value);
+                ASSERT(array != IL_NONE, "Variable '%s' not found within '%s'", token.value.data(), fn_name.data());
+
+                index += 2;
+                uint32_t element = ParseExpression(function, index, 0, ils);
+                ASSERT(index < m_tokens.size() && m_tokens[index].type == TOKEN_TYPE_INDEX_END, "Expected ']' after index of '%s' within '%s'", token.value.data(), fn_name.data());
+
+                ++index;
+                CheckIndex(function, array, element);
+                return MakeNode(EXPR_OP_INDEX, array, element);
+            }
+
+            uint32_t var = FindScalar(function, token.value);
+
+            ++index;
+            return MakeNode(EXPR_OP_LEAF, var, IL_NONE);
+        }
+        case TOKEN_TYPE_NUMBER: {
+            ++index;
+            return MakeNode(EXPR_OP_LEAF, MakeVariable(function, token), IL_NONE);
+        }
+        default: CRASH("Unexpected '%s' in expression within '%s'", token.value.data(), fn_name.data()); break;
+    }
+
+    return IL_NONE;
+}
+
+uint32_t engine::IL::MakeNode(ExprOp op, uint32_t left, uint32_t right, uint32_t other) {
+    ExprNode node = {};
+    node.op = op;
+    node.need = 1;
+    node.is_signed = false;
+    node.reserved = 0;
+    node.left = left;
+    node.right = right;
+    node.other = other;
+
+    auto need = [&](uint32_t child) -> uint8_t {
+        return m_expr_nodes[child].need;
+    };
+
+    switch (op) {
+        case EXPR_OP_LEAF: {
+            node.is_signed = isSigned(m_variables[left].type);
+        } break;
+        case EXPR_OP_NOT:
+        case EXPR_OP_NEG: {
+            node.need = need(left);
+            node.is_signed = m_expr_nodes[left].is_signed;
+        } break;
+        case EXPR_OP_INDEX: {
+            // the element is loaded into the register that held its index
+            node.need = need(right);
+            node.is_signed = isSigned(m_variables[left].type);
+        } break;
+        case EXPR_OP_SELECT: {
+            // condition, then each arm on top of what is already held
+            node.need = max({ need(left), (uint8_t)(need(right) + 1), (uint8_t)(need(other) + 2) });
+            node.is_signed = m_expr_nodes[right].is_signed || m_expr_nodes[other].is_signed;
+        } break;
+        default: {
+            // a leaf on the right is used as a memory or immediate operand and needs no register of its own
+            uint8_t left_need = need(left);
+            uint8_t right_need = m_expr_nodes[right].op != EXPR_OP_LEAF ? need(right) : 0;
+
+            node.need = left_need == right_need ? left_need + 1 : max(left_need, right_need);
+            node.is_signed = m_expr_nodes[left].is_signed || m_expr_nodes[right].is_signed;
+        } break;
+    }
+
+    m_expr_nodes.push_back(node);
+    return m_expr_nodes.size() - 1;
+}
+
+uint32_t engine::IL::MakeTemporary(uint32_t function, DataType type, vector<IL_Instruction>& ils) {
+    DeclareVariable var = {};
+    var.flags = VAR_FLAGS_NONE;
+    var.function = function;
+    var.name = GenerateName("tmp_");
+    var.type = type;
+    var.size = DATA_TYPE_SIZES.at(type);
+    var.value = IL_NONE;
+    var.count = 1;
+    var.reserved = 0;
+    var.imm = 0;
+
+    uint32_t index = AddVariable(var);
+    ils.push_back(CreateIL(IL_TYPE_DECLARE_VARIABLE, function, index));
+    return index;
+}
+
+void engine::IL::CheckExpression(uint32_t function, uint32_t node, const DeclareVariable* target) const {
+    // operands of a comparison (and a select's condition) only have to be numbers, the result is 0 or 1
+    const ExprNode& expr = m_expr_nodes[node];
+    const string fn_name(getString(m_functions[function].name));
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: break;
+        case EXPR_OP_INDEX: break;
+        case EXPR_OP_SELECT: {
+            CheckExpression(function, expr.left, nullptr);
+            CheckExpression(function, expr.right, target);
+            CheckExpression(function, expr.other, target);
+        } return;
+        default: {
+            const DeclareVariable* operand_target = isComparison(expr.op) ? nullptr : target;
+
+            CheckExpression(function, expr.left, operand_target);
+            if (expr.right != IL_NONE) {
+                CheckExpression(function, expr.right, operand_target);
+            }
+        } return;
+    }
+
+    // the result of a select with calls in its arms is checked like the select
+    if (auto it = m_selects.find(expr.left); it != m_selects.end()) {
+        CheckExpression(function, it->second, target);
+        return;
+    }
+
+    const DeclareVariable& var = m_variables[expr.left];
+    ASSERT(var.type != DATA_TYPE_STR, "Expected number type in expression within '%s'", fn_name.data());
+
+    if (target != nullptr) {
+        ASSERT(target->type != DATA_TYPE_STR, "Expected number type in expression within '%s'", fn_name.data());
+        ASSERT(target->size >= var.size, "Integer overflow at '%s' < '%s' within '%s'", getString(target->name).data(), getString(var.name).data(), fn_name.data());
+    }
+}
+
+void engine::IL::CheckIndex(uint32_t function, uint32_t array, uint32_t index) const {
+    // constant indices are bound checked here, everything else is left to the program like in C
+    const string fn_name(getString(m_functions[function].name));
+    const DeclareVariable& var = m_variables[array];
+    ASSERT(var.flags & VAR_FLAGS_ARRAY, "'%s' is not an array within '%s'", getString(var.name).data(), fn_name.data());
+
+    CheckExpression(function, index, nullptr);
+
+    const ExprNode& node = m_expr_nodes[index];
+    if (node.op == EXPR_OP_LEAF && (m_variables[node.left].flags & VAR_FLAGS_IMMEDIATE)) {
+        ASSERT(m_variables[node.left].imm < var.count, "Index %llu is out of bounds of '%s' within '%s'", (unsigned long long)m_variables[node.left].imm, getString(var.name).data(), fn_name.data());
+    }
 }
 
-pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeCall(const DeclareFunction* function, const Token& token) const {
-    ASSERT(function != nullptr, "Expected function declaration before call");
+pair<engine::IL_Instruction, size_t> engine::IL::AnalyzeCall(uint32_t function, const Token& token) {
+    ASSERT(function != IL_NONE, "Expected function declaration before call");
     ASSERT(token.type == TOKEN_TYPE_IDENTIFIER, "Expected identifier before call");
     ASSERT(Move(token, 1).type == TOKEN_TYPE_ARG_START, "Expected '(' after call");
 
-    const DeclareFunction* callee = FindFunction(token.value);
-    ASSERT(callee != nullptr, "Function '%s' not found", token.value.data());
+    uint32_t callee = FindFunction(token.value);
+    ASSERT(callee != IL_NONE, "Function '%s' not found", token.value.data());
+
+    const string fn_name(getString(m_functions[function].name));
+    const string callee_name(getString(m_functions[callee].name));
 
     size_t size = 2;
 
-    vector<const DeclareVariable*> args;
+    vector<uint32_t> args;
     if (Move(token, size).type != TOKEN_TYPE_ARG_END) {
         while (true) {
             const Token& arg = Move(token, size);
             ASSERT(arg.type == TOKEN_TYPE_IDENTIFIER || arg.type == TOKEN_TYPE_NUMBER || arg.type == TOKEN_TYPE_STRING, "Expected identifier in argument");
-            
+
             if (arg.type == TOKEN_TYPE_IDENTIFIER) {
-                args.push_back(FindVariable(function, arg.value));
+                args.push_back(FindScalar(function, arg.value));
             }
             else {
                 args.push_back(MakeVariable(function, arg));
@@ -403,60 +2213,234 @@ pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeCall(const DeclareFunct
         }
     }
 
-    if (args.size() < callee->args.size()) {
-        CRASH("Too few arguments at call '%s' within '%s'", callee->name.data(), function->name.data());
+    const DeclareFunction& target = m_functions[callee];
+    if (args.size() < target.arg_count) {
+        CRASH("Too few arguments at call '%s' within '%s'", callee_name.data(), fn_name.data());
     }
-    else if (args.size() > callee->args.size()){ 
-        CRASH("Too many arguments at call '%s' within '%s'", callee->name.data(), function->name.data());
+    else if (args.size() > target.arg_count){
+        CRASH("Too many arguments at call '%s' within '%s'", callee_name.data(), fn_name.data());
     }
-   
+
     for (size_t i = 0; i < args.size(); ++i) {
-        const DeclareVariable* left = args.at(i);
-        const DeclareVariable* right = &callee->args.at(i);
+        const DeclareVariable& left = m_variables[args.at(i)];
+        const DeclareVariable& right = m_variables[target.first_arg + i];
 
-        if (left->type == DATA_TYPE_STR) {
-            ASSERT(right->type == DATA_TYPE_STR, "Expected number type");
+        if (left.type == DATA_TYPE_STR) {
+            ASSERT(right.type == DATA_TYPE_STR, "Expected number type");
         } else {
-            ASSERT(right->type != DATA_TYPE_STR, "Expected string type");
+            ASSERT(right.type != DATA_TYPE_STR, "Expected string type");
         }
 
-        ASSERT(right->size >= left->size, "Integer overflow at call '%s' within '%s'", callee->name.data(), function->name.data());
+        ASSERT(right.size >= left.size, "Integer overflow at call '%s' within '%s'", callee_name.data(), fn_name.data());
     }
 
-    FunctionCall call;
-    call.function = function;
+    FunctionCall call = {};
     call.callee = callee;
-    call.ret = nullptr;
-    call.args = move(args);
-    return { CreateIL(IL_TYPE_FUNC_CALL, call), size };
+    call.ret = IL_NONE;
+    call.first_arg = m_call_args.size();
+    call.arg_count = args.size();
+    m_call_args.insert(m_call_args.end(), args.begin(), args.end());
+
+    m_calls.push_back(call);
+    return { CreateIL(IL_TYPE_FUNC_CALL, function, m_calls.size() - 1), size };
 }
 
-pair<engine::IL_Instruction*, size_t> engine::IL::AnalyzeMacro(const DeclareFunction* function, const Token& token) const {
-    ASSERT(function != nullptr, "Expected function declaration before macro");
+pair<engine::IL_Instruction, size_t> engine::IL::AnalyzeMacro(uint32_t function, const Token& token) {
+    ASSERT(function != IL_NONE, "Expected function declaration before macro");
     ASSERT(Move(token, 1).type == TOKEN_TYPE_IDENTIFIER, "Expected identifier after macro");
 
     if (Move(token, 1).value == "asm") {
         ASSERT(Move(token, 2).type == TOKEN_TYPE_ARG_START, "Expected '(' after asm macro");
         ASSERT(Move(token, 3).type == TOKEN_TYPE_STRING, "Expected string after asm macro");
         ASSERT(Move(token, 4).type == TOKEN_TYPE_ARG_END, "Expected ')' after asm macro");
-    
+
         string code = Move(token, 3).value.substr(1, Move(token, 3).value.size() - 2);
         code = regex_replace(code, regex("\n\\s*"), "\n");
         code = regex_replace(code, regex("^\\s+|\\s+$"), "");
 
-        InlineAsm inline_asm;
-        inline_asm.function = function;
-        inline_asm.code = code;
-        
-        return { CreateIL(IL_TYPE_INLINE_ASM, inline_asm), 5 };
+        ParseAsm(function, code);
+        return { CreateIL(IL_TYPE_INLINE_ASM, function, m_asms.size() - 1), 5 };
+    }
+
+    if (Move(token, 1).value == "copy" || Move(token, 1).value == "fill") {
+        return AnalyzeMemory(function, token);
     }
 
     CRASH("Unknown macro");
-    return { nullptr, 2 };
+    return { IL_Instruction(), 2 };
+}
+
+pair<engine::IL_Instruction, size_t> engine::IL::AnalyzeMemory(uint32_t function, const Token& token) {
+    // '$copy(dst, src, count)' and '$fill(dst, value, count)', counts are in elements
+    const string fn_name(getString(m_functions[function].name));
+    const string& name = Move(token, 1).value;
+
+    ASSERT(Move(token, 2).type == TOKEN_TYPE_ARG_START, "Expected '(' after %s macro within '%s'", name.data(), fn_name.data());
+    ASSERT(Move(token, 4).type == TOKEN_TYPE_NEW_ARG && Move(token, 6).type == TOKEN_TYPE_NEW_ARG, "Expected 3 arguments in %s macro within '%s'", name.data(), fn_name.data());
+    ASSERT(Move(token, 8).type == TOKEN_TYPE_ARG_END, "Expected ')' after %s macro within '%s'", name.data(), fn_name.data());
+
+    MemoryOp op = {};
+    op.type = name == "copy" ? MEMORY_OP_COPY : MEMORY_OP_FILL;
+
+    auto array = [&](const Token& arg) {
+        uint32_t var = FindVariable(function, arg.value);
+        ASSERT(arg.type == TOKEN_TYPE_IDENTIFIER && var != IL_NONE, "Variable '%s' not found within '%s'", arg.value.data(), fn_name.data());
+        ASSERT(m_variables[var].flags & VAR_FLAGS_ARRAY, "'%s' is not an array within '%s'", arg.value.data(), fn_name.data());
+        return var;
+    };
+
+    op.dst = array(Move(token, 3));
+    op.count = ParseOperand(function, Move(token, 7));
+
+    const DeclareVariable& dst = m_variables[op.dst];
+    const DeclareVariable& count = m_variables[op.count];
+    ASSERT(count.type != DATA_TYPE_STR, "Expected number type for the count of %s macro within '%s'", name.data(), fn_name.data());
+
+    uint32_t limit = dst.count;
+    if (op.type == MEMORY_OP_COPY) {
+        op.src = array(Move(token, 5));
+
+        const DeclareVariable& src = m_variables[op.src];
+        ASSERT(src.size == dst.size, "Elements of '%s' and '%s' differ in size within '%s'", getString(dst.name).data(), getString(src.name).data(), fn_name.data());
+        limit = min(limit, src.count);
+    }
+    else {
+        op.src = ParseOperand(function, Move(token, 5));
+
+        const DeclareVariable& value = m_variables[op.src];
+        ASSERT(value.type != DATA_TYPE_STR, "Expected number type for the value of fill macro within '%s'", fn_name.data());
+        ASSERT(dst.size >= value.size, "Integer overflow at '%s' < '%s' within '%s'", getString(dst.name).data(), getString(value.name).data(), fn_name.data());
+    }
+
+    if (count.flags & VAR_FLAGS_IMMEDIATE) {
+        ASSERT(count.imm <= limit, "Count %llu of %s macro is out of bounds within '%s'", (unsigned long long)count.imm, name.data(), fn_name.data());
+    }
+
+    m_memory_ops.push_back(op);
+    return { CreateIL(IL_TYPE_MEMORY, function, m_memory_ops.size() - 1), 9 };
+}
+
+void engine::IL::ParseAsm(uint32_t function, const string& code) {
+    InlineAsm inline_asm = {};
+    inline_asm.first_part = m_asm_parts.size();
+
+    // records are written to IL images as raw bytes, so their padding has to be zeroed as well
+    string text;
+    auto flush = [&]() {
+        if (text.empty() == false) {
+            AsmPart part = {};
+            part.type = ASM_PART_TEXT;
+            part.value = Intern(text);
+            m_asm_parts.push_back(part);
+            text.clear();
+        }
+    };
+
+    // split on '@name' references, unknown names stay part of the text
+    for (size_t i = 0; i < code.size(); ++i) {
+        if (code[i] != '@') {
+            text.push_back(code[i]);
+            continue;
+        }
+
+        size_t end = i + 1;
+        while (end < code.size() && (isalnum(code[end]) || code[end] == '_')) {
+            ++end;
+        }
+
+        const string name = code.substr(i + 1, end - i - 1);
+
+        AsmPart part = {};
+        if (name == "stack_size") {
+            part.type = ASM_PART_STACK_SIZE;
+            part.value = 0;
+        }
+        else if (uint32_t var = FindVariable(function, name); var != IL_NONE) {
+            part.type = ASM_PART_VARIABLE;
+            part.value = var;
+        }
+        else {
+            text.push_back(code[i]);
+            continue;
+        }
+
+        flush();
+        m_asm_parts.push_back(part);
+        i = end - 1;
+    }
+
+    flush();
+    inline_asm.part_count = m_asm_parts.size() - inline_asm.first_part;
+    m_asms.push_back(inline_asm);
+}
+
+pair<engine::IL_Instruction, size_t> engine::IL::AnalyzeLoop(uint32_t function, const Token& token) {
+    ASSERT(function != IL_NONE, "Expected function declaration before loop");
+    ASSERT(Move(token, 1).type == TOKEN_TYPE_ARG_START, "Expected '(' after '%s'", token.value.data());
+
+    const string fn_name(getString(m_functions[function].name));
+
+    Loop loop = {};
+    loop.unroll = 1;
+    loop.lanes = 1;
+    loop.reserved = 0;
+    loop.hoisted = 0;
+    loop.cond = IL_NONE;
+    loop.counter = IL_NONE;
+    loop.start = IL_NONE;
+    loop.end = IL_NONE;
+
+    size_t index = token.id + 1;
+    if (token.value == "while") {
+        vector<IL_Instruction> ils;
+
+        loop.type = LOOP_TYPE_WHILE;
+        loop.cond = ParseExpression(function, index, 0, ils);
+        ASSERT(ils.empty(), "Calls are not supported in loop conditions within '%s'", fn_name.data());
+
+        CheckExpression(function, loop.cond, nullptr);
+    }
+    else {
+        const Token& counter = Move(token, 2);
+        ASSERT(counter.type == TOKEN_TYPE_IDENTIFIER, "Expected loop counter after 'for (' within '%s'", fn_name.data());
+        ASSERT(Move(token, 3).value == "=", "Expected '=' after loop counter within '%s'", fn_name.data());
+        ASSERT(Move(token, 5).type == TOKEN_TYPE_NEW_ARG, "Expected ',' after loop start within '%s'", fn_name.data());
+        ASSERT(Move(token, 7).type == TOKEN_TYPE_ARG_END, "Expected ')' after loop end within '%s'", fn_name.data());
+
+        loop.type = LOOP_TYPE_COUNTED;
+        loop.counter = FindScalar(function, counter.value);
+
+        loop.start = ParseOperand(function, Move(token, 4));
+        loop.end = ParseOperand(function, Move(token, 6));
+
+        const DeclareVariable& var = m_variables[loop.counter];
+        ASSERT(var.type != DATA_TYPE_STR, "Expected number type for loop counter '%s' within '%s'", counter.value.data(), fn_name.data());
+
+        for (uint32_t bound : { loop.start, loop.end }) {
+            ASSERT(m_variables[bound].type != DATA_TYPE_STR, "Expected number type in loop bounds within '%s'", fn_name.data());
+            ASSERT(m_variables[bound].size <= var.size, "Integer overflow at loop counter '%s' within '%s'", counter.value.data(), fn_name.data());
+        }
+
+        index = token.id + 8;
+    }
+
+    ASSERT(index < m_tokens.size() && m_tokens[index].type == TOKEN_TYPE_SCOPE_START, "Expected '{' after loop within '%s'", fn_name.data());
+
+    m_loops.push_back(loop);
+    return { CreateIL(IL_TYPE_LOOP_BEGIN, function, m_loops.size() - 1), index + 1 - token.id };
+}
+
+uint32_t engine::IL::ParseOperand(uint32_t function, const Token& token) {
+    if (token.type == TOKEN_TYPE_NUMBER) {
+        return MakeVariable(function, token);
+    }
+
+    ASSERT(token.type == TOKEN_TYPE_IDENTIFIER, "Expected identifier or number, got '%s'", token.value.data());
+    return FindScalar(function, token.value);
 }
 
-pair<vector<uint64_t>, size_t> engine::IL::AnalyzeKeep(const DeclareFunction* function, const Token& token) const {
-    ASSERT(function != nullptr, "Expected function declaration before keep");
+pair<vector<uint64_t>, size_t> engine::IL::AnalyzeKeep(uint32_t function, const Token& token) {
+    ASSERT(function != IL_NONE, "Expected function declaration before keep");
     ASSERT(Move(token, 1).type == TOKEN_TYPE_IDENTIFIER, "Expected identifier after keep");
 
     vector<uint64_t> ids;
@@ -465,15 +2449,15 @@ pair<vector<uint64_t>, size_t> engine::IL::AnalyzeKeep(const DeclareFunction* fu
     while (true) {
         const Token& src = Move(token, size);
 
-        if (const DeclareVariable* var = FindVariable(function, src.value)) {
-            if (!(var->flags & VAR_FLAGS_IMMEDIATE)) {
-                const IL_Instruction* il = (const IL_Instruction*)((uint64_t)var - offsetof(IL_Instruction, data));
-                ids.push_back(il->id);
+        if (uint32_t var = FindVariable(function, src.value); var != IL_NONE) {
+            // args have no declaration of their own
+            uint32_t id = FindDeclaration(IL_TYPE_DECLARE_VARIABLE, var);
+            if (id != IL_NONE) {
+                ids.push_back(id);
             }
         }
-        else if (const DeclareFunction* func = FindFunction(src.value)) {
-            const IL_Instruction* il = (const IL_Instruction*)((uint64_t)func - offsetof(IL_Instruction, data));
-            ids.push_back(il->id);
+        else if (uint32_t func = FindFunction(src.value); func != IL_NONE) {
+            ids.push_back(m_declarations[func].id);
         }
         else {
             CRASH("Identifier '%s' not found", src.value.data());
@@ -488,67 +2472,72 @@ pair<vector<uint64_t>, size_t> engine::IL::AnalyzeKeep(const DeclareFunction* fu
     return { ids, size };
 }
 
-const engine::DeclareFunction* engine::IL::FindFunction(const string& name) const {
-    for (const IL_Instruction* il : m_ils) {
-        if (il->type == IL_TYPE_DECLARE_FUNCTION) {
-            const DeclareFunction& fn = get<DeclareFunction>(il->data);
-            if (fn.name == name) {
-                return (const DeclareFunction*)&fn;
-            }
+uint32_t engine::IL::FindDeclaration(InstructionType type, uint32_t operand) const {
+    for (auto it = m_ils.rbegin(); it != m_ils.rend(); ++it) {
+        if (it->type == type && it->operand == operand) {
+            return it->id;
         }
     }
 
-    return nullptr;
+    return IL_NONE;
 }
 
-const engine::DeclareVariable* engine::IL::FindVariable(const DeclareFunction* function, const string& name) const {
-    ASSERT(function != nullptr, "Expected function declaration");
-    
-    for (const IL_Instruction* il : m_ils) {
-        if (il->type == IL_TYPE_DECLARE_VARIABLE) {
-            const DeclareVariable& var = get<DeclareVariable>(il->data);
-            if (var.function == function && var.name == name) {
-                return (const DeclareVariable*)&var;
-            }
-        }
-    }
-    
-    for (const DeclareVariable& arg : function->args) {
-        if (arg.name == name) {
-            return &arg;
-        }
+uint32_t engine::IL::FindFunction(const string& name) const {
+    auto it = m_function_names.find(name);
+    return it != m_function_names.end() ? it->second : IL_NONE;
+}
+
+uint32_t engine::IL::FindVariable(uint32_t function, const string& name) const {
+    ASSERT(function != IL_NONE, "Expected function declaration");
+
+    const unordered_map<string, uint32_t>& scope = m_scopes.at(function);
+    if (auto it = scope.find(name); it != scope.end()) {
+        return it->second;
     }
 
-    //CRASH("Variable '%s' not found within '%s'", name.data(), function->name.data());
-    return nullptr;
+    auto it = m_globals.find(name);
+    return it != m_globals.end() ? it->second : IL_NONE;
+}
+
+uint32_t engine::IL::FindScalar(uint32_t function, const string& name) const {
+    const string fn_name(getString(m_functions[function].name));
+
+    uint32_t var = FindVariable(function, name);
+    ASSERT(var != IL_NONE, "Variable '%s' not found within '%s'", name.data(), fn_name.data());
+    ASSERT(!(m_variables[var].flags & VAR_FLAGS_ARRAY), "Array '%s' needs an index within '%s'", name.data(), fn_name.data());
+    return var;
 }
 
-engine::DeclareVariable* engine::IL::MakeVariable(const DeclareFunction* function, const Token& token) const {
-    ASSERT(function != nullptr, "Expected function declaration");
+uint32_t engine::IL::MakeVariable(uint32_t function, const Token& token) {
+    ASSERT(function != IL_NONE, "Expected function declaration");
     ASSERT(token.type == TOKEN_TYPE_STRING || token.type == TOKEN_TYPE_NUMBER, "Expected string or number token");
 
-    DeclareVariable* var = new DeclareVariable();
-    var->function = function;
-    var->flags = VAR_FLAGS_NONE;
-    
+    DeclareVariable var = {};
+    var.function = function;
+    var.flags = VAR_FLAGS_NONE;
+    var.value = IL_NONE;
+    var.count = 1;
+    var.reserved = 0;
+    var.imm = 0;
+
     if (isDataType(Move(token, -1)) == true) {
-        var->type = DATA_TYPES.at(Move(token, -1).value);
-        var->name = Move(token, 1).value;
+        var.type = DATA_TYPES.at(Move(token, -1).value);
+        var.name = Intern(Move(token, 1).value);
     }
     else {
-        var->flags |= VAR_FLAGS_IMMEDIATE;
-        var->name = "var_" + to_string(getRandomId());
+        var.flags |= VAR_FLAGS_IMMEDIATE;
+        var.name = GenerateName("var_");
 
         switch (token.type)
         {
         case TOKEN_TYPE_STRING: {
-            var->type = DATA_TYPE_STR;
-;
-            var->value = token.value.substr(1, token.value.size() - 2);
+            var.type = DATA_TYPE_STR;
+            var.value = Intern(token.value.substr(1, token.value.size() - 2));
         } break;
         case TOKEN_TYPE_NUMBER: {
-            var->type = getImmType(token.value);
-            var->value = token.value;
+            // parsed once here, codegen only ever reads 'imm'
+            var.imm = getImm(token.value);
+            var.type = getImmType(var.imm);
         } break;
         default:
             CRASH("Unexpected token type");
@@ -556,6 +2545,6 @@ engine::DeclareVariable* engine::IL::MakeVariable(const DeclareFunction* functio
         }
     }
 
-    var->size = DATA_TYPE_SIZES.at(var->type);
-    return var;
-}
+    var.size = DATA_TYPE_SIZES.at(var.type);
+    return AddVariable(var);
+}
\ No newline at end of file
@@ -2,12 +2,16 @@
 #define HPP_LI
 
 #include "tokenizer.hpp"
-#include <variant>
+
+#include <string_view>
+#include <unordered_map>
+#include <functional>
+#include <span>
 
 using namespace std;
 
 namespace engine {
-    enum DataType {
+    enum DataType : uint8_t {
         DATA_TYPE_NONE = 0,
         DATA_TYPE_I64,
         DATA_TYPE_I32,
@@ -21,14 +25,16 @@ namespace engine {
         DATA_TYPE_BOOL
     };
 
-    enum VarFlags {
+    enum VarFlags : uint8_t {
         VAR_FLAGS_NONE = 0,
         VAR_FLAGS_ARG = (1 << 0),
         VAR_FLAGS_IMMEDIATE = (1 << 1),
         VAR_FLAGS_PTR = (1 << 2),
+        VAR_FLAGS_ARRAY = (1 << 3),     // 'count' elements of 'type'
+        VAR_FLAGS_GLOBAL = (1 << 4),    // declared outside any function, 'function' is IL_NONE
     };
 
-    enum SetType {
+    enum SetType : uint8_t {
         SET_TYPE_DIRECT = 0,
         SET_TYPE_ADD,
         SET_TYPE_SUB,
@@ -43,7 +49,7 @@ namespace engine {
         SET_TYPE_OR,
     };
 
-    const static unordered_map<string, DataType> DATA_TYPES = {
+    inline constexpr PerfectMap<DataType, 10> DATA_TYPES({
         { "i64", DATA_TYPE_I64 },
         { "i32", DATA_TYPE_I32 },
         { "i16", DATA_TYPE_I16 },
@@ -54,9 +60,9 @@ namespace engine {
         { "u8", DATA_TYPE_U8 },
         { "str", DATA_TYPE_STR },
         { "bool", DATA_TYPE_BOOL }
-    };
+    });
 
-    const static unordered_map<string, SetType> OPERATION_TYPES = {
+    inline constexpr PerfectMap<SetType, 12> OPERATION_TYPES({
         { "=", SET_TYPE_DIRECT },
         { "+=", SET_TYPE_ADD },
         { "-=", SET_TYPE_SUB },
@@ -69,117 +75,377 @@ namespace engine {
         { "&=", SET_TYPE_AND },
         { "~=", SET_TYPE_NOT },
         { "|=", SET_TYPE_OR }
+    });
+
+    enum ExprOp : uint8_t {
+        EXPR_OP_LEAF = 0,
+        EXPR_OP_ADD,
+        EXPR_OP_SUB,
+        EXPR_OP_MUL,
+        EXPR_OP_DIV,
+        EXPR_OP_REM,
+        EXPR_OP_AND,
+        EXPR_OP_OR,
+        EXPR_OP_XOR,
+        EXPR_OP_SHL,
+        EXPR_OP_SHR,
+        EXPR_OP_NOT,
+        EXPR_OP_NEG,
+        EXPR_OP_EQ,
+        EXPR_OP_NE,
+        EXPR_OP_LT,
+        EXPR_OP_LE,
+        EXPR_OP_GT,
+        EXPR_OP_GE,
+        EXPR_OP_SELECT,         // left ? right : other
+        EXPR_OP_INDEX           // left[right], left is the array variable
+    };
+
+    struct ExprOperator {
+        ExprOp op;
+        uint8_t precedence;     // higher binds tighter
+    };
+
+    // C precedence, '?:' sits below all of them and is handled by the parser
+    inline constexpr PerfectMap<ExprOperator, 16> EXPR_OPERATORS({
+        { "|", { EXPR_OP_OR, 1 } },
+        { "^", { EXPR_OP_XOR, 2 } },
+        { "&", { EXPR_OP_AND, 3 } },
+        { "==", { EXPR_OP_EQ, 4 } },
+        { "!=", { EXPR_OP_NE, 4 } },
+        { "<", { EXPR_OP_LT, 5 } },
+        { "<=", { EXPR_OP_LE, 5 } },
+        { ">", { EXPR_OP_GT, 5 } },
+        { ">=", { EXPR_OP_GE, 5 } },
+        { "<<", { EXPR_OP_SHL, 6 } },
+        { ">>", { EXPR_OP_SHR, 6 } },
+        { "+", { EXPR_OP_ADD, 7 } },
+        { "-", { EXPR_OP_SUB, 7 } },
+        { "*", { EXPR_OP_MUL, 8 } },
+        { "/", { EXPR_OP_DIV, 8 } },
+        { "%", { EXPR_OP_REM, 8 } }
+    });
+
+    // indexed by SetType, the operator 'a op= b' applies
+    inline constexpr array<ExprOp, SET_TYPE_OR + 1> SET_TYPE_OPS = {
+        EXPR_OP_LEAF,   // SET_TYPE_DIRECT
+        EXPR_OP_ADD,    // SET_TYPE_ADD
+        EXPR_OP_SUB,    // SET_TYPE_SUB
+        EXPR_OP_MUL,    // SET_TYPE_MUL
+        EXPR_OP_DIV,    // SET_TYPE_DIV
+        EXPR_OP_REM,    // SET_TYPE_REM
+        EXPR_OP_XOR,    // SET_TYPE_XOR
+        EXPR_OP_SHR,    // SET_TYPE_SHIFTR
+        EXPR_OP_SHL,    // SET_TYPE_SHIFTL
+        EXPR_OP_AND,    // SET_TYPE_AND
+        EXPR_OP_NOT,    // SET_TYPE_NOT
+        EXPR_OP_OR      // SET_TYPE_OR
     };
 
-    const static unordered_map<DataType, uint8_t> DATA_TYPE_SIZES = {
-        { DATA_TYPE_I64, 64 },
-        { DATA_TYPE_I32, 32 },
-        { DATA_TYPE_I16, 16 },
-        { DATA_TYPE_I8, 8 },
-        { DATA_TYPE_U64, 64 },
-        { DATA_TYPE_U32, 32 },
-        { DATA_TYPE_U16, 16 },
-        { DATA_TYPE_U8, 8 },
-        { DATA_TYPE_STR, 64 },
-        { DATA_TYPE_BOOL, 8 }
+    // indexed by DataType, DATA_TYPE_NONE has no size
+    inline constexpr array<uint8_t, DATA_TYPE_BOOL + 1> DATA_TYPE_SIZES = {
+        0,  // DATA_TYPE_NONE
+        64, // DATA_TYPE_I64
+        32, // DATA_TYPE_I32
+        16, // DATA_TYPE_I16
+        8,  // DATA_TYPE_I8
+        64, // DATA_TYPE_U64
+        32, // DATA_TYPE_U32
+        16, // DATA_TYPE_U16
+        8,  // DATA_TYPE_U8
+        64, // DATA_TYPE_STR
+        8   // DATA_TYPE_BOOL
+    };
+
+    constexpr uint32_t IL_NONE = UINT32_MAX;
+
+    // instructions specialization may always add, a percentage of a small program is next to nothing
+    constexpr size_t SPECIALIZE_MIN_BUDGET = 64;
+
+    // The IL is flat: instructions are fixed-size records in one array and every operand is an index
+    // into a per-kind array owned by the IL. Names and literals live in one string table.
+
+    struct ILString {
+        uint32_t offset;
+        uint32_t size;
     };
 
     struct DeclareVariable {
-        const struct DeclareFunction* function;
+        uint32_t function;
+        uint32_t name;          // string
+        uint32_t value;         // string, literal of DATA_TYPE_STR immediates and globals, initial bytes of other globals, IL_NONE otherwise
+        uint32_t count;         // elements, 1 unless VAR_FLAGS_ARRAY
         DataType type;
-        size_t size;
-        string name;
-        string value;
-        uint8_t flags;
+        uint8_t size;           // bits, of one element for arrays
+        uint8_t flags;          // VarFlags
+        uint8_t reserved;
+        uint64_t imm;           // value of VAR_FLAGS_IMMEDIATE numbers, parsed once during analysis
     };
 
     struct DeclareFunction {
-        string name;
+        uint32_t name;          // string
         DataType ret_type;
-        vector<DeclareVariable> args;
+        uint32_t first_arg;     // variable, args are stored back to back
+        uint32_t arg_count;
     };
 
     struct FunctionReturn {
-        const DeclareFunction* function;
-        const DeclareVariable* var;
+        uint32_t var;           // variable, IL_NONE for void functions
     };
 
     struct EQSet {
-        const DeclareFunction* function;
-        const DeclareVariable* left;
-        const DeclareVariable* right;
+        uint32_t left;          // variable
+        uint32_t right;         // variable
         SetType type;
     };
 
     struct FunctionCall {
-        const DeclareFunction* function;
-        const DeclareFunction* callee;
-        const DeclareVariable* ret;
-        vector<const DeclareVariable*> args;
+        uint32_t callee;        // function
+        uint32_t ret;           // variable, IL_NONE if the result is dropped
+        uint32_t first_arg;     // call arg
+        uint32_t arg_count;
+    };
+
+    enum AsmPartType : uint8_t {
+        ASM_PART_TEXT = 0,      // literal code
+        ASM_PART_VARIABLE,      // '@name', replaced with the variable's stack slot
+        ASM_PART_STACK_SIZE     // '@stack_size'
     };
 
+    struct AsmPart {
+        AsmPartType type;
+        uint32_t value;         // string for ASM_PART_TEXT, variable for ASM_PART_VARIABLE
+    };
+
+    // $asm bodies are split into parts once during analysis, expanding one is a plain concatenation
     struct InlineAsm {
-        const DeclareFunction* function;
-        string code;
+        uint32_t first_part;    // asm part, parts are stored back to back
+        uint32_t part_count;
+    };
+
+    struct ExprNode {
+        ExprOp op;
+        uint8_t need;           // registers needed to evaluate the node (Sethi-Ullman number)
+        uint8_t is_signed;      // operands are signed, picks sar/idiv and the signed condition codes
+        uint8_t reserved;
+        uint32_t left;          // variable for EXPR_OP_LEAF and EXPR_OP_INDEX, node otherwise
+        uint32_t right;         // node, IL_NONE for leaves and unary operators
+        uint32_t other;         // node, the false arm of EXPR_OP_SELECT, IL_NONE otherwise
+    };
+
+    // target = tree, evaluated in registers with a single store at the end
+    struct Expression {
+        uint32_t target;        // variable
+        uint32_t root;          // expr node
+        uint32_t index;         // expr node, the stored element of array targets, IL_NONE otherwise
+    };
+
+    enum LoopType : uint8_t {
+        LOOP_TYPE_WHILE = 0,    // while (cond) { }
+        LOOP_TYPE_COUNTED       // for (counter = start, end) { }, end is exclusive
     };
 
-    enum InstructionType {
+    // the body is every instruction between IL_TYPE_LOOP_BEGIN and the IL_TYPE_LOOP_END of the same loop
+    struct Loop {
+        LoopType type;
+        uint8_t unroll;         // body copies per iteration, set by optimize() for constant trip counts
+        uint8_t lanes;          // elements per SSE2 iteration, set by optimize() for element-wise loops, 1 otherwise
+        uint8_t reserved;
+        uint32_t hoisted;       // leading body instructions that run once before the first iteration
+        uint32_t cond;          // expr node, while loops
+        uint32_t counter;       // variable, counted loops
+        uint32_t start;         // variable, counted loops
+        uint32_t end;           // variable, counted loops
+    };
+
+    enum MemoryOpType : uint8_t {
+        MEMORY_OP_COPY = 0,     // $copy(dst, src, count)
+        MEMORY_OP_FILL          // $fill(dst, value, count)
+    };
+
+    // bulk memory on arrays, 'count' elements from the first one
+    struct MemoryOp {
+        MemoryOpType type;
+        uint32_t dst;           // variable, array
+        uint32_t src;           // variable, array of the same element size for copies, the stored value for fills
+        uint32_t count;         // variable
+    };
+
+    enum InstructionType : uint8_t {
         IL_TYPE_UNKNOWN,
         IL_TYPE_DECLARE_VARIABLE,
         IL_TYPE_DECLARE_FUNCTION,
         IL_TYPE_RETURN,
         IL_TYPE_EQ_SET,
         IL_TYPE_FUNC_CALL,
-        IL_TYPE_INLINE_ASM
+        IL_TYPE_INLINE_ASM,
+        IL_TYPE_EXPRESSION,
+        IL_TYPE_LOOP_BEGIN,
+        IL_TYPE_LOOP_END,
+        IL_TYPE_MEMORY
     };
 
     struct IL_Instruction {
-        uint64_t id;
+        uint32_t id;
         InstructionType type;
-        variant<DeclareVariable, DeclareFunction, FunctionReturn, EQSet, FunctionCall, InlineAsm> data;
-
-        IL_Instruction() {}
-        ~IL_Instruction() {}
+        uint32_t function;      // owning function
+        uint32_t operand;       // index into the array of 'type'
+        uint32_t line;          // source line of the statement it came from, 0 if unknown
     };
     
+    class ILImage;
+    class Interpreter;
+    class Profile;
+    class PassManager;
+
     class IL {
         public:
-            IL(const vector<Token>& tokens);
+            IL(vector<Token>&& tokens);
+            IL(const ILImage& image);
             ~IL();
 
             void analyze();
-            void optimize();
+
+            // every IL pass at -O2, see passes.hpp
+            void optimize(uint32_t unroll = 4, uint32_t budget = 10, const Profile* profile = nullptr);
+            void registerPasses(PassManager& passes, uint32_t unroll, uint32_t budget, const Profile* profile);
+
+            // the passes, each returns how much it changed. Loops of functions 'profile' saw entered
+            // zero times are neither vectorized nor unrolled, and calls from them aren't specialized.
+            // 'budget' is the percentage the IL may grow by specialized clones.
+            size_t specializeCalls(uint32_t budget, const Profile* profile);
+            size_t foldCalls();
+            size_t removeDeadFunctions();
+            size_t hoistInvariants();
+            size_t vectorizeLoops(const Profile* profile);
+            size_t unrollLoops(uint32_t factor, const Profile* profile);
             
-            [[nodiscard]] const vector<const IL_Instruction*>& getILs() const;
+            [[nodiscard]] const vector<IL_Instruction>& getILs() const;
+
+            // hands the instructions to the back end, the rest of the IL stays readable
+            [[nodiscard]] vector<IL_Instruction> takeILs();
+
+            // every function with its instructions in place, declaration first
+            void forEachFunction(const function<void(const DeclareFunction&, span<IL_Instruction>)>& visit);
+            [[nodiscard]] const vector<uint64_t>& getKept() const;
+
+            [[nodiscard]] const vector<DeclareFunction>& getFunctions() const;
+            [[nodiscard]] const vector<DeclareVariable>& getVariables() const;
+            [[nodiscard]] const vector<FunctionReturn>& getReturns() const;
+            [[nodiscard]] const vector<EQSet>& getSets() const;
+            [[nodiscard]] const vector<FunctionCall>& getCalls() const;
+            [[nodiscard]] const vector<uint32_t>& getCallArgs() const;
+            [[nodiscard]] const vector<InlineAsm>& getAsms() const;
+            [[nodiscard]] const vector<AsmPart>& getAsmParts() const;
+            [[nodiscard]] const vector<Expression>& getExpressions() const;
+            [[nodiscard]] const vector<ExprNode>& getExprNodes() const;
+            [[nodiscard]] const vector<Loop>& getLoops() const;
+            [[nodiscard]] const vector<MemoryOp>& getMemoryOps() const;
+            [[nodiscard]] const vector<ILString>& getStrings() const;
+            [[nodiscard]] const string& getChars() const;
+
+            [[nodiscard]] const DeclareFunction& getFunction(uint32_t index) const;
+            [[nodiscard]] const DeclareVariable& getVariable(uint32_t index) const;
+            [[nodiscard]] string_view getString(uint32_t index) const;
+            void getLeaves(uint32_t node, vector<uint32_t>& leaves) const;
             
-            [[nodiscard]] static uint16_t getRandomId();
             [[nodiscard]] static uint64_t getImm(const string& value);
-            [[nodiscard]] static DataType getImmType(const string& value);
+            [[nodiscard]] static DataType getImmType(uint64_t value);
             [[nodiscard]] static bool isDataType(const Token& token);
+            [[nodiscard]] static bool isSigned(DataType type);
+            [[nodiscard]] static bool isComparison(ExprOp op);
 
         private:
 
             [[nodiscard]] const Token& Move(const Token& token, int64_t times) const;
-            [[nodiscard]] IL_Instruction* CreateIL(InstructionType type, const auto& data) const;
+            [[nodiscard]] IL_Instruction CreateIL(InstructionType type, uint32_t function, uint32_t operand);
+            [[nodiscard]] uint32_t Intern(string_view value);
+
+            void AnalyzeBody(uint32_t function, size_t begin, size_t end);
+
+            [[nodiscard]] pair<IL_Instruction, size_t> AnalyzeDeclareFunction(const Token& token);
+            [[nodiscard]] pair<IL_Instruction, size_t> AnalyzeDeclareVariable(uint32_t function, const Token& token); 
+            [[nodiscard]] size_t ParseInitializer(DeclareVariable& var, const Token& token);
+            [[nodiscard]] pair<vector<IL_Instruction>, size_t> AnalyzeReturn(uint32_t function, const Token& token);
+            [[nodiscard]] pair<vector<IL_Instruction>, size_t> AnalyzeOperator(uint32_t function, const Token& token);
+            [[nodiscard]] pair<vector<IL_Instruction>, size_t> AnalyzeElementSet(uint32_t function, const Token& token);
+            [[nodiscard]] pair<IL_Instruction, size_t> AnalyzeCall(uint32_t function, const Token& token);
+            [[nodiscard]] pair<IL_Instruction, size_t> AnalyzeMacro(uint32_t function, const Token& token);
+            [[nodiscard]] pair<IL_Instruction, size_t> AnalyzeMemory(uint32_t function, const Token& token);
+            [[nodiscard]] pair<IL_Instruction, size_t> AnalyzeLoop(uint32_t function, const Token& token);
+            [[nodiscard]] pair<vector<uint64_t>, size_t> AnalyzeKeep(uint32_t function, const Token& token);
+
+            [[nodiscard]] uint32_t FindFunction(const string& name) const;
+
+            [[nodiscard]] uint32_t FindVariable(uint32_t function, const string& name) const;
+            [[nodiscard]] uint32_t FindScalar(uint32_t function, const string& name) const;
+            [[nodiscard]] uint32_t MakeVariable(uint32_t function, const Token& token);
+            [[nodiscard]] uint32_t AddVariable(const DeclareVariable& var);
+            [[nodiscard]] uint32_t GenerateName(string_view prefix);
 
-            [[nodiscard]] pair<IL_Instruction*, size_t> AnalyzeDeclareFunction(const Token& token) const;
-            [[nodiscard]] pair<IL_Instruction*, size_t> AnalyzeDeclareVariable(const DeclareFunction* function, const Token& token) const; 
-            [[nodiscard]] pair<vector<IL_Instruction*>, size_t> AnalyzeReturn(const DeclareFunction* function, const Token& token) const;
-            [[nodiscard]] pair<IL_Instruction*, size_t> AnalyzeOperator(const DeclareFunction* function, const Token& token) const;
-            [[nodiscard]] pair<IL_Instruction*, size_t> AnalyzeCall(const DeclareFunction* function, const Token& token) const;
-            [[nodiscard]] pair<IL_Instruction*, size_t> AnalyzeMacro(const DeclareFunction* function, const Token& token) const;
-            [[nodiscard]] pair<vector<uint64_t>, size_t> AnalyzeKeep(const DeclareFunction* function, const Token& token) const;
+            [[nodiscard]] bool IsExpression(size_t index) const;
+            [[nodiscard]] uint32_t ParseExpression(uint32_t function, size_t& index, uint8_t precedence, vector<IL_Instruction>& ils);
+            [[nodiscard]] uint32_t BranchSelect(uint32_t function, uint32_t select, const vector<IL_Instruction>& yes_ils, const vector<IL_Instruction>& no_ils, vector<IL_Instruction>& ils);
+            [[nodiscard]] uint32_t ParsePrimary(uint32_t function, size_t& index, vector<IL_Instruction>& ils);
+            [[nodiscard]] uint32_t MakeNode(ExprOp op, uint32_t left, uint32_t right, uint32_t other = IL_NONE);
+            [[nodiscard]] uint32_t MakeTemporary(uint32_t function, DataType type, vector<IL_Instruction>& ils);
+            void CheckExpression(uint32_t function, uint32_t node, const DeclareVariable* target) const;
+            void CheckIndex(uint32_t function, uint32_t array, uint32_t index) const;
 
-            [[nodiscard]] const DeclareFunction* FindFunction(const string& name) const;
+            [[nodiscard]] uint32_t ParseOperand(uint32_t function, const Token& token);
 
-            [[nodiscard]] const DeclareVariable* FindVariable(const DeclareFunction* function, const string& name) const;
-            [[nodiscard]] DeclareVariable* MakeVariable(const DeclareFunction* function, const Token& token) const;
+            void ForEachLoop(const function<void(size_t, size_t)>& visit) const;
+            [[nodiscard]] vector<bool> GetCold(const Profile* profile) const;
+            [[nodiscard]] size_t HoistInvariants(size_t begin, size_t end);
+            void UnrollLoop(size_t begin, size_t end, uint32_t factor);
+            void VectorizeLoop(size_t begin, size_t end);
+            [[nodiscard]] uint8_t GetPackedDepth(uint32_t node, uint32_t counter, uint8_t size, vector<uint32_t>& scalars) const;
+            [[nodiscard]] bool IsElement(uint32_t node, uint32_t counter) const;
+            [[nodiscard]] uint32_t CloneFunction(uint32_t function, string_view name, const vector<pair<uint32_t, uint64_t>>& constants, size_t begin, size_t end);
+            [[nodiscard]] uint32_t CloneVariable(uint32_t var, uint32_t function, uint32_t clone, unordered_map<uint32_t, uint32_t>& vars);
+            [[nodiscard]] uint32_t CloneNode(uint32_t node, uint32_t function, uint32_t clone, unordered_map<uint32_t, uint32_t>& vars);
+            void FoldConstants(size_t begin, size_t end, const Interpreter& interpreter);
+            [[nodiscard]] uint32_t FoldNode(uint32_t node, uint32_t function, const Interpreter& interpreter);
+            [[nodiscard]] uint32_t MakeConstant(uint32_t function, uint64_t value, bool is_signed);
+            [[nodiscard]] bool IsConstant(uint32_t node) const;
+            void GetAccess(const IL_Instruction& il, vector<uint32_t>& reads, vector<uint32_t>& writes) const;
 
-            [[nodiscard]] const IL_Instruction* FindIL(uint64_t id) const;
+            void ParseAsm(uint32_t function, const string& code);
+
+            [[nodiscard]] uint32_t FindDeclaration(InstructionType type, uint32_t operand) const;
             
             vector<Token> m_tokens;
-            vector<const IL_Instruction*> m_ils;
+            vector<IL_Instruction> m_ils;
             vector<uint64_t> m_kept;
+            uint32_t m_next_id;
+
+            vector<DeclareFunction> m_functions;
+            vector<DeclareVariable> m_variables;
+            vector<FunctionReturn> m_returns;
+            vector<EQSet> m_sets;
+            vector<FunctionCall> m_calls;
+            vector<uint32_t> m_call_args;
+            vector<InlineAsm> m_asms;
+            vector<AsmPart> m_asm_parts;
+            vector<Expression> m_exprs;
+            vector<ExprNode> m_expr_nodes;
+            vector<Loop> m_loops;
+            vector<MemoryOp> m_memory_ops;
+
+            vector<ILString> m_strings;
+            string m_chars;
+            unordered_map<string, uint32_t> m_interned;
+
+            // globals by name, calls are assumed to read and write all of them
+            unordered_map<string, uint32_t> m_globals;
+
+            // analysis only: name lookups per function and for functions
+            unordered_map<string, uint32_t> m_function_names;
+            vector<unordered_map<string, uint32_t>> m_scopes;
+            vector<IL_Instruction> m_declarations;
+            vector<pair<size_t, size_t>> m_bodies;      // token range of each function's body
+            unordered_map<uint32_t, uint32_t> m_selects;    // result of a branched select -> the select
+            uint32_t m_line;                            // of the statement being analyzed, CreateIL stamps it
     };
 }
 
@@ -0,0 +1,228 @@
+#include "image.hpp"
+#include "assert.hpp"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+engine::ILImage::ILImage(const string& path) : m_data(nullptr), m_size(0), m_mapped(false) {
+    int fd = open(path.data(), O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(ILImageHeader)) {
+        close(fd);
+        return;
+    }
+
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    // anything else (e.g. source files) is left to the caller
+    if (isImage(data, st.st_size) == false) {
+        munmap(data, st.st_size);
+        return;
+    }
+
+    m_data = (const uint8_t*)data;
+    m_size = st.st_size;
+    m_mapped = true;
+
+    // the destructor doesn't run when the constructor throws, a corrupted image would keep its mapping
+    try {
+        Validate();
+    }
+    catch (...) {
+        munmap(data, m_size);
+        throw;
+    }
+}
+
+engine::ILImage::ILImage(const void* data, size_t size) : m_data((const uint8_t*)data), m_size(size), m_mapped(false) {
+    Validate();
+}
+
+engine::ILImage::~ILImage() {
+    if (m_mapped) {
+        munmap((void*)m_data, m_size);
+    }
+}
+
+bool engine::ILImage::operator!() const {
+    return m_data == nullptr;
+}
+
+bool engine::ILImage::isImage(const void* data, size_t size) {
+    uint32_t magic = 0;
+    if (size < sizeof(magic)) {
+        return false;
+    }
+
+    memcpy(&magic, data, sizeof(magic));
+    return magic == IL_IMAGE_MAGIC;
+}
+
+void engine::ILImage::Validate() {
+    ASSERT(m_size >= sizeof(ILImageHeader), "IL image is truncated");
+    ASSERT(((uintptr_t)m_data % alignof(ILImageHeader)) == 0, "IL image is not aligned");
+
+    const ILImageHeader& header = Header();
+    ASSERT(header.magic == IL_IMAGE_MAGIC, "Not an IL image");
+    ASSERT(header.version == IL_IMAGE_VERSION, "Unsupported IL image version %u (expected %u)", header.version, IL_IMAGE_VERSION);
+    ASSERT(header.header_size == sizeof(ILImageHeader), "Unexpected IL image header size");
+    ASSERT(header.file_size == m_size, "IL image size mismatch");
+
+    auto check = [&](const ILImageSection& section, size_t record_size, size_t alignment, const char* name) {
+        ASSERT(section.offset % alignment == 0, "Misaligned IL image section '%s'", name);
+        ASSERT(section.offset <= m_size, "IL image section '%s' out of bounds", name);
+        ASSERT(section.count <= (m_size - section.offset) / record_size, "IL image section '%s' out of bounds", name);
+    };
+
+    check(header.strings, sizeof(ILString), alignof(ILString), "strings");
+    check(header.chars, sizeof(char), alignof(char), "chars");
+    check(header.functions, sizeof(DeclareFunction), alignof(DeclareFunction), "functions");
+    check(header.variables, sizeof(DeclareVariable), alignof(DeclareVariable), "variables");
+    check(header.instructions, sizeof(IL_Instruction), alignof(IL_Instruction), "instructions");
+    check(header.returns, sizeof(FunctionReturn), alignof(FunctionReturn), "returns");
+    check(header.sets, sizeof(EQSet), alignof(EQSet), "sets");
+    check(header.calls, sizeof(FunctionCall), alignof(FunctionCall), "calls");
+    check(header.call_args, sizeof(uint32_t), alignof(uint32_t), "call_args");
+    check(header.asms, sizeof(InlineAsm), alignof(InlineAsm), "asms");
+    check(header.asm_parts, sizeof(AsmPart), alignof(AsmPart), "asm_parts");
+    check(header.exprs, sizeof(Expression), alignof(Expression), "exprs");
+    check(header.expr_nodes, sizeof(ExprNode), alignof(ExprNode), "expr_nodes");
+    check(header.loops, sizeof(Loop), alignof(Loop), "loops");
+    check(header.kept, sizeof(uint64_t), alignof(uint64_t), "kept");
+    check(header.memory_ops, sizeof(MemoryOp), alignof(MemoryOp), "memory_ops");
+}
+
+const engine::ILImageHeader& engine::ILImage::Header() const {
+    return *(const ILImageHeader*)m_data;
+}
+
+span<const engine::ILString> engine::ILImage::getStrings() const {
+    return Section<ILString>(Header().strings);
+}
+
+string_view engine::ILImage::getChars() const {
+    return { (const char*)m_data + Header().chars.offset, Header().chars.count };
+}
+
+span<const engine::DeclareFunction> engine::ILImage::getFunctions() const {
+    return Section<DeclareFunction>(Header().functions);
+}
+
+span<const engine::DeclareVariable> engine::ILImage::getVariables() const {
+    return Section<DeclareVariable>(Header().variables);
+}
+
+span<const engine::IL_Instruction> engine::ILImage::getInstructions() const {
+    return Section<IL_Instruction>(Header().instructions);
+}
+
+span<const engine::FunctionReturn> engine::ILImage::getReturns() const {
+    return Section<FunctionReturn>(Header().returns);
+}
+
+span<const engine::EQSet> engine::ILImage::getSets() const {
+    return Section<EQSet>(Header().sets);
+}
+
+span<const engine::FunctionCall> engine::ILImage::getCalls() const {
+    return Section<FunctionCall>(Header().calls);
+}
+
+span<const uint32_t> engine::ILImage::getCallArgs() const {
+    return Section<uint32_t>(Header().call_args);
+}
+
+span<const engine::InlineAsm> engine::ILImage::getAsms() const {
+    return Section<InlineAsm>(Header().asms);
+}
+
+span<const engine::AsmPart> engine::ILImage::getAsmParts() const {
+    return Section<AsmPart>(Header().asm_parts);
+}
+
+span<const engine::Expression> engine::ILImage::getExpressions() const {
+    return Section<Expression>(Header().exprs);
+}
+
+span<const engine::ExprNode> engine::ILImage::getExprNodes() const {
+    return Section<ExprNode>(Header().expr_nodes);
+}
+
+span<const engine::Loop> engine::ILImage::getLoops() const {
+    return Section<Loop>(Header().loops);
+}
+
+span<const uint64_t> engine::ILImage::getKept() const {
+    return Section<uint64_t>(Header().kept);
+}
+
+span<const engine::MemoryOp> engine::ILImage::getMemoryOps() const {
+    return Section<MemoryOp>(Header().memory_ops);
+}
+
+string_view engine::ILImage::getString(uint32_t index) const {
+    span<const ILString> strings = getStrings();
+    ASSERT(index < strings.size(), "IL image string %u out of bounds", index);
+
+    const ILString& record = strings[index];
+    ASSERT((uint64_t)record.offset + record.size <= Header().chars.count, "IL image string %u out of bounds", index);
+
+    return getChars().substr(record.offset, record.size);
+}
+
+string engine::ILImage::serialize(const IL& il) {
+    string data(sizeof(ILImageHeader), '\0');
+    ILImageHeader header = {};
+    header.magic = IL_IMAGE_MAGIC;
+    header.version = IL_IMAGE_VERSION;
+    header.header_size = sizeof(ILImageHeader);
+
+    auto append = [&](ILImageSection& section, const void* records, size_t count, size_t record_size) {
+        data.resize((data.size() + 7) & ~(size_t)7, '\0');
+        section.offset = data.size();
+        section.count = count;
+        data.append((const char*)records, count * record_size);
+    };
+
+    auto appendVector = [&](ILImageSection& section, const auto& records) {
+        append(section, records.data(), records.size(), sizeof(records[0]));
+    };
+
+    appendVector(header.strings, il.getStrings());
+    appendVector(header.chars, il.getChars());
+    appendVector(header.functions, il.getFunctions());
+    appendVector(header.variables, il.getVariables());
+    appendVector(header.instructions, il.getILs());
+    appendVector(header.returns, il.getReturns());
+    appendVector(header.sets, il.getSets());
+    appendVector(header.calls, il.getCalls());
+    appendVector(header.call_args, il.getCallArgs());
+    appendVector(header.asms, il.getAsms());
+    appendVector(header.asm_parts, il.getAsmParts());
+    appendVector(header.exprs, il.getExpressions());
+    appendVector(header.expr_nodes, il.getExprNodes());
+    appendVector(header.loops, il.getLoops());
+    appendVector(header.kept, il.getKept());
+    appendVector(header.memory_ops, il.getMemoryOps());
+
+    data.resize((data.size() + 7) & ~(size_t)7, '\0');
+    header.file_size = data.size();
+    memcpy(data.data(), &header, sizeof(header));
+
+    return data;
+}
\ No newline at end of file
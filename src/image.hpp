@@ -0,0 +1,97 @@
+#ifndef HPP_IMAGE
+#define HPP_IMAGE
+
+#include "il.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    // On-disk IL layout. The sections are the IL's own flat arrays (see il.hpp), every reference is an
+    // index and every section is aligned for its record type, so a mapped file is used in place
+    // without fix-ups and loading into an IL is one copy per array.
+    constexpr uint32_t IL_IMAGE_MAGIC = 0x4C49584C; // "LXIL"
+    constexpr uint16_t IL_IMAGE_VERSION = 8;
+
+    struct ILImageSection {
+        uint64_t offset;
+        uint64_t count;
+    };
+
+    struct ILImageHeader {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t header_size;
+        uint64_t file_size;
+        ILImageSection strings;         // ILString
+        ILImageSection chars;           // char, referenced by ILString
+        ILImageSection functions;       // DeclareFunction
+        ILImageSection variables;       // DeclareVariable
+        ILImageSection instructions;    // IL_Instruction
+        ILImageSection returns;         // FunctionReturn
+        ILImageSection sets;            // EQSet
+        ILImageSection calls;           // FunctionCall
+        ILImageSection call_args;       // uint32_t variable index
+        ILImageSection asms;            // InlineAsm
+        ILImageSection asm_parts;       // AsmPart
+        ILImageSection exprs;           // Expression
+        ILImageSection expr_nodes;      // ExprNode
+        ILImageSection loops;           // Loop
+        ILImageSection kept;            // uint64_t instruction id
+        ILImageSection memory_ops;      // MemoryOp
+    };
+
+    class ILImage {
+        public:
+            ILImage(const string& path);
+            ILImage(const void* data, size_t size);
+            ~ILImage();
+
+            ILImage(const ILImage&) = delete;
+            ILImage& operator=(const ILImage&) = delete;
+
+            [[nodiscard]] bool operator!() const;
+
+            [[nodiscard]] span<const ILString> getStrings() const;
+            [[nodiscard]] string_view getChars() const;
+            [[nodiscard]] span<const DeclareFunction> getFunctions() const;
+            [[nodiscard]] span<const DeclareVariable> getVariables() const;
+            [[nodiscard]] span<const IL_Instruction> getInstructions() const;
+            [[nodiscard]] span<const FunctionReturn> getReturns() const;
+            [[nodiscard]] span<const EQSet> getSets() const;
+            [[nodiscard]] span<const FunctionCall> getCalls() const;
+            [[nodiscard]] span<const uint32_t> getCallArgs() const;
+            [[nodiscard]] span<const InlineAsm> getAsms() const;
+            [[nodiscard]] span<const AsmPart> getAsmParts() const;
+            [[nodiscard]] span<const Expression> getExpressions() const;
+            [[nodiscard]] span<const ExprNode> getExprNodes() const;
+            [[nodiscard]] span<const Loop> getLoops() const;
+            [[nodiscard]] span<const uint64_t> getKept() const;
+            [[nodiscard]] span<const MemoryOp> getMemoryOps() const;
+            [[nodiscard]] string_view getString(uint32_t index) const;
+
+            [[nodiscard]] static bool isImage(const void* data, size_t size);
+            [[nodiscard]] static string serialize(const IL& il);
+
+        private:
+            void Validate();
+
+            [[nodiscard]] const ILImageHeader& Header() const;
+
+            template <typename T>
+            [[nodiscard]] span<const T> Section(const ILImageSection& section) const {
+                return { reinterpret_cast<const T*>(m_data + section.offset), section.count };
+            }
+
+            const uint8_t* m_data;
+            size_t m_size;
+            bool m_mapped;
+    };
+}
+
+#endif
\ No newline at end of file
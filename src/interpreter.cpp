@@ -0,0 +1,571 @@
+#include "interpreter.hpp"
+#include "assert.hpp"
+
+#include <limits>
+
+using namespace std;
+
+// the bits a variable of 'size' keeps
+static uint64_t Truncate(uint64_t value, size_t size) {
+    return size >= 64 ? value : value & ((1ull << size) - 1);
+}
+
+// loads widen by the variable's type, see Assembler::LoadMemory
+static uint64_t Widen(const engine::DeclareVariable& var, uint64_t bits) {
+    if (engine::IL::isSigned(var.type) == false || var.size >= 64) {
+        return bits;
+    }
+
+    uint64_t sign = 1ull << (var.size - 1);
+    return (bits ^ sign) - sign;
+}
+
+engine::Interpreter::Interpreter(const IL& il) : m_il(il), m_steps(0), m_depth(0) {
+    const size_t count = il.getFunctions().size();
+    m_bodies.resize(count);
+    m_ends.resize(count);
+    m_pure.resize(count, true);
+    m_frame_sizes.resize(count, 0);
+
+    // immediates and globals have no slot
+    const vector<DeclareVariable>& variables = il.getVariables();
+    m_offsets.resize(variables.size(), IL_NONE);
+    for (uint32_t var = 0; var < variables.size(); ++var) {
+        const DeclareVariable& data = variables[var];
+        if (data.function < count && !(data.flags & (VAR_FLAGS_IMMEDIATE | VAR_FLAGS_GLOBAL))) {
+            m_offsets[var] = m_frame_sizes[data.function];
+            m_frame_sizes[data.function] += data.count;
+        }
+    }
+
+    vector<vector<size_t>> open(count);
+    for (const IL_Instruction& insn : il.getILs()) {
+        if (insn.type == IL_TYPE_DECLARE_FUNCTION || insn.type == IL_TYPE_DECLARE_VARIABLE) {
+            continue;
+        }
+
+        vector<IL_Instruction>& body = m_bodies[insn.function];
+        vector<size_t>& ends = m_ends[insn.function];
+
+        if (insn.type == IL_TYPE_LOOP_BEGIN) {
+            open[insn.function].push_back(body.size());
+        }
+        else if (insn.type == IL_TYPE_LOOP_END) {
+            ASSERT(open[insn.function].empty() == false, "Unbalanced loop");
+            ends[open[insn.function].back()] = body.size();
+            open[insn.function].pop_back();
+        }
+
+        body.push_back(insn);
+        ends.push_back(SIZE_MAX);
+    }
+
+    // what a function touches itself first, then whatever it calls
+    for (uint32_t function = 0; function < count; ++function) {
+        if (il.getFunction(function).ret_type == DATA_TYPE_STR) {
+            m_pure[function] = false;
+            continue;
+        }
+
+        for (const IL_Instruction& insn : m_bodies[function]) {
+            vector<uint32_t> vars;
+
+            switch (insn.type) {
+                case IL_TYPE_INLINE_ASM: m_pure[function] = false; break;
+                case IL_TYPE_EQ_SET: {
+                    const EQSet& set = il.getSets()[insn.operand];
+                    vars = { set.left, set.right };
+                } break;
+                case IL_TYPE_EXPRESSION: {
+                    const Expression& expr = il.getExpressions()[insn.operand];
+                    vars.push_back(expr.target);
+                    il.getLeaves(expr.root, vars);
+
+                    if (expr.index != IL_NONE) {
+                        il.getLeaves(expr.index, vars);
+                    }
+                } break;
+                case IL_TYPE_FUNC_CALL: {
+                    const FunctionCall& call = il.getCalls()[insn.operand];
+                    for (uint32_t i = 0; i < call.arg_count; ++i) {
+                        vars.push_back(il.getCallArgs()[call.first_arg + i]);
+                    }
+
+                    if (call.ret != IL_NONE) {
+                        vars.push_back(call.ret);
+                    }
+                } break;
+                case IL_TYPE_RETURN: {
+                    if (il.getReturns()[insn.operand].var != IL_NONE) {
+                        vars.push_back(il.getReturns()[insn.operand].var);
+                    }
+                } break;
+                case IL_TYPE_LOOP_BEGIN: {
+                    const Loop& loop = il.getLoops()[insn.operand];
+                    if (loop.type == LOOP_TYPE_COUNTED) {
+                        vars = { loop.counter, loop.start, loop.end };
+                    }
+                    else {
+                        il.getLeaves(loop.cond, vars);
+                    }
+                } break;
+                case IL_TYPE_MEMORY: {
+                    const MemoryOp& op = il.getMemoryOps()[insn.operand];
+                    vars = { op.dst, op.src, op.count };
+                } break;
+                default: break;
+            }
+
+            for (uint32_t var : vars) {
+                if (IsPureVariable(var) == false) {
+                    m_pure[function] = false;
+                }
+            }
+        }
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (uint32_t function = 0; function < count; ++function) {
+            if (m_pure[function] == false) {
+                continue;
+            }
+
+            for (const IL_Instruction& insn : m_bodies[function]) {
+                if (insn.type == IL_TYPE_FUNC_CALL && m_pure[il.getCalls()[insn.operand].callee] == false) {
+                    m_pure[function] = false;
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+engine::Interpreter::~Interpreter() {
+
+}
+
+bool engine::Interpreter::isPure(uint32_t function) const {
+    return m_pure[function];
+}
+
+bool engine::Interpreter::call(uint32_t function, const vector<uint64_t>& args, uint64_t& result) {
+    m_steps = 0;
+    m_depth = 0;
+    return Call(function, args, result);
+}
+
+bool engine::Interpreter::evaluate(uint32_t node, uint64_t& value) const {
+    // with nothing but immediates the frame is never read
+    vector<uint32_t> leaves;
+    m_il.getLeaves(node, leaves);
+
+    for (uint32_t var : leaves) {
+        const DeclareVariable& data = m_il.getVariable(var);
+        if (!(data.flags & VAR_FLAGS_IMMEDIATE) || data.type == DATA_TYPE_STR) {
+            return false;
+        }
+    }
+
+    const Frame frame = { {}, {}, false, 0 };
+    return Evaluate(frame, node, value);
+}
+
+bool engine::Interpreter::IsPureVariable(uint32_t var) const {
+    const DeclareVariable& data = m_il.getVariable(var);
+    return !(data.flags & (VAR_FLAGS_GLOBAL | VAR_FLAGS_PTR)) && data.type != DATA_TYPE_STR;
+}
+
+bool engine::Interpreter::Step() {
+    return ++m_steps <= INTERPRETER_STEP_LIMIT;
+}
+
+bool engine::Interpreter::Call(uint32_t function, const vector<uint64_t>& args, uint64_t& result) {
+    if (m_pure[function] == false || m_depth >= INTERPRETER_DEPTH_LIMIT) {
+        return false;
+    }
+
+    // a frame costs a step per element, large arrays count against the limit like the loops over them
+    if (m_frame_sizes[function] > INTERPRETER_STEP_LIMIT - m_steps) {
+        return false;
+    }
+
+    m_steps += m_frame_sizes[function];
+
+    const DeclareFunction& data = m_il.getFunction(function);
+
+    Frame frame;
+    frame.values.resize(m_frame_sizes[function]);
+    frame.known.resize(m_frame_sizes[function]);
+    frame.returned = false;
+    frame.result = 0;
+
+    for (uint32_t i = 0; i < data.arg_count; ++i) {
+        if (Write(frame, data.first_arg + i, 0, args[i]) == false) {
+            return false;
+        }
+    }
+
+    ++m_depth;
+    bool done = Run(frame, function, 0, m_bodies[function].size());
+    --m_depth;
+
+    // falling off the end runs into whatever code follows the function
+    if (done == false || frame.returned == false) {
+        return false;
+    }
+
+    result = frame.result;
+    return true;
+}
+
+bool engine::Interpreter::Run(Frame& frame, uint32_t function, size_t begin, size_t end) {
+    const vector<IL_Instruction>& body = m_bodies[function];
+
+    for (size_t i = begin; i < end && frame.returned == false; ++i) {
+        if (Step() == false) {
+            return false;
+        }
+
+        if (body[i].type == IL_TYPE_LOOP_BEGIN) {
+            if (RunLoop(frame, function, i, m_ends[function][i]) == false) {
+                return false;
+            }
+
+            i = m_ends[function][i];
+        }
+        else if (Execute(frame, body[i]) == false) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool engine::Interpreter::RunLoop(Frame& frame, uint32_t function, size_t begin, size_t end) {
+    const vector<IL_Instruction>& body = m_bodies[function];
+    const Loop& loop = m_il.getLoops()[body[begin].operand];
+
+    if (loop.type == LOOP_TYPE_WHILE) {
+        while (true) {
+            uint64_t cond = 0;
+            if (Step() == false || Evaluate(frame, loop.cond, cond) == false) {
+                return false;
+            }
+
+            if (cond == 0) {
+                return true;
+            }
+
+            if (Run(frame, function, begin + 1, end) == false) {
+                return false;
+            }
+
+            if (frame.returned) {
+                return true;
+            }
+        }
+    }
+
+    // unrolled copies only check the counter between groups, a body that writes it runs differently
+    for (size_t i = begin + 1; i < end; ++i) {
+        const IL_Instruction& insn = body[i];
+
+        bool writes = (insn.type == IL_TYPE_EQ_SET && m_il.getSets()[insn.operand].left == loop.counter) ||
+            (insn.type == IL_TYPE_EXPRESSION && m_il.getExpressions()[insn.operand].target == loop.counter) ||
+            (insn.type == IL_TYPE_FUNC_CALL && m_il.getCalls()[insn.operand].ret == loop.counter) ||
+            (insn.type == IL_TYPE_LOOP_BEGIN && m_il.getLoops()[insn.operand].type == LOOP_TYPE_COUNTED && m_il.getLoops()[insn.operand].counter == loop.counter);
+
+        if (writes) {
+            return false;
+        }
+    }
+
+    const DeclareVariable& counter = m_il.getVariable(loop.counter);
+    const DeclareVariable& start = m_il.getVariable(loop.start);
+    const DeclareVariable& last = m_il.getVariable(loop.end);
+    const bool is_signed = IL::isSigned(counter.type);
+
+    auto below = [&](uint64_t left, uint64_t right) {
+        return is_signed ? (int64_t)left < (int64_t)right : left < right;
+    };
+
+    uint64_t first = 0;
+    uint64_t limit = 0;
+    if (Read(frame, loop.start, 0, first) == false || Read(frame, loop.end, 0, limit) == false || Write(frame, loop.counter, 0, first) == false) {
+        return false;
+    }
+
+    // constant bounds are checked on the immediates themselves, see Assembler::AssembleLoop
+    const bool constant = (start.flags & VAR_FLAGS_IMMEDIATE) && (last.flags & VAR_FLAGS_IMMEDIATE);
+    if (constant ? last.imm <= start.imm : below(first, limit) == false) {
+        return true;
+    }
+
+    while (true) {
+        if (Run(frame, function, begin + 1, end) == false) {
+            return false;
+        }
+
+        if (frame.returned) {
+            return true;
+        }
+
+        uint64_t value = 0;
+        if (Step() == false || Read(frame, loop.counter, 0, value) == false || Write(frame, loop.counter, 0, value + 1) == false) {
+            return false;
+        }
+
+        if (Read(frame, loop.counter, 0, value) == false) {
+            return false;
+        }
+
+        if (below(value, limit) == false) {
+            return true;
+        }
+    }
+}
+
+bool engine::Interpreter::Execute(Frame& frame, const IL_Instruction& il) {
+    switch (il.type) {
+        case IL_TYPE_EQ_SET: return Set(frame, m_il.getSets()[il.operand]);
+        case IL_TYPE_MEMORY: return Memory(frame, m_il.getMemoryOps()[il.operand]);
+        case IL_TYPE_EXPRESSION: {
+            const Expression& expr = m_il.getExpressions()[il.operand];
+
+            uint64_t value = 0;
+            uint64_t index = 0;
+            if (Evaluate(frame, expr.root, value) == false) {
+                return false;
+            }
+
+            if (expr.index != IL_NONE && Evaluate(frame, expr.index, index) == false) {
+                return false;
+            }
+
+            return Write(frame, expr.target, index, value);
+        }
+        case IL_TYPE_FUNC_CALL: {
+            const FunctionCall& call = m_il.getCalls()[il.operand];
+            const DeclareFunction& callee = m_il.getFunction(call.callee);
+
+            vector<uint64_t> args(call.arg_count);
+            for (uint32_t i = 0; i < call.arg_count; ++i) {
+                if (Read(frame, m_il.getCallArgs()[call.first_arg + i], 0, args[i]) == false) {
+                    return false;
+                }
+            }
+
+            // rax is left over from the body of void functions
+            uint64_t result = 0;
+            if (Call(call.callee, args, result) == false || (call.ret != IL_NONE && callee.ret_type == DATA_TYPE_NONE)) {
+                return false;
+            }
+
+            return call.ret == IL_NONE || Write(frame, call.ret, 0, result);
+        }
+        case IL_TYPE_RETURN: {
+            const FunctionReturn& ret = m_il.getReturns()[il.operand];
+
+            frame.returned = true;
+            return ret.var == IL_NONE || Read(frame, ret.var, 0, frame.result);
+        }
+        default: return false;
+    }
+}
+
+bool engine::Interpreter::Set(Frame& frame, const EQSet& set) {
+    // the right side is widened into rax and applied at the left's size, see the IL_TYPE_EQ_SET lowering
+    const DeclareVariable& left = m_il.getVariable(set.left);
+    const DeclareVariable& right = m_il.getVariable(set.right);
+
+    uint64_t l = 0;
+    uint64_t r = 0;
+    if (set.type != SET_TYPE_DIRECT && Read(frame, set.left, 0, l) == false) {
+        return false;
+    }
+
+    if (set.type != SET_TYPE_SHIFTL && set.type != SET_TYPE_SHIFTR && Read(frame, set.right, 0, r) == false) {
+        return false;
+    }
+
+    uint64_t value = 0;
+    switch (set.type) {
+        case SET_TYPE_DIRECT: value = r; break;
+        case SET_TYPE_ADD: value = l + r; break;
+        case SET_TYPE_SUB: value = l - r; break;
+        case SET_TYPE_MUL: value = l * r; break;
+        case SET_TYPE_XOR: value = l ^ r; break;
+        case SET_TYPE_OR: value = l | r; break;
+        case SET_TYPE_AND: value = l & r; break;
+        case SET_TYPE_NOT: value = ~l; break;
+        case SET_TYPE_SHIFTL:
+        case SET_TYPE_SHIFTR: {
+            // the count is an immediate, x86 masks it to 5 bits below 64 bit operands
+            uint64_t count = right.imm & (left.size == 64 ? 63 : 31);
+            uint64_t bits = Truncate(l, left.size);
+
+            if (set.type == SET_TYPE_SHIFTR) value = bits >> count;
+            else value = count >= left.size ? 0 : bits << count;
+        } break;
+        case SET_TYPE_DIV:
+        case SET_TYPE_REM: {
+            // 8 and 16 bit dividends leave stale bits of rax above them
+            if (left.size < 32) {
+                return false;
+            }
+
+            uint64_t dividend = Truncate(l, left.size);
+            uint64_t divisor = r;
+            if (right.flags & VAR_FLAGS_IMMEDIATE) divisor = Truncate(right.imm, left.size);
+            else if (right.size >= left.size) divisor = Truncate(r, right.size);
+
+            if (divisor == 0) {
+                return false;
+            }
+
+            value = set.type == SET_TYPE_DIV ? dividend / divisor : dividend % divisor;
+        } break;
+        default: return false;
+    }
+
+    return Write(frame, set.left, 0, value);
+}
+
+bool engine::Interpreter::Memory(Frame& frame, const MemoryOp& op) {
+    const DeclareVariable& dst = m_il.getVariable(op.dst);
+    const DeclareVariable& src = m_il.getVariable(op.src);
+
+    uint64_t count = 0;
+    if (Read(frame, op.count, 0, count) == false || count > dst.count) {
+        return false;
+    }
+
+    if (op.type == MEMORY_OP_FILL) {
+        uint64_t value = 0;
+        if (Read(frame, op.src, 0, value) == false) {
+            return false;
+        }
+
+        for (uint64_t i = 0; i < count; ++i) {
+            if (Write(frame, op.dst, i, value) == false) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // elements that were never set stay that way, their bits are copied as they are
+    if (count > src.count) {
+        return false;
+    }
+
+    const uint64_t from = m_offsets[op.src];
+    const uint64_t to = m_offsets[op.dst];
+    for (uint64_t i = 0; i < count; ++i) {
+        frame.values[to + i] = frame.values[from + i];
+        frame.known[to + i] = frame.known[from + i];
+    }
+
+    return true;
+}
+
+bool engine::Interpreter::Evaluate(const Frame& frame, uint32_t node, uint64_t& value) const {
+    // every node is a 64 bit register, see Assembler::LowerNode
+    const ExprNode& expr = m_il.getExprNodes()[node];
+
+    switch (expr.op) {
+        case EXPR_OP_LEAF: return Read(frame, expr.left, 0, value);
+        case EXPR_OP_INDEX: {
+            uint64_t index = 0;
+            return Evaluate(frame, expr.right, index) && Read(frame, expr.left, index, value);
+        }
+        case EXPR_OP_NOT:
+        case EXPR_OP_NEG: {
+            if (Evaluate(frame, expr.left, value) == false) {
+                return false;
+            }
+
+            value = expr.op == EXPR_OP_NOT ? ~value : 0 - value;
+            return true;
+        }
+        case EXPR_OP_SELECT: {
+            // only the arm that is taken counts, see Assembler::LowerSelect
+            uint64_t cond = 0;
+            return Evaluate(frame, expr.left, cond) && Evaluate(frame, cond != 0 ? expr.right : expr.other, value);
+        }
+        default: break;
+    }
+
+    uint64_t l = 0;
+    uint64_t r = 0;
+    if (Evaluate(frame, expr.left, l) == false || Evaluate(frame, expr.right, r) == false) {
+        return false;
+    }
+
+    const int64_t sl = (int64_t)l;
+    const int64_t sr = (int64_t)r;
+
+    switch (expr.op) {
+        case EXPR_OP_ADD: value = l + r; break;
+        case EXPR_OP_SUB: value = l - r; break;
+        case EXPR_OP_MUL: value = l * r; break;
+        case EXPR_OP_AND: value = l & r; break;
+        case EXPR_OP_OR: value = l | r; break;
+        case EXPR_OP_XOR: value = l ^ r; break;
+        case EXPR_OP_SHL: value = l << (r & 63); break;
+        case EXPR_OP_SHR: value = expr.is_signed ? (uint64_t)(sl >> (r & 63)) : l >> (r & 63); break;
+        case EXPR_OP_DIV:
+        case EXPR_OP_REM: {
+            // #DE at run time
+            if (r == 0 || (expr.is_signed && sl == numeric_limits<int64_t>::min() && sr == -1)) {
+                return false;
+            }
+
+            if (expr.is_signed) value = expr.op == EXPR_OP_DIV ? (uint64_t)(sl / sr) : (uint64_t)(sl % sr);
+            else value = expr.op == EXPR_OP_DIV ? l / r : l % r;
+        } break;
+        case EXPR_OP_EQ: value = l == r; break;
+        case EXPR_OP_NE: value = l != r; break;
+        case EXPR_OP_LT: value = expr.is_signed ? sl < sr : l < r; break;
+        case EXPR_OP_LE: value = expr.is_signed ? sl <= sr : l <= r; break;
+        case EXPR_OP_GT: value = expr.is_signed ? sl > sr : l > r; break;
+        case EXPR_OP_GE: value = expr.is_signed ? sl >= sr : l >= r; break;
+        default: return false;
+    }
+
+    return true;
+}
+
+bool engine::Interpreter::Read(const Frame& frame, uint32_t var, uint64_t index, uint64_t& value) const {
+    // immediates are loaded whole, everything else must have been set, a read past it is stack garbage
+    const DeclareVariable& data = m_il.getVariable(var);
+
+    if (data.flags & VAR_FLAGS_IMMEDIATE) {
+        value = data.imm;
+        return true;
+    }
+
+    if (index >= data.count || frame.known[m_offsets[var] + index] == false) {
+        return false;
+    }
+
+    value = Widen(data, frame.values[m_offsets[var] + index]);
+    return true;
+}
+
+bool engine::Interpreter::Write(Frame& frame, uint32_t var, uint64_t index, uint64_t value) const {
+    const DeclareVariable& data = m_il.getVariable(var);
+
+    if (index >= data.count || (data.flags & VAR_FLAGS_IMMEDIATE)) {
+        return false;
+    }
+
+    frame.values[m_offsets[var] + index] = Truncate(value, data.size);
+    frame.known[m_offsets[var] + index] = true;
+    return true;
+}
\ No newline at end of file
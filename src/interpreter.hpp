@@ -0,0 +1,65 @@
+#ifndef HPP_INTERPRETER
+#define HPP_INTERPRETER
+
+#include "il.hpp"
+
+#include <vector>
+
+using namespace std;
+
+namespace engine {
+    // limits of one compile-time call, calls that go past them are left to run
+    constexpr uint32_t INTERPRETER_STEP_LIMIT = 1 << 18;
+    constexpr uint32_t INTERPRETER_DEPTH_LIMIT = 64;
+
+    // Runs functions of the IL the way the generated code would: values wrap at their variable's size and
+    // are widened by its type when read. Anything that would read stack garbage or fault is not evaluated.
+    class Interpreter {
+        public:
+            Interpreter(const IL& il);
+            ~Interpreter();
+
+            // no $asm, globals, pointers or strings, and only calls to functions that are pure too
+            [[nodiscard]] bool isPure(uint32_t function) const;
+
+            // false if the call can't be evaluated, 'result' is the whole of rax on return
+            [[nodiscard]] bool call(uint32_t function, const vector<uint64_t>& args, uint64_t& result);
+
+            // an expression of immediates only, false if it reads anything else or would fault
+            [[nodiscard]] bool evaluate(uint32_t node, uint64_t& value) const;
+
+        private:
+            // every element of the function's variables, laid out by m_offsets
+            struct Frame {
+                vector<uint64_t> values;
+                vector<bool> known;     // set so far
+                bool returned;
+                uint64_t result;
+            };
+
+            [[nodiscard]] bool Call(uint32_t function, const vector<uint64_t>& args, uint64_t& result);
+            [[nodiscard]] bool Run(Frame& frame, uint32_t function, size_t begin, size_t end);
+            [[nodiscard]] bool Execute(Frame& frame, const IL_Instruction& il);
+            [[nodiscard]] bool RunLoop(Frame& frame, uint32_t function, size_t begin, size_t end);
+            [[nodiscard]] bool Set(Frame& frame, const EQSet& set);
+            [[nodiscard]] bool Memory(Frame& frame, const MemoryOp& op);
+            [[nodiscard]] bool Evaluate(const Frame& frame, uint32_t node, uint64_t& value) const;
+            [[nodiscard]] bool Read(const Frame& frame, uint32_t var, uint64_t index, uint64_t& value) const;
+            [[nodiscard]] bool Write(Frame& frame, uint32_t var, uint64_t index, uint64_t value) const;
+            [[nodiscard]] bool Step();
+
+            [[nodiscard]] bool IsPureVariable(uint32_t var) const;
+
+        private:
+            const IL& m_il;
+            vector<vector<IL_Instruction>> m_bodies;    // function -> instructions without declarations
+            vector<vector<size_t>> m_ends;              // function -> matching LOOP_END of each LOOP_BEGIN
+            vector<uint64_t> m_offsets;                 // variable -> first element in its function's frame
+            vector<uint64_t> m_frame_sizes;             // function -> elements
+            vector<bool> m_pure;
+            uint32_t m_steps;
+            uint32_t m_depth;
+    };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,1141 @@
+#include "jit.hpp"
+#include "assert.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+
+#include <setjmp.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+using namespace std;
+
+namespace {
+    // Generated routines take their arguments on the stack the way _start passes them and may use any
+    // register, the host calls them through this stub with the System V convention as
+    // entry(routine, image_handle, system_table).
+    constexpr const char* JIT_ENTRY = "__lefix_jit_entry";
+    constexpr const char* JIT_ENTRY_CODE =
+        "section .text\n"
+        "__lefix_jit_entry:\n"
+        "\tpush rbx\n"
+        "\tpush rbp\n"
+        "\tpush r12\n"
+        "\tpush r13\n"
+        "\tpush r14\n"
+        "\tpush r15\n"
+        "\tsub rsp, 8 ; the routine finds rsp aligned like under _start\n"
+        "\tpush rdx ; SystemTable\n"
+        "\tpush rsi ; ImageHandle\n"
+        "\tcall rdi\n"
+        "\tadd rsp, 24\n"
+        "\tpop r15\n"
+        "\tpop r14\n"
+        "\tpop r13\n"
+        "\tpop r12\n"
+        "\tpop rbp\n"
+        "\tpop rbx\n"
+        "\tret\n";
+
+    constexpr int FAULT_SIGNALS[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGTRAP };
+    constexpr size_t FAULT_SIGNAL_COUNT = sizeof(FAULT_SIGNALS) / sizeof(FAULT_SIGNALS[0]);
+    constexpr size_t FAULT_STACK_SIZE = 64 << 10;
+
+    thread_local sigjmp_buf* s_fault = nullptr;
+    struct sigaction s_previous[FAULT_SIGNAL_COUNT] = {};
+
+    // faults of threads that aren't running JIT code go to whoever handled them before
+    void OnFault(int signal, siginfo_t* info, void* context) {
+        if (s_fault != nullptr) {
+            siglongjmp(*s_fault, signal);
+        }
+
+        for (size_t i = 0; i < FAULT_SIGNAL_COUNT; ++i) {
+            if (FAULT_SIGNALS[i] != signal) {
+                continue;
+            }
+
+            const struct sigaction& previous = s_previous[i];
+            if (previous.sa_flags & SA_SIGINFO) {
+                previous.sa_sigaction(signal, info, context);
+            }
+            else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+                previous.sa_handler(signal);
+            }
+            else {
+                // the faulting instruction runs again and gets the default action
+                sigaction(signal, &previous, nullptr);
+            }
+        }
+    }
+
+    // Installed once and left in place, swapping them around every run would race with other threads
+    // running JIT code at the same time.
+    bool InstallFaultHandlers() {
+        struct sigaction action = {};
+        action.sa_sigaction = OnFault;
+        action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&action.sa_mask);
+
+        for (size_t i = 0; i < FAULT_SIGNAL_COUNT; ++i) {
+            sigaction(FAULT_SIGNALS[i], &action, &s_previous[i]);
+        }
+
+        return true;
+    }
+
+    string_view Trim(string_view text) {
+        size_t begin = text.find_first_not_of(" \t\r");
+        if (begin == string_view::npos) {
+            return {};
+        }
+
+        size_t end = text.find_last_not_of(" \t\r");
+        return text.substr(begin, end - begin + 1);
+    }
+
+    // splits on commas outside of brackets and quotes
+    vector<string_view> Split(string_view text) {
+        vector<string_view> parts;
+        size_t begin = 0;
+        size_t depth = 0;
+        char quote = 0;
+
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (quote != 0) {
+                quote = c == quote ? 0 : quote;
+            }
+            else if (c == '"' || c == '\'' || c == '`') {
+                quote = c;
+            }
+            else if (c == '[') {
+                ++depth;
+            }
+            else if (c == ']') {
+                --depth;
+            }
+            else if (c == ',' && depth == 0) {
+                parts.push_back(Trim(text.substr(begin, i - begin)));
+                begin = i + 1;
+            }
+        }
+
+        if (Trim(text.substr(begin)).empty() == false || parts.empty() == false) {
+            parts.push_back(Trim(text.substr(begin)));
+        }
+
+        return parts;
+    }
+
+    // decimal, 0x and h suffixed hex, 0b binary, optionally signed
+    bool ParseNumber(string_view text, int64_t& value) {
+        bool negative = false;
+        if (text.starts_with('-') || text.starts_with('+')) {
+            negative = text[0] == '-';
+            text = Trim(text.substr(1));
+        }
+
+        if (text.empty() || isdigit((uint8_t)text[0]) == false) {
+            return false;
+        }
+
+        int base = 10;
+        if (text.starts_with("0x") || text.starts_with("0X")) {
+            base = 16;
+            text = text.substr(2);
+        }
+        else if (text.ends_with('h') || text.ends_with('H')) {
+            base = 16;
+            text = text.substr(0, text.size() - 1);
+        }
+        else if (text.starts_with("0b") || text.starts_with("0B")) {
+            base = 2;
+            text = text.substr(2);
+        }
+
+        uint64_t result = 0;
+        auto [end, error] = from_chars(text.data(), text.data() + text.size(), result, base);
+        if (text.empty() || error != errc() || end != text.data() + text.size()) {
+            return false;
+        }
+
+        value = negative ? -(int64_t)result : (int64_t)result;
+        return true;
+    }
+
+    bool FitsInt8(int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    bool FitsInt32(int64_t value) {
+        return value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    // immediates of 8 to 32 bit operations may be written signed or unsigned, 64 bit ones are
+    // sign extended from 32 bits
+    void CheckImmediate(int64_t value, size_t bits) {
+        bool fits = bits >= 64 ? FitsInt32(value) : value >= -(1ll << (bits - 1)) && value < (1ll << bits);
+        ASSERT(fits, "Immediate %lld doesn't fit in %zu bits", (long long)value, min<size_t>(bits, 32));
+    }
+
+    size_t GetImmediateSize(size_t bits) {
+        return bits == 8 ? 1 : bits == 16 ? 2 : 4;
+    }
+
+    // operand size of an instruction, from its first register or sized memory operand
+    uint8_t GetSize(const vector<engine::JitOperand>& operands) {
+        for (const engine::JitOperand& operand : operands) {
+            if (operand.type == engine::JIT_OPERAND_REGISTER) {
+                return operand.size;
+            }
+        }
+
+        for (const engine::JitOperand& operand : operands) {
+            if (operand.type == engine::JIT_OPERAND_MEMORY && operand.size != 0) {
+                return operand.size;
+            }
+        }
+
+        return 0;
+    }
+
+    // the /digit of opcodes that take one in place of a register
+    engine::JitOperand Digit(uint8_t digit) {
+        engine::JitOperand operand = {};
+        operand.number = digit;
+        return operand;
+    }
+
+    bool IsRegisterOrMemory(const engine::JitOperand& operand) {
+        return operand.type == engine::JIT_OPERAND_REGISTER || operand.type == engine::JIT_OPERAND_MEMORY;
+    }
+
+    bool IsXmmOrMemory(const engine::JitOperand& operand) {
+        return operand.type == engine::JIT_OPERAND_XMM || operand.type == engine::JIT_OPERAND_MEMORY;
+    }
+}
+
+engine::Jit::Jit(string assembly)
+    : m_assembly(move(assembly)), m_section(JIT_SECTION_TEXT), m_offsets{}, m_pending(SIZE_MAX), m_memory(nullptr), m_size(0) {
+    m_assembly += JIT_ENTRY_CODE;
+}
+
+engine::Jit::~Jit() {
+    if (m_memory != nullptr) {
+        munmap(m_memory, m_size);
+    }
+}
+
+void engine::Jit::encode() {
+    string_view assembly = m_assembly;
+
+    size_t begin = 0;
+    while (begin < assembly.size()) {
+        size_t end = assembly.find('\n', begin);
+        if (end == string_view::npos) {
+            end = assembly.size();
+        }
+
+        EncodeLine(assembly.substr(begin, end - begin));
+        begin = end + 1;
+    }
+
+    // symbols and fixups own their names, the text isn't needed anymore
+    m_assembly = string();
+}
+
+void engine::Jit::EncodeLine(string_view line) {
+    line = Trim(line.substr(0, line.find(';')));
+    if (line.empty()) {
+        return;
+    }
+
+    size_t split = line.find_first_of(" \t");
+    string_view word = line.substr(0, split);
+    string_view rest = split == string_view::npos ? "" : Trim(line.substr(split));
+
+    // a label may share its line with an instruction
+    if (word.ends_with(':')) {
+        Define(word.substr(0, word.size() - 1));
+        EncodeLine(rest);
+        return;
+    }
+
+    if (IsDirective(word)) {
+        EncodeDirective(word, rest);
+        return;
+    }
+
+    if (word == "rep") {
+        const JitEncoding* encoding = JIT_MNEMONICS.find(rest);
+        ASSERT(encoding != nullptr && encoding->form == JIT_FORM_STRING, "'rep' can't prefix '%.*s'", (int)rest.size(), rest.data());
+        Emit(0xF3);
+        EncodeInstruction(rest, {});
+        return;
+    }
+
+    vector<JitOperand> operands;
+    for (string_view operand : Split(rest)) {
+        operands.push_back(ParseOperand(operand));
+    }
+
+    EncodeInstruction(word, operands);
+
+    // rip relative displacements count from the end of the instruction, immediates included
+    if (m_pending != SIZE_MAX) {
+        m_fixups[m_pending].next = m_sections[m_section].size();
+        m_pending = SIZE_MAX;
+    }
+}
+
+bool engine::Jit::IsDirective(string_view word) const {
+    return word == "%line" || word == "global" || word == "extern" || word == "default" || word == "bits" || word == "section"
+        || word == "align" || word == "resb" || word == "times" || word == "db" || word == "dw" || word == "dd" || word == "dq";
+}
+
+void engine::Jit::EncodeDirective(string_view directive, string_view rest) {
+    if (directive == "global" || directive == "extern" || directive == "default" || directive == "bits") {
+        return;
+    }
+
+    if (directive == "%line") {
+        // '%line number+increment file', the increment is always 0 from the Assembler
+        size_t split = rest.find_first_of(" \t");
+        string_view number = rest.substr(0, min(split, rest.find('+')));
+        int64_t value = 0;
+        ASSERT(ParseNumber(number, value) && value >= 0, "Invalid '%%line %.*s'", (int)rest.size(), rest.data());
+
+        if (split != string_view::npos) {
+            m_source = Trim(rest.substr(split));
+        }
+
+        if (m_section == JIT_SECTION_TEXT) {
+            m_lines.push_back({ m_sections[JIT_SECTION_TEXT].size(), (uint32_t)value });
+        }
+
+        return;
+    }
+
+    if (directive == "section") {
+        // attributes after the name are implied by it, .text.* names are all code
+        rest = rest.substr(0, rest.find_first_of(" \t"));
+
+        if (rest == ".text" || rest.starts_with(".text.")) {
+            m_section = JIT_SECTION_TEXT;
+        }
+        else if (rest == ".rodata" || rest == ".rdata") {
+            m_section = JIT_SECTION_RODATA;
+        }
+        else if (rest == ".data") {
+            m_section = JIT_SECTION_DATA;
+        }
+        else if (rest == ".bss") {
+            m_section = JIT_SECTION_BSS;
+        }
+        else {
+            CRASH("Unknown section '%.*s'", (int)rest.size(), rest.data());
+        }
+
+        return;
+    }
+
+    if (directive == "times") {
+        size_t split = rest.find_first_of(" \t");
+        int64_t count = 0;
+        ASSERT(split != string_view::npos && ParseNumber(rest.substr(0, split), count) && count >= 0, "Invalid 'times %.*s'", (int)rest.size(), rest.data());
+
+        string_view line = Trim(rest.substr(split));
+        size_t next = line.find_first_of(" \t");
+        string_view word = line.substr(0, next);
+        ASSERT(word == "db" || word == "dw" || word == "dd" || word == "dq", "Only data can be repeated with 'times'");
+
+        for (int64_t i = 0; i < count; ++i) {
+            EncodeDirective(word, next == string_view::npos ? "" : Trim(line.substr(next)));
+        }
+
+        return;
+    }
+
+    int64_t value = 0;
+    if (directive == "align") {
+        ASSERT(ParseNumber(rest, value) && value > 0 && has_single_bit((uint64_t)value), "Invalid alignment '%.*s'", (int)rest.size(), rest.data());
+
+        // code is padded with nops so falling into the padding is harmless
+        while (m_sections[m_section].size() % value != 0) {
+            Emit(m_section == JIT_SECTION_TEXT ? 0x90 : 0x00);
+        }
+
+        return;
+    }
+
+    if (directive == "resb") {
+        ASSERT(ParseNumber(rest, value) && value >= 0, "Invalid 'resb %.*s'", (int)rest.size(), rest.data());
+        m_sections[m_section].resize(m_sections[m_section].size() + value);
+        return;
+    }
+
+    const size_t width = directive == "db" ? 1 : directive == "dw" ? 2 : directive == "dd" ? 4 : 8;
+    for (string_view item : Split(rest)) {
+        if (item.size() >= 2 && (item[0] == '"' || item[0] == '\'' || item[0] == '`') && item.back() == item[0]) {
+            ASSERT(width == 1, "Strings are only supported with 'db'");
+            for (char c : item.substr(1, item.size() - 2)) {
+                Emit(c);
+            }
+        }
+        else if (ParseNumber(item, value)) {
+            EmitValue(value, width);
+        }
+        else {
+            ASSERT(width == 8, "Addresses are only supported with 'dq'");
+            m_fixups.push_back({ JIT_FIXUP_ABS64, m_section, m_sections[m_section].size(), 0, GetSymbol(item), 0 });
+            EmitValue(0, 8);
+        }
+    }
+}
+
+void engine::Jit::Define(string_view name) {
+    string symbol = GetSymbol(name);
+    if (name.starts_with('.') == false) {
+        m_scope = symbol;
+    }
+
+    ASSERT(m_symbols.contains(symbol) == false, "Symbol '%s' is defined twice", symbol.data());
+    m_symbols[symbol] = { m_section, m_sections[m_section].size() };
+}
+
+string engine::Jit::GetSymbol(string_view name) const {
+    // like nasm, '.name' is local to the last label without a dot
+    return name.starts_with('.') ? m_scope + string(name) : string(name);
+}
+
+engine::JitOperand engine::Jit::ParseOperand(string_view text) const {
+    JitOperand operand = {};
+    operand.base = -1;
+    operand.index = -1;
+    text = Trim(text);
+
+    constexpr pair<string_view, uint8_t> SIZES[] = {
+        { "byte", 8 }, { "word", 16 }, { "dword", 32 }, { "qword", 64 }, { "oword", 128 }, { "xmmword", 128 }
+    };
+
+    for (auto [keyword, bits] : SIZES) {
+        if (text.starts_with(keyword) && text.size() > keyword.size() && (text[keyword.size()] == ' ' || text[keyword.size()] == '[')) {
+            operand.size = bits;
+            text = Trim(text.substr(keyword.size()));
+            break;
+        }
+    }
+
+    if (text.starts_with('[')) {
+        ASSERT(text.ends_with(']'), "Unterminated memory operand '%.*s'", (int)text.size(), text.data());
+        operand.type = JIT_OPERAND_MEMORY;
+
+        string_view inner = Trim(text.substr(1, text.size() - 2));
+        if (inner.starts_with("rel ")) {
+            operand.rip = true;
+            inner = Trim(inner.substr(4));
+        }
+
+        // base + index * scale + displacement, the terms in any order
+        bool negative = false;
+        size_t begin = 0;
+        while (begin <= inner.size()) {
+            size_t end = inner.find_first_of("+-", begin);
+            if (end == string_view::npos) {
+                end = inner.size();
+            }
+
+            string_view term = Trim(inner.substr(begin, end - begin));
+            int64_t value = 0;
+
+            if (term.empty()) {
+                ASSERT(begin == 0 && end < inner.size(), "Invalid memory operand '%.*s'", (int)text.size(), text.data());
+            }
+            else if (size_t star = term.find('*'); star != string_view::npos) {
+                string_view left = Trim(term.substr(0, star));
+                string_view right = Trim(term.substr(star + 1));
+                if (JIT_REGISTERS.contains(right)) {
+                    swap(left, right);
+                }
+
+                const JitRegister* reg = JIT_REGISTERS.find(left);
+                ASSERT(reg != nullptr && reg->type == JIT_OPERAND_REGISTER && reg->size == 64 && negative == false && operand.index < 0, "Invalid index in '%.*s'", (int)text.size(), text.data());
+                ASSERT(ParseNumber(right, value) && (value == 1 || value == 2 || value == 4 || value == 8), "Invalid scale in '%.*s'", (int)text.size(), text.data());
+                operand.index = reg->number;
+                operand.scale = value;
+            }
+            else if (const JitRegister* reg = JIT_REGISTERS.find(term); reg != nullptr) {
+                ASSERT(reg->type == JIT_OPERAND_REGISTER && reg->size == 64 && negative == false, "Invalid address register in '%.*s'", (int)text.size(), text.data());
+                if (operand.base < 0) {
+                    operand.base = reg->number;
+                }
+                else {
+                    ASSERT(operand.index < 0, "Too many registers in '%.*s'", (int)text.size(), text.data());
+                    operand.index = reg->number;
+                    operand.scale = 1;
+                }
+            }
+            else if (ParseNumber(term, value)) {
+                operand.value += negative ? -value : value;
+            }
+            else {
+                ASSERT(operand.symbol.empty() && negative == false, "Invalid symbol in '%.*s'", (int)text.size(), text.data());
+                operand.symbol = GetSymbol(term);
+            }
+
+            if (end == inner.size()) {
+                break;
+            }
+
+            negative = inner[end] == '-';
+            begin = end + 1;
+        }
+
+        // rsp can't be an index, with a scale of one the registers are swapped
+        if (operand.index == 4) {
+            ASSERT(operand.scale == 1 && operand.base != 4, "rsp can't be an index in '%.*s'", (int)text.size(), text.data());
+            swap(operand.base, operand.index);
+        }
+
+        // symbols are only reachable rip relative in a mapping above 4 GB
+        if (operand.symbol.empty() == false) {
+            ASSERT(operand.base < 0 && operand.index < 0, "Symbols can't be combined with registers in '%.*s'", (int)text.size(), text.data());
+            operand.rip = true;
+        }
+
+        ASSERT(FitsInt32(operand.value), "Displacement out of range in '%.*s'", (int)text.size(), text.data());
+        return operand;
+    }
+
+    if (const JitRegister* reg = JIT_REGISTERS.find(text); reg != nullptr) {
+        operand.type = reg->type;
+        operand.number = reg->number;
+        operand.size = reg->size;
+        operand.rex = reg->rex;
+        operand.high = reg->high;
+        return operand;
+    }
+
+    if (ParseNumber(text, operand.value)) {
+        operand.type = JIT_OPERAND_IMMEDIATE;
+        return operand;
+    }
+
+    ASSERT(text.empty() == false, "Empty operand");
+    operand.type = JIT_OPERAND_SYMBOL;
+    operand.symbol = GetSymbol(text);
+    return operand;
+}
+
+void engine::Jit::Emit(uint8_t byte) {
+    m_sections[m_section].push_back(byte);
+}
+
+void engine::Jit::EmitValue(uint64_t value, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        Emit((uint8_t)(value >> (i * 8)));
+    }
+}
+
+void engine::Jit::EmitRex(bool wide, const JitOperand& reg, const JitOperand& rm) {
+    uint8_t rex = 0x40;
+    rex |= wide ? 0x08 : 0;
+    rex |= reg.number & 8 ? 0x04 : 0;
+
+    if (rm.type == JIT_OPERAND_MEMORY) {
+        rex |= rm.index >= 8 ? 0x02 : 0;
+        rex |= rm.base >= 8 ? 0x01 : 0;
+    }
+    else {
+        rex |= rm.number & 8 ? 0x01 : 0;
+    }
+
+    if (rex == 0x40 && reg.rex == false && rm.rex == false) {
+        return;
+    }
+
+    ASSERT(reg.high == false && rm.high == false, "ah, ch, dh and bh can't be used with a rex prefix");
+    Emit(rex);
+}
+
+void engine::Jit::EmitModRM(uint8_t reg, const JitOperand& rm) {
+    reg = (reg & 7) << 3;
+
+    if (rm.type != JIT_OPERAND_MEMORY) {
+        Emit(0xC0 | reg | (rm.number & 7));
+        return;
+    }
+
+    if (rm.rip) {
+        Emit(0x05 | reg);
+
+        if (rm.symbol.empty() == false) {
+            m_pending = m_fixups.size();
+            m_fixups.push_back({ JIT_FIXUP_REL32, m_section, m_sections[m_section].size(), 0, rm.symbol, rm.value });
+        }
+
+        EmitValue(rm.symbol.empty() ? rm.value : 0, 4);
+        return;
+    }
+
+    const uint8_t scale = rm.index < 0 ? 0 : countr_zero(rm.scale) << 6;
+    const uint8_t index = rm.index < 0 ? 0x20 : (rm.index & 7) << 3;
+
+    // no base is encoded as base rbp without a displacement byte, a disp32 always follows
+    if (rm.base < 0) {
+        Emit(0x04 | reg);
+        Emit(scale | index | 0x05);
+        EmitValue(rm.value, 4);
+        return;
+    }
+
+    // rbp and r13 as base always carry a displacement, rsp and r12 always need a sib byte
+    uint8_t mod = rm.value == 0 && (rm.base & 7) != 5 ? 0x00 : FitsInt8(rm.value) ? 0x40 : 0x80;
+    if (rm.index >= 0 || (rm.base & 7) == 4) {
+        Emit(mod | reg | 0x04);
+        Emit(scale | index | (rm.base & 7));
+    }
+    else {
+        Emit(mod | reg | (rm.base & 7));
+    }
+
+    if (mod == 0x40) {
+        EmitValue(rm.value, 1);
+    }
+    else if (mod == 0x80) {
+        EmitValue(rm.value, 4);
+    }
+}
+
+void engine::Jit::EmitOp(uint8_t prefix, bool wide, const JitOperand& reg, const JitOperand& rm, initializer_list<uint8_t> opcode) {
+    if (prefix != 0) {
+        Emit(prefix);
+    }
+
+    EmitRex(wide, reg, rm);
+    for (uint8_t byte : opcode) {
+        Emit(byte);
+    }
+
+    EmitModRM(reg.number, rm);
+}
+
+void engine::Jit::EmitBranch(initializer_list<uint8_t> opcode, const JitOperand& target) {
+    ASSERT(target.type == JIT_OPERAND_SYMBOL, "Branches need a label");
+
+    // always rel32, labels are resolved once everything is encoded
+    for (uint8_t byte : opcode) {
+        Emit(byte);
+    }
+
+    size_t offset = m_sections[m_section].size();
+    m_fixups.push_back({ JIT_FIXUP_REL32, m_section, offset, offset + 4, target.symbol, 0 });
+    EmitValue(0, 4);
+}
+
+void engine::Jit::EncodeInstruction(string_view mnemonic, const vector<JitOperand>& operands) {
+    auto expect = [&](size_t count) {
+        ASSERT(operands.size() == count, "'%.*s' takes %zu operands", (int)mnemonic.size(), mnemonic.data(), count);
+    };
+
+    auto invalid = [&]() {
+        CRASH("Invalid operands for '%.*s'", (int)mnemonic.size(), mnemonic.data());
+    };
+
+    const JitEncoding* encoding = JIT_MNEMONICS.find(mnemonic);
+    if (encoding == nullptr) {
+        // jcc, setcc and cmovcc carry their condition in the mnemonic
+        const uint8_t* condition = nullptr;
+
+        if (mnemonic.starts_with("j") && (condition = JIT_CONDITIONS.find(mnemonic.substr(1))) != nullptr) {
+            expect(1);
+            EmitBranch({ 0x0F, (uint8_t)(0x80 | *condition) }, operands[0]);
+        }
+        else if (mnemonic.starts_with("set") && (condition = JIT_CONDITIONS.find(mnemonic.substr(3))) != nullptr) {
+            expect(1);
+            if (IsRegisterOrMemory(operands[0]) == false || (operands[0].size != 8 && operands[0].size != 0)) {
+                invalid();
+            }
+
+            EmitOp(0, false, Digit(0), operands[0], { 0x0F, (uint8_t)(0x90 | *condition) });
+        }
+        else if (mnemonic.starts_with("cmov") && (condition = JIT_CONDITIONS.find(mnemonic.substr(4))) != nullptr) {
+            expect(2);
+            if (operands[0].type != JIT_OPERAND_REGISTER || operands[0].size == 8 || IsRegisterOrMemory(operands[1]) == false) {
+                invalid();
+            }
+
+            const uint8_t size = operands[0].size;
+            EmitOp(size == 16 ? 0x66 : 0, size == 64, operands[0], operands[1], { 0x0F, (uint8_t)(0x40 | *condition) });
+        }
+        else {
+            CRASH("The JIT can't encode '%.*s'", (int)mnemonic.size(), mnemonic.data());
+        }
+
+        return;
+    }
+
+    if (encoding->form >= JIT_FORM_SSE) {
+        EncodeSSE(*encoding, operands);
+        return;
+    }
+
+    const uint8_t size = GetSize(operands);
+    const uint8_t prefix = size == 16 ? 0x66 : 0;
+    const bool wide = size == 64;
+    const uint8_t one = size == 8 ? 0 : 1;
+
+    switch (encoding->form) {
+        case JIT_FORM_ALU:
+        case JIT_FORM_MOV:
+        case JIT_FORM_TEST: {
+            expect(2);
+            const JitOperand& dst = operands[0];
+            const JitOperand& src = operands[1];
+            ASSERT(size != 0, "Operand size of '%.*s' is unknown", (int)mnemonic.size(), mnemonic.data());
+
+            if (dst.type == JIT_OPERAND_REGISTER && src.type == JIT_OPERAND_REGISTER && dst.size != src.size) {
+                invalid();
+            }
+
+            if (encoding->form == JIT_FORM_MOV && dst.type == JIT_OPERAND_REGISTER && (src.type == JIT_OPERAND_IMMEDIATE || src.type == JIT_OPERAND_SYMBOL)) {
+                // the register is part of the opcode, 64 bit values that fit zero extended use the 32 bit form
+                if (src.type == JIT_OPERAND_SYMBOL) {
+                    ASSERT(size == 64, "Addresses need a 64 bit register");
+                    EmitRex(true, Digit(0), dst);
+                    Emit(0xB8 | (dst.number & 7));
+                    m_fixups.push_back({ JIT_FIXUP_ABS64, m_section, m_sections[m_section].size(), 0, src.symbol, 0 });
+                    EmitValue(0, 8);
+                }
+                else if (size == 64 && (src.value < 0 || src.value > UINT32_MAX)) {
+                    if (FitsInt32(src.value)) {
+                        EmitOp(0, true, Digit(0), dst, { 0xC7 });
+                        EmitValue(src.value, 4);
+                    }
+                    else {
+                        EmitRex(true, Digit(0), dst);
+                        Emit(0xB8 | (dst.number & 7));
+                        EmitValue(src.value, 8);
+                    }
+                }
+                else {
+                    CheckImmediate(src.value, size == 64 ? 32 : size);
+                    if (prefix != 0) {
+                        Emit(prefix);
+                    }
+
+                    EmitRex(false, Digit(0), dst);
+                    Emit((size == 8 ? 0xB0 : 0xB8) | (dst.number & 7));
+                    EmitValue(src.value, size == 64 ? 4 : GetImmediateSize(size));
+                }
+            }
+            else if (src.type == JIT_OPERAND_IMMEDIATE) {
+                if (IsRegisterOrMemory(dst) == false) {
+                    invalid();
+                }
+
+                CheckImmediate(src.value, size);
+                if (encoding->form == JIT_FORM_ALU && size != 8 && FitsInt8(src.value)) {
+                    EmitOp(prefix, wide, Digit(encoding->digit), dst, { 0x83 });
+                    EmitValue(src.value, 1);
+                }
+                else {
+                    const uint8_t opcode = encoding->form == JIT_FORM_ALU ? 0x80 : encoding->form == JIT_FORM_MOV ? 0xC6 : 0xF6;
+                    EmitOp(prefix, wide, Digit(encoding->form == JIT_FORM_ALU ? encoding->digit : 0), dst, { (uint8_t)(opcode | one) });
+                    EmitValue(src.value, GetImmediateSize(size));
+                }
+            }
+            else {
+                // reg, r/m and r/m, reg, test is symmetric
+                const uint8_t base = encoding->form == JIT_FORM_ALU ? encoding->digit * 8 : encoding->form == JIT_FORM_MOV ? 0x88 : 0x84;
+                if (src.type == JIT_OPERAND_REGISTER && IsRegisterOrMemory(dst)) {
+                    EmitOp(prefix, wide, src, dst, { (uint8_t)(base | one) });
+                }
+                else if (dst.type == JIT_OPERAND_REGISTER && src.type == JIT_OPERAND_MEMORY) {
+                    EmitOp(prefix, wide, dst, src, { (uint8_t)((encoding->form == JIT_FORM_TEST ? base : base + 2) | one) });
+                }
+                else {
+                    invalid();
+                }
+            }
+        } break;
+        case JIT_FORM_UNARY: {
+            expect(1);
+            ASSERT(size != 0, "Operand size of '%.*s' is unknown", (int)mnemonic.size(), mnemonic.data());
+            if (IsRegisterOrMemory(operands[0]) == false) {
+                invalid();
+            }
+
+            EmitOp(prefix, wide, Digit(encoding->digit), operands[0], { (uint8_t)(0xF6 | one) });
+        } break;
+        case JIT_FORM_IMUL: {
+            ASSERT(size != 0, "Operand size of '%.*s' is unknown", (int)mnemonic.size(), mnemonic.data());
+            if (operands.size() == 1) {
+                EmitOp(prefix, wide, Digit(encoding->digit), operands[0], { (uint8_t)(0xF6 | one) });
+                break;
+            }
+
+            // 'imul reg, imm' is 'imul reg, reg, imm'
+            if (operands.size() < 2 || operands.size() > 3 || operands[0].type != JIT_OPERAND_REGISTER || size == 8) {
+                invalid();
+            }
+
+            const JitOperand& dst = operands[0];
+            const JitOperand& src = operands.size() == 3 || operands[1].type != JIT_OPERAND_IMMEDIATE ? operands[1] : operands[0];
+            const JitOperand& imm = operands.back();
+            if (IsRegisterOrMemory(src) == false) {
+                invalid();
+            }
+
+            if (imm.type != JIT_OPERAND_IMMEDIATE) {
+                expect(2);
+                EmitOp(prefix, wide, dst, src, { 0x0F, 0xAF });
+            }
+            else if (FitsInt8(imm.value)) {
+                EmitOp(prefix, wide, dst, src, { 0x6B });
+                EmitValue(imm.value, 1);
+            }
+            else {
+                CheckImmediate(imm.value, size);
+                EmitOp(prefix, wide, dst, src, { 0x69 });
+                EmitValue(imm.value, GetImmediateSize(size));
+            }
+        } break;
+        case JIT_FORM_SHIFT: {
+            expect(2);
+            const JitOperand& dst = operands[0];
+            const JitOperand& count = operands[1];
+            ASSERT(size != 0, "Operand size of '%.*s' is unknown", (int)mnemonic.size(), mnemonic.data());
+            if (IsRegisterOrMemory(dst) == false) {
+                invalid();
+            }
+
+            if (count.type == JIT_OPERAND_IMMEDIATE && count.value == 1) {
+                EmitOp(prefix, wide, Digit(encoding->digit), dst, { (uint8_t)(0xD0 | one) });
+            }
+            else if (count.type == JIT_OPERAND_IMMEDIATE) {
+                CheckImmediate(count.value, 8);
+                EmitOp(prefix, wide, Digit(encoding->digit), dst, { (uint8_t)(0xC0 | one) });
+                EmitValue(count.value, 1);
+            }
+            else if (count.type == JIT_OPERAND_REGISTER && count.number == 1 && count.size == 8 && count.high == false) {
+                EmitOp(prefix, wide, Digit(encoding->digit), dst, { (uint8_t)(0xD2 | one) });
+            }
+            else {
+                invalid();
+            }
+        } break;
+        case JIT_FORM_EXTEND: {
+            expect(2);
+            const JitOperand& dst = operands[0];
+            const JitOperand& src = operands[1];
+            if (dst.type != JIT_OPERAND_REGISTER || dst.size == 8 || IsRegisterOrMemory(src) == false || (src.size != 8 && src.size != 16)) {
+                invalid();
+            }
+
+            EmitOp(dst.size == 16 ? 0x66 : 0, dst.size == 64, dst, src, { 0x0F, (uint8_t)(encoding->opcode | (src.size == 16)) });
+        } break;
+        case JIT_FORM_MOVSXD: {
+            expect(2);
+            if (operands[0].type != JIT_OPERAND_REGISTER || operands[0].size != 64 || IsRegisterOrMemory(operands[1]) == false) {
+                invalid();
+            }
+
+            EmitOp(0, true, operands[0], operands[1], { 0x63 });
+        } break;
+        case JIT_FORM_LEA: {
+            expect(2);
+            if (operands[0].type != JIT_OPERAND_REGISTER || operands[0].size == 8 || operands[1].type != JIT_OPERAND_MEMORY) {
+                invalid();
+            }
+
+            EmitOp(operands[0].size == 16 ? 0x66 : 0, operands[0].size == 64, operands[0], operands[1], { 0x8D });
+        } break;
+        case JIT_FORM_JMP:
+        case JIT_FORM_CALL: {
+            expect(1);
+            const bool call = encoding->form == JIT_FORM_CALL;
+
+            if (operands[0].type == JIT_OPERAND_SYMBOL) {
+                EmitBranch({ (uint8_t)(call ? 0xE8 : 0xE9) }, operands[0]);
+            }
+            else if (IsRegisterOrMemory(operands[0]) && (operands[0].size == 64 || operands[0].size == 0)) {
+                EmitOp(0, false, Digit(call ? 2 : 4), operands[0], { 0xFF });
+            }
+            else {
+                invalid();
+            }
+        } break;
+        case JIT_FORM_PUSH:
+        case JIT_FORM_POP: {
+            expect(1);
+            const JitOperand& operand = operands[0];
+            const bool push = encoding->form == JIT_FORM_PUSH;
+
+            if (operand.type == JIT_OPERAND_REGISTER && operand.size == 64) {
+                EmitRex(false, Digit(0), operand);
+                Emit((push ? 0x50 : 0x58) | (operand.number & 7));
+            }
+            else if (operand.type == JIT_OPERAND_MEMORY && (operand.size == 64 || operand.size == 0)) {
+                EmitOp(0, false, Digit(push ? 6 : 0), operand, { (uint8_t)(push ? 0xFF : 0x8F) });
+            }
+            else if (push && operand.type == JIT_OPERAND_IMMEDIATE) {
+                CheckImmediate(operand.value, 64);
+                Emit(FitsInt8(operand.value) ? 0x6A : 0x68);
+                EmitValue(operand.value, FitsInt8(operand.value) ? 1 : 4);
+            }
+            else {
+                invalid();
+            }
+        } break;
+        case JIT_FORM_RET: {
+            if (operands.empty()) {
+                Emit(0xC3);
+                break;
+            }
+
+            expect(1);
+            ASSERT(operands[0].type == JIT_OPERAND_IMMEDIATE && operands[0].value >= 0 && operands[0].value <= UINT16_MAX, "Invalid 'ret' operand");
+            Emit(0xC2);
+            EmitValue(operands[0].value, 2);
+        } break;
+        case JIT_FORM_INT: {
+            expect(1);
+            ASSERT(operands[0].type == JIT_OPERAND_IMMEDIATE && operands[0].value >= 0 && operands[0].value <= UINT8_MAX, "Invalid interrupt vector");
+            Emit(0xCD);
+            EmitValue(operands[0].value, 1);
+        } break;
+        case JIT_FORM_FIXED:
+        case JIT_FORM_STRING: {
+            expect(0);
+            if (encoding->prefix != 0) {
+                Emit(encoding->prefix);
+            }
+
+            Emit(encoding->opcode);
+        } break;
+        default: invalid(); break;
+    }
+}
+
+void engine::Jit::EncodeSSE(const JitEncoding& encoding, const vector<JitOperand>& operands) {
+    // the mandatory prefix comes before rex, everything is in the 0F map
+    ASSERT(operands.size() == (encoding.form == JIT_FORM_SSE_SHUFFLE ? 3 : 2), "Wrong operand count for a sse instruction");
+    const JitOperand& dst = operands[0];
+    const JitOperand& src = operands[1];
+
+    switch (encoding.form) {
+        case JIT_FORM_SSE: {
+            ASSERT(dst.type == JIT_OPERAND_XMM && IsXmmOrMemory(src), "Invalid sse operands");
+            EmitOp(encoding.prefix, false, dst, src, { 0x0F, encoding.opcode });
+        } break;
+        case JIT_FORM_SSE_MOVE: {
+            if (dst.type == JIT_OPERAND_XMM && IsXmmOrMemory(src)) {
+                EmitOp(encoding.prefix, false, dst, src, { 0x0F, encoding.opcode });
+            }
+            else {
+                ASSERT(dst.type == JIT_OPERAND_MEMORY && src.type == JIT_OPERAND_XMM, "Invalid sse operands");
+                EmitOp(encoding.prefix, false, src, dst, { 0x0F, encoding.extra });
+            }
+        } break;
+        case JIT_FORM_SSE_SHUFFLE: {
+            ASSERT(dst.type == JIT_OPERAND_XMM && IsXmmOrMemory(src) && operands[2].type == JIT_OPERAND_IMMEDIATE, "Invalid sse operands");
+            CheckImmediate(operands[2].value, 8);
+            EmitOp(encoding.prefix, false, dst, src, { 0x0F, encoding.opcode });
+            EmitValue(operands[2].value, 1);
+        } break;
+        case JIT_FORM_SSE_SHIFT: {
+            ASSERT(dst.type == JIT_OPERAND_XMM, "Invalid sse operands");
+            if (src.type == JIT_OPERAND_IMMEDIATE) {
+                CheckImmediate(src.value, 8);
+                EmitOp(encoding.prefix, false, Digit(encoding.digit), dst, { 0x0F, encoding.extra });
+                EmitValue(src.value, 1);
+            }
+            else {
+                ASSERT(IsXmmOrMemory(src), "Invalid sse operands");
+                EmitOp(encoding.prefix, false, dst, src, { 0x0F, encoding.opcode });
+            }
+        } break;
+        case JIT_FORM_MOVD:
+        case JIT_FORM_MOVQ: {
+            // general registers go through 6E/7E, with rex.w for movq, xmm and memory movq has its own forms
+            const bool wide = encoding.form == JIT_FORM_MOVQ;
+            if (dst.type == JIT_OPERAND_XMM && (src.type == JIT_OPERAND_REGISTER || (src.type == JIT_OPERAND_MEMORY && wide == false))) {
+                EmitOp(0x66, wide, dst, src, { 0x0F, 0x6E });
+            }
+            else if (src.type == JIT_OPERAND_XMM && (dst.type == JIT_OPERAND_REGISTER || (dst.type == JIT_OPERAND_MEMORY && wide == false))) {
+                EmitOp(0x66, wide, src, dst, { 0x0F, 0x7E });
+            }
+            else if (wide && dst.type == JIT_OPERAND_XMM && IsXmmOrMemory(src)) {
+                EmitOp(0xF3, false, dst, src, { 0x0F, 0x7E });
+            }
+            else if (wide && dst.type == JIT_OPERAND_MEMORY && src.type == JIT_OPERAND_XMM) {
+                EmitOp(0x66, false, src, dst, { 0x0F, 0xD6 });
+            }
+            else {
+                CRASH("Invalid operands for '%s'", wide ? "movq" : "movd");
+            }
+        } break;
+        default: CRASH("Not a sse form"); break;
+    }
+}
+
+uint8_t* engine::Jit::GetBase(JitSection section) const {
+    return m_memory + m_offsets[section];
+}
+
+uint8_t* engine::Jit::GetAddress(const string& symbol) const {
+    auto it = m_symbols.find(symbol);
+    ASSERT(it != m_symbols.end(), "Undefined symbol '%s'", symbol.data());
+    return GetBase(it->second.section) + it->second.offset;
+}
+
+void engine::Jit::load() {
+    // Every section shares one mapping so rip relative references always reach. Text and rodata get
+    // pages of their own to be made read/execute and read only, bss directly follows data.
+    ASSERT(m_memory == nullptr, "JIT code is already loaded");
+    const size_t page = sysconf(_SC_PAGESIZE);
+    auto align = [](size_t value, size_t alignment) { return (value + alignment - 1) / alignment * alignment; };
+
+    size_t offset = 0;
+    for (size_t i = 0; i < JIT_SECTION_COUNT; ++i) {
+        offset = align(offset, i == JIT_SECTION_BSS ? 64 : page);
+        m_offsets[i] = offset;
+        offset += m_sections[i].size();
+    }
+
+    m_size = max(page, align(offset, page));
+    void* memory = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(memory != MAP_FAILED, "Failed to map %zu bytes for the JIT", m_size);
+    m_memory = (uint8_t*)memory;
+
+    for (size_t i = 0; i < JIT_SECTION_COUNT; ++i) {
+        if (m_sections[i].empty() == false) {
+            memcpy(GetBase((JitSection)i), m_sections[i].data(), m_sections[i].size());
+        }
+    }
+
+    for (const JitFixup& fixup : m_fixups) {
+        uint8_t* target = GetAddress(fixup.symbol) + fixup.addend;
+        uint8_t* field = GetBase(fixup.section) + fixup.offset;
+
+        if (fixup.type == JIT_FIXUP_REL32) {
+            int64_t distance = target - (GetBase(fixup.section) + fixup.next);
+            ASSERT(FitsInt32(distance), "'%s' is out of rel32 range", fixup.symbol.data());
+
+            int32_t value = distance;
+            memcpy(field, &value, sizeof(value));
+        }
+        else {
+            uint64_t value = (uint64_t)target;
+            memcpy(field, &value, sizeof(value));
+        }
+    }
+
+    const size_t text = m_offsets[JIT_SECTION_RODATA] - m_offsets[JIT_SECTION_TEXT];
+    const size_t rodata = m_offsets[JIT_SECTION_DATA] - m_offsets[JIT_SECTION_RODATA];
+
+    ASSERT(mprotect(GetBase(JIT_SECTION_TEXT), text, PROT_READ | PROT_EXEC) == 0, "Failed to make the JIT code executable");
+    if (rodata > 0) {
+        ASSERT(mprotect(GetBase(JIT_SECTION_RODATA), rodata, PROT_READ) == 0, "Failed to protect the JIT rodata");
+    }
+}
+
+string engine::Jit::writePerfMap() const {
+    ASSERT(m_memory != nullptr, "JIT code has to be loaded before it is mapped");
+
+    // routines are the labels in text without a dot, each runs until the next one
+    vector<pair<size_t, string>> routines;
+    for (const auto& [name, symbol] : m_symbols) {
+        if (symbol.section == JIT_SECTION_TEXT && name.find('.') == string::npos) {
+            routines.emplace_back(symbol.offset, name);
+        }
+    }
+
+    sort(routines.begin(), routines.end());
+
+    string map;
+    auto write = [&](size_t begin, size_t end, const string& name) {
+        if (end > begin) {
+            char line[64];
+            snprintf(line, sizeof(line), "%llx %zx ", (unsigned long long)(GetBase(JIT_SECTION_TEXT) + begin), end - begin);
+            map += line + name + "\n";
+        }
+    };
+
+    // a routine with line markers is split into one entry per run of code from the same line
+    size_t mark = 0;
+    for (size_t i = 0; i < routines.size(); ++i) {
+        const auto& [begin, name] = routines[i];
+        const size_t end = i + 1 < routines.size() ? routines[i + 1].first : m_sections[JIT_SECTION_TEXT].size();
+
+        while (mark < m_lines.size() && m_lines[mark].offset < begin) {
+            ++mark;
+        }
+
+        size_t start = begin;
+        uint32_t line = 0;
+        for (; mark < m_lines.size() && m_lines[mark].offset < end; ++mark) {
+            if (m_lines[mark].line == line) {
+                continue;
+            }
+
+            write(start, m_lines[mark].offset, line == 0 ? name : name + " " + m_source + ":" + to_string(line));
+            start = max(start, m_lines[mark].offset);
+            line = m_lines[mark].line;
+        }
+
+        write(start, end, line == 0 ? name : name + " " + m_source + ":" + to_string(line));
+    }
+
+    // every JIT of the process adds its code to the same map, one write keeps concurrent ones whole
+    const string path = "/tmp/perf-" + to_string(getpid()) + ".map";
+    int file = open(path.data(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    ASSERT(file >= 0, "Failed to open '%s'", path.data());
+
+    ssize_t written = ::write(file, map.data(), map.size());
+    close(file);
+    ASSERT(written == (ssize_t)map.size(), "Failed to write '%s'", path.data());
+
+    return path;
+}
+
+uint64_t engine::Jit::run(const string& routine, uint64_t image_handle, uint64_t system_table) {
+    ASSERT(m_memory != nullptr, "JIT code has to be loaded before it runs");
+
+    using Entry = uint64_t (*)(const uint8_t* routine, uint64_t image_handle, uint64_t system_table);
+    Entry entry = (Entry)GetAddress(JIT_ENTRY);
+    const uint8_t* target = GetAddress(routine);
+
+    // A fault in the program comes back here instead of killing the compiler without a word. The
+    // handler runs on a stack of its own so runaway recursion is reported too.
+    vector<uint8_t> stack(FAULT_STACK_SIZE);
+    stack_t alternate = {};
+    stack_t previous_stack = {};
+    alternate.ss_sp = stack.data();
+    alternate.ss_size = stack.size();
+    sigaltstack(&alternate, &previous_stack);
+
+    static const bool installed = InstallFaultHandlers();
+    (void)installed;
+
+    sigjmp_buf fault;
+    s_fault = &fault;
+
+    uint64_t result = 0;
+    int signal = sigsetjmp(fault, 1);
+    if (signal == 0) {
+        result = entry(target, image_handle, system_table);
+    }
+
+    s_fault = nullptr;
+    sigaltstack(&previous_stack, nullptr);
+
+    ASSERT(signal == 0, "'%s' raised %s", routine.data(), strsignal(signal));
+    return result;
+}
\ No newline at end of file
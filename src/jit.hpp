@@ -0,0 +1,301 @@
+#ifndef HPP_JIT
+#define HPP_JIT
+
+#include "lookup.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <initializer_list>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    enum JitSection {
+        JIT_SECTION_TEXT = 0,
+        JIT_SECTION_RODATA,
+        JIT_SECTION_DATA,
+        JIT_SECTION_BSS,
+        JIT_SECTION_COUNT
+    };
+
+    enum JitFixupType {
+        JIT_FIXUP_REL32 = 0,        // rip relative, from the end of the instruction
+        JIT_FIXUP_ABS64             // absolute address, 'dq label' and 'mov r64, label'
+    };
+
+    struct JitFixup {
+        JitFixupType type;
+        JitSection section;
+        size_t offset;              // of the field in its section
+        size_t next;                // of the instruction after it, rel32 only
+        string symbol;
+        int64_t addend;
+    };
+
+    struct JitSymbol {
+        JitSection section;
+        size_t offset;
+    };
+
+    // the code from 'offset' of text on came from 'line' of the source, set by '%line'
+    struct JitLine {
+        size_t offset;
+        uint32_t line;
+    };
+
+    enum JitOperandType {
+        JIT_OPERAND_NONE = 0,
+        JIT_OPERAND_REGISTER,
+        JIT_OPERAND_XMM,
+        JIT_OPERAND_MEMORY,
+        JIT_OPERAND_IMMEDIATE,
+        JIT_OPERAND_SYMBOL
+    };
+
+    struct JitRegister {
+        JitOperandType type;
+        uint8_t number;
+        uint8_t size;               // bits, 128 for xmm
+        bool rex;                   // spl, bpl, sil and dil only exist with a rex prefix
+        bool high;                  // ah, ch, dh and bh can't be encoded with one
+    };
+
+    struct JitOperand {
+        JitOperandType type;
+        uint8_t size;               // bits, 0 for memory without a size keyword
+        uint8_t number;             // register
+        bool rex;
+        bool high;
+        int8_t base;                // memory, -1 when absent
+        int8_t index;
+        uint8_t scale;
+        bool rip;
+        int64_t value;              // displacement or immediate
+        string symbol;
+    };
+
+    enum JitForm {
+        JIT_FORM_ALU = 0,           // add or and sub xor cmp, 'digit' is the group and opcode / 8
+        JIT_FORM_MOV,
+        JIT_FORM_TEST,
+        JIT_FORM_UNARY,             // F6/F7 /digit
+        JIT_FORM_IMUL,
+        JIT_FORM_SHIFT,             // D0 D2 C0 /digit
+        JIT_FORM_EXTEND,            // movzx movsx, 'opcode' is the 8 bit source form
+        JIT_FORM_MOVSXD,
+        JIT_FORM_LEA,
+        JIT_FORM_JMP,
+        JIT_FORM_CALL,
+        JIT_FORM_PUSH,
+        JIT_FORM_POP,
+        JIT_FORM_RET,
+        JIT_FORM_INT,
+        JIT_FORM_FIXED,             // 'prefix' when set, then 'opcode'
+        JIT_FORM_STRING,            // like fixed, the only form 'rep' may come before
+        JIT_FORM_SSE,               // xmm, xmm/m128
+        JIT_FORM_SSE_MOVE,          // 'opcode' loads, 'extra' stores
+        JIT_FORM_SSE_SHUFFLE,       // xmm, xmm/m128, imm8
+        JIT_FORM_SSE_SHIFT,         // 'opcode' by xmm, 'extra' /digit by imm8
+        JIT_FORM_MOVD,
+        JIT_FORM_MOVQ
+    };
+
+    struct JitEncoding {
+        JitForm form;
+        uint8_t prefix;
+        uint8_t opcode;
+        uint8_t digit;
+        uint8_t extra;
+    };
+
+    inline constexpr PerfectMap<JitRegister, 84> JIT_REGISTERS({
+        { "rax", { JIT_OPERAND_REGISTER, 0, 64 } }, { "rcx", { JIT_OPERAND_REGISTER, 1, 64 } },
+        { "rdx", { JIT_OPERAND_REGISTER, 2, 64 } }, { "rbx", { JIT_OPERAND_REGISTER, 3, 64 } },
+        { "rsp", { JIT_OPERAND_REGISTER, 4, 64 } }, { "rbp", { JIT_OPERAND_REGISTER, 5, 64 } },
+        { "rsi", { JIT_OPERAND_REGISTER, 6, 64 } }, { "rdi", { JIT_OPERAND_REGISTER, 7, 64 } },
+        { "r8", { JIT_OPERAND_REGISTER, 8, 64 } }, { "r9", { JIT_OPERAND_REGISTER, 9, 64 } },
+        { "r10", { JIT_OPERAND_REGISTER, 10, 64 } }, { "r11", { JIT_OPERAND_REGISTER, 11, 64 } },
+        { "r12", { JIT_OPERAND_REGISTER, 12, 64 } }, { "r13", { JIT_OPERAND_REGISTER, 13, 64 } },
+        { "r14", { JIT_OPERAND_REGISTER, 14, 64 } }, { "r15", { JIT_OPERAND_REGISTER, 15, 64 } },
+        { "eax", { JIT_OPERAND_REGISTER, 0, 32 } }, { "ecx", { JIT_OPERAND_REGISTER, 1, 32 } },
+        { "edx", { JIT_OPERAND_REGISTER, 2, 32 } }, { "ebx", { JIT_OPERAND_REGISTER, 3, 32 } },
+        { "esp", { JIT_OPERAND_REGISTER, 4, 32 } }, { "ebp", { JIT_OPERAND_REGISTER, 5, 32 } },
+        { "esi", { JIT_OPERAND_REGISTER, 6, 32 } }, { "edi", { JIT_OPERAND_REGISTER, 7, 32 } },
+        { "r8d", { JIT_OPERAND_REGISTER, 8, 32 } }, { "r9d", { JIT_OPERAND_REGISTER, 9, 32 } },
+        { "r10d", { JIT_OPERAND_REGISTER, 10, 32 } }, { "r11d", { JIT_OPERAND_REGISTER, 11, 32 } },
+        { "r12d", { JIT_OPERAND_REGISTER, 12, 32 } }, { "r13d", { JIT_OPERAND_REGISTER, 13, 32 } },
+        { "r14d", { JIT_OPERAND_REGISTER, 14, 32 } }, { "r15d", { JIT_OPERAND_REGISTER, 15, 32 } },
+        { "ax", { JIT_OPERAND_REGISTER, 0, 16 } }, { "cx", { JIT_OPERAND_REGISTER, 1, 16 } },
+        { "dx", { JIT_OPERAND_REGISTER, 2, 16 } }, { "bx", { JIT_OPERAND_REGISTER, 3, 16 } },
+        { "sp", { JIT_OPERAND_REGISTER, 4, 16 } }, { "bp", { JIT_OPERAND_REGISTER, 5, 16 } },
+        { "si", { JIT_OPERAND_REGISTER, 6, 16 } }, { "di", { JIT_OPERAND_REGISTER, 7, 16 } },
+        { "r8w", { JIT_OPERAND_REGISTER, 8, 16 } }, { "r9w", { JIT_OPERAND_REGISTER, 9, 16 } },
+        { "r10w", { JIT_OPERAND_REGISTER, 10, 16 } }, { "r11w", { JIT_OPERAND_REGISTER, 11, 16 } },
+        { "r12w", { JIT_OPERAND_REGISTER, 12, 16 } }, { "r13w", { JIT_OPERAND_REGISTER, 13, 16 } },
+        { "r14w", { JIT_OPERAND_REGISTER, 14, 16 } }, { "r15w", { JIT_OPERAND_REGISTER, 15, 16 } },
+        { "al", { JIT_OPERAND_REGISTER, 0, 8 } }, { "cl", { JIT_OPERAND_REGISTER, 1, 8 } },
+        { "dl", { JIT_OPERAND_REGISTER, 2, 8 } }, { "bl", { JIT_OPERAND_REGISTER, 3, 8 } },
+        { "spl", { JIT_OPERAND_REGISTER, 4, 8, true } }, { "bpl", { JIT_OPERAND_REGISTER, 5, 8, true } },
+        { "sil", { JIT_OPERAND_REGISTER, 6, 8, true } }, { "dil", { JIT_OPERAND_REGISTER, 7, 8, true } },
+        { "r8b", { JIT_OPERAND_REGISTER, 8, 8 } }, { "r9b", { JIT_OPERAND_REGISTER, 9, 8 } },
+        { "r10b", { JIT_OPERAND_REGISTER, 10, 8 } }, { "r11b", { JIT_OPERAND_REGISTER, 11, 8 } },
+        { "r12b", { JIT_OPERAND_REGISTER, 12, 8 } }, { "r13b", { JIT_OPERAND_REGISTER, 13, 8 } },
+        { "r14b", { JIT_OPERAND_REGISTER, 14, 8 } }, { "r15b", { JIT_OPERAND_REGISTER, 15, 8 } },
+        { "ah", { JIT_OPERAND_REGISTER, 4, 8, false, true } }, { "ch", { JIT_OPERAND_REGISTER, 5, 8, false, true } },
+        { "dh", { JIT_OPERAND_REGISTER, 6, 8, false, true } }, { "bh", { JIT_OPERAND_REGISTER, 7, 8, false, true } },
+        { "xmm0", { JIT_OPERAND_XMM, 0, 128 } }, { "xmm1", { JIT_OPERAND_XMM, 1, 128 } },
+        { "xmm2", { JIT_OPERAND_XMM, 2, 128 } }, { "xmm3", { JIT_OPERAND_XMM, 3, 128 } },
+        { "xmm4", { JIT_OPERAND_XMM, 4, 128 } }, { "xmm5", { JIT_OPERAND_XMM, 5, 128 } },
+        { "xmm6", { JIT_OPERAND_XMM, 6, 128 } }, { "xmm7", { JIT_OPERAND_XMM, 7, 128 } },
+        { "xmm8", { JIT_OPERAND_XMM, 8, 128 } }, { "xmm9", { JIT_OPERAND_XMM, 9, 128 } },
+        { "xmm10", { JIT_OPERAND_XMM, 10, 128 } }, { "xmm11", { JIT_OPERAND_XMM, 11, 128 } },
+        { "xmm12", { JIT_OPERAND_XMM, 12, 128 } }, { "xmm13", { JIT_OPERAND_XMM, 13, 128 } },
+        { "xmm14", { JIT_OPERAND_XMM, 14, 128 } }, { "xmm15", { JIT_OPERAND_XMM, 15, 128 } }
+    });
+
+    // condition code suffixes of jcc, setcc and cmovcc
+    inline constexpr PerfectMap<uint8_t, 30> JIT_CONDITIONS({
+        { "o", 0x0 }, { "no", 0x1 }, { "b", 0x2 }, { "c", 0x2 }, { "nae", 0x2 }, { "ae", 0x3 },
+        { "nb", 0x3 }, { "nc", 0x3 }, { "e", 0x4 }, { "z", 0x4 }, { "ne", 0x5 }, { "nz", 0x5 },
+        { "be", 0x6 }, { "na", 0x6 }, { "a", 0x7 }, { "nbe", 0x7 }, { "s", 0x8 }, { "ns", 0x9 },
+        { "p", 0xA }, { "pe", 0xA }, { "np", 0xB }, { "po", 0xB }, { "l", 0xC }, { "nge", 0xC },
+        { "ge", 0xD }, { "nl", 0xD }, { "le", 0xE }, { "ng", 0xE }, { "g", 0xF }, { "nle", 0xF }
+    });
+
+    // every mnemonic the Assembler emits, and the common ones inline asm is likely to use
+    inline constexpr PerfectMap<JitEncoding, 74> JIT_MNEMONICS({
+        { "add", { JIT_FORM_ALU, 0, 0, 0 } },
+        { "or", { JIT_FORM_ALU, 0, 0, 1 } },
+        { "adc", { JIT_FORM_ALU, 0, 0, 2 } },
+        { "sbb", { JIT_FORM_ALU, 0, 0, 3 } },
+        { "and", { JIT_FORM_ALU, 0, 0, 4 } },
+        { "sub", { JIT_FORM_ALU, 0, 0, 5 } },
+        { "xor", { JIT_FORM_ALU, 0, 0, 6 } },
+        { "cmp", { JIT_FORM_ALU, 0, 0, 7 } },
+        { "mov", { JIT_FORM_MOV } },
+        { "test", { JIT_FORM_TEST } },
+        { "not", { JIT_FORM_UNARY, 0, 0, 2 } },
+        { "neg", { JIT_FORM_UNARY, 0, 0, 3 } },
+        { "mul", { JIT_FORM_UNARY, 0, 0, 4 } },
+        { "div", { JIT_FORM_UNARY, 0, 0, 6 } },
+        { "idiv", { JIT_FORM_UNARY, 0, 0, 7 } },
+        { "imul", { JIT_FORM_IMUL, 0, 0, 5 } },
+        { "rol", { JIT_FORM_SHIFT, 0, 0, 0 } },
+        { "ror", { JIT_FORM_SHIFT, 0, 0, 1 } },
+        { "shl", { JIT_FORM_SHIFT, 0, 0, 4 } },
+        { "sal", { JIT_FORM_SHIFT, 0, 0, 4 } },
+        { "shr", { JIT_FORM_SHIFT, 0, 0, 5 } },
+        { "sar", { JIT_FORM_SHIFT, 0, 0, 7 } },
+        { "movzx", { JIT_FORM_EXTEND, 0, 0xB6 } },
+        { "movsx", { JIT_FORM_EXTEND, 0, 0xBE } },
+        { "movsxd", { JIT_FORM_MOVSXD } },
+        { "lea", { JIT_FORM_LEA } },
+        { "jmp", { JIT_FORM_JMP } },
+        { "call", { JIT_FORM_CALL } },
+        { "push", { JIT_FORM_PUSH } },
+        { "pop", { JIT_FORM_POP } },
+        { "ret", { JIT_FORM_RET } },
+        { "int", { JIT_FORM_INT } },
+        { "int3", { JIT_FORM_FIXED, 0, 0xCC } },
+        { "nop", { JIT_FORM_FIXED, 0, 0x90 } },
+        { "hlt", { JIT_FORM_FIXED, 0, 0xF4 } },
+        { "leave", { JIT_FORM_FIXED, 0, 0xC9 } },
+        { "cwd", { JIT_FORM_FIXED, 0x66, 0x99 } },
+        { "cdq", { JIT_FORM_FIXED, 0, 0x99 } },
+        { "cqo", { JIT_FORM_FIXED, 0x48, 0x99 } },
+        { "cdqe", { JIT_FORM_FIXED, 0x48, 0x98 } },
+        { "syscall", { JIT_FORM_FIXED, 0x0F, 0x05 } },
+        { "movsb", { JIT_FORM_STRING, 0, 0xA4 } },
+        { "stosb", { JIT_FORM_STRING, 0, 0xAA } },
+        { "stosw", { JIT_FORM_STRING, 0x66, 0xAB } },
+        { "stosd", { JIT_FORM_STRING, 0, 0xAB } },
+        { "stosq", { JIT_FORM_STRING, 0x48, 0xAB } },
+        { "movdqa", { JIT_FORM_SSE_MOVE, 0x66, 0x6F, 0, 0x7F } },
+        { "movdqu", { JIT_FORM_SSE_MOVE, 0xF3, 0x6F, 0, 0x7F } },
+        { "movd", { JIT_FORM_MOVD, 0x66 } },
+        { "movq", { JIT_FORM_MOVQ, 0x66 } },
+        { "paddb", { JIT_FORM_SSE, 0x66, 0xFC } },
+        { "paddw", { JIT_FORM_SSE, 0x66, 0xFD } },
+        { "paddd", { JIT_FORM_SSE, 0x66, 0xFE } },
+        { "paddq", { JIT_FORM_SSE, 0x66, 0xD4 } },
+        { "psubb", { JIT_FORM_SSE, 0x66, 0xF8 } },
+        { "psubw", { JIT_FORM_SSE, 0x66, 0xF9 } },
+        { "psubd", { JIT_FORM_SSE, 0x66, 0xFA } },
+        { "psubq", { JIT_FORM_SSE, 0x66, 0xFB } },
+        { "pand", { JIT_FORM_SSE, 0x66, 0xDB } },
+        { "por", { JIT_FORM_SSE, 0x66, 0xEB } },
+        { "pxor", { JIT_FORM_SSE, 0x66, 0xEF } },
+        { "pmullw", { JIT_FORM_SSE, 0x66, 0xD5 } },
+        { "pcmpeqb", { JIT_FORM_SSE, 0x66, 0x74 } },
+        { "pcmpeqw", { JIT_FORM_SSE, 0x66, 0x75 } },
+        { "pcmpeqd", { JIT_FORM_SSE, 0x66, 0x76 } },
+        { "punpcklbw", { JIT_FORM_SSE, 0x66, 0x60 } },
+        { "punpcklwd", { JIT_FORM_SSE, 0x66, 0x61 } },
+        { "punpckldq", { JIT_FORM_SSE, 0x66, 0x62 } },
+        { "punpcklqdq", { JIT_FORM_SSE, 0x66, 0x6C } },
+        { "pshufd", { JIT_FORM_SSE_SHUFFLE, 0x66, 0x70 } },
+        { "pshuflw", { JIT_FORM_SSE_SHUFFLE, 0xF2, 0x70 } },
+        { "psrlw", { JIT_FORM_SSE_SHIFT, 0x66, 0xD1, 2, 0x71 } },
+        { "psrld", { JIT_FORM_SSE_SHIFT, 0x66, 0xD2, 2, 0x72 } },
+        { "psrlq", { JIT_FORM_SSE_SHIFT, 0x66, 0xD3, 2, 0x73 } }
+    });
+
+    // Encodes the Assembler's NASM output into x86-64 machine code, maps it and calls into it, so a
+    // program runs inside the compiler without nasm and ld. Only the instructions and directives in
+    // JIT_MNEMONICS are known, inline asm using anything else fails to encode.
+    class Jit {
+        public:
+            Jit(string assembly);
+            ~Jit();
+
+            Jit(const Jit&) = delete;
+            Jit& operator=(const Jit&) = delete;
+
+            void encode();
+            void load();
+            [[nodiscard]] uint64_t run(const string& routine, uint64_t image_handle, uint64_t system_table);
+
+            // adds the loaded code to /tmp/perf-<pid>.map for perf to name samples in it, and returns the path
+            [[nodiscard]] string writePerfMap() const;
+
+        private:
+            void EncodeLine(string_view line);
+            void EncodeDirective(string_view directive, string_view rest);
+            void EncodeInstruction(string_view mnemonic, const vector<JitOperand>& operands);
+            void EncodeSSE(const JitEncoding& encoding, const vector<JitOperand>& operands);
+            void Define(string_view name);
+
+            [[nodiscard]] JitOperand ParseOperand(string_view text) const;
+            [[nodiscard]] string GetSymbol(string_view name) const;
+            [[nodiscard]] bool IsDirective(string_view word) const;
+
+            void Emit(uint8_t byte);
+            void EmitValue(uint64_t value, size_t size);
+            void EmitRex(bool wide, const JitOperand& reg, const JitOperand& rm);
+            void EmitModRM(uint8_t reg, const JitOperand& rm);
+            void EmitOp(uint8_t prefix, bool wide, const JitOperand& reg, const JitOperand& rm, initializer_list<uint8_t> opcode);
+            void EmitBranch(initializer_list<uint8_t> opcode, const JitOperand& target);
+
+            [[nodiscard]] uint8_t* GetBase(JitSection section) const;
+            [[nodiscard]] uint8_t* GetAddress(const string& symbol) const;
+
+        private:
+            string m_assembly;
+            string m_scope;                 // last non-local label, '.name' labels belong to it
+            JitSection m_section;
+            vector<uint8_t> m_sections[JIT_SECTION_COUNT];
+            size_t m_offsets[JIT_SECTION_COUNT];    // of every section in the mapping
+            unordered_map<string, JitSymbol> m_symbols;
+            vector<JitFixup> m_fixups;
+            vector<JitLine> m_lines;        // in text order
+            string m_source;                // file named by the last '%line'
+            size_t m_pending;               // rip relative fixup of the instruction being encoded
+            uint8_t* m_memory;
+            size_t m_size;
+    };
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+#ifndef HPP_LOOKUP
+#define HPP_LOOKUP
+
+#include "assert.hpp"
+
+#include <string_view>
+#include <array>
+#include <bit>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    // Compile-time perfect hash over a fixed set of string keys. The seed is searched while the table
+    // is built in a constant expression, so a lookup is one hash, one slot load and one compare, with
+    // no allocation and nothing to construct at startup.
+    template <typename T, size_t N>
+    class PerfectMap {
+        public:
+            struct Entry {
+                string_view key;
+                T value;
+            };
+
+            consteval PerfectMap(const Entry (&entries)[N]) : m_entries{}, m_slots{}, m_seed(0) {
+                for (size_t i = 0; i < N; ++i) {
+                    m_entries[i] = entries[i];
+                }
+
+                for (uint32_t seed = 1; seed < 0x10000; ++seed) {
+                    if (TrySeed(seed)) {
+                        m_seed = seed;
+                        return;
+                    }
+                }
+
+                throw "no perfect hash seed found";
+            }
+
+            [[nodiscard]] constexpr const T* find(string_view key) const {
+                uint8_t slot = m_slots[Hash(key, m_seed) & (SLOTS - 1)];
+                if (slot == EMPTY || m_entries[slot].key != key) {
+                    return nullptr;
+                }
+
+                return &m_entries[slot].value;
+            }
+
+            [[nodiscard]] constexpr bool contains(string_view key) const {
+                return find(key) != nullptr;
+            }
+
+            [[nodiscard]] const T& at(string_view key) const {
+                const T* value = find(key);
+                ASSERT(value != nullptr, "Unknown key '%.*s'", (int)key.size(), key.data());
+                return *value;
+            }
+
+            [[nodiscard]] constexpr const array<Entry, N>& getEntries() const {
+                return m_entries;
+            }
+
+        private:
+            static constexpr size_t SLOTS = bit_ceil(N * 4);
+            static constexpr uint8_t EMPTY = 0xFF;
+            static_assert(N < EMPTY, "PerfectMap supports up to 254 keys");
+
+            [[nodiscard]] static constexpr uint32_t Hash(string_view key, uint32_t seed) {
+                uint32_t hash = 2166136261u ^ seed;
+                for (char c : key) {
+                    hash = (hash ^ (uint8_t)c) * 16777619u;
+                }
+
+                return hash ^ (hash >> 15);
+            }
+
+            [[nodiscard]] constexpr bool TrySeed(uint32_t seed) {
+                m_slots.fill(EMPTY);
+
+                for (size_t i = 0; i < N; ++i) {
+                    uint8_t& slot = m_slots[Hash(m_entries[i].key, seed) & (SLOTS - 1)];
+                    if (slot != EMPTY) {
+                        return false;
+                    }
+
+                    slot = i;
+                }
+
+                return true;
+            }
+
+            array<Entry, N> m_entries;
+            array<uint8_t, SLOTS> m_slots;
+            uint32_t m_seed;
+    };
+}
+
+#endif
\ No newline at end of file
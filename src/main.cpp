@@ -1,47 +1,274 @@
 #include <stdio.h>
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <charconv>
 
 #include "io.hpp"
 #include "engine.hpp"
+#include "server.hpp"
 #include "assert.hpp"
 
-int main() {
-    io::File file("example/main.lx");
-    ASSERT(file, "Failed to open file");
-
-    auto code = file.read<string>();
-    ASSERT(!code.empty(), "Failed to read file");
-    
-    printf("Step 1:\n");
-    engine::Tokenizer tokenizer(code);
-    
-    printf("\t- Cleaning\n");
-    tokenizer.cleanup();
-
-    printf("\t- Tokenizing\n");
-    tokenizer.tokenize();
-
-    printf("Step 2:\n");
-    engine::IL il(tokenizer.getTokens());
-    printf("\t- Analyzing\n");
-    il.analyze();
-
-    printf("\t- Optimizing\n");
-    il.optimize();
-
-    printf("Step 3:\n");
-    engine::Assembler assembler(il.getILs());
-    printf("\t- Translating\n");
-    assembler.translate();
-
-    printf("\t- Optimizing\n");
-    assembler.optimize();
-    
-    printf("\t- Assembling\n");
-    assembler.assemble();
-
-    printf("\t- Saving\n");
-    assembler.create("example/main.asm");
-
-    return EXIT_SUCCESS;
+struct Options {
+    string input = "example/main.lx";
+    string output = "example/main.asm";
+    string emit_il;
+    string instrument;  // --run writes the profile here
+    string server;      // socket to serve compiles on
+    string client;      // socket of the server to forward this compile to
+    engine::CompileOptions compile;
+};
+
+static void Usage() {
+    printf("usage: compiler [input.lx|input.lxil] [options]\n");
+    printf("\t-o FILE          assembly output (default example/main.asm)\n");
+    printf("\t--emit-il FILE   write the analyzed IL as a binary image and stop\n");
+    printf("\t--unroll N       body copies per iteration of constant counted loops (default 4, 1 disables)\n");
+    printf("\t--specialize-budget N\n");
+    printf("\t                 percent the IL may grow by clones of functions for constant arguments (default 10, 0 disables)\n");
+    printf("\t-O0|-O1|-O2|-Os  optimization level (default -O2)\n");
+    printf("\t--enable-pass P  run the passes P (comma separated) whatever the level\n");
+    printf("\t--disable-pass P skip the passes P (comma separated)\n");
+    printf("\t--pass-stats     print the time and changes of every pass that ran\n");
+    printf("\t                 passes:");
+    for (const auto& [name, info] : engine::PASSES.getEntries()) {
+        printf(" %.*s", (int)name.size(), name.data());
+    }
+    printf("\n");
+    printf("\t--align N        align function entries to N bytes (default 16, 1 disables)\n");
+    printf("\t--run            run efi_main in process, the exit code is its result like under _start\n");
+    printf("\t--instrument OUT count function entries and calls, with --run the profile is written to OUT\n");
+    printf("\t--profile-use IN optimize with the profile IN of an instrumented run\n");
+    printf("\t--hook PLUGIN    load a compiler hook (a shared library, see hooks.hpp), may be repeated\n");
+    printf("\t-g               emit symbol sizes and source lines, with --run also a perf map of the JIT code\n");
+    printf("\t--server SOCKET  serve compiles on a unix socket until killed\n");
+    printf("\t--client SOCKET  compile through the server on SOCKET\n");
+}
+
+// empty if the file can't be read
+static string Read(const string& path) {
+    ifstream stream(path, ios::binary);
+    return string((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+}
+
+// the whole text has to be a decimal number that fits
+static bool ParseNumber(const string& text, uint32_t& value) {
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), value);
+    return error == errc() && end == text.data() + text.size();
+}
+
+// false on anything it doesn't know, the caller prints the usage
+static bool ParseOptions(const vector<string>& args, Options& options) {
+    for (size_t i = 0; i < args.size(); ++i) {
+        const string& arg = args[i];
+        bool value = i + 1 < args.size();
+
+        if (arg == "-o" && value) {
+            options.output = args[++i];
+        }
+        else if (arg == "--emit-il" && value) {
+            options.emit_il = args[++i];
+            options.compile.emit_il = true;
+        }
+        else if (arg == "--unroll" && value) {
+            if (ParseNumber(args[++i], options.compile.unroll) == false) {
+                return false;
+            }
+        }
+        else if (arg == "--specialize-budget" && value) {
+            if (ParseNumber(args[++i], options.compile.specialize_budget) == false) {
+                return false;
+            }
+        }
+        else if (engine::PassManager::parseLevel(arg, options.compile.level)) {
+            continue;
+        }
+        else if ((arg == "--enable-pass" || arg == "--disable-pass") && value) {
+            string_view list = args[++i];
+            while (list.empty() == false) {
+                string_view name = list.substr(0, list.find(','));
+                if (engine::PASSES.contains(name) == false) {
+                    return false;
+                }
+
+                options.compile.passes.emplace_back(name, arg == "--enable-pass");
+                list.remove_prefix(min(list.size(), name.size() + 1));
+            }
+        }
+        else if (arg == "--hook" && value) {
+            options.compile.hooks.push_back(args[++i]);
+        }
+        else if (arg == "--pass-stats") {
+            options.compile.pass_stats = true;
+        }
+        else if (arg == "--align" && value) {
+            if (ParseNumber(args[++i], options.compile.align) == false) {
+                return false;
+            }
+        }
+        else if (arg == "--run") {
+            options.compile.run = true;
+        }
+        else if (arg == "-g") {
+            options.compile.debug = true;
+        }
+        else if (arg == "--instrument" && value) {
+            options.instrument = args[++i];
+            options.compile.instrument = true;
+        }
+        else if (arg == "--profile-use" && value) {
+            options.compile.profile_use = Read(args[++i]);
+            ASSERT(options.compile.profile_use.empty() == false, "Failed to open profile '%s'", args[i].data());
+        }
+        else if (arg == "--server" && value) {
+            options.server = args[++i];
+        }
+        else if (arg == "--client" && value) {
+            options.client = args[++i];
+        }
+        else if (arg.starts_with("-") == false) {
+            options.input = arg;
+            options.compile.source = arg;
+        }
+        else {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// prints what the compile did and keeps what it produced, 'output' is what the output file gets
+static int Finish(const Options& options, const engine::CompileResult& result, string& output) {
+    fwrite(result.log.data(), 1, result.log.size(), stdout);
+
+    if (result.profile.empty() == false) {
+        io::File file(options.instrument);
+        ASSERT(file, "Failed to open '%s'", options.instrument.data());
+        file.clear();
+        file.write(result.profile);
+        printf("\t- Wrote profile %s\n", options.instrument.data());
+    }
+
+    output = result.output;
+    return result.status;
+}
+
+static void Save(const Options& options, const string& output) {
+    const string& path = options.emit_il.empty() ? options.output : options.emit_il;
+
+    io::File file(path);
+    ASSERT(file, "Failed to open '%s'", path.data());
+    file.clear();
+    file.write(output);
+}
+
+static int Main(const vector<string>& args) {
+    Options options;
+
+    for (const string& arg : args) {
+        if (arg == "-h" || arg == "--help") {
+            Usage();
+            return EXIT_SUCCESS;
+        }
+    }
+
+    if (ParseOptions(args, options) == false) {
+        Usage();
+        return EXIT_FAILURE;
+    }
+
+    if (options.server.empty() == false) {
+        // every request is parsed like a command line of its own
+        bool served = engine::server::serve(options.server, [](const vector<string>& args, const string& input, string& output) {
+            // anything that loads, reads or writes a path on this side is refused before it gets parsed
+            for (const string& arg : args) {
+                ASSERT(arg != "--hook" && arg != "--profile-use" && arg != "--instrument" && arg != "--server" && arg != "--client",
+                    "'%s' isn't allowed in a compile request", arg.data());
+            }
+
+            Options options;
+            ASSERT(ParseOptions(args, options), "Invalid options in compile request");
+
+            engine::CompileSession session(options.compile);
+            return Finish(options, session.compile(input), output);
+        });
+
+        return served ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (options.client.empty() == false) {
+        // the input is sent as bytes and the output written here, so paths stay relative to the caller
+        string input = Read(options.input);
+        ASSERT(input.empty() == false, "Failed to open file");
+
+        // the server caches by arguments and input, files it reads itself could change behind the cache
+        ASSERT(options.compile.profile_use.empty(), "--profile-use can't be combined with --client");
+        ASSERT(options.compile.hooks.empty(), "--hook can't be combined with --client");
+        // the profile would be written where the server runs, not where the caller asked for it
+        ASSERT(options.instrument.empty(), "--instrument can't be combined with --client");
+
+        // paths mean nothing to the server, leaving them out lets the same source hit its cache from anywhere
+        vector<string> forwarded;
+        for (size_t i = 0; i < args.size(); ++i) {
+            if (args[i] == "--client" || args[i] == "-o") {
+                ++i;
+                continue;
+            }
+
+            if (args[i].starts_with("-") == false) {
+                continue;
+            }
+
+            forwarded.push_back(args[i]);
+            if ((args[i] == "--emit-il" || args[i] == "--unroll" || args[i] == "--specialize-budget" || args[i] == "--align"
+                || args[i] == "--enable-pass" || args[i] == "--disable-pass") && i + 1 < args.size()) {
+                forwarded.push_back(args[++i]);
+            }
+        }
+
+        engine::server::Response response = engine::server::request(options.client, forwarded, input);
+        fwrite(response.log.data(), 1, response.log.size(), stdout);
+
+        if (response.status == EXIT_SUCCESS && options.compile.run == false) {
+            Save(options, response.output);
+        }
+
+        return response.status;
+    }
+
+    string output;
+    int status = EXIT_SUCCESS;
+    engine::CompileSession session(options.compile);
+
+    engine::ILImage image(options.input);
+    if (!image) {
+        io::File file(options.input);
+        ASSERT(file, "Failed to open file");
+
+        auto code = file.read<string>();
+        ASSERT(!code.empty(), "Failed to read file");
+
+        status = Finish(options, session.compile(move(code)), output);
+    }
+    else {
+        status = Finish(options, session.compile(image), output);
+    }
+
+    if (options.compile.run == false && status == EXIT_SUCCESS) {
+        Save(options, output);
+    }
+
+    return status;
+}
+
+int main(int argc, char** argv) {
+    // errors outside a compile, like an unreadable input, end up here
+    try {
+        return Main(vector<string>(argv + 1, argv + argc));
+    }
+    catch (const engine::Error& error) {
+        printf("%s\n", error.what());
+        return EXIT_FAILURE;
+    }
 }
\ No newline at end of file
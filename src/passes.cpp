@@ -0,0 +1,84 @@
+#include "passes.hpp"
+#include "assert.hpp"
+
+#include <chrono>
+
+using namespace std;
+
+namespace {
+    // the name as it is in PASSES, which outlives any string it is looked up with
+    string_view GetKey(string_view name) {
+        for (const auto& entry : engine::PASSES.getEntries()) {
+            if (entry.key == name) {
+                return entry.key;
+            }
+        }
+
+        return {};
+    }
+}
+
+engine::PassManager::PassManager(OptLevel level) : m_level(level) {
+}
+
+engine::PassManager::~PassManager() {
+}
+
+bool engine::PassManager::setEnabled(string_view name, bool enabled) {
+    string_view key = GetKey(name);
+    if (key.empty()) {
+        return false;
+    }
+
+    m_enabled[key] = enabled;
+    return true;
+}
+
+bool engine::PassManager::isEnabled(string_view name) const {
+    auto it = m_enabled.find(name);
+    if (it != m_enabled.end()) {
+        return it->second;
+    }
+
+    return (PASSES.at(name).levels & (1 << m_level)) != 0;
+}
+
+void engine::PassManager::add(string_view name, function<size_t()> pass) {
+    string_view key = GetKey(name);
+    ASSERT(key.empty() == false, "Unknown pass '%.*s'", (int)name.size(), name.data());
+    m_passes[key] = move(pass);
+}
+
+void engine::PassManager::run(PassStage stage) {
+    for (const auto& [name, info] : PASSES.getEntries()) {
+        auto pass = m_passes.find(name);
+        if (info.stage != stage || pass == m_passes.end() || isEnabled(name) == false) {
+            continue;
+        }
+
+        auto start = chrono::steady_clock::now();
+        size_t changed = pass->second();
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+
+        m_stats.push_back({ name, elapsed.count(), changed });
+    }
+}
+
+const vector<engine::PassStats>& engine::PassManager::getStats() const {
+    return m_stats;
+}
+
+bool engine::PassManager::parseLevel(string_view flag, OptLevel& level) {
+    constexpr pair<string_view, OptLevel> LEVELS[] = {
+        { "-O0", OPT_LEVEL_0 }, { "-O1", OPT_LEVEL_1 }, { "-O2", OPT_LEVEL_2 }, { "-Os", OPT_LEVEL_S }
+    };
+
+    for (auto [name, value] : LEVELS) {
+        if (flag == name) {
+            level = value;
+            return true;
+        }
+    }
+
+    return false;
+}
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef HPP_PASSES
+#define HPP_PASSES
+
+#include "lookup.hpp"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    enum OptLevel {
+        OPT_LEVEL_0 = 0,
+        OPT_LEVEL_1,
+        OPT_LEVEL_2,
+        OPT_LEVEL_S             // -O2 without the passes that trade size for speed
+    };
+
+    enum PassStage {
+        PASS_STAGE_IL = 0,      // IL::registerPasses, before translation
+        PASS_STAGE_MACHINE      // Assembler::registerPasses, between translation and assembly
+    };
+
+    struct PassInfo {
+        PassStage stage;
+        uint8_t levels;         // 1 << OptLevel of every level the pass runs at
+        const char* unit;       // what the pass counts as changed
+    };
+
+    constexpr uint8_t PASS_LEVELS_O1 = (1 << OPT_LEVEL_1) | (1 << OPT_LEVEL_2) | (1 << OPT_LEVEL_S);
+    constexpr uint8_t PASS_LEVELS_OS = (1 << OPT_LEVEL_2) | (1 << OPT_LEVEL_S);
+    constexpr uint8_t PASS_LEVELS_O2 = 1 << OPT_LEVEL_2;
+
+    // the pipeline, the passes of a stage run in this order
+    inline constexpr PerfectMap<PassInfo, 9> PASSES({
+        { "specialize", { PASS_STAGE_IL, PASS_LEVELS_O2, "calls" } },
+        { "fold-calls", { PASS_STAGE_IL, PASS_LEVELS_OS, "calls" } },
+        { "dead-functions", { PASS_STAGE_IL, PASS_LEVELS_O1, "instructions" } },
+        { "hoist", { PASS_STAGE_IL, PASS_LEVELS_O1, "instructions" } },
+        { "vectorize", { PASS_STAGE_IL, PASS_LEVELS_O2, "loop instructions" } },
+        { "unroll", { PASS_STAGE_IL, PASS_LEVELS_O2, "loop instructions" } },
+        { "strip-stack", { PASS_STAGE_MACHINE, PASS_LEVELS_O1, "routines" } },
+        { "layout", { PASS_STAGE_MACHINE, PASS_LEVELS_O1, "routines" } },
+        { "align", { PASS_STAGE_MACHINE, PASS_LEVELS_O2, "routines" } }
+    });
+
+    struct PassStats {
+        string_view name;
+        double milliseconds;
+        size_t changed;
+    };
+
+    // Runs the passes the IL and the Assembler register, the level picks which of them are enabled and
+    // single passes can be switched on or off on top of it, e.g. to find the one that breaks a program.
+    class PassManager {
+        public:
+            PassManager(OptLevel level = OPT_LEVEL_2);
+            ~PassManager();
+
+            // false if there is no pass 'name'
+            [[nodiscard]] bool setEnabled(string_view name, bool enabled);
+            [[nodiscard]] bool isEnabled(string_view name) const;
+
+            // 'pass' returns how many of its PassInfo::unit it changed
+            void add(string_view name, function<size_t()> pass);
+            void run(PassStage stage);
+
+            [[nodiscard]] const vector<PassStats>& getStats() const;
+
+            // -O0, -O1, -O2 or -Os
+            [[nodiscard]] static bool parseLevel(string_view flag, OptLevel& level);
+
+        private:
+            OptLevel m_level;
+            unordered_map<string_view, bool> m_enabled;     // overrides of the level
+            unordered_map<string_view, function<size_t()>> m_passes;
+            vector<PassStats> m_stats;
+    };
+}
+
+#endif
\ No newline at end of file
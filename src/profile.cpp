@@ -0,0 +1,76 @@
+#include "profile.hpp"
+#include "assert.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+
+using namespace std;
+
+engine::Profile::Profile(const string& path) : m_loaded(false) {
+    ifstream stream(path, ios::binary);
+    if (!stream) {
+        return;
+    }
+
+    string data((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    Load(data.data(), data.size());
+}
+
+engine::Profile::Profile(const void* data, size_t size) : m_loaded(false) {
+    Load(data, size);
+}
+
+engine::Profile::~Profile() {
+}
+
+bool engine::Profile::operator!() const {
+    return m_loaded == false;
+}
+
+void engine::Profile::Load(const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    ProfileHeader header;
+    ASSERT(size >= sizeof(header), "Profile is truncated");
+    memcpy(&header, bytes, sizeof(header));
+
+    ASSERT(header.magic == PROFILE_MAGIC, "Not a profile");
+    ASSERT(header.version == PROFILE_VERSION, "Unsupported profile version %u (expected %u)", header.version, PROFILE_VERSION);
+    ASSERT(header.size == size, "Profile size mismatch");
+    ASSERT(header.count <= (size - sizeof(header)) / sizeof(uint64_t), "Profile counters out of bounds");
+
+    const char* names = (const char*)bytes + sizeof(header) + header.count * sizeof(uint64_t);
+    const char* end = (const char*)bytes + size;
+
+    for (uint64_t i = 0; i < header.count; ++i) {
+        const char* terminator = (const char*)memchr(names, 0, end - names);
+        ASSERT(terminator != nullptr, "Profile names out of bounds");
+
+        uint64_t count = 0;
+        memcpy(&count, bytes + sizeof(header) + i * sizeof(uint64_t), sizeof(count));
+
+        m_counts[string(names, terminator)] += count;
+        names = terminator + 1;
+    }
+
+    m_loaded = true;
+}
+
+bool engine::Profile::getCount(const string& name, uint64_t& count) const {
+    auto it = m_counts.find(name);
+    if (it == m_counts.end()) {
+        return false;
+    }
+
+    count = it->second;
+    return true;
+}
+
+string engine::Profile::getEntryName(string_view function) {
+    return string(function);
+}
+
+string engine::Profile::getCallName(string_view caller, string_view callee, uint32_t line) {
+    return string(caller) + ">" + string(callee) + ":" + to_string(line);
+}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#ifndef HPP_PROFILE
+#define HPP_PROFILE
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    // An instrumented build keeps its counters in .data laid out like the profile file, so dumping
+    // them is one copy: the header, a qword per counter, then the counters' names in the same order,
+    // each ending with a zero byte.
+    constexpr uint32_t PROFILE_MAGIC = 0x4650584C; // "LXPF"
+    constexpr uint32_t PROFILE_VERSION = 1;
+
+    // labels of the counters and of 'u64 lefix_profile_dump(u64 buffer)', which copies them to
+    // 'buffer' unless it is 0 and returns their size in bytes
+    constexpr const char* PROFILE_SYMBOL = "lefix_profile";
+    constexpr const char* PROFILE_DUMP = "lefix_profile_dump";
+
+    struct ProfileHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t size;      // bytes, names included
+        uint64_t count;     // counters
+    };
+
+    class Profile {
+        public:
+            Profile(const string& path);
+            Profile(const void* data, size_t size);
+            ~Profile();
+
+            [[nodiscard]] bool operator!() const;
+
+            // false if the profile has no such counter, e.g. it came from another version of the program
+            [[nodiscard]] bool getCount(const string& name, uint64_t& count) const;
+
+            // counter names: function entries are the function's name, call sites 'caller>callee:line'
+            [[nodiscard]] static string getEntryName(string_view function);
+            [[nodiscard]] static string getCallName(string_view caller, string_view callee, uint32_t line);
+
+        private:
+            void Load(const void* data, size_t size);
+
+        private:
+            bool m_loaded;
+            unordered_map<string, uint64_t> m_counts;
+    };
+}
+
+#endif
\ No newline at end of file
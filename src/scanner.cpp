@@ -0,0 +1,201 @@
+#include "scanner.hpp"
+
+#include <cstdint>
+#include <immintrin.h>
+
+using namespace std;
+
+namespace {
+    struct Backend {
+        const char* name;
+        const char* (*skipWhitespace)(const char*, const char*);
+        const char* (*skipIdentifier)(const char*, const char*);
+        const char* (*skipDigits)(const char*, const char*);
+        const char* (*findEither)(const char*, const char*, char, char);
+    };
+
+    inline bool IsWhitespace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
+
+    inline bool IsIdentifier(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+    }
+
+    inline bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    // unsigned range check with the signed compares sse2 has: shift 'lo' down to -128 first
+    inline __m128i InRange128(__m128i x, char lo, char hi) {
+        __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - lo)));
+        return _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(-128 + (hi - lo + 1))));
+    }
+
+    inline __m128i IsWhitespace128(__m128i x) {
+        return _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), InRange128(x, '\t', '\r'));
+    }
+
+    inline __m128i IsIdentifier128(__m128i x) {
+        __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+        __m128i alpha = InRange128(lower, 'a', 'z');
+        __m128i digit = InRange128(x, '0', '9');
+        __m128i under = _mm_cmpeq_epi8(x, _mm_set1_epi8('_'));
+        return _mm_or_si128(_mm_or_si128(alpha, digit), under);
+    }
+
+    // 'Class' yields 0xFF for bytes that continue the run, the first zero byte ends it
+    template <typename Class, typename Scalar>
+    inline const char* Skip128(const char* p, const char* end, Class cls, Scalar scalar) {
+        while (end - p >= 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)p);
+            uint32_t stop = ~(uint32_t)_mm_movemask_epi8(cls(x)) & 0xFFFF;
+            if (stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+
+            p += 16;
+        }
+
+        while (p < end && scalar(*p)) ++p;
+        return p;
+    }
+
+    const char* SkipWhitespaceSSE2(const char* p, const char* end) {
+        return Skip128(p, end, IsWhitespace128, IsWhitespace);
+    }
+
+    const char* SkipIdentifierSSE2(const char* p, const char* end) {
+        return Skip128(p, end, IsIdentifier128, IsIdentifier);
+    }
+
+    const char* SkipDigitsSSE2(const char* p, const char* end) {
+        return Skip128(p, end, [](__m128i x) { return InRange128(x, '0', '9'); }, IsDigit);
+    }
+
+    const char* FindEitherSSE2(const char* p, const char* end, char a, char b) {
+        __m128i va = _mm_set1_epi8(a);
+        __m128i vb = _mm_set1_epi8(b);
+
+        while (end - p >= 16) {
+            __m128i x = _mm_loadu_si128((const __m128i*)p);
+            uint32_t hit = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(x, vb)));
+            if (hit != 0) {
+                return p + __builtin_ctz(hit);
+            }
+
+            p += 16;
+        }
+
+        while (p < end && *p != a && *p != b) ++p;
+        return p;
+    }
+
+    __attribute__((target("avx2"))) inline __m256i InRange256(__m256i x, char lo, char hi) {
+        __m256i shifted = _mm256_add_epi8(x, _mm256_set1_epi8((char)(0x80 - lo)));
+        return _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(-128 + (hi - lo + 1))), shifted);
+    }
+
+    __attribute__((target("avx2"))) inline __m256i IsWhitespace256(__m256i x) {
+        return _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')), InRange256(x, '\t', '\r'));
+    }
+
+    __attribute__((target("avx2"))) inline __m256i IsIdentifier256(__m256i x) {
+        __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+        __m256i alpha = InRange256(lower, 'a', 'z');
+        __m256i digit = InRange256(x, '0', '9');
+        __m256i under = _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_'));
+        return _mm256_or_si256(_mm256_or_si256(alpha, digit), under);
+    }
+
+    __attribute__((target("avx2"))) const char* SkipWhitespaceAVX2(const char* p, const char* end) {
+        while (end - p >= 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)p);
+            uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(IsWhitespace256(x));
+            if (stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+
+            p += 32;
+        }
+
+        return SkipWhitespaceSSE2(p, end);
+    }
+
+    __attribute__((target("avx2"))) const char* SkipIdentifierAVX2(const char* p, const char* end) {
+        while (end - p >= 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)p);
+            uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(IsIdentifier256(x));
+            if (stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+
+            p += 32;
+        }
+
+        return SkipIdentifierSSE2(p, end);
+    }
+
+    __attribute__((target("avx2"))) const char* SkipDigitsAVX2(const char* p, const char* end) {
+        while (end - p >= 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)p);
+            uint32_t stop = ~(uint32_t)_mm256_movemask_epi8(InRange256(x, '0', '9'));
+            if (stop != 0) {
+                return p + __builtin_ctz(stop);
+            }
+
+            p += 32;
+        }
+
+        return SkipDigitsSSE2(p, end);
+    }
+
+    __attribute__((target("avx2"))) const char* FindEitherAVX2(const char* p, const char* end, char a, char b) {
+        __m256i va = _mm256_set1_epi8(a);
+        __m256i vb = _mm256_set1_epi8(b);
+
+        while (end - p >= 32) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)p);
+            uint32_t hit = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(x, vb)));
+            if (hit != 0) {
+                return p + __builtin_ctz(hit);
+            }
+
+            p += 32;
+        }
+
+        return FindEitherSSE2(p, end, a, b);
+    }
+
+    const Backend& GetBackend() {
+        static const Backend backend = __builtin_cpu_supports("avx2")
+            ? Backend { "avx2", SkipWhitespaceAVX2, SkipIdentifierAVX2, SkipDigitsAVX2, FindEitherAVX2 }
+            : Backend { "sse2", SkipWhitespaceSSE2, SkipIdentifierSSE2, SkipDigitsSSE2, FindEitherSSE2 };
+
+        return backend;
+    }
+}
+
+const char* engine::scanner::skipWhitespace(const char* begin, const char* end) {
+    return GetBackend().skipWhitespace(begin, end);
+}
+
+const char* engine::scanner::skipIdentifier(const char* begin, const char* end) {
+    return GetBackend().skipIdentifier(begin, end);
+}
+
+const char* engine::scanner::skipDigits(const char* begin, const char* end) {
+    return GetBackend().skipDigits(begin, end);
+}
+
+const char* engine::scanner::find(const char* begin, const char* end, char c) {
+    return GetBackend().findEither(begin, end, c, c);
+}
+
+const char* engine::scanner::findEither(const char* begin, const char* end, char a, char b) {
+    return GetBackend().findEither(begin, end, a, b);
+}
+
+const char* engine::scanner::getBackend() {
+    return GetBackend().name;
+}
\ No newline at end of file
@@ -0,0 +1,20 @@
+#ifndef HPP_SCANNER
+#define HPP_SCANNER
+
+using namespace std;
+
+namespace engine::scanner {
+    // Vectorised character scanning for the tokenizer. Every function returns the first position in
+    // [begin, end) that does not continue the run (or 'end'). SSE2 is the baseline, AVX2 is picked at
+    // runtime when the cpu has it.
+
+    [[nodiscard]] const char* skipWhitespace(const char* begin, const char* end);
+    [[nodiscard]] const char* skipIdentifier(const char* begin, const char* end);
+    [[nodiscard]] const char* skipDigits(const char* begin, const char* end);
+    [[nodiscard]] const char* find(const char* begin, const char* end, char c);
+    [[nodiscard]] const char* findEither(const char* begin, const char* end, char a, char b);
+
+    [[nodiscard]] const char* getBackend();
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,474 @@
+#include "server.hpp"
+#include "assert.hpp"
+
+#include <cstring>
+#include <unordered_map>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+namespace {
+    constexpr uint32_t MESSAGE_MAGIC = 0x5653584C; // "LXSV"
+    constexpr uint64_t MESSAGE_LIMIT = 1ull << 30;
+    constexpr size_t CACHE_LIMIT = 256 << 20;
+
+    // a message is a header and a list of strings, each prefixed by its size
+    struct MessageHeader {
+        uint32_t magic;
+        uint32_t count;
+        uint64_t size;      // bytes after the header
+    };
+
+    string Pack(const vector<string_view>& parts) {
+        string message(sizeof(MessageHeader), '\0');
+        for (string_view part : parts) {
+            uint64_t size = part.size();
+            message.append((const char*)&size, sizeof(size));
+            message.append(part);
+        }
+
+        MessageHeader header = { MESSAGE_MAGIC, (uint32_t)parts.size(), message.size() - sizeof(MessageHeader) };
+        memcpy(message.data(), &header, sizeof(header));
+        return message;
+    }
+
+    // bytes of the message at the start of 'buffer', 0 while it is incomplete and SIZE_MAX if it's broken
+    size_t GetMessageSize(const string& buffer) {
+        if (buffer.size() < sizeof(MessageHeader)) {
+            return 0;
+        }
+
+        MessageHeader header;
+        memcpy(&header, buffer.data(), sizeof(header));
+        if (header.magic != MESSAGE_MAGIC || header.size > MESSAGE_LIMIT) {
+            return SIZE_MAX;
+        }
+
+        size_t size = sizeof(MessageHeader) + header.size;
+        return buffer.size() >= size ? size : 0;
+    }
+
+    bool Unpack(string_view message, vector<string>& parts) {
+        MessageHeader header;
+        memcpy(&header, message.data(), sizeof(header));
+        message.remove_prefix(sizeof(header));
+
+        for (uint32_t i = 0; i < header.count; ++i) {
+            uint64_t size;
+            if (message.size() < sizeof(size)) {
+                return false;
+            }
+
+            memcpy(&size, message.data(), sizeof(size));
+            message.remove_prefix(sizeof(size));
+            if (message.size() < size) {
+                return false;
+            }
+
+            parts.emplace_back(message.substr(0, size));
+            message.remove_prefix(size);
+        }
+
+        return message.empty();
+    }
+
+    bool WriteAll(int fd, string_view data) {
+        while (data.empty() == false) {
+            ssize_t written = write(fd, data.data(), data.size());
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (written <= 0) {
+                return false;
+            }
+
+            data.remove_prefix(written);
+        }
+
+        return true;
+    }
+
+    bool SetNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL);
+        return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+    }
+
+    // reads what is available into 'buffer', false once the other side is closed or failed
+    bool Drain(int fd, string& buffer) {
+        char chunk[64 * 1024];
+
+        while (true) {
+            ssize_t size = read(fd, chunk, sizeof(chunk));
+            if (size > 0) {
+                buffer.append(chunk, size);
+                continue;
+            }
+
+            return size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+        }
+    }
+
+    bool MakeAddress(const string& path, sockaddr_un& address) {
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+
+        if (path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+
+        memcpy(address.sun_path, path.data(), path.size());
+        return true;
+    }
+
+    enum ConnectionState {
+        CONNECTION_READING,
+        CONNECTION_QUEUED,      // waits for a free compile slot
+        CONNECTION_COMPILING,
+        CONNECTION_WRITING
+    };
+
+    struct Connection {
+        int fd;
+        ConnectionState state;
+        string request;
+        string response;
+        size_t written;
+
+        pid_t child;
+        int log_fd;             // child's stdout
+        int output_fd;          // child's output file
+        string log;
+        string output;
+    };
+
+    class Server {
+        public:
+            Server(int listener, const engine::server::Compile& compile)
+                : m_listener(listener), m_compile(compile), m_compiling(0), m_cached(0) {
+                m_slots = max(1u, thread::hardware_concurrency());
+            }
+
+            void run() {
+                vector<pollfd> fds;
+                vector<pair<size_t, int>> owners;     // connection and fd of every entry past the listener
+
+                while (true) {
+                    fds.clear();
+                    owners.clear();
+                    fds.push_back({ m_listener, POLLIN, 0 });
+
+                    for (size_t i = 0; i < m_connections.size(); ++i) {
+                        const Connection& connection = m_connections[i];
+
+                        switch (connection.state) {
+                            case CONNECTION_READING: Watch(fds, owners, i, connection.fd, POLLIN); break;
+                            case CONNECTION_WRITING: Watch(fds, owners, i, connection.fd, POLLOUT); break;
+                            case CONNECTION_COMPILING: {
+                                Watch(fds, owners, i, connection.log_fd, POLLIN);
+                                Watch(fds, owners, i, connection.output_fd, POLLIN);
+                            } break;
+                            default: break;
+                        }
+                    }
+
+                    if (poll(fds.data(), fds.size(), -1) < 0) {
+                        ASSERT(errno == EINTR, "Compile server poll failed: %s", strerror(errno));
+                        continue;
+                    }
+
+                    for (size_t i = 1; i < fds.size(); ++i) {
+                        if (fds[i].revents != 0) {
+                            Update(m_connections[owners[i - 1].first], owners[i - 1].second);
+                        }
+                    }
+
+                    if (fds[0].revents & POLLIN) {
+                        Accept();
+                    }
+
+                    Schedule();
+
+                    erase_if(m_connections, [](const Connection& connection) {
+                        return connection.fd < 0;
+                    });
+                }
+            }
+
+        private:
+            static void Watch(vector<pollfd>& fds, vector<pair<size_t, int>>& owners, size_t connection, int fd, short events) {
+                if (fd >= 0) {
+                    fds.push_back({ fd, events, 0 });
+                    owners.push_back({ connection, fd });
+                }
+            }
+
+            void Accept() {
+                int fd = accept(m_listener, nullptr, nullptr);
+                if (fd < 0) {
+                    return;
+                }
+
+                if (SetNonBlocking(fd) == false) {
+                    close(fd);
+                    return;
+                }
+
+                Connection connection = {};
+                connection.fd = fd;
+                connection.state = CONNECTION_READING;
+                connection.child = -1;
+                connection.log_fd = -1;
+                connection.output_fd = -1;
+                m_connections.push_back(move(connection));
+            }
+
+            void Update(Connection& connection, int fd) {
+                switch (connection.state) {
+                    case CONNECTION_READING: {
+                        bool open = Drain(fd, connection.request);
+
+                        size_t size = GetMessageSize(connection.request);
+                        if (size == SIZE_MAX || (size == 0 && open == false)) {
+                            Close(connection);
+                        }
+                        else if (size != 0) {
+                            connection.request.resize(size);
+
+                            if (auto it = m_cache.find(connection.request); it != m_cache.end()) {
+                                Respond(connection, it->second);
+                            }
+                            else {
+                                connection.state = CONNECTION_QUEUED;
+                            }
+                        }
+                    } break;
+                    case CONNECTION_COMPILING: {
+                        int& pipe = fd == connection.log_fd ? connection.log_fd : connection.output_fd;
+                        if (Drain(pipe, fd == connection.log_fd ? connection.log : connection.output) == false) {
+                            close(pipe);
+                            pipe = -1;
+                        }
+
+                        if (connection.log_fd < 0 && connection.output_fd < 0) {
+                            Finish(connection);
+                        }
+                    } break;
+                    case CONNECTION_WRITING: {
+                        ssize_t written = send(fd, connection.response.data() + connection.written, connection.response.size() - connection.written, MSG_NOSIGNAL);
+                        if (written > 0) {
+                            connection.written += written;
+                        }
+
+                        if (connection.written == connection.response.size() || (written < 0 && errno != EAGAIN && errno != EINTR)) {
+                            Close(connection);
+                        }
+                    } break;
+                    default: break;
+                }
+            }
+
+            void Schedule() {
+                for (Connection& connection : m_connections) {
+                    if (m_compiling >= m_slots) {
+                        return;
+                    }
+
+                    if (connection.state == CONNECTION_QUEUED) {
+                        Start(connection);
+                    }
+                }
+            }
+
+            void Start(Connection& connection) {
+                int log[2];
+                int output[2];
+                if (pipe(log) != 0) {
+                    Close(connection);
+                    return;
+                }
+
+                if (pipe(output) != 0) {
+                    close(log[0]);
+                    close(log[1]);
+                    Close(connection);
+                    return;
+                }
+
+                // buffered output would be written by both processes
+                fflush(stdout);
+
+                pid_t child = fork();
+                if (child == 0) {
+                    close(m_listener);
+                    close(log[0]);
+                    close(output[0]);
+                    dup2(log[1], STDOUT_FILENO);
+                    close(log[1]);
+
+                    string result;
+                    int status = EXIT_FAILURE;
+
+                    // the error goes to the client with the rest of the log
+                    try {
+                        vector<string> parts;
+                        if (Unpack(connection.request, parts) == false || parts.empty()) {
+                            CRASH("Malformed compile request");
+                        }
+
+                        string input = move(parts.back());
+                        parts.pop_back();
+
+                        status = m_compile(parts, input, result);
+                    }
+                    catch (const engine::Error& error) {
+                        printf("%s\n", error.what());
+                        result.clear();
+                    }
+
+                    fflush(stdout);
+                    WriteAll(output[1], result);
+                    exit(status);
+                }
+
+                close(log[1]);
+                close(output[1]);
+
+                if (child < 0) {
+                    close(log[0]);
+                    close(output[0]);
+                    Close(connection);
+                    return;
+                }
+
+                SetNonBlocking(log[0]);
+                SetNonBlocking(output[0]);
+
+                connection.state = CONNECTION_COMPILING;
+                connection.child = child;
+                connection.log_fd = log[0];
+                connection.output_fd = output[0];
+                ++m_compiling;
+            }
+
+            void Finish(Connection& connection) {
+                int status = 0;
+                while (waitpid(connection.child, &status, 0) < 0 && errno == EINTR) {
+                }
+
+                --m_compiling;
+                connection.child = -1;
+
+                int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                string response = Pack({ to_string(code), connection.log, connection.output });
+
+                // failures are cheap to reproduce and usually fixed before the next request
+                if (code == 0) {
+                    if (m_cached + response.size() + connection.request.size() > CACHE_LIMIT) {
+                        m_cache.clear();
+                        m_cached = 0;
+                    }
+
+                    m_cached += response.size() + connection.request.size();
+                    m_cache.emplace(connection.request, response);
+                }
+
+                connection.log.clear();
+                connection.output.clear();
+                Respond(connection, response);
+            }
+
+            void Respond(Connection& connection, const string& response) {
+                connection.response = response;
+                connection.written = 0;
+                connection.state = CONNECTION_WRITING;
+            }
+
+            void Close(Connection& connection) {
+                close(connection.fd);
+                connection.fd = -1;
+            }
+
+            int m_listener;
+            const engine::server::Compile& m_compile;
+            size_t m_slots;
+            size_t m_compiling;
+
+            vector<Connection> m_connections;
+            unordered_map<string, string> m_cache;  // request -> response
+            size_t m_cached;                        // bytes held by the cache
+    };
+}
+
+bool engine::server::serve(const string& path, const Compile& compile) {
+    sockaddr_un address;
+    if (MakeAddress(path, address) == false) {
+        printf("Socket path '%s' is too long\n", path.data());
+        return false;
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        printf("Failed to create socket: %s\n", strerror(errno));
+        return false;
+    }
+
+    // a socket file left behind by a previous server would make bind fail
+    unlink(path.data());
+
+    if (bind(listener, (const sockaddr*)&address, sizeof(address)) != 0 || listen(listener, SOMAXCONN) != 0 || SetNonBlocking(listener) == false) {
+        printf("Failed to listen on '%s': %s\n", path.data(), strerror(errno));
+        close(listener);
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("Serving compiles on '%s'\n", path.data());
+
+    Server server(listener, compile);
+    server.run();
+    return true;
+}
+
+engine::server::Response engine::server::request(const string& path, const vector<string>& args, const string& input) {
+    sockaddr_un address;
+    ASSERT(MakeAddress(path, address), "Socket path '%s' is too long", path.data());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ASSERT(fd >= 0, "Failed to create socket: %s", strerror(errno));
+    ASSERT(connect(fd, (const sockaddr*)&address, sizeof(address)) == 0, "Failed to connect to the compile server at '%s': %s", path.data(), strerror(errno));
+
+    vector<string_view> parts(args.begin(), args.end());
+    parts.push_back(input);
+    ASSERT(WriteAll(fd, Pack(parts)), "Failed to send the compile request: %s", strerror(errno));
+
+    string message;
+    size_t size = 0;
+    char chunk[64 * 1024];
+
+    while ((size = GetMessageSize(message)) == 0) {
+        ssize_t received = read(fd, chunk, sizeof(chunk));
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+
+        ASSERT(received > 0, "Compile server closed the connection");
+        message.append(chunk, received);
+    }
+
+    close(fd);
+
+    vector<string> response;
+    ASSERT(size != SIZE_MAX && Unpack(string_view(message).substr(0, size), response) && response.size() == 3, "Malformed compile server response");
+
+    return { stoi(response[0]), move(response[1]), move(response[2]) };
+}
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef HPP_SERVER
+#define HPP_SERVER
+
+#include <string>
+#include <vector>
+#include <functional>
+
+using namespace std;
+
+namespace engine::server {
+    // Compile server on a unix socket. A request is the command line and the bytes of the input file,
+    // the response is the exit status, everything the compile printed and the output file's content.
+    // Each compile runs in a forked child, so a failed one can't take the server down and several
+    // run at once. Successful responses are cached by request and answered without compiling again.
+
+    // compiles 'input' as the command line 'args' asks, 'output' is what the output file gets
+    using Compile = function<int(const vector<string>& args, const string& input, string& output)>;
+
+    struct Response {
+        int status;
+        string log;
+        string output;
+    };
+
+    // only returns if the socket can't be set up
+    [[nodiscard]] bool serve(const string& path, const Compile& compile);
+    [[nodiscard]] Response request(const string& path, const vector<string>& args, const string& input);
+}
+
+#endif
\ No newline at end of file
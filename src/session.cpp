@@ -0,0 +1,211 @@
+#include "session.hpp"
+#include "engine.hpp"
+#include "hooks.hpp"
+#include "assert.hpp"
+
+#include <memory>
+#include <cstdarg>
+#include <cstdio>
+
+using namespace std;
+
+namespace {
+    __attribute__((format(printf, 2, 3))) void Log(string& log, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        va_list copy;
+        va_copy(copy, args);
+
+        size_t size = log.size();
+        log.resize(size + vsnprintf(nullptr, 0, format, copy));
+        va_end(copy);
+
+        // vsnprintf writes a terminator past the end, which the string keeps room for
+        vsnprintf(log.data() + size, log.size() - size + 1, format, args);
+        va_end(args);
+    }
+
+    // rax past the return type of the routine is left over from its body
+    uint64_t GetResult(const engine::IL& il, const string& routine, uint64_t value) {
+        for (const engine::DeclareFunction& function : il.getFunctions()) {
+            if (il.getString(function.name) != routine) {
+                continue;
+            }
+
+            switch (function.ret_type) {
+                case engine::DATA_TYPE_I8: case engine::DATA_TYPE_U8: case engine::DATA_TYPE_BOOL: return (uint8_t)value;
+                case engine::DATA_TYPE_I16: case engine::DATA_TYPE_U16: return (uint16_t)value;
+                case engine::DATA_TYPE_I32: case engine::DATA_TYPE_U32: return (uint32_t)value;
+                default: return value;
+            }
+        }
+
+        return value;
+    }
+}
+
+engine::CompileSession::CompileSession(const CompileOptions& options) : m_options(options) {
+}
+
+engine::CompileSession::~CompileSession() {
+}
+
+engine::CompileResult engine::CompileSession::compile(string input) const {
+    // images are loaded by Run, a corrupted one then fails like any other input
+    return Compile(nullptr, move(input));
+}
+
+engine::CompileResult engine::CompileSession::compile(const ILImage& image) const {
+    return Compile(&image, "");
+}
+
+engine::CompileResult engine::CompileSession::Compile(const ILImage* image, string&& code) const {
+    CompileResult result = { EXIT_FAILURE, "", "", "" };
+
+    // everything a failed compile built is gone by the time the error is caught
+    try {
+        result.status = Run(image, move(code), result);
+    }
+    catch (const exception& error) {
+        Log(result.log, "%s\n", error.what());
+        result.status = EXIT_FAILURE;
+        result.output.clear();
+        result.profile.clear();
+    }
+
+    return result;
+}
+
+int engine::CompileSession::Run(const ILImage* image, string&& code, CompileResult& result) const {
+    string& log = result.log;
+
+    // the plugins' code has to outlive everything they touched
+    Hooks hooks;
+    unique_ptr<IL> il;
+
+    // the image reads straight from 'code', which stays alive until the end of the compile
+    unique_ptr<ILImage> loaded;
+    if (image == nullptr && ILImage::isImage(code.data(), code.size())) {
+        loaded = make_unique<ILImage>(code.data(), code.size());
+        image = loaded.get();
+    }
+
+    // precompiled modules are used as is, everything else goes through the front end
+    if (image == nullptr) {
+        ASSERT(code.empty() == false, "Nothing to compile");
+
+        Log(log, "Step 1:\n");
+        Tokenizer tokenizer(move(code));
+
+        Log(log, "\t- Cleaning\n");
+        tokenizer.cleanup();
+
+        Log(log, "\t- Tokenizing\n");
+        tokenizer.tokenize();
+
+        Log(log, "Step 2:\n");
+        il = make_unique<IL>(tokenizer.takeTokens());
+        Log(log, "\t- Analyzing\n");
+        il->analyze();
+    }
+    else {
+        Log(log, "Step 1:\n");
+        Log(log, "\t- Loading IL image\n");
+        il = make_unique<IL>(*image);
+        Log(log, "Step 2:\n");
+    }
+
+    for (const string& path : m_options.hooks) {
+        Log(log, "\t- Loaded hook %s\n", hooks.load(path));
+    }
+
+    hooks.run(HOOK_POINT_ANALYZED, *il);
+
+    if (m_options.emit_il) {
+        Log(log, "\t- Saving IL image\n");
+        result.output = ILImage::serialize(*il);
+        return EXIT_SUCCESS;
+    }
+
+    unique_ptr<Profile> profile;
+    if (m_options.profile_use.empty() == false) {
+        profile = make_unique<Profile>(m_options.profile_use.data(), m_options.profile_use.size());
+        ASSERT(!*profile == false, "Invalid profile");
+    }
+
+    PassManager passes(m_options.level);
+    for (const auto& [name, enabled] : m_options.passes) {
+        ASSERT(passes.setEnabled(name, enabled), "Unknown pass '%s'", name.data());
+    }
+
+    Log(log, "\t- Optimizing\n");
+    il->registerPasses(passes, m_options.unroll, m_options.specialize_budget, profile.get());
+    passes.run(PASS_STAGE_IL);
+    hooks.run(HOOK_POINT_OPTIMIZED, *il);
+
+    Log(log, "Step 3:\n");
+    Assembler assembler(*il);
+    assembler.setFunctionAlignment(m_options.align);
+
+    if (m_options.debug) {
+        assembler.enableDebugInfo(m_options.source);
+    }
+
+    if (m_options.instrument) {
+        assembler.enableInstrumentation();
+    }
+
+    if (profile != nullptr) {
+        assembler.useProfile(*profile);
+    }
+
+    Log(log, "\t- Translating\n");
+    assembler.translate(il->takeILs());
+
+    hooks.run(HOOK_POINT_TRANSLATED, assembler, *il);
+
+    Log(log, "\t- Optimizing\n");
+    assembler.registerPasses(passes);
+    passes.run(PASS_STAGE_MACHINE);
+    hooks.run(HOOK_POINT_LAID_OUT, assembler, *il);
+
+    Log(log, "\t- Assembling\n");
+    assembler.assemble();
+
+    if (m_options.pass_stats) {
+        Log(log, "Passes:\n");
+        for (const PassStats& stats : passes.getStats()) {
+            Log(log, "\t- %-16.*s %9.3f ms %8zu %s\n", (int)stats.name.size(), stats.name.data(), stats.milliseconds, stats.changed, PASSES.at(stats.name).unit);
+        }
+    }
+
+    if (m_options.run) {
+        Log(log, "\t- Encoding\n");
+        Jit jit(assembler.takeOutput());
+        jit.encode();
+        jit.load();
+
+        if (m_options.debug) {
+            Log(log, "\t- Wrote %s\n", jit.writePerfMap().data());
+        }
+
+        Log(log, "Step 4:\n");
+        Log(log, "\t- Running\n");
+        uint64_t value = GetResult(*il, "efi_main", jit.run("efi_main", TEST_IMAGE_HANDLE, TEST_SYSTEM_TABLE));
+        Log(log, "\t- efi_main returned %llu\n", (unsigned long long)value);
+
+        // the dump routine is called the way firmware would, once for the size and once to copy
+        if (m_options.instrument) {
+            result.profile.assign(jit.run(PROFILE_DUMP, 0, 0), '\0');
+            (void)jit.run(PROFILE_DUMP, (uint64_t)result.profile.data(), 0);
+        }
+
+        // sys_exit keeps the low byte too
+        return (int)(value & 0xFF);
+    }
+
+    Log(log, "\t- Saving\n");
+    result.output = assembler.takeOutput();
+
+    return EXIT_SUCCESS;
+}
\ No newline at end of file
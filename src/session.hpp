@@ -0,0 +1,58 @@
+#ifndef HPP_SESSION
+#define HPP_SESSION
+
+#include "passes.hpp"
+#include "image.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+using namespace std;
+
+namespace engine {
+    // what the command line options set, less the paths of the files it reads and writes
+    struct CompileOptions {
+        string source = "input.lx";     // name of the input in line info and the perf map
+        bool emit_il = false;           // stop after analysis and output the IL image
+        uint32_t unroll = 4;
+        uint32_t specialize_budget = 10;    // percent the IL may grow by specialized clones
+        OptLevel level = OPT_LEVEL_2;
+        vector<pair<string, bool>> passes;  // enabled or disabled over the level, in order
+        bool pass_stats = false;
+        uint32_t align = 16;
+        bool run = false;               // run efi_main in process instead of outputting the assembly
+        bool debug = false;
+        bool instrument = false;        // count entries and calls, with run the counts are the result's profile
+        string profile_use;             // content of a profile to optimize with
+        vector<string> hooks;           // plugin paths
+    };
+
+    struct CompileResult {
+        int status;         // EXIT_FAILURE on errors, with run the low byte of efi_main's result
+        string output;      // assembly or IL image
+        string log;         // the steps and, on failure, the error
+        string profile;
+    };
+
+    // One compile per call, nothing is printed and errors end up in the result instead of ending the
+    // process. Sessions share no state, any number of them can compile at once on their own threads.
+    class CompileSession {
+        public:
+            CompileSession(const CompileOptions& options);
+            ~CompileSession();
+
+            // 'input' is source or the bytes of an IL image, moving it in saves the tokenizer a copy
+            [[nodiscard]] CompileResult compile(string input) const;
+            [[nodiscard]] CompileResult compile(const ILImage& image) const;
+
+        private:
+            [[nodiscard]] CompileResult Compile(const ILImage* image, string&& code) const;
+            int Run(const ILImage* image, string&& code, CompileResult& result) const;
+
+        private:
+            const CompileOptions m_options;
+    };
+}
+
+#endif
\ No newline at end of file
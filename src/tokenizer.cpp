@@ -1,17 +1,15 @@
 #include "tokenizer.hpp"
+#include "scanner.hpp"
 #include "assert.hpp"
 
 #include <iostream>
 #include <string>
 #include <vector>
-#include <regex>
-#include <unordered_map>
-#include <random>
-#include <immintrin.h>
+#include <algorithm>
 
 using namespace std;
 
-engine::Tokenizer::Tokenizer(const string& code) 
+engine::Tokenizer::Tokenizer(string code) 
                             : m_code(move(code)) {
     m_tokens.clear();
 }
@@ -22,47 +20,62 @@ engine::Tokenizer::~Tokenizer() {
 
 void engine::Tokenizer::cleanup() {
     // remove comments. eg: # hello world
-    m_code = regex_replace(m_code, regex("#.*"), "");
+    const char* begin = m_code.data();
+    const char* end = begin + m_code.size();
+
+    const char* hash = scanner::find(begin, end, '#');
+    if (hash == end) {
+        return;
+    }
+
+    string code;
+    code.reserve(m_code.size());
+
+    for (const char* p = begin; p < end;) {
+        hash = scanner::find(p, end, '#');
+        code.append(p, hash);
+
+        // a comment runs up to (not including) the line break
+        p = hash < end ? scanner::findEither(hash + 1, end, '\n', '\r') : end;
+    }
+
+    m_code = move(code);
 }
 
-[[nodiscard]] uint16_t engine::Tokenizer::getRandomId() {
-    random_device rd;
-    mt19937_64 gen(rd());
-    uniform_int_distribution<uint64_t> dis(10000, 99999);
-    return dis(gen);
+size_t engine::Tokenizer::MatchOperator(const char* begin, const char* end) {
+    // longest match first, operators are at most 3 characters
+    for (size_t length = min<size_t>(3, end - begin); length > 0; --length) {
+        if (const uint8_t* match = OPERATORS.find(string_view(begin, length))) {
+            return *match;
+        }
+    }
+
+    return 0;
 }
 
 void engine::Tokenizer::tokenize() {
+    const char* base = m_code.data();
+    const char* end = base + m_code.size();
+
+    // line breaks are counted up to each token, every character is looked at once
+    uint32_t line = 1;
+    size_t counted = 0;
+
     auto addToken = [&](size_t* i, TokenType type, size_t length = 1) {
-        string value = m_code.substr(*i, length);
-        uint64_t id = getRandomId();
+        uint64_t id = m_tokens.size();
 
-        m_tokens.emplace_back(id, type, value);
-        *i += length;
-    };
+        line += count(base + counted, base + *i, '\n');
+        counted = *i;
 
-    static vector<string> OPERATORS = {
-        "=",
-        "+=",
-        "-=",
-        "*=",
-        "/=",
-        "%=",
-        "^=",
-        ">>=",
-        "<<=",
-        "&=", 
-        "~=", 
-        "|="
+        m_tokens.emplace_back(id, type, m_code.substr(*i, length), line);
+        *i += length;
     };
 
     for (size_t i = 0; i < m_code.size();) {
         char c = m_code[i];
 
-        printf("Found operator: %s\n", m_code.substr(i, 2).data());
-
         if (isspace(c)) {
-            ++i;
+            i = scanner::skipWhitespace(base + i, end) - base;
         } else if (c == '(' || c == ')') {
             addToken(&i, c == '(' ? TOKEN_TYPE_ARG_START : TOKEN_TYPE_ARG_END);
         }else if (c == '$') {
@@ -71,31 +84,26 @@ void engine::Tokenizer::tokenize() {
             addToken(&i, TOKEN_TYPE_NEW_ARG);
         } else if (c == '{' || c == '}') {
             addToken(&i, c == '{' ? TOKEN_TYPE_SCOPE_START : TOKEN_TYPE_SCOPE_END);
+        } else if (c == '[' || c == ']') {
+            addToken(&i, c == '[' ? TOKEN_TYPE_INDEX_START : TOKEN_TYPE_INDEX_END);
         } else if (c == '"') {
-            size_t j = m_code.find('"', i + 1);
-            ASSERT(j != string::npos, "Expected closing '\"'");
+            size_t j = scanner::find(base + i + 1, end, '"') - base;
+            ASSERT(j != m_code.size(), "Expected closing '\"'");
             addToken(&i, TOKEN_TYPE_STRING, j - i + 1);
         } else if (c == '0' && (i + 1 < m_code.size()) && m_code[i + 1] == 'x') {
             size_t j = i + 2;
             while (j < m_code.size() && isxdigit(m_code[j])) ++j;
             addToken(&i, TOKEN_TYPE_NUMBER, j - i);
         } else if (isdigit(c) && !(i > 0 && m_code[i - 1] == '0' && m_code[i] == 'x')) {
-            size_t j = i;
-            while (j < m_code.size() && isdigit(m_code[j])) ++j;
+            size_t j = scanner::skipDigits(base + i, end) - base;
             addToken(&i, TOKEN_TYPE_NUMBER, j - i);
         } else if (isalpha(c) || c == '_') {
-            size_t j = i;
-            while (j < m_code.size() && (isalnum(m_code[j]) || m_code[j] == '_')) ++j;
+            size_t j = scanner::skipIdentifier(base + i, end) - base;
             
-            string value = m_code.substr(i, j - i);
-            TokenType type = (KEYWORDS.find(value) != KEYWORDS.end()) ? KEYWORDS.at(value) : TOKEN_TYPE_IDENTIFIER;
-            addToken(&i, type, j - i);
-        } else if (i + 1 < m_code.size() && find(OPERATORS.begin(), OPERATORS.end(), m_code.substr(i, 2)) != OPERATORS.end()) {
-            addToken(&i, TOKEN_TYPE_OPERATOR, 2);
-        } else if (i + 2 < m_code.size() && find(OPERATORS.begin(), OPERATORS.end(), m_code.substr(i, 3)) != OPERATORS.end()) {
-            addToken(&i, TOKEN_TYPE_OPERATOR, 3);
-        } else if (find(OPERATORS.begin(), OPERATORS.end(), m_code.substr(i, 1)) != OPERATORS.end()) {
-            addToken(&i, TOKEN_TYPE_OPERATOR);
+            const TokenType* keyword = KEYWORDS.find(string_view(base + i, j - i));
+            addToken(&i, keyword != nullptr ? *keyword : TOKEN_TYPE_IDENTIFIER, j - i);
+        } else if (size_t length = MatchOperator(base + i, end)) {
+            addToken(&i, TOKEN_TYPE_OPERATOR, length);
         }
         else {
             size_t j = i;
@@ -105,6 +113,7 @@ void engine::Tokenizer::tokenize() {
     }
 }
 
-const vector<engine::Token>& engine::Tokenizer::getTokens() const {
+vector<engine::Token> engine::Tokenizer::takeTokens() {
+    m_code = string();
     return move(m_tokens);
 }
\ No newline at end of file
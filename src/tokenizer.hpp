@@ -1,9 +1,10 @@
 #ifndef HPP_TOKENIZER
 #define HPP_TOKENIZER
 
+#include "lookup.hpp"
+
 #include <string>
 #include <vector>
-#include <unordered_map>
 
 using namespace std;
 
@@ -22,16 +23,21 @@ namespace engine {
         TOKEN_TYPE_MACRO,
         TOKEN_TYPE_SCOPE_START,
         TOKEN_TYPE_SCOPE_END,
+        TOKEN_TYPE_INDEX_START,
+        TOKEN_TYPE_INDEX_END,
     };
 
     struct Token {
         uint64_t id;
         TokenType type;
         string value;
+        uint32_t line;      // 1 based, comments are removed without taking their line breaks
     };
 
-    const static unordered_map<string, TokenType> KEYWORDS = {
+    inline constexpr PerfectMap<TokenType, 15> KEYWORDS({
         { "ret", TOKEN_TYPE_KEYWORD },
+        { "while", TOKEN_TYPE_KEYWORD },
+        { "for", TOKEN_TYPE_KEYWORD },
         { "fn", TOKEN_TYPE_KEYWORD },
         { "keep", TOKEN_TYPE_KEYWORD },
         { "i64", TOKEN_TYPE_KEYWORD },
@@ -44,23 +50,57 @@ namespace engine {
         { "u8", TOKEN_TYPE_KEYWORD },
         { "str", TOKEN_TYPE_KEYWORD },
         { "bool", TOKEN_TYPE_KEYWORD }
-    };
+    });
+
+    // value is the operator length
+    inline constexpr PerfectMap<uint8_t, 31> OPERATORS({
+        { "=", 1 },
+        { "+=", 2 },
+        { "-=", 2 },
+        { "*=", 2 },
+        { "/=", 2 },
+        { "%=", 2 },
+        { "^=", 2 },
+        { ">>=", 3 },
+        { "<<=", 3 },
+        { "&=", 2 },
+        { "~=", 2 },
+        { "|=", 2 },
+        { "+", 1 },
+        { "-", 1 },
+        { "*", 1 },
+        { "/", 1 },
+        { "%", 1 },
+        { "^", 1 },
+        { ">>", 2 },
+        { "<<", 2 },
+        { "&", 1 },
+        { "~", 1 },
+        { "|", 1 },
+        { "==", 2 },
+        { "!=", 2 },
+        { "<", 1 },
+        { "<=", 2 },
+        { ">", 1 },
+        { ">=", 2 },
+        { "?", 1 },
+        { ":", 1 }
+    });
 
     class Tokenizer {
         public:
-            Tokenizer(const string& code);
+            Tokenizer(string code);
             ~Tokenizer();
 
             void cleanup();
             void tokenize();
 
-            [[nodiscard]] const vector<Token>& getTokens() const;
+            // hands the tokens over and drops the source, every token owns its text
+            [[nodiscard]] vector<Token> takeTokens();
             
         private:    
-            
-            [[nodiscard]] static uint16_t getRandomId();
+            [[nodiscard]] static size_t MatchOperator(const char* begin, const char* end);
 
-            
             vector<Token> m_tokens;
             string m_code;
     };
@@ -0,0 +1,40 @@
+#!/bin/bash
+# usage: check.sh COMPILER
+# runs every tests/*.lx with --run at each level and through an IL image, the first line of a test
+# is '# expect: N' with what efi_main returns or '# expect: error' if it must not compile
+compiler=$1
+dir=$(dirname "$0")
+image=$(mktemp)
+trap 'rm -f "$image"' EXIT
+
+failed=0
+total=0
+
+check() {
+    local name=$1 expect=$2 got
+    shift 2
+
+    got=$("$@" 2>&1 | sed -n 's/.*efi_main returned \([0-9]*\).*/\1/p')
+    total=$((total + 1))
+    if [ "${got:-error}" != "$expect" ]; then
+        echo "FAIL $name ($*): expected $expect, got ${got:-error}"
+        failed=$((failed + 1))
+    fi
+}
+
+for test in "$dir"/*.lx; do
+    name=$(basename "$test" .lx)
+    expect=$(sed -n '1s/^# expect: *//p' "$test")
+
+    for level in -O0 -O1 -O2 -Os; do
+        check "$name" "$expect" "$compiler" "$test" --run $level
+    done
+
+    if [ "$expect" != error ]; then
+        "$compiler" "$test" --emit-il "$image" > /dev/null
+        check "$name" "$expect" "$compiler" "$image" --run
+    fi
+done
+
+echo "$((total - failed))/$total passed"
+[ $failed -eq 0 ]